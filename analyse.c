@@ -0,0 +1,1117 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analyse.h"
+#include "builtins.h"
+#include "common.h"
+#include "environment.h"
+#include "eval.h"
+#include "interp.h"
+#include "preparse.h"
+#include "profiler.h"
+#include "stats.h"
+#include "uthash.h"
+
+typedef struct s_obj sobj;
+typedef struct s_env senv;
+typedef sobj *(*builtin_fn)(sobj *, senv *);
+
+// ============================== EVALUATION =================================
+// One function per kind of node. Each does only what could not be decided
+// when the node was built, and mirrors what eval and the builtin for the
+// form would do, down to the errors.
+// ===========================================================================
+
+static sobj *run_constant(struct node *node, senv *env) {
+	(void)env;
+	return node->u.constant;
+}
+
+static sobj *lookup(senv *env, const char *name) {
+	sobj *val = resolve_symbol(env, name, true);
+	if(val == NULL && !has_symbol(env, name, true))
+		SET_ERR("Unbound symbol: %s", name);
+	return val;
+}
+
+static sobj *run_ref(struct node *node, senv *env) {
+	return lookup(env, node->u.name);
+}
+
+// A form that could not be analysed, usually because it is malformed
+static sobj *run_fallback(struct node *node, senv *env) {
+	return eval(node->expr, env, true);
+}
+
+static sobj *run_if(struct node *node, senv *env) {
+	sobj *test = run_node(node->u.branch.test, env);
+	if(test == NULL) return NULL;
+
+	if(is_false(test))
+		return run_node(node->u.branch.otherwise, env);
+	return run_node(node->u.branch.then, env);
+}
+
+static sobj *run_seq(struct node *node, senv *env) {
+	sobj *res = fetch_singleton_object(SG_EMPTY_LIST);
+	for(int i=0; i<node->u.seq.len; i++) {
+		res = run_node(node->u.seq.exprs[i], env);
+		if(res == NULL) return NULL;
+	}
+
+	return res;
+}
+
+// Every lambda made here shares the analysed body
+static sobj *run_lambda(struct node *node, senv *env) {
+	sobj *lambda = new_lambda(node->u.lambda.params, node->u.lambda.body, env);
+	if(lambda == NULL) return NULL;
+
+	lambda->val.lambda->analysed = node->u.lambda.analysed;
+	return lambda;
+}
+
+// Like builtin_define, a failed value is still bound
+static sobj *run_define(struct node *node, senv *env) {
+	sobj *val = run_node(node->u.define.value, env);
+	if(val != NULL && val->type == OBJ_LAMBDA && val->val.lambda->name == NULL)
+		val->val.lambda->name = node->u.define.name;
+
+	associate_symbol(env, node->u.define.name, val);
+	return fetch_singleton_object(SG_EMPTY_LIST);
+}
+
+// Evaluates the inits of a let form in eval_env and binds them in frame
+static bool bind_inits(struct node *node, senv *eval_env, senv *frame) {
+	for(int i=0; i<node->u.let.len; i++) {
+		sobj *val = run_node(node->u.let.inits[i], eval_env);
+		if(val == NULL) return false;
+
+		associate_symbol(frame, node->u.let.names[i], val);
+	}
+
+	return true;
+}
+
+static sobj *run_let(struct node *node, senv *env) {
+	senv *frame = create_new_env(env);
+	if(!bind_inits(node, env, frame)) return NULL;
+
+	return run_node(node->u.let.body, frame);
+}
+
+static sobj *run_let_star(struct node *node, senv *env) {
+	senv *frame = create_new_env(env);
+	if(!bind_inits(node, frame, frame)) return NULL;
+
+	return run_node(node->u.let.body, frame);
+}
+
+static sobj *run_letrec(struct node *node, senv *env) {
+	senv *frame = create_new_env(env);
+	for(int i=0; i<node->u.let.len; i++) {
+		associate_symbol(frame, node->u.let.names[i],
+			fetch_singleton_object(SG_EMPTY_LIST));
+	}
+
+	if(!bind_inits(node, frame, frame)) return NULL;
+	return run_node(node->u.let.body, frame);
+}
+
+// The arity was checked when the node was built
+static sobj *run_form(struct node *node, senv *env) {
+	return node->u.form.func(node->u.form.args, env);
+}
+
+// Evaluates the arguments of a call, in order, into a new list
+static sobj *run_args(struct node *node, senv *env) {
+	sobj *emptylist = fetch_singleton_object(SG_EMPTY_LIST);
+	sobj *arglist = emptylist;
+	sobj **tail = &arglist;
+
+	for(int i=0; i<node->u.call.num_args; i++) {
+		sobj *arg = run_node(node->u.call.arg_nodes[i], env);
+		if(arg == NULL) return NULL;
+
+		*tail = new_cons(arg, emptylist);
+		tail = &(*tail)->val.cc.right;
+	}
+
+	return arglist;
+}
+
+// Applies op, the value of the operator of a call node
+static sobj *apply_op(struct node *node, sobj *op, senv *env) {
+	bool is_macro = false;
+	if(op->type == OBJ_BUILTIN_FUNC) {
+		is_macro = op->val.builtin.is_macro;
+	} else if(op->type == OBJ_LAMBDA) {
+		is_macro = op->val.lambda->is_macro;
+	} else {
+		char rep[128];
+		SET_ERR("Trying to treat non-function object as function: %s",
+			get_string_rep(op, rep, sizeof(rep)));
+		return NULL;
+	}
+
+	// Macros get their arguments unevaluated
+	if(is_macro)
+		return apply_function(op, node->u.call.args, env);
+
+	sobj *arglist = run_args(node, env);
+	if(arglist == NULL) return NULL;
+
+	return apply_function_n(op, arglist, node->u.call.num_args, env);
+}
+
+static sobj *run_call(struct node *node, senv *env) {
+	sobj *op = run_node(node->u.call.op, env);
+	if(op == NULL) return NULL;
+
+	return apply_op(node, op, env);
+}
+
+// Calls the builtin directly while the operator is still bound to it
+static sobj *run_prim_call(struct node *node, senv *env) {
+	sobj *op = run_node(node->u.call.op, env);
+	if(op == NULL) return NULL;
+
+	if(op != node->u.call.prim)
+		return apply_op(node, op, env);
+
+	sobj *arglist = run_args(node, env);
+	if(arglist == NULL) return NULL;
+
+	return op->val.builtin.func(arglist, env);
+}
+
+// =========================== INLINE PRIMITIVES =============================
+// Each inline primitive has its own node function, which evaluates the
+// arguments straight from their nodes and handles the common case without
+// calling the builtin. The operator is never looked up: as long as the
+// primitive's guard holds, no environment has ever bound its name to
+// anything else, so the lookup could only find the builtin. Once the guard
+// is broken the node deoptimises to a primitive call, which looks it up.
+// ===========================================================================
+
+static inline bool guards_hold(struct interp *interp, uint64_t guard) {
+	uint64_t broken = __atomic_load_n(&interp->broken_guards, __ATOMIC_RELAXED);
+	return (broken & guard) == 0;
+}
+
+static inline bool guards_ok(struct node *node) {
+	return guards_hold(node->u.call.interp, node->u.call.guard);
+}
+
+static inline bool fixnums(sobj *a, sobj *b) {
+	return a->type == OBJ_NUMBER && a->val.number.type == SCHEME_INT
+		&& b->type == OBJ_NUMBER && b->val.number.type == SCHEME_INT;
+}
+
+// Calls the builtin itself, for arguments the fast path doesn't handle
+static sobj *call_builtin(struct node *node, senv *env, int num_args,
+	sobj **args) {
+
+	sobj *arglist = fetch_singleton_object(SG_EMPTY_LIST);
+	for(int i=num_args-1; i>=0; i--)
+		arglist = new_cons(args[i], arglist);
+
+	return node->u.call.prim->val.builtin.func(arglist, env);
+}
+
+#define INLINE1(NAME, FAST)                                                 \
+	static sobj *NAME(struct node *node, senv *env) {                       \
+		if(!guards_ok(node))                                                \
+			return run_prim_call(node, env);                                \
+		sobj *a = run_node(node->u.call.arg_nodes[0], env);                 \
+		if(a == NULL) return NULL;                                          \
+		FAST;                                                               \
+		return call_builtin(node, env, 1, (sobj *[]){ a });                 \
+	}
+
+#define INLINE2(NAME, FAST)                                                 \
+	static sobj *NAME(struct node *node, senv *env) {                       \
+		if(!guards_ok(node))                                                \
+			return run_prim_call(node, env);                                \
+		sobj *a = run_node(node->u.call.arg_nodes[0], env);                 \
+		if(a == NULL) return NULL;                                          \
+		sobj *b = run_node(node->u.call.arg_nodes[1], env);                 \
+		if(b == NULL) return NULL;                                          \
+		FAST;                                                               \
+		return call_builtin(node, env, 2, (sobj *[]){ a, b });              \
+	}
+
+#define FIXNUM_OP(EXPR)                                                     \
+	if(fixnums(a, b)) {                                                     \
+		int64_t x = a->val.number.value.integer;                            \
+		int64_t y = b->val.number.value.integer;                            \
+		return EXPR;                                                        \
+	}
+
+INLINE1(run_car, if(a->type == OBJ_CONS) return a->val.cc.left)
+INLINE1(run_cdr, if(a->type == OBJ_CONS) return a->val.cc.right)
+INLINE1(run_is_null, return fetch_bool(a->type == OBJ_EMPTY_LIST))
+INLINE2(run_cons, return new_cons(a, b))
+INLINE2(run_is_equal, return fetch_bool(elt_eq(a, b)))
+INLINE2(run_add, FIXNUM_OP(new_numeric(SCHEME_INT, x + y, 0)))
+INLINE2(run_sub, FIXNUM_OP(new_numeric(SCHEME_INT, x - y, 0)))
+INLINE2(run_lt, FIXNUM_OP(fetch_bool(x < y)))
+INLINE2(run_gt, FIXNUM_OP(fetch_bool(x > y)))
+INLINE2(run_le, FIXNUM_OP(fetch_bool(x <= y)))
+INLINE2(run_ge, FIXNUM_OP(fetch_bool(x >= y)))
+
+#undef INLINE1
+#undef INLINE2
+#undef FIXNUM_OP
+
+struct inline_def {
+	const char *name;
+	builtin_fn func;
+	int num_args;
+	node_fn run;
+};
+
+static const struct inline_def inline_defs[NUM_INLINE_PRIMS] = {
+	[INLINE_CAR] =      { "car",    &builtin_car,      1, &run_car },
+	[INLINE_CDR] =      { "cdr",    &builtin_cdr,      1, &run_cdr },
+	[INLINE_IS_NULL] =  { "null?",  &builtin_is_null,  1, &run_is_null },
+	[INLINE_CONS] =     { "cons",   &builtin_cons,     2, &run_cons },
+	[INLINE_IS_EQUAL] = { "equal?", &builtin_is_equal, 2, &run_is_equal },
+	[INLINE_NUM_EQ] =   { "=",      &builtin_is_equal, 2, &run_is_equal },
+	[INLINE_ADD] =      { "+",      &builtin_add,      2, &run_add },
+	[INLINE_SUB] =      { "-",      &builtin_sub,      2, &run_sub },
+	[INLINE_LT] =       { "<",      &builtin_lt,       2, &run_lt },
+	[INLINE_GT] =       { ">",      &builtin_gt,       2, &run_gt },
+	[INLINE_LE] =       { "<=",     &builtin_le,       2, &run_le },
+	[INLINE_GE] =       { ">=",     &builtin_ge,       2, &run_ge },
+};
+
+// ================================= GUARDS ==================================
+// A guard is broken by binding its name to any other value, in any
+// environment, which every binding checks for. Code relying on guards checks
+// their bits in interp->broken_guards each time it runs, which is one load.
+// ===========================================================================
+
+static bool initial_bit(uint64_t *initials, const char *name, uint64_t *bit) {
+	unsigned char c = name[0];
+	*bit = 1ull << (c % 64);
+	return (__atomic_load_n(&initials[c / 64], __ATOMIC_RELAXED) & *bit) != 0;
+}
+
+static void add_initial(struct interp *interp, const char *name) {
+	uint64_t bit;
+	if(!initial_bit(interp->guard_initials, name, &bit))
+		__atomic_fetch_or(&interp->guard_initials[(unsigned char)name[0] / 64],
+			bit, __ATOMIC_SEQ_CST);
+}
+
+// The word and bit of interp->shadowed for a name with the given hash
+static uint64_t *shadowed_word(struct interp *interp, unsigned hash,
+	uint64_t *bit) {
+
+	size_t num_words = sizeof(interp->shadowed) / sizeof(interp->shadowed[0]);
+	*bit = 1ull << (hash % 64);
+	return &interp->shadowed[hash / 64 % num_words];
+}
+
+// Whether name may have been bound outside the root environment
+static bool is_shadowed(struct interp *interp, const char *name) {
+	unsigned hash;
+	HASH_VALUE(name, strlen(name), hash);
+
+	uint64_t bit;
+	uint64_t *word = shadowed_word(interp, hash, &bit);
+	return (__atomic_load_n(word, __ATOMIC_SEQ_CST) & bit) != 0;
+}
+
+void init_guards(struct interp *interp) {
+	struct guard *guards = calloc(MAX_GUARDS, sizeof(struct guard));
+	ensure_mem(guards);
+
+	for(int i=0; i<NUM_INLINE_PRIMS; i++) {
+		const struct inline_def *def = &inline_defs[i];
+		sobj *bound = resolve_symbol(interp->root_env, def->name, false);
+
+		guards[i].name = def->name;
+		if(bound != NULL && bound->type == OBJ_BUILTIN_FUNC
+			&& bound->val.builtin.func == def->func)
+			guards[i].value = bound;
+		else
+			interp->broken_guards |= 1ull << i;
+		add_initial(interp, def->name);
+	}
+
+	interp->guards = guards;
+	__atomic_store_n(&interp->num_guards, NUM_INLINE_PRIMS, __ATOMIC_RELEASE);
+}
+
+// Guards the binding of name to value, sharing an existing guard for the
+// same binding. Returns the guard's bit, or 0 if there is no room for it.
+static uint64_t add_guard(struct interp *interp, const char *name,
+	sobj *value) {
+
+	pthread_mutex_lock(&interp->lock);
+
+	int num_guards = interp->num_guards;
+	int i = 0;
+	while(i < num_guards && (interp->guards[i].value != value
+		|| strcmp(interp->guards[i].name, name) != 0))
+		i++;
+
+	if(i == num_guards && i < MAX_GUARDS) {
+		char *copy = strdup(name);
+		ensure_mem(copy);
+		interp->guards[i] = (struct guard){ copy, value };
+		add_initial(interp, copy);
+		__atomic_store_n(&interp->num_guards, i + 1, __ATOMIC_SEQ_CST);
+	}
+
+	pthread_mutex_unlock(&interp->lock);
+	return i < MAX_GUARDS ? 1ull << i : 0;
+}
+
+// Guards a name in the root environment that analysed code looks past. The
+// name must never have been bound anywhere else, which is checked again once
+// the guard is in place, so that a binding made in the meantime is either
+// seen here or breaks the guard. Returns the guard's bit, or 0 if the name
+// can't be guarded.
+static uint64_t guard_global(struct interp *interp, const char *name,
+	sobj *value) {
+
+	uint64_t bit = add_guard(interp, name, value);
+	if(bit == 0 || is_shadowed(interp, name)
+		|| resolve_symbol(interp->root_env, name, false) != value
+		|| !guards_hold(interp, bit))
+		return 0;
+	return bit;
+}
+
+void note_binding(senv *env, const char *name, unsigned hash, sobj *val) {
+	struct interp *interp = env_interp(env);
+
+	if(get_parent_env(env) != NULL) {
+		uint64_t bit;
+		uint64_t *word = shadowed_word(interp, hash, &bit);
+		if((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) == 0)
+			__atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST);
+	}
+
+	uint64_t bit;
+	if(!initial_bit(interp->guard_initials, name, &bit))
+		return;
+
+	int num_guards = __atomic_load_n(&interp->num_guards, __ATOMIC_SEQ_CST);
+	for(int i=0; i<num_guards; i++) {
+		struct guard *guard = &interp->guards[i];
+		if(val != guard->value && strcmp(name, guard->name) == 0)
+			__atomic_fetch_or(&interp->broken_guards, 1ull << i, __ATOMIC_RELAXED);
+	}
+}
+
+// =============================== ANALYSIS ==================================
+// Runs over a desugared expression, so special forms appear in head position
+// as the builtins themselves. Analysis never fails: anything that isn't a
+// well-formed instance of a form with a node of its own is left to eval or
+// to the form's builtin, which report the error when it is evaluated.
+// ===========================================================================
+
+// A variable of a let that is bound to a constant, or, with a NULL value,
+// to something else. Folded constants are only valid while guard holds.
+struct known {
+	const char *name;
+	sobj *value;
+	uint64_t guard;
+	struct known *next;
+};
+
+// Where an expression is being analysed: the variables known to be bound to
+// constants wherever it runs, innermost first
+struct analysis {
+	struct interp *interp;
+	struct known *known;
+};
+
+static struct node *analyse(struct analysis *an, sobj *expr);
+static bool constant_value(struct node *node, sobj **val, uint64_t *guard);
+
+static struct node *new_node(node_fn run, sobj *expr) {
+	struct node *node = calloc(1, sizeof(struct node));
+	ensure_mem(node);
+	STAT_ADD(STAT_NODES_ANALYSED, 1);
+
+	node->run = run;
+	node->expr = expr;
+	return node;
+}
+
+static struct node *constant_node(sobj *expr, sobj *val) {
+	struct node *node = new_node(&run_constant, expr);
+	node->u.constant = val;
+	return node;
+}
+
+// Analyses each element of a proper list of len elements
+static struct node **analyse_list(struct analysis *an, sobj *lst, int len) {
+	struct node **nodes = calloc(len > 0 ? len : 1, sizeof(struct node *));
+	ensure_mem(nodes);
+
+	for(int i=0; i<len; i++, lst = get_list_rest(lst))
+		nodes[i] = analyse(an, get_list_head(lst));
+	return nodes;
+}
+
+static struct node *analyse_seq(struct analysis *an, sobj *expr,
+	sobj *exprs) {
+
+	struct node *node = new_node(&run_seq, expr);
+	node->u.seq.len = get_list_len(exprs);
+	node->u.seq.exprs = analyse_list(an, exprs, node->u.seq.len);
+	return node;
+}
+
+// The body of a lambda, analysed once for every lambda the node makes. It
+// may run anywhere, so nothing is known about its variables.
+static struct node *analyse_lambda_body(struct interp *interp, sobj *body) {
+	STAT_ADD(STAT_BODIES_ANALYSED, 1);
+
+	struct analysis an = { .interp = interp };
+	return analyse(&an, body);
+}
+
+// Checks that bindings is a list of (name init) like builtin_let expects
+static bool well_formed_bindings(sobj *bindings) {
+	if(get_list_len(bindings) == -1)
+		return false;
+
+	for(; bindings->type == OBJ_CONS; bindings = get_list_rest(bindings)) {
+		sobj *binding = get_list_head(bindings);
+		if(get_list_len(binding) != 2
+			|| get_list_head(binding)->type != OBJ_SYMBOL)
+			return false;
+	}
+
+	return true;
+}
+
+// let, let* and letrec without a name. Returns NULL if the form is malformed
+// or a named let, which are left to the builtin.
+static struct node *analyse_let(struct analysis *an, sobj *expr,
+	sobj *args, node_fn run) {
+
+	if(get_list_len(args) < 2)
+		return NULL;
+
+	sobj *bindings = get_list_head(args);
+	if(bindings->type == OBJ_SYMBOL || !well_formed_bindings(bindings))
+		return NULL;
+
+	struct node *node = new_node(run, expr);
+	int len = get_list_len(bindings);
+	node->u.let.len = len;
+	node->u.let.names = calloc(len > 0 ? len : 1, sizeof(const char *));
+	node->u.let.inits = calloc(len > 0 ? len : 1, sizeof(struct node *));
+	ensure_mem(node->u.let.names);
+	ensure_mem(node->u.let.inits);
+
+	// The names bound hide what is known about them outside. The inits of
+	// let* and letrec may see the new bindings, so only those of a plain
+	// let are analysed outside it, and only they can make a name known.
+	struct analysis inner = *an;
+	struct known *known = calloc(len > 0 ? len : 1, sizeof(struct known));
+	ensure_mem(known);
+	for(int i=0; i<len; i++, bindings = get_list_rest(bindings)) {
+		known[i].name = get_list_head(get_list_head(bindings))->val.sym.str;
+		known[i].next = inner.known;
+		inner.known = &known[i];
+	}
+
+	bindings = get_list_head(args);
+	for(int i=0; i<len; i++, bindings = get_list_rest(bindings)) {
+		sobj *init = get_list_nth(get_list_head(bindings), 2);
+		node->u.let.names[i] = known[i].name;
+		node->u.let.inits[i] = analyse(run == &run_let ? an : &inner, init);
+		if(run == &run_let)
+			constant_value(node->u.let.inits[i], &known[i].value,
+				&known[i].guard);
+	}
+
+	node->u.let.body = analyse_seq(&inner, expr, get_list_rest(args));
+	free(known);
+	return node;
+}
+
+// A special form whose arguments are a proper list that matches its arity
+static struct node *analyse_form(struct analysis *an, sobj *expr,
+	sobj *form, sobj *args) {
+
+	builtin_fn func = form->val.builtin.func;
+
+	if(func == &builtin_quote)
+		return constant_node(expr, get_list_head(args));
+
+	if(func == &builtin_if) {
+		struct node *test = analyse(an, get_list_nth(args, 1));
+
+		// Only the branch taken by a constant test is kept
+		sobj *val;
+		uint64_t guard;
+		if(constant_value(test, &val, &guard) && guard == 0)
+			return analyse(an, get_list_nth(args, is_false(val) ? 3 : 2));
+
+		struct node *node = new_node(&run_if, expr);
+		node->u.branch.test = test;
+		node->u.branch.then = analyse(an, get_list_nth(args, 2));
+		node->u.branch.otherwise = analyse(an, get_list_nth(args, 3));
+		return node;
+	}
+
+	if(func == &builtin_begin)
+		return analyse_seq(an, expr, args);
+
+	struct node *node = NULL;
+	if(func == &builtin_lambda) {
+		sobj *params = get_list_head(args);
+		if(all_list_of_type(params, OBJ_SYMBOL)) {
+			node = new_node(&run_lambda, expr);
+			node->u.lambda.params = params;
+			node->u.lambda.body = get_list_nth(args, 2);
+			node->u.lambda.analysed = analyse_lambda_body(an->interp,
+				node->u.lambda.body);
+		}
+	} else if(func == &builtin_define || func == &builtin_set_bang) {
+		sobj *target = get_list_head(args);
+		if(target->type == OBJ_SYMBOL) {
+			node = new_node(&run_define, expr);
+			node->u.define.name = target->val.sym.str;
+			node->u.define.value = analyse(an, get_list_nth(args, 2));
+		}
+	} else if(func == &builtin_let) {
+		node = analyse_let(an, expr, args, &run_let);
+	} else if(func == &builtin_let_star) {
+		node = analyse_let(an, expr, args, &run_let_star);
+	} else if(func == &builtin_letrec) {
+		node = analyse_let(an, expr, args, &run_letrec);
+	}
+
+	if(node != NULL)
+		return node;
+
+	node = new_node(&run_form, expr);
+	node->u.form.func = func;
+	node->u.form.args = args;
+	return node;
+}
+
+// The builtin that head is bound to in the root environment, if it is a
+// function that can take num_args arguments
+static sobj *find_prim(struct interp *interp, sobj *head, int num_args) {
+	sobj *bound = head;
+	if(head->type == OBJ_SYMBOL)
+		bound = resolve_symbol(interp->root_env, head->val.sym.str, false);
+
+	if(bound == NULL || bound->type != OBJ_BUILTIN_FUNC
+		|| bound->val.builtin.is_macro)
+		return NULL;
+
+	int expected = bound->val.builtin.num_args;
+	return expected == -1 || expected == num_args ? bound : NULL;
+}
+
+// The inline primitive for a call to prim through head, or -1 if there
+// isn't one. A name must still be bound to the original builtin.
+static int find_inline(struct interp *interp, sobj *head, sobj *prim,
+	int num_args) {
+
+	for(int i=0; i<NUM_INLINE_PRIMS; i++) {
+		const struct inline_def *def = &inline_defs[i];
+		if(def->func != prim->val.builtin.func || def->num_args != num_args)
+			continue;
+
+		if(head->type == OBJ_BUILTIN_FUNC)
+			return i;
+
+		if(strcmp(head->val.sym.str, def->name) == 0
+			&& interp->guards[i].value == prim
+			&& (interp->broken_guards & (1ull << i)) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+// ================================ INLINING =================================
+// A call to a small global lambda can be analysed as the lambda's body, so
+// that the call makes no environment and passes its arguments in an array.
+// The body may only use its parameters, other variables, constants, if,
+// begin, the inline primitives and other lambdas that can be inlined: none
+// of them bind anything, so they evaluate the same in the caller's
+// environment as in the lambda's. A variable that is a parameter of an
+// enclosing inlined lambda would have been bound in the caller, so it stops
+// the inlining, as does recursion.
+//
+// The lookup of the operator is skipped, which only gives the same lambda
+// while no environment binds its name to anything else. So the name must
+// never have been bound outside the root environment when the call is
+// analysed, and a guard on it sends the call back through the lookup from
+// the first binding on. The profiler only sees calls that make a frame, so
+// calls aren't inlined while it runs.
+// ===========================================================================
+
+#define INLINE_BUDGET 16
+#define MAX_INLINE_DEPTH 4
+
+// State of the analysis of one inlined call, including the calls inlined
+// into its body
+struct inliner {
+	struct interp *interp;
+	// Lambdas whose bodies are being analysed, outermost first
+	struct s_lambda *lambdas[MAX_INLINE_DEPTH];
+	int depth;
+	// Nodes that may still be built
+	int budget;
+	// Guards of the inline primitives in the body, and the names of the
+	// lambdas inlined, which only get guards once the whole body is done
+	uint64_t guard;
+	struct guard pending[INLINE_BUDGET];
+	int num_pending;
+};
+
+// Arguments of the innermost inlined call running in this thread
+static __thread sobj **inline_args;
+
+static sobj *run_param(struct node *node, senv *env) {
+	(void)env;
+	return inline_args[node->u.param];
+}
+
+static sobj *run_inlined(struct node *node, senv *env) {
+	if(profiling || !guards_ok(node))
+		return run_call(node, env);
+
+	int num_args = node->u.call.num_args;
+	sobj *args[num_args > 0 ? num_args : 1];
+	for(int i=0; i<num_args; i++) {
+		args[i] = run_node(node->u.call.arg_nodes[i], env);
+		if(args[i] == NULL) return NULL;
+	}
+
+	sobj **outer = inline_args;
+	inline_args = args;
+	sobj *res = run_node(node->u.call.inlined, env);
+	inline_args = outer;
+	return res;
+}
+
+static struct node *inline_expr(struct inliner *in, sobj *expr);
+
+static struct node *inline_new_node(struct inliner *in, node_fn run,
+	sobj *expr) {
+
+	if(--in->budget < 0)
+		return NULL;
+	return new_node(run, expr);
+}
+
+// Position of name among the parameters of the innermost lambda, -1 if it
+// isn't a parameter, or -2 if it is one of an enclosing lambda
+static int param_index(struct inliner *in, const char *name) {
+	for(int d=in->depth-1; d>=0; d--) {
+		struct s_lambda *lambda = in->lambdas[d];
+
+		// The last of two parameters with the same name is the one bound
+		for(int i=lambda->num_args-1; i>=0; i--) {
+			if(strcmp(lambda->arglist[i], name) == 0)
+				return d == in->depth - 1 ? i : -2;
+		}
+	}
+
+	return -1;
+}
+
+static struct node **inline_list(struct inliner *in, sobj *lst, int len) {
+	struct node **nodes = calloc(len > 0 ? len : 1, sizeof(struct node *));
+	ensure_mem(nodes);
+
+	for(int i=0; i<len; i++, lst = get_list_rest(lst)) {
+		nodes[i] = inline_expr(in, get_list_head(lst));
+		if(nodes[i] == NULL) return NULL;
+	}
+
+	return nodes;
+}
+
+// The body of the global lambda that head names, for a call with num_args
+// arguments, or NULL if it can't be inlined
+static struct node *inline_lambda(struct inliner *in, sobj *head,
+	int num_args) {
+
+	if(head->type != OBJ_SYMBOL || in->depth == MAX_INLINE_DEPTH
+		|| in->num_pending == INLINE_BUDGET)
+		return NULL;
+
+	const char *name = head->val.sym.str;
+	sobj *bound = resolve_symbol(in->interp->root_env, name, false);
+	if(bound == NULL || bound->type != OBJ_LAMBDA
+		|| is_shadowed(in->interp, name))
+		return NULL;
+
+	// Compiled lambdas may not have a body to inline
+	struct s_lambda *lambda = bound->val.lambda;
+	if(lambda->is_macro || lambda->num_args != num_args
+		|| lambda->native != NULL)
+		return NULL;
+
+	for(int i=0; i<in->depth; i++) {
+		if(in->lambdas[i] == lambda)
+			return NULL;
+	}
+
+	// A body that doesn't parse reports its error when it is called
+	bool print = set_err_print(false);
+	sobj *src = lambda_body(lambda);
+	set_err_print(print);
+	if(src == NULL)
+		return NULL;
+
+	in->pending[in->num_pending++] = (struct guard){ name, bound };
+	in->lambdas[in->depth++] = lambda;
+	struct node *body = inline_expr(in, src);
+	in->depth--;
+	return body;
+}
+
+// A call in an inlined body, to an inline primitive or a lambda that can be
+// inlined too. Their guards are checked by the outermost inlined call.
+static struct node *inline_call(struct inliner *in, sobj *expr, sobj *head,
+	sobj *args, int num_args) {
+
+	if(head->type == OBJ_SYMBOL && param_index(in, head->val.sym.str) != -1)
+		return NULL;
+
+	sobj *prim = find_prim(in->interp, head, num_args);
+	int inline_prim = -1;
+	struct node *body = NULL;
+	if(prim != NULL) {
+		inline_prim = find_inline(in->interp, head, prim, num_args);
+		if(inline_prim == -1) return NULL;
+	} else {
+		body = inline_lambda(in, head, num_args);
+		if(body == NULL) return NULL;
+	}
+
+	struct node *node = inline_new_node(in,
+		body != NULL ? &run_inlined : inline_defs[inline_prim].run, expr);
+	if(node == NULL) return NULL;
+
+	node->u.call.arg_nodes = inline_list(in, args, num_args);
+	if(node->u.call.arg_nodes == NULL) return NULL;
+
+	// The operator is only evaluated by the ordinary calls made for the
+	// profiler, so it doesn't count against the budget
+	if(head->type == OBJ_SYMBOL) {
+		node->u.call.op = new_node(&run_ref, head);
+		node->u.call.op->u.name = head->val.sym.str;
+	} else {
+		node->u.call.op = constant_node(head, head);
+	}
+	node->u.call.num_args = num_args;
+	node->u.call.args = args;
+	node->u.call.prim = prim;
+	node->u.call.interp = in->interp;
+	node->u.call.inlined = body;
+	if(prim != NULL && head->type == OBJ_SYMBOL)
+		in->guard |= 1ull << inline_prim;
+	return node;
+}
+
+static struct node *inline_expr(struct inliner *in, sobj *expr) {
+	if(expr->type == OBJ_SYMBOL) {
+		int param = param_index(in, expr->val.sym.str);
+		if(param == -2) return NULL;
+
+		struct node *node = inline_new_node(in,
+			param == -1 ? &run_ref : &run_param, expr);
+		if(node == NULL) return NULL;
+
+		if(param == -1)
+			node->u.name = expr->val.sym.str;
+		else
+			node->u.param = param;
+		return node;
+	}
+
+	if(expr->type != OBJ_CONS) {
+		struct node *node = inline_new_node(in, &run_constant, expr);
+		if(node != NULL)
+			node->u.constant = expr;
+		return node;
+	}
+
+	sobj *head = get_list_head(expr);
+	sobj *args = get_list_rest(expr);
+	int num_args = get_list_len(args);
+	if(num_args == -1)
+		return NULL;
+
+	if(head->type != OBJ_BUILTIN_FUNC || !head->val.builtin.is_macro)
+		return inline_call(in, expr, head, args, num_args);
+
+	int expected = head->val.builtin.num_args;
+	if(expected != -1 && expected != num_args)
+		return NULL;
+
+	builtin_fn func = head->val.builtin.func;
+	struct node *node = NULL;
+	if(func == &builtin_quote) {
+		node = inline_new_node(in, &run_constant, expr);
+		if(node != NULL)
+			node->u.constant = get_list_head(args);
+	} else if(func == &builtin_if) {
+		node = inline_new_node(in, &run_if, expr);
+		if(node != NULL
+			&& ((node->u.branch.test = inline_expr(in, get_list_nth(args, 1))) == NULL
+			|| (node->u.branch.then = inline_expr(in, get_list_nth(args, 2))) == NULL
+			|| (node->u.branch.otherwise = inline_expr(in, get_list_nth(args, 3))) == NULL))
+			return NULL;
+	} else if(func == &builtin_begin && num_args > 0) {
+		node = inline_new_node(in, &run_seq, expr);
+		if(node != NULL) {
+			node->u.seq.len = num_args;
+			node->u.seq.exprs = inline_list(in, args, num_args);
+			if(node->u.seq.exprs == NULL) return NULL;
+		}
+	}
+
+	return node;
+}
+
+// Analyses a call to the global lambda that head names as the lambda's
+// body, if it can be inlined, and sets guard to the guards it relies on
+static struct node *analyse_inlined(struct interp *interp, sobj *head,
+	int num_args, uint64_t *guard) {
+
+	struct inliner in = { .interp = interp, .budget = INLINE_BUDGET };
+	struct node *body = inline_lambda(&in, head, num_args);
+	if(body == NULL)
+		return NULL;
+
+	for(int i=0; i<in.num_pending; i++) {
+		struct guard *pending = &in.pending[i];
+		uint64_t bit = guard_global(interp, pending->name, pending->value);
+		if(bit == 0) return NULL;
+		in.guard |= bit;
+	}
+
+	if(!guards_hold(interp, in.guard))
+		return NULL;
+
+	STAT_ADD(STAT_CALLS_INLINED, 1);
+	*guard = in.guard;
+	return body;
+}
+
+// ================================ FOLDING ==================================
+// A call to a builtin that is_foldable with constant arguments is evaluated
+// once, when it is analysed, and so is a reference to a variable that a let
+// binds to a constant, within the let. Both stay valid only while guards
+// hold: the builtin's name must keep its binding, and the variable must
+// never be bound to anything else, anywhere, as an eval could do it within
+// the let. A broken guard sends the node back to the full evaluation. Calls
+// that fail are left to fail when they run, and calls on pairs that could be
+// mutated are never folded.
+// ===========================================================================
+
+static sobj *run_folded(struct node *node, senv *env) {
+	if(!guards_ok(node))
+		return run_prim_call(node, env);
+	return node->u.call.folded;
+}
+
+static sobj *run_known(struct node *node, senv *env) {
+	if(!guards_hold(node->u.known.interp, node->u.known.guard))
+		return lookup(env, node->u.known.name);
+	return node->u.known.value;
+}
+
+// The value a node always evaluates to while guard holds, if there is one
+static bool constant_value(struct node *node, sobj **val, uint64_t *guard) {
+	if(node->run == &run_constant) {
+		*val = node->u.constant;
+		*guard = 0;
+	} else if(node->run == &run_folded) {
+		*val = node->u.call.folded;
+		*guard = node->u.call.guard;
+	} else if(node->run == &run_known) {
+		*val = node->u.known.value;
+		*guard = node->u.known.guard;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+// Calls prim without printing any error, leaving the last error as it was
+static sobj *call_quietly(struct interp *interp, sobj *prim, int num_args,
+	sobj **args) {
+
+	char reason[512];
+	snprintf(reason, sizeof(reason), "%s", get_err_reason());
+	bool print = set_err_print(false);
+
+	sobj *arglist = fetch_singleton_object(SG_EMPTY_LIST);
+	for(int i=num_args-1; i>=0; i--)
+		arglist = new_cons(args[i], arglist);
+	sobj *val = prim->val.builtin.func(arglist, interp->root_env);
+
+	set_err_reason("%s", reason);
+	set_err_print(print);
+	return val;
+}
+
+// Folds a call node to a builtin in place, if it can be
+static void fold_call(struct interp *interp, struct node *node, sobj *head) {
+	int num_args = node->u.call.num_args;
+	sobj *args[num_args > 0 ? num_args : 1];
+	uint64_t guard = node->u.call.guard;
+
+	for(int i=0; i<num_args; i++) {
+		uint64_t arg_guard;
+		if(!constant_value(node->u.call.arg_nodes[i], &args[i], &arg_guard))
+			return;
+		guard |= arg_guard;
+
+		// set-car! and set-cdr! can change a constant pair after the call is
+		// folded, unless hash consing shared it and so made it immutable
+		if(args[i]->type == OBJ_CONS && !args[i]->immutable)
+			return;
+	}
+
+	// Inline primitives are guarded already
+	if(head->type == OBJ_SYMBOL && node->u.call.guard == 0) {
+		uint64_t bit = guard_global(interp, head->val.sym.str,
+			node->u.call.prim);
+		if(bit == 0) return;
+		guard |= bit;
+	}
+
+	sobj *val = call_quietly(interp, node->u.call.prim, num_args, args);
+	if(val == NULL) return;
+
+	STAT_ADD(STAT_CALLS_FOLDED, 1);
+	node->run = &run_folded;
+	node->u.call.folded = val;
+	node->u.call.guard = guard;
+}
+
+// A reference to a variable known to be bound to a constant, or NULL
+static struct node *known_ref(struct analysis *an, sobj *expr) {
+	const char *name = expr->val.sym.str;
+	struct known *known = an->known;
+	while(known != NULL && strcmp(known->name, name) != 0)
+		known = known->next;
+
+	if(known == NULL || known->value == NULL)
+		return NULL;
+
+	uint64_t bit = add_guard(an->interp, name, known->value);
+	if(bit == 0 || !guards_hold(an->interp, bit))
+		return NULL;
+
+	struct node *node = new_node(&run_known, expr);
+	node->u.known.name = name;
+	node->u.known.value = known->value;
+	node->u.known.interp = an->interp;
+	node->u.known.guard = bit | known->guard;
+	return node;
+}
+
+// =============================== DISPATCH ==================================
+// Picks the node for each expression, from the kinds above.
+// ===========================================================================
+
+static struct node *analyse(struct analysis *an, sobj *expr) {
+	struct interp *interp = an->interp;
+
+	if(expr->type == OBJ_SYMBOL) {
+		struct node *node = known_ref(an, expr);
+		if(node != NULL)
+			return node;
+
+		node = new_node(&run_ref, expr);
+		node->u.name = expr->val.sym.str;
+		return node;
+	}
+
+	if(expr->type != OBJ_CONS)
+		return constant_node(expr, expr);
+
+	sobj *head = get_list_head(expr);
+	sobj *args = get_list_rest(expr);
+	int num_args = get_list_len(args);
+	if(num_args == -1)
+		return new_node(&run_fallback, expr);
+
+	if(head->type == OBJ_BUILTIN_FUNC) {
+		int expected = head->val.builtin.num_args;
+		if(expected != -1 && expected != num_args)
+			return new_node(&run_fallback, expr);
+
+		if(head->val.builtin.is_macro)
+			return analyse_form(an, expr, head, args);
+	}
+
+	sobj *prim = find_prim(interp, head, num_args);
+	int inline_prim = prim != NULL
+		? find_inline(interp, head, prim, num_args) : -1;
+
+	uint64_t guard = 0;
+	struct node *inlined = NULL;
+	if(inline_prim != -1 && head->type == OBJ_SYMBOL)
+		guard = 1ull << inline_prim;
+	else if(prim == NULL)
+		inlined = analyse_inlined(interp, head, num_args, &guard);
+
+	node_fn run = &run_call;
+	if(inline_prim != -1)
+		run = inline_defs[inline_prim].run;
+	else if(prim != NULL)
+		run = &run_prim_call;
+	else if(inlined != NULL)
+		run = &run_inlined;
+
+	struct node *node = new_node(run, expr);
+	node->u.call.op = analyse(an, head);
+	node->u.call.num_args = num_args;
+	node->u.call.arg_nodes = analyse_list(an, args, num_args);
+	node->u.call.args = args;
+	node->u.call.prim = prim;
+	node->u.call.interp = interp;
+	node->u.call.guard = guard;
+	node->u.call.inlined = inlined;
+
+	if(prim != NULL && is_foldable(&prim->val.builtin))
+		fold_call(interp, node, head);
+	return node;
+}
+
+struct node *analysed_body(struct s_lambda *lambda, senv *env) {
+	struct interp *interp = env_interp(env);
+	if(!interp->analyse || interp->verbose)
+		return NULL;
+
+	struct node *body = __atomic_load_n(&lambda->analysed, __ATOMIC_ACQUIRE);
+	if(body != NULL)
+		return body;
+
+	body = analyse_lambda_body(interp, lambda_body(lambda));
+
+	// Threads racing here analyse the same body, so any copy will do
+	struct node *expected = NULL;
+	if(!__atomic_compare_exchange_n(&lambda->analysed, &expected, body, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return expected;
+	return body;
+}
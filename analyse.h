@@ -0,0 +1,172 @@
+#ifndef __ANALYSE_H__
+#define __ANALYSE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "environment.h"
+#include "internal_rep.h"
+
+// Analysing evaluator, in the style of SICP's. The body of a lambda is
+// converted once into a tree of nodes, each holding the C function that
+// evaluates it, so that the syntax of a form is dispatched on, and the arity
+// of calls to special forms and to primitives known at analysis time is
+// checked, once rather than on every evaluation. The tree is cached in the
+// lambda and shared by every lambda made from the same lambda expression.
+//
+// Node kinds: constants (including quote), variable references, if, begin,
+// lambda, define and set! of a symbol, let, let* and letrec, calls with a
+// fixed number of arguments, and calls to a primitive whose operator is
+// checked to still be the builtin it was bound to at analysis time. Other
+// special forms are applied to their unevaluated arguments directly, and
+// malformed forms are handed to eval, so errors are reported exactly as in
+// the interpreter. Scope is dynamic, so a variable's frame isn't known until
+// run time and every reference is looked up.
+//
+// Calls to the primitives in enum inline_prim go further and are evaluated
+// inline, without looking up the operator or building an argument list, for
+// as long as the primitive's name has never been bound to anything else.
+// Calls to small global lambdas, like cadr, are replaced by their bodies
+// under the same kind of guard on the lambda's name. Calls to pure builtins
+// with constant arguments are folded into their result, and references to
+// variables that a let binds to constants into the constant, also under
+// guards. See analyse.c.
+
+struct node;
+
+typedef struct s_obj *(*node_fn)(struct node *node, struct s_env *env);
+
+struct node {
+    node_fn run;
+    // The expression the node was analysed from
+    struct s_obj *expr;
+
+    union {
+        // Constants and quote
+        struct s_obj *constant;
+
+        // Variable references
+        const char *name;
+
+        // Parameters of an inlined lambda, by position
+        int param;
+
+        // Variables bound to a constant by an enclosing let, whose value is
+        // used while guard holds
+        struct {
+            const char *name;
+            struct s_obj *value;
+            struct interp *interp;
+            uint64_t guard;
+        } known;
+
+        struct {
+            struct node *test;
+            struct node *then;
+            struct node *otherwise;
+        } branch;
+
+        // begin, and the bodies of let forms
+        struct {
+            int len;
+            struct node **exprs;
+        } seq;
+
+        struct {
+            struct s_obj *params;
+            struct s_obj *body;
+            struct node *analysed;
+        } lambda;
+
+        // define and set!
+        struct {
+            const char *name;
+            struct node *value;
+        } define;
+
+        // let, let* and letrec
+        struct {
+            int len;
+            const char **names;
+            struct node **inits;
+            struct node *body;
+        } let;
+
+        // Calls. prim is the builtin the operator was bound to at analysis
+        // time for primitive calls, and NULL otherwise. args holds the
+        // unevaluated arguments in case op turns out to be a macro. Inline
+        // primitive calls, inlined lambdas and folded calls take their fast
+        // path while none of the guard bits are set in
+        // interp->broken_guards. inlined is the body of the lambda, and
+        // folded the value of the call.
+        struct {
+            struct node *op;
+            int num_args;
+            struct node **arg_nodes;
+            struct s_obj *args;
+            struct s_obj *prim;
+            struct interp *interp;
+            uint64_t guard;
+            struct node *inlined;
+            struct s_obj *folded;
+        } call;
+
+        // Special forms without a node of their own
+        struct {
+            struct s_obj *(*func)(struct s_obj *args, struct s_env *env);
+            struct s_obj *args;
+        } form;
+    } u;
+};
+
+// Primitives with inline fast paths. car and cdr of a pair, null?, cons,
+// equal? and =, and +, -, <, >, <= and >= of two fixnums never call the
+// builtin; any other arguments are passed to it.
+enum inline_prim {
+    INLINE_CAR,
+    INLINE_CDR,
+    INLINE_IS_NULL,
+    INLINE_CONS,
+    INLINE_IS_EQUAL,
+    INLINE_NUM_EQ,
+    INLINE_ADD,
+    INLINE_SUB,
+    INLINE_LT,
+    INLINE_GT,
+    INLINE_LE,
+    INLINE_GE,
+    NUM_INLINE_PRIMS
+};
+
+// A name that analysed code assumes is only ever bound to value. The first
+// NUM_INLINE_PRIMS guards are the inline primitives, in order; the rest are
+// added as lambdas get inlined.
+struct guard {
+    const char *name;
+    struct s_obj *value;
+};
+
+#define MAX_GUARDS 64
+
+// Sets up the guards of the inline primitives from the root environment,
+// once add_builtins has run
+void init_guards(struct interp *interp);
+
+// Called for every binding made in env, with the hash of name in env's
+// symbol table. Binding a guarded name to anything but its value breaks the
+// guard for good: scope is dynamic, so even a parameter with that name is
+// seen by everything called while it is bound.
+void note_binding(struct s_env *env, const char *name, unsigned hash,
+    struct s_obj *val);
+
+// Analysed body of lambda, analysing it on first use. Returns NULL if bodies
+// are not analysed in this interpreter, in which case the body has to be
+// evaluated with eval.
+struct node *analysed_body(struct s_lambda *lambda, struct s_env *env);
+
+// Evaluates an analysed expression. Like eval, NULL means an error was set.
+static inline struct s_obj *run_node(struct node *node, struct s_env *env) {
+    return node->run(node, env);
+}
+
+#endif
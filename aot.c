@@ -0,0 +1,129 @@
+#include <string.h>
+
+#include "aot.h"
+#include "common.h"
+#include "desugar.h"
+#include "environment.h"
+#include "eval.h"
+#include "interp.h"
+#include "lexer.h"
+#include "parser.h"
+
+typedef struct s_obj sobj;
+typedef struct s_env senv;
+
+sobj *aot_lookup(senv *env, const char *name) {
+	sobj *val = resolve_symbol(env, name, true);
+	if(val == NULL && !has_symbol(env, name, true))
+		SET_ERR("Unbound symbol: %s", name);
+	return val;
+}
+
+enum aot_callable aot_callable(sobj *op) {
+	if(op->type == OBJ_BUILTIN_FUNC)
+		return op->val.builtin.is_macro ? AOT_MACRO : AOT_FUNCTION;
+	if(op->type == OBJ_LAMBDA)
+		return op->val.lambda->is_macro ? AOT_MACRO : AOT_FUNCTION;
+
+	char rep[128];
+	SET_ERR("Trying to treat non-function object as function: %s",
+		get_string_rep(op, rep, sizeof(rep)));
+	return AOT_NOT_CALLABLE;
+}
+
+sobj *aot_apply(sobj *op, senv *env, int num_args, sobj **args) {
+	// Built back to front, like eval does
+	sobj *arglist = fetch_singleton_object(SG_EMPTY_LIST);
+	for(int i=num_args-1; i>=0; i--)
+		arglist = new_cons(args[i], arglist);
+
+	return apply_function(op, arglist, env);
+}
+
+// Parses and desugars the source of a site. Keywords are resolved in the
+// root environment, the same one top-level forms are desugared in.
+static sobj *load_site(senv *env, const char *src) {
+	struct interp *interp = env_interp(env);
+	struct tok_lst *toks = tokenise_string(interp->lexer, src);
+	if(toks == NULL) {
+		SET_ERR("Failed to tokenise compiled form");
+		return NULL;
+	}
+
+	sobj *program = parse_tokens(interp, toks);
+	free_tok_lst(toks);
+	if(program == NULL)
+		return NULL;
+
+	return desugar(get_list_head(get_list_rest(program)), interp->root_env);
+}
+
+static sobj *site_form(senv *env, struct aot_site *site) {
+	sobj *form = __atomic_load_n(&site->form, __ATOMIC_ACQUIRE);
+	if(form != NULL)
+		return form;
+
+	form = load_site(env, site->src);
+	if(form == NULL)
+		return NULL;
+
+	// Threads racing here parse the same text, so any copy will do
+	sobj *expected = NULL;
+	if(!__atomic_compare_exchange_n(&site->form, &expected, form, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return expected;
+	return form;
+}
+
+sobj *aot_eval(senv *env, struct aot_site *site) {
+	sobj *form = site_form(env, site);
+	if(form == NULL) return NULL;
+
+	return eval(form, env, true);
+}
+
+sobj *aot_apply_macro(sobj *op, senv *env, struct aot_site *site) {
+	sobj *form = site_form(env, site);
+	if(form == NULL) return NULL;
+
+	return apply_function(op, get_list_rest(form), env);
+}
+
+sobj *aot_lambda(senv *env, sobj *params, jit_fn code) {
+	// The body only exists as code, so the lambda never reaches eval
+	sobj *lambda = new_lambda(params, fetch_singleton_object(SG_EMPTY_LIST), env);
+	if(lambda == NULL) return NULL;
+
+	lambda->val.lambda->native = code;
+	return lambda;
+}
+
+sobj *aot_define(senv *env, const char *name, sobj *val) {
+	if(val->type == OBJ_LAMBDA && val->val.lambda->name == NULL)
+		val->val.lambda->name = name;
+
+	associate_symbol(env, name, val);
+	return fetch_singleton_object(SG_EMPTY_LIST);
+}
+
+sobj *aot_arity_error(int expected, int got) {
+	SET_ERR("Arity mismatch: expected %d, got %d", expected, got);
+	return NULL;
+}
+
+int aot_main(void (*init)(struct interp *),
+	sobj *(**files)(senv *), int num_files) {
+
+	struct interp *interp = create_interp();
+	clear_err_reason(interp->print_errors);
+	init(interp);
+
+	int status = 0;
+	for(int i=0; i<num_files; i++) {
+		if(files[i](interp->root_env) == NULL)
+			status = EX_SOFTWARE;
+	}
+
+	fflush(stdout);
+	return status;
+}
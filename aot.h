@@ -0,0 +1,118 @@
+#ifndef __AOT_H__
+#define __AOT_H__
+
+#include <stdbool.h>
+
+#include "environment.h"
+#include "eval.h"
+#include "internal_rep.h"
+#include "interp.h"
+#include "jit.h"
+
+// Runtime support for the C programs written by --compile-to-c, see
+// compile.h. Generated code includes only this header and links against
+// libscheme.a. Every helper follows the conventions of eval: NULL means an
+// error was set with SET_ERR and has to be passed up.
+
+// Result of aot_callable
+enum aot_callable { AOT_NOT_CALLABLE, AOT_FUNCTION, AOT_MACRO };
+
+// A form the compiler leaves to the interpreter. It is kept as source text
+// and parsed and desugared the first time it is evaluated, so that forms
+// which never run cost nothing at startup.
+struct aot_site {
+    const char *src;
+    struct s_obj *form;
+};
+
+// Value of name in env, with eval's error if it is unbound
+struct s_obj *aot_lookup(struct s_env *env, const char *name);
+
+// Checks that op can be applied, setting eval's error if it can't
+enum aot_callable aot_callable(struct s_obj *op);
+
+// Applies a function to num_args evaluated arguments
+struct s_obj *aot_apply(struct s_obj *op, struct s_env *env,
+    int num_args, struct s_obj **args);
+
+// Evaluates the form of site in env with the interpreter
+struct s_obj *aot_eval(struct s_env *env, struct aot_site *site);
+
+// Applies the macro op to the unevaluated arguments of the call at site
+struct s_obj *aot_apply_macro(struct s_obj *op, struct s_env *env,
+    struct aot_site *site);
+
+// A lambda closing over env whose body is the compiled function code.
+// params is the argument list as it appeared in the source.
+struct s_obj *aot_lambda(struct s_env *env, struct s_obj *params, jit_fn code);
+
+// define and set! of a symbol: names an anonymous lambda after the binding
+// and binds name in env
+struct s_obj *aot_define(struct s_env *env, const char *name, struct s_obj *val);
+
+// Error for a call to a named let loop with the wrong number of arguments
+struct s_obj *aot_arity_error(int expected, int got);
+
+// Creates an interpreter, builds the program's constants with init, then
+// runs each file's function in order. A file stops at its first error, like
+// interp_eval_file. Returns the exit status for main.
+int aot_main(void (*init)(struct interp *),
+    struct s_obj *(**files)(struct s_env *), int num_files);
+
+static inline bool aot_is_false(struct s_obj *obj) {
+    return obj->type == OBJ_BOOLEAN && obj->val.boolean == false;
+}
+
+// ============================== PRIMITIVES =================================
+// Fast paths for primitives that the compiler proved are never rebound. op
+// is the builtin itself, which handles every case but fixnums (and pairs for
+// car and cdr), including the errors.
+// ===========================================================================
+
+static inline bool aot_fixnums(struct s_obj *a, struct s_obj *b) {
+    return a->type == OBJ_NUMBER && a->val.number.type == SCHEME_INT
+        && b->type == OBJ_NUMBER && b->val.number.type == SCHEME_INT;
+}
+
+#define AOT_ARITH(NAME, EXPR)                                               \
+    static inline struct s_obj *NAME(struct s_obj *op, struct s_env *env,   \
+        struct s_obj *a, struct s_obj *b) {                                 \
+        if(!aot_fixnums(a, b))                                              \
+            return aot_apply(op, env, 2, (struct s_obj *[]){ a, b });       \
+        int64_t x = a->val.number.value.integer;                            \
+        int64_t y = b->val.number.value.integer;                            \
+        return EXPR;                                                        \
+    }
+
+AOT_ARITH(aot_add, new_numeric(SCHEME_INT, x + y, 0))
+AOT_ARITH(aot_sub, new_numeric(SCHEME_INT, x - y, 0))
+AOT_ARITH(aot_lt, fetch_bool(x < y))
+AOT_ARITH(aot_gt, fetch_bool(x > y))
+AOT_ARITH(aot_le, fetch_bool(x <= y))
+AOT_ARITH(aot_ge, fetch_bool(x >= y))
+AOT_ARITH(aot_num_eq, fetch_bool(x == y))
+
+#undef AOT_ARITH
+
+static inline struct s_obj *aot_car(struct s_obj *op, struct s_env *env,
+    struct s_obj *a) {
+    if(a->type != OBJ_CONS)
+        return aot_apply(op, env, 1, &a);
+    return a->val.cc.left;
+}
+
+static inline struct s_obj *aot_cdr(struct s_obj *op, struct s_env *env,
+    struct s_obj *a) {
+    if(a->type != OBJ_CONS)
+        return aot_apply(op, env, 1, &a);
+    return a->val.cc.right;
+}
+
+static inline struct s_obj *aot_is_null(struct s_obj *op, struct s_env *env,
+    struct s_obj *a) {
+    (void)op;
+    (void)env;
+    return fetch_bool(a->type == OBJ_EMPTY_LIST);
+}
+
+#endif
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Ahead-of-time compilation benchmark. Each Gabriel-style program is run by
+# the interpreter and as a native executable built with --compile-to-c, from
+# the same source: the program followed by REPEAT calls of (run) and a final
+# (write (run)). Both results must be the same. Times include startup.
+# Run from the repository root: bash bench/aot.sh [program...]
+
+set -e
+SCHEME=${SCHEME:-./scheme}
+REPEAT=${REPEAT:-20}
+TMP=${TMPDIR:-/tmp}
+
+if [ $# -eq 0 ]; then
+    set -- fib tak nqueens deriv destruct hanoi strings member countatoms \
+        accessors constants mutation
+fi
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+echo "program,repeat,interp_ms,compiled_ms,speedup"
+for name in "$@"; do
+    src=$TMP/aot-$name.scheme
+    cat "bench/gabriel/$name.scheme" > "$src"
+    for ((i = 0; i < REPEAT; i++)); do
+        echo "(run)" >> "$src"
+    done
+    echo "(write (run))" >> "$src"
+
+    make -s "${src%.scheme}.compiled" > /dev/null
+
+    start=$(now_ms)
+    expected=$("$SCHEME" "$src" < /dev/null | grep -v "^\[LOG" | head -n 1)
+    interp_ms=$(( $(now_ms) - start ))
+
+    start=$(now_ms)
+    actual=$("${src%.scheme}.compiled" | head -n 1)
+    compiled_ms=$(( $(now_ms) - start ))
+
+    if [ "$expected" != "$actual" ]; then
+        echo "$name: compiled result $actual, interpreter $expected" >&2
+        exit 1
+    fi
+
+    speedup=$(awk -v a="$interp_ms" -v b="$compiled_ms" \
+        'BEGIN { printf "%.2f", (b > 0 ? a / b : 0) }')
+    echo "$name,$REPEAT,$interp_ms,$compiled_ms,$speedup"
+
+    rm -f "$src" "${src%.scheme}.compiled.c" "${src%.scheme}.compiled"
+done
@@ -0,0 +1,77 @@
+#!/bin/bash
+# Binary serialisation benchmark. Builds a list of N records, writes it out
+# as text with write and as binary with write-binary, and reads each back:
+# the text by loading it as a quoted constant, the binary with read-binary.
+# Times include startup and building the data, which the build row times
+# alone. Both reads are checked against equal-hash of the original.
+# Run from the repository root: bash bench/binary-io.sh
+
+set -e
+SCHEME=${SCHEME:-./scheme}
+N=${N:-100000}
+TMP=${TMPDIR:-/tmp}
+GEN=$TMP/scheme-binary-io-gen.scheme
+TEXT=$TMP/scheme-binary-io-text.scheme
+BIN=$TMP/scheme-binary-io.dat
+PROG=$TMP/scheme-binary-io-prog.scheme
+
+# Each record is a list of an int, a string, a list of symbols, a boolean,
+# a list of ints and a tag list shared by all of them, 14 pairs in all.
+# Built with do, since a recursive loop grows the dynamic scope chain.
+cat > "$GEN" <<EOF
+(define tags (list 'hot 'cold))
+(define (record i)
+  (list i (number->string (* i 7919)) (list 'id 'name 'value) (= 0 (- i i))
+        (list i (* i i)) tags))
+(define data
+  (do ((i $N (- i 1)) (acc '() (cons (record i) acc))) ((= i 0) acc)))
+EOF
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Runs the generator followed by the given expressions, printing the time
+run() {
+    local out=$1
+    shift
+    { cat "$GEN"; printf '%s\n' "$@"; } > "$PROG"
+    local start=$(now_ms)
+    "$SCHEME" "$PROG" < /dev/null 2>/dev/null | grep -v "^\[LOG" \
+        | head -n 1 > "$out"
+    echo $(( $(now_ms) - start ))
+}
+
+# Loads file, printing the time and checking the hash it prints
+load() {
+    local start=$(now_ms)
+    local hash=$("$SCHEME" "$1" < /dev/null 2>/dev/null | grep -v "^\[LOG" \
+        | head -n 1)
+    local ms=$(( $(now_ms) - start ))
+    if [ "$hash" != "$expected" ]; then
+        echo "hash mismatch: $hash, expected $expected" >&2
+        exit 1
+    fi
+    echo $ms
+}
+
+build_ms=$(run "$TMP/scheme-binary-io.hash" '(write (equal-hash data))')
+expected=$(head -n 1 "$TMP/scheme-binary-io.hash")
+
+text_write_ms=$(run "$TMP/scheme-binary-io.out" '(write data)')
+{ printf "(define data '"; cat "$TMP/scheme-binary-io.out"; \
+  printf ")\n(write (equal-hash data))\n"; } > "$TEXT"
+text_read_ms=$(load "$TEXT")
+
+bin_write_ms=$(run /dev/null "(write-binary data \"$BIN\")")
+echo "(write (equal-hash (read-binary \"$BIN\")))" > "$PROG"
+bin_read_ms=$(load "$PROG")
+
+echo "$N records"
+echo "format,bytes,write_ms,read_ms"
+echo "build,,$build_ms,"
+echo "text,$(wc -c < "$TEXT"),$text_write_ms,$text_read_ms"
+echo "binary,$(wc -c < "$BIN"),$bin_write_ms,$bin_read_ms"
+
+rm -f "$GEN" "$TEXT" "$BIN" "$PROG" "$TMP"/scheme-binary-io.hash \
+    "$TMP"/scheme-binary-io.out
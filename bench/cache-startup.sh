@@ -0,0 +1,66 @@
+#!/bin/bash
+# Parse cache benchmark. Loads builtins.scheme alone, and a generated
+# program of N functions that are all called, without a cache, with an empty
+# cache directory (cold) and with the entries the cold run wrote (warm).
+# Times include startup. Each is run with lazy bodies and with --no-lazy.
+# Run from the repository root: bash bench/cache-startup.sh
+
+set -e
+SCHEME=${SCHEME:-./scheme}
+N=${N:-2000}
+TMP=${TMPDIR:-/tmp}
+SRC=$TMP/scheme-cache-startup.scheme
+CACHE=$TMP/scheme-cache-startup.d
+
+awk -v n="$N" 'BEGIN {
+    for(i = 0; i < n; i++) {
+        printf "(define (f%d x y)\n", i;
+        printf "  (let ((a (+ x %d)) (b (list y \"s%d\" (quote (p q r)))))\n", i % 7, i;
+        printf "    (cond ((< a 0) (f%d (- a 1) b))\n", (i + 1) % n;
+        printf "          ((null? b) (list a x y))\n";
+        printf "          (else (let loop ((k a) (acc (quote ())))\n";
+        printf "                  (if (= k 0) (length acc)\n";
+        printf "                      (loop (- k 1) (cons k acc))))))))\n\n";
+    }
+    printf "(define total 0)\n";
+    for(i = 0; i < n; i++)
+        printf "(set! total (+ total (f%d 1 2)))\n", i;
+    printf "(write total)\n";
+}' > "$SRC"
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Prints the time of one run and checks its result against the first one
+run() {
+    local start=$(now_ms)
+    local out=$("$SCHEME" "$@" < /dev/null 2>&1 | grep -v "^\[LOG" | head -n 1)
+    local ms=$(( $(now_ms) - start ))
+    if [ -z "${expected+x}" ]; then
+        expected=$out
+    elif [ "$out" != "$expected" ]; then
+        echo "result mismatch: $out, expected $expected" >&2
+        exit 1
+    fi
+    echo -n ",$ms"
+}
+
+echo "$SRC: $(wc -c < "$SRC") bytes, $N functions"
+echo "input,mode,uncached_ms,cold_ms,warm_ms"
+for input in noin "$SRC"; do
+    unset expected
+    for mode in lazy eager; do
+        flags=
+        [ "$mode" = eager ] && flags=--no-lazy
+        rm -rf "$CACHE"
+
+        echo -n "$(basename "$input"),$mode"
+        run $flags "$input"
+        run $flags --cache-dir="$CACHE" "$input"
+        run $flags --cache-dir="$CACHE" "$input"
+        echo
+    done
+done
+
+rm -rf "$SRC" "$CACHE"
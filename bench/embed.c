@@ -0,0 +1,130 @@
+// Compares evaluating requests with the embedded library against running one
+// `scheme` process per request and reading its output back through a pipe.
+//
+// Build with `make bench/embed` and run from the repository root:
+//     ./bench/embed [requests]
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "interp.h"
+
+extern char **environ;
+
+// The request each call evaluates. host-scale is a native primitive when
+// embedded and defined in scheme for the subprocess.
+static const char *request = "(host-scale (length (transfer 'a 'b 'c 8)))";
+
+static const char *definitions =
+	"(define (transfer from to spare n)"
+	"  (if (= n 1)"
+	"      (list (list 'move from to))"
+	"      (append (transfer from spare to (- n 1))"
+	"              (append (list (list 'move from to))"
+	"                      (transfer spare to from (- n 1))))))";
+
+static struct s_obj *host_scale(struct s_obj *args, struct s_env *env) {
+	(void)env;
+	struct s_obj *n = get_list_head(args);
+	if(n->type != OBJ_NUMBER || n->val.number.type != SCHEME_INT) {
+		SET_ERR("host-scale: expected an integer");
+		return NULL;
+	}
+	return new_numeric(SCHEME_INT, n->val.number.value.integer * 10, 0);
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run_embedded(int requests) {
+	double start = now();
+
+	struct interp *interp = create_interp();
+	interp_eval_file(interp, "builtins.scheme");
+	interp_eval_string(interp, definitions);
+	interp_define_primitive(interp, "host-scale", 1, &host_scale);
+
+	for(int i=0; i<requests; i++) {
+		struct s_obj *res = interp_eval_string(interp, request);
+		if(res == NULL || res->type != OBJ_NUMBER)
+			exit_msg(EX_SOFTWARE, "Embedded request failed: %s",
+				get_err_reason());
+	}
+
+	return now() - start;
+}
+
+static double run_subprocess(int requests) {
+	char path[] = "/tmp/scheme-embed-XXXXXX";
+	int fd = mkstemp(path);
+	ensure_exit(fd != -1, EX_CANTCREAT, "Failed to create request file");
+
+	FILE *fp = fdopen(fd, "w");
+	fprintf(fp, "%s\n(define (host-scale n) (* n 10))\n(write %s)\n",
+		definitions, request);
+	fclose(fp);
+
+	char *argv[] = { "./scheme", path, NULL };
+	char outbuf[4096];
+	double start = now();
+
+	for(int i=0; i<requests; i++) {
+		int out[2];
+		ensure_exit(pipe(out) == 0, EX_OSERR, "Failed to create pipe");
+
+		// stdin is /dev/null so that the REPL exits straight away
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+		posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+		posix_spawn_file_actions_addclose(&actions, out[0]);
+
+		pid_t pid;
+		int ret = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+		ensure_exit(ret == 0, EX_OSERR, "Failed to spawn %s", argv[0]);
+		posix_spawn_file_actions_destroy(&actions);
+		close(out[1]);
+
+		// Read the whole output back, as a client parsing the result would
+		while(read(out[0], outbuf, sizeof(outbuf)) > 0)
+			continue;
+		close(out[0]);
+
+		int status;
+		waitpid(pid, &status, 0);
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			exit_msg(EX_SOFTWARE, "Subprocess request failed");
+	}
+
+	double elapsed = now() - start;
+	unlink(path);
+	return elapsed;
+}
+
+int main(int argc, char **argv) {
+	int requests = argc > 1 ? atoi(argv[1]) : 200;
+	if(requests < 1)
+		exit_msg(EX_USAGE, "Usage: %s [requests]", argv[0]);
+
+	double embedded = run_embedded(requests);
+	double subprocess = run_subprocess(requests);
+
+	printf("mode,requests,seconds,usec_per_request\n");
+	printf("embedded,%d,%.3f,%.1f\n", requests, embedded,
+		embedded / requests * 1e6);
+	printf("subprocess,%d,%.3f,%.1f\n", requests, subprocess,
+		subprocess / requests * 1e6);
+	printf("speedup,%.1f\n", subprocess / embedded);
+
+	return 0;
+}
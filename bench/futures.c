@@ -0,0 +1,113 @@
+// Divide-and-conquer benchmarks for future and touch, run with 1, 2, 4 and 8
+// threads. Each program spawns a future for one branch of the recursion down
+// to a cutoff and evaluates the rest sequentially.
+//
+// Build with `make bench/futures` and run from the repository root:
+//     ./bench/futures [repetitions]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "interp.h"
+
+static const char *definitions =
+	"(define (fib n)"
+	"  (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+	"(define (pfib n)"
+	"  (if (< n 12)"
+	"      (fib n)"
+	"      (let ((a (future (pfib (- n 1)))) (b (pfib (- n 2))))"
+	"        (+ (touch a) b))))"
+
+	"(define (tak x y z)"
+	"  (if (< y x)"
+	"      (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))"
+	"      z))"
+	"(define (ptak x y z depth)"
+	"  (if (if (= depth 0) #f (< y x))"
+	"      (let ((a (future (ptak (- x 1) y z (- depth 1))))"
+	"            (b (future (ptak (- y 1) z x (- depth 1))))"
+	"            (c (ptak (- z 1) x y (- depth 1))))"
+	"        (ptak (touch a) (touch b) c (- depth 1)))"
+	"      (tak x y z)))"
+
+	"(define (safe? q dist placed)"
+	"  (cond ((null? placed) #t)"
+	"        ((= (car placed) q) #f)"
+	"        ((= (- (car placed) q) dist) #f)"
+	"        ((= (- q (car placed)) dist) #f)"
+	"        (else (safe? q (+ dist 1) (cdr placed)))))"
+	"(define (queens n row placed)"
+	"  (if (= row n) 1"
+	"      (do ((q 0 (+ q 1))"
+	"           (total 0 (if (safe? q 1 placed)"
+	"                        (+ total (queens n (+ row 1) (cons q placed)))"
+	"                        total)))"
+	"          ((= q n) total))))"
+	"(define (spawn-queens n q)"
+	"  (future (queens n 1 (list q))))"
+	"(define (pqueens n)"
+	"  (do ((q 0 (+ q 1))"
+	"       (parts '() (cons (spawn-queens n q) parts)))"
+	"      ((= q n) (apply + (pmap touch parts)))))";
+
+struct program {
+	const char *name;
+	const char *expr;
+	long expected;
+};
+
+static const struct program programs[] = {
+	{ "fib",     "(pfib 22)",        17711 },
+	{ "tak",     "(ptak 18 12 6 3)", 7 },
+	{ "nqueens", "(pqueens 7)",      40 },
+};
+
+#define NUM_PROGRAMS (sizeof(programs) / sizeof(programs[0]))
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+	int reps = argc > 1 ? atoi(argv[1]) : 3;
+	if(reps < 1)
+		exit_msg(EX_USAGE, "Usage: %s [repetitions]", argv[0]);
+
+	static const int thread_counts[] = { 1, 2, 4, 8 };
+	double base[NUM_PROGRAMS];
+
+	printf("program,threads,seconds,speedup\n");
+
+	for(size_t t=0; t<sizeof(thread_counts)/sizeof(int); t++) {
+		struct interp *interp = create_interp();
+		interp->num_threads = thread_counts[t];
+		interp_eval_file(interp, "builtins.scheme");
+		interp_eval_string(interp, definitions);
+
+		for(size_t p=0; p<NUM_PROGRAMS; p++) {
+			double start = now();
+			for(int r=0; r<reps; r++) {
+				struct s_obj *res = interp_eval_string(interp, programs[p].expr);
+				if(res == NULL || res->type != OBJ_NUMBER
+					|| res->val.number.value.integer != programs[p].expected) {
+					exit_msg(EX_SOFTWARE, "%s failed: %s", programs[p].name,
+						get_err_reason());
+				}
+			}
+			double elapsed = (now() - start) / reps;
+
+			if(t == 0)
+				base[p] = elapsed;
+
+			printf("%s,%d,%.3f,%.2f\n", programs[p].name, thread_counts[t],
+				elapsed, base[p] / elapsed);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Lazy function body benchmark. Generates a program defining N functions, of
+# which only the first CALLED are ever called, and loads it with lazy bodies
+# and with --no-lazy. Times include startup; bytes are from --stats.
+# Run from the repository root: bash bench/lazy-load.sh
+
+set -e
+SCHEME=${SCHEME:-./scheme}
+N=${N:-5000}
+CALLED=${CALLED:-10}
+TMP=${TMPDIR:-/tmp}
+SRC=$TMP/scheme-lazy-load.scheme
+
+awk -v n="$N" -v called="$CALLED" 'BEGIN {
+    for(i = 0; i < n; i++) {
+        printf "(define (f%d x y)\n", i;
+        printf "  ; Body big enough to be worth skipping\n";
+        printf "  (let ((a (+ x %d)) (b (list y \"s%d\" (quote (p q r)))))\n", i, i;
+        printf "    (cond ((< a 0) (f%d (- a 1) b))\n", (i + 1) % n;
+        printf "          ((null? b) (list a x y))\n";
+        printf "          (else (let loop ((k a) (acc (quote ())))\n";
+        printf "                  (if (= k 0) (length acc)\n";
+        printf "                      (loop (- k 1) (cons (* k k) acc))))))))\n\n";
+    }
+    printf "(define total 0)\n";
+    for(i = 0; i < called; i++)
+        printf "(set! total (+ total (f%d 1 2)))\n", i;
+    printf "(write total)\n";
+}' > "$SRC"
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+echo "$SRC: $(wc -c < "$SRC") bytes, $N functions, $CALLED called"
+echo "mode,ms,bytes_allocated,result"
+for mode in lazy eager; do
+    flags=--stats
+    [ "$mode" = eager ] && flags="$flags --no-lazy"
+
+    start=$(now_ms)
+    out=$("$SCHEME" $flags "$SRC" < /dev/null 2>&1)
+    ms=$(( $(now_ms) - start ))
+
+    bytes=$(echo "$out" | awk '$1 == "bytes-allocated" { print $2 }')
+    result=$(echo "$out" | grep -v "^\[LOG" | head -n 1)
+    echo "$mode,$ms,$bytes,$result"
+done
+
+rm -f "$SRC"
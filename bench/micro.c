@@ -0,0 +1,294 @@
+// Microbenchmarks for the runtime's hot paths, timed in isolation against
+// the runtime object files. Each operation runs in batches sized so that one
+// batch takes a few milliseconds, and the spread between batches is reported
+// alongside the mean so that a regression can be told apart from noise.
+//
+// Build and run with `make microbench`, or run from the repository root:
+//     ./bench/micro [--samples n] [name-prefix...]
+
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "environment.h"
+#include "eval.h"
+#include "internal_rep.h"
+#include "interp.h"
+#include "lexer.h"
+#include "parser.h"
+
+// Minimum duration of one timed batch
+#define MIN_BATCH_NS 5000000
+
+// Tokens in each input of the tokeniser benchmarks
+#define NUM_INPUT_TOKENS 1000
+
+struct microbench {
+	const char *name;
+	// Operations performed by one call of run with iters = 1
+	int ops_per_iter;
+	void (*run)(long iters);
+};
+
+static struct interp *interp;
+
+// Results are written here so that the work can't be optimised away
+static volatile void *sink;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ============================== ALLOCATION =================================
+
+static void run_new_cons(long iters) {
+	struct s_obj *empty = fetch_singleton_object(SG_EMPTY_LIST);
+	for(long i=0; i<iters; i++)
+		sink = new_cons(empty, empty);
+}
+
+static void run_new_numeric(long iters) {
+	for(long i=0; i<iters; i++)
+		sink = new_numeric(SCHEME_INT, i, 0);
+}
+
+// ============================== ENVIRONMENTS ===============================
+// Lookups start at the innermost of a chain of environments and find a
+// symbol bound in the outermost one, so depth is the number of hash tables
+// searched.
+// ===========================================================================
+
+static struct s_env *make_chain(int depth) {
+	struct s_env *env = create_new_env(interp->root_env);
+	associate_symbol(env, "target", fetch_bool(true));
+
+	// Every frame binds a few other names, like a typical procedure call
+	for(int i=1; i<depth; i++) {
+		env = create_new_env(env);
+		associate_symbol(env, "a", fetch_bool(false));
+		associate_symbol(env, "b", fetch_bool(false));
+	}
+	return env;
+}
+
+static void run_resolve(int depth, long iters) {
+	static struct s_env *chains[65];
+	if(chains[depth] == NULL)
+		chains[depth] = make_chain(depth);
+
+	for(long i=0; i<iters; i++)
+		sink = resolve_symbol(chains[depth], "target", true);
+}
+
+static void run_resolve_1(long iters)  { run_resolve(1, iters); }
+static void run_resolve_4(long iters)  { run_resolve(4, iters); }
+static void run_resolve_16(long iters) { run_resolve(16, iters); }
+static void run_resolve_64(long iters) { run_resolve(64, iters); }
+
+// Rebinding an existing name, as set! and define in a loop do
+static void run_associate(long iters) {
+	static struct s_env *env = NULL;
+	if(env == NULL)
+		env = make_chain(1);
+
+	struct s_obj *val = fetch_bool(true);
+	for(long i=0; i<iters; i++)
+		associate_symbol(env, "target", val);
+}
+
+static void run_intern(long iters) {
+	for(long i=0; i<iters; i++)
+		sink = fetch_or_create_symbol(interp, strlen("lambda"), "lambda");
+}
+
+// ============================== READER =====================================
+
+static char *repeat_token(const char *tok) {
+	size_t len = strlen(tok);
+	char *buf = malloc(len * NUM_INPUT_TOKENS + 1);
+	ensure_mem(buf);
+	for(int i=0; i<NUM_INPUT_TOKENS; i++)
+		memcpy(buf + i * len, tok, len);
+	buf[len * NUM_INPUT_TOKENS] = '\0';
+	return buf;
+}
+
+static void run_tokenise(const char *tok, long iters) {
+	char *input = repeat_token(tok);
+	for(long i=0; i<iters; i++) {
+		struct tok_lst *toks = tokenise_string(interp->lexer, input);
+		free_tok_lst(toks);
+	}
+	free(input);
+}
+
+static void run_tok_number(long iters)     { run_tokenise("12345 ", iters); }
+static void run_tok_identifier(long iters) { run_tokenise("list-ref ", iters); }
+static void run_tok_string(long iters)     { run_tokenise("\"abc\" ", iters); }
+static void run_tok_bool(long iters)       { run_tokenise("#t ", iters); }
+static void run_tok_paren(long iters)      { run_tokenise("(", iters); }
+static void run_tok_comment(long iters)    { run_tokenise("; note\n", iters); }
+
+// Parses the same token list over and over, NUM_INPUT_TOKENS tokens at a time
+static void run_parse(long iters) {
+	char *input = repeat_token("(f 1 \"s\") ");
+	struct tok_lst *toks = tokenise_string(interp->lexer, input);
+
+	for(long i=0; i<iters; i++) {
+		set_stream_pos(toks, 0);
+		sink = parse_tokens(interp, toks);
+	}
+
+	free_tok_lst(toks);
+	free(input);
+}
+
+// ============================== EQUALITY ===================================
+
+static struct s_obj *number_list(int n) {
+	struct s_obj *lst = fetch_singleton_object(SG_EMPTY_LIST);
+	for(int i=n; i>0; i--)
+		lst = new_cons(new_numeric(SCHEME_INT, i, 0), lst);
+	return lst;
+}
+
+// Per element of two equal 100 element lists
+static void run_elt_eq(long iters) {
+	static struct s_obj *a = NULL, *b = NULL;
+	if(a == NULL) {
+		a = number_list(100);
+		b = number_list(100);
+	}
+
+	for(long i=0; i<iters; i++)
+		ensure_exit(elt_eq(a, b), EX_SOFTWARE, "elt_eq failed");
+}
+
+// ============================== CALLS ======================================
+
+static void run_apply(const char *src, long iters) {
+	struct s_obj *proc = interp_eval_string(interp, src);
+	ensure_exit(proc != NULL, EX_SOFTWARE, "%s: %s", src, get_err_reason());
+
+	struct s_obj *args = new_cons(new_numeric(SCHEME_INT, 1, 0),
+		new_cons(new_numeric(SCHEME_INT, 2, 0),
+			fetch_singleton_object(SG_EMPTY_LIST)));
+
+	for(long i=0; i<iters; i++)
+		sink = apply_function(proc, args, interp->root_env);
+}
+
+static void run_apply_builtin(long iters) { run_apply("+", iters); }
+static void run_apply_lambda(long iters)  { run_apply("(lambda (a b) a)", iters); }
+
+static const struct microbench benches[] = {
+	{ "new_cons",               1,                &run_new_cons },
+	{ "new_numeric",            1,                &run_new_numeric },
+	{ "resolve_symbol/depth1",  1,                &run_resolve_1 },
+	{ "resolve_symbol/depth4",  1,                &run_resolve_4 },
+	{ "resolve_symbol/depth16", 1,                &run_resolve_16 },
+	{ "resolve_symbol/depth64", 1,                &run_resolve_64 },
+	{ "associate_symbol",       1,                &run_associate },
+	{ "fetch_or_create_symbol", 1,                &run_intern },
+	{ "tokenise/number",        NUM_INPUT_TOKENS, &run_tok_number },
+	{ "tokenise/identifier",    NUM_INPUT_TOKENS, &run_tok_identifier },
+	{ "tokenise/string",        NUM_INPUT_TOKENS, &run_tok_string },
+	{ "tokenise/bool",          NUM_INPUT_TOKENS, &run_tok_bool },
+	{ "tokenise/paren",         NUM_INPUT_TOKENS, &run_tok_paren },
+	{ "tokenise/comment",       NUM_INPUT_TOKENS, &run_tok_comment },
+	{ "parse_tokens",           NUM_INPUT_TOKENS * 5, &run_parse },
+	{ "elt_eq",                 100,              &run_elt_eq },
+	{ "apply_function/builtin", 1,                &run_apply_builtin },
+	{ "apply_function/lambda",  1,                &run_apply_lambda },
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+// Doubles the batch size until one batch takes at least MIN_BATCH_NS
+static long calibrate(const struct microbench *b) {
+	long iters = 1;
+	while(true) {
+		uint64_t start = now_ns();
+		b->run(iters);
+		if(now_ns() - start >= MIN_BATCH_NS)
+			return iters;
+		iters *= 2;
+	}
+}
+
+static bool selected(const struct microbench *b, int argc, char **argv) {
+	if(argc == 0)
+		return true;
+
+	for(int i=0; i<argc; i++) {
+		if(strncmp(b->name, argv[i], strlen(argv[i])) == 0)
+			return true;
+	}
+	return false;
+}
+
+int main(int argc, char **argv) {
+	int samples = 10;
+
+	struct option long_options[] = {
+		{"samples", required_argument, NULL, 's'},
+		{0, 0, 0, 0},
+	};
+
+	int ch;
+	while((ch = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		if(ch == 's')
+			samples = atoi(optarg);
+		else
+			exit_msg(EX_USAGE, "Usage: %s [--samples n] [name-prefix...]",
+				argv[0]);
+	}
+
+	if(samples < 2)
+		exit_msg(EX_USAGE, "Need at least two samples");
+
+	argc -= optind;
+	argv += optind;
+
+	interp = create_interp();
+
+	printf("operation,samples,ops_per_sample,mean_ns,stddev_ns,min_ns,cv_pct\n");
+
+	for(size_t i=0; i<NUM_BENCHES; i++) {
+		const struct microbench *b = &benches[i];
+		if(!selected(b, argc, argv))
+			continue;
+
+		long iters = calibrate(b);
+		double ops = (double)iters * b->ops_per_iter;
+
+		double sum = 0, sum_sq = 0, min = INFINITY;
+		for(int s=0; s<samples; s++) {
+			uint64_t start = now_ns();
+			b->run(iters);
+			double ns = (now_ns() - start) / ops;
+
+			sum += ns;
+			sum_sq += ns * ns;
+			min = fmin(min, ns);
+		}
+
+		double mean = sum / samples;
+		// Sample standard deviation of the per-batch means
+		double var = (sum_sq - samples * mean * mean) / (samples - 1);
+		double stddev = var > 0 ? sqrt(var) : 0;
+
+		printf("%s,%d,%.0f,%.2f,%.2f,%.2f,%.1f\n", b->name, samples, ops,
+			mean, stddev, min, 100 * stddev / mean);
+		fflush(stdout);
+	}
+
+	return 0;
+}
@@ -0,0 +1,34 @@
+#!/bin/bash
+# Parse throughput benchmark. Generates multi-MB inputs that the old recursive
+# parser could not handle, one flat 1M element list literal and one list
+# nested 100000 deep, and times loading each of them.
+# Run from the repository root: bash bench/parse-throughput.sh
+
+set -e
+SCHEME=${SCHEME:-./scheme}
+TMP=${TMPDIR:-/tmp}
+
+FLAT=$TMP/scheme-parse-flat.scheme
+DEEP=$TMP/scheme-parse-deep.scheme
+
+awk 'BEGIN {
+    printf "(define data (quote (";
+    for(i = 0; i < 1000000; i++) printf "(%d sym%d \"s%d\") ", i, i % 100, i;
+    print ")))";
+    print "(write (length data))";
+}' > "$FLAT"
+
+awk 'BEGIN {
+    printf "(define data (quote ";
+    for(i = 0; i < 100000; i++) printf "(%d ", i;
+    for(i = 0; i < 100000; i++) printf ")";
+    print "))";
+    print "(write (car data))";
+}' > "$DEEP"
+
+for f in "$FLAT" "$DEEP"; do
+    echo "$f: $(wc -c < "$f") bytes"
+    time "$SCHEME" "$f" < /dev/null > /dev/null
+done
+
+rm -f "$FLAT" "$DEEP"
@@ -0,0 +1,72 @@
+// Scaling benchmark for the data-parallel builtins. Scores a list of records
+// with a pure procedure using pmap and preduce, with pools of 1 up to N
+// threads. With one thread the pool runs every chunk on the calling thread,
+// so that row is the sequential baseline.
+//
+// Build with `make bench/pmap` and run from the repository root:
+//     ./bench/pmap [max-threads] [records]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "interp.h"
+
+static const char *definitions =
+	"(define (score n)"
+	"  (do ((i 0 (+ i 1)) (acc 0 (+ acc (* i n)))) ((= i 30) acc)))"
+	"(define (iota n)"
+	"  (do ((i n (- i 1)) (acc '() (cons i acc))) ((= i 0) acc)))";
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double time_request(struct interp *interp, const char *src) {
+	double start = now();
+	if(interp_eval_string(interp, src) == NULL)
+		exit_msg(EX_SOFTWARE, "Request failed: %s", get_err_reason());
+	return now() - start;
+}
+
+int main(int argc, char **argv) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+	int records = argc > 2 ? atoi(argv[2]) : 2000;
+
+	if(max_threads < 1 || records < 1)
+		exit_msg(EX_USAGE, "Usage: %s [max-threads] [records]", argv[0]);
+
+	char setup[128];
+	snprintf(setup, sizeof(setup), "(define records (iota %d))", records);
+
+	printf("threads,records,pmap_sec,preduce_sec,pmap_speedup\n");
+	double base = 0;
+
+	for(int n=1; n<=max_threads; n *= 2) {
+		struct interp *interp = create_interp();
+		interp->num_threads = n;
+		interp_eval_file(interp, "builtins.scheme");
+		interp_eval_string(interp, definitions);
+		interp_eval_string(interp, setup);
+
+		double pmap = time_request(interp, "(pmap score records)");
+		double preduce = time_request(interp,
+			"(preduce + 0 (pmap score records))");
+
+		if(n == 1)
+			base = pmap;
+
+		printf("%d,%d,%.3f,%.3f,%.2f\n", n, records, pmap, preduce,
+			base / pmap);
+
+		// Also measure the exact core count if it isn't a power of two
+		if(n < max_threads && n*2 > max_threads)
+			n = max_threads / 2;
+	}
+
+	return 0;
+}
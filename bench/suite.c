@@ -0,0 +1,229 @@
+// Whole-program benchmark suite. Runs each of the Gabriel-style programs in
+// bench/gabriel in its own process, so that peak RSS is per program: loads
+// the file, calls (run) for the warmup iterations, then times the measured
+// ones and checks every result. Allocation counts come from the runtime
+// statistics and are per measured iteration.
+//
+// Build and run everything with `make bench`, or run from the repository
+// root:
+//     ./bench/suite [--json] [--jit] [--no-analyse] [--warmup n] [--repeat n]
+//         [program...]
+
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "interp.h"
+#include "jit.h"
+#include "stats.h"
+
+struct program {
+	const char *name;
+	long expected;
+};
+
+static const struct program programs[] = {
+	{ "fib",        6765 },
+	{ "tak",        7 },
+	{ "nqueens",    40 },
+	{ "deriv",      5 },
+	{ "destruct",   13650 },
+	{ "hanoi",      65535 },
+	{ "strings",    125450 },
+	{ "member",     45150 },
+	{ "countatoms", 8190 },
+	{ "accessors",  125750 },
+	{ "constants",  87000 },
+	{ "mutation",   503500 },
+};
+
+#define NUM_PROGRAMS (sizeof(programs) / sizeof(programs[0]))
+
+struct result {
+	double mean_ms;
+	double min_ms;
+	double max_ms;
+	double stddev_ms;
+	long peak_rss_kb;
+	uint64_t conses;
+	uint64_t bytes;
+	uint64_t envs;
+};
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void call_run(struct interp *interp, const struct program *prog) {
+	struct s_obj *res = interp_eval_string(interp, "(run)");
+	if(res == NULL)
+		exit_msg(EX_SOFTWARE, "%s failed: %s", prog->name, get_err_reason());
+
+	if(res->type != OBJ_NUMBER
+		|| res->val.number.value.integer != prog->expected)
+		exit_msg(EX_SOFTWARE, "%s returned the wrong result", prog->name);
+}
+
+static void measure(const struct program *prog, int warmup, int repeat,
+	bool jit, bool analyse, struct result *out) {
+
+	struct interp *interp = create_interp();
+	interp->print_errors = false;
+	interp->analyse = analyse;
+	if(jit)
+		interp->jit_threshold = JIT_DEFAULT_THRESHOLD;
+	if(interp_eval_file(interp, "builtins.scheme") == NULL)
+		exit_msg(EX_NOINPUT, "Cannot load builtins.scheme: %s", get_err_reason());
+
+	char path[256];
+	snprintf(path, sizeof(path), "bench/gabriel/%s.scheme", prog->name);
+	if(interp_eval_file(interp, path) == NULL)
+		exit_msg(EX_NOINPUT, "Cannot load %s: %s", path, get_err_reason());
+
+	for(int i=0; i<warmup; i++)
+		call_run(interp, prog);
+
+	uint64_t before[NUM_STATS], after[NUM_STATS];
+	read_stats(before);
+
+	double sum = 0, sum_sq = 0;
+	out->min_ms = INFINITY;
+	out->max_ms = 0;
+	for(int i=0; i<repeat; i++) {
+		double start = now();
+		call_run(interp, prog);
+		double ms = (now() - start) * 1000;
+
+		sum += ms;
+		sum_sq += ms * ms;
+		out->min_ms = fmin(out->min_ms, ms);
+		out->max_ms = fmax(out->max_ms, ms);
+	}
+
+	read_stats(after);
+
+	out->mean_ms = sum / repeat;
+	double var = sum_sq / repeat - out->mean_ms * out->mean_ms;
+	out->stddev_ms = var > 0 ? sqrt(var) : 0;
+	out->conses = (after[STAT_ALLOC_CONS] - before[STAT_ALLOC_CONS]) / repeat;
+	out->bytes = (after[STAT_BYTES_ALLOCATED] - before[STAT_BYTES_ALLOCATED])
+		/ repeat;
+	out->envs = (after[STAT_ENVS_CREATED] - before[STAT_ENVS_CREATED]) / repeat;
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	out->peak_rss_kb = usage.ru_maxrss;
+}
+
+static void print_result(const struct program *prog, const struct result *r,
+	int warmup, int repeat, bool json, bool first) {
+
+	if(json) {
+		printf("%s\n  {\"name\": \"%s\", \"warmup\": %d, \"repeat\": %d, "
+			"\"mean_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f, "
+			"\"stddev_ms\": %.3f, \"peak_rss_kb\": %ld, \"conses\": %llu, "
+			"\"bytes\": %llu, \"envs\": %llu}",
+			first ? "" : ",", prog->name, warmup, repeat, r->mean_ms,
+			r->min_ms, r->max_ms, r->stddev_ms, r->peak_rss_kb,
+			(unsigned long long)r->conses, (unsigned long long)r->bytes,
+			(unsigned long long)r->envs);
+	} else {
+		printf("%s,%d,%d,%.3f,%.3f,%.3f,%.3f,%ld,%llu,%llu,%llu\n",
+			prog->name, warmup, repeat, r->mean_ms, r->min_ms, r->max_ms,
+			r->stddev_ms, r->peak_rss_kb, (unsigned long long)r->conses,
+			(unsigned long long)r->bytes, (unsigned long long)r->envs);
+	}
+	fflush(stdout);
+}
+
+static bool selected(const struct program *prog, int argc, char **argv) {
+	if(argc == 0)
+		return true;
+
+	for(int i=0; i<argc; i++) {
+		if(strcmp(argv[i], prog->name) == 0)
+			return true;
+	}
+	return false;
+}
+
+int main(int argc, char **argv) {
+	int json_flag = false;
+	int jit_flag = false;
+	int no_analyse_flag = false;
+	int warmup = 1;
+	int repeat = 5;
+
+	struct option long_options[] = {
+		{"json", no_argument, &json_flag, true},
+		{"jit", no_argument, &jit_flag, true},
+		{"no-analyse", no_argument, &no_analyse_flag, true},
+		{"warmup", required_argument, NULL, 'w'},
+		{"repeat", required_argument, NULL, 'r'},
+		{0, 0, 0, 0},
+	};
+
+	int ch;
+	while((ch = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		if(ch == 'w')
+			warmup = atoi(optarg);
+		else if(ch == 'r')
+			repeat = atoi(optarg);
+		else if(ch != 0)
+			exit_msg(EX_USAGE, "Usage: %s [--json] [--jit] [--no-analyse]"
+				" [--warmup n] [--repeat n] [program...]", argv[0]);
+	}
+
+	if(warmup < 0 || repeat < 1)
+		exit_msg(EX_USAGE, "Need at least one repetition");
+
+	argc -= optind;
+	argv += optind;
+
+	if(json_flag)
+		printf("[");
+	else
+		printf("program,warmup,repeat,mean_ms,min_ms,max_ms,stddev_ms,"
+			"peak_rss_kb,conses,bytes,envs\n");
+	fflush(stdout);
+
+	bool first = true;
+	int failures = 0;
+	for(size_t p=0; p<NUM_PROGRAMS; p++) {
+		if(!selected(&programs[p], argc, argv))
+			continue;
+
+		// A fresh process per program so that peak RSS and the counters
+		// only cover that program
+		pid_t pid = fork();
+		ensure_exit(pid != -1, EX_OSERR, "fork failed");
+		if(pid == 0) {
+			struct result r;
+			measure(&programs[p], warmup, repeat, jit_flag, !no_analyse_flag, &r);
+			print_result(&programs[p], &r, warmup, repeat, json_flag, first);
+			exit(0);
+		}
+
+		int status;
+		waitpid(pid, &status, 0);
+		if(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+			first = false;
+		else
+			failures++;
+	}
+
+	if(json_flag)
+		printf("\n]\n");
+
+	return failures == 0 ? 0 : EX_SOFTWARE;
+}
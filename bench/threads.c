@@ -0,0 +1,94 @@
+// Multi-threaded throughput benchmark. Runs one independent interpreter per
+// thread, each evaluating the same workload repeatedly, and reports the
+// total throughput for 1 up to N threads.
+//
+// Build with `make bench/threads` and run from the repository root:
+//     ./bench/threads [max-threads] [iterations-per-thread]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "interp.h"
+
+static const char *workload =
+	"(define (transfer from to spare n)"
+	"  (if (= n 1)"
+	"      (list (list 'move from to))"
+	"      (append (transfer from spare to (- n 1))"
+	"              (append (list (list 'move from to))"
+	"                      (transfer spare to from (- n 1))))))"
+	"(length (transfer 'a 'b 'c 10))"
+	"(do ((i 0 (+ i 1)) (acc '() (cons i acc))) ((= i 2000) (length acc)))";
+
+struct worker {
+	pthread_t thread;
+	int iterations;
+	bool failed;
+};
+
+static void *run_worker(void *arg) {
+	struct worker *w = arg;
+	struct interp *interp = create_interp();
+
+	if(interp_eval_file(interp, "builtins.scheme") == NULL)
+		w->failed = true;
+
+	for(int i=0; i<w->iterations && !w->failed; i++) {
+		if(interp_eval_string(interp, workload) == NULL)
+			w->failed = true;
+	}
+
+	return NULL;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+	int iterations = argc > 2 ? atoi(argv[2]) : 50;
+
+	if(max_threads < 1 || iterations < 1)
+		exit_msg(EX_USAGE, "Usage: %s [max-threads] [iterations]", argv[0]);
+
+	printf("threads,iterations,seconds,evals_per_sec,speedup\n");
+	double base_rate = 0;
+
+	for(int n=1; n<=max_threads; n *= 2) {
+		struct worker workers[n];
+		double start = now();
+
+		for(int i=0; i<n; i++) {
+			workers[i].iterations = iterations;
+			workers[i].failed = false;
+			pthread_create(&workers[i].thread, NULL, &run_worker, &workers[i]);
+		}
+
+		for(int i=0; i<n; i++) {
+			pthread_join(workers[i].thread, NULL);
+			if(workers[i].failed)
+				exit_msg(EX_SOFTWARE, "Worker %d failed", i);
+		}
+
+		double elapsed = now() - start;
+		double rate = n * iterations / elapsed;
+		if(n == 1)
+			base_rate = rate;
+
+		printf("%d,%d,%.3f,%.1f,%.2f\n", n, n * iterations, elapsed, rate,
+			rate / base_rate);
+
+		// Also measure the exact core count if it isn't a power of two
+		if(n < max_threads && n*2 > max_threads)
+			n = max_threads / 2;
+	}
+
+	return 0;
+}
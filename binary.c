@@ -0,0 +1,680 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "binary.h"
+#include "common.h"
+#include "future.h"
+#include "internal_rep.h"
+#include "interp.h"
+
+typedef struct s_obj sobj;
+
+// Changed whenever the encoding changes, so that older files are rejected
+// rather than misread
+#define BINARY_VERSION 1
+
+// Encoding and decoding recurse on the elements of lists, but not along
+// their spines
+#define MAX_DEPTH 10000
+
+// Size of the buffers between the encoder or decoder and the file
+#define BUF_SIZE 65536
+
+static const char binary_magic[4] = { 'S', 'C', 'M', 'B' };
+
+enum tag {
+	TAG_EMPTY_LIST,
+	TAG_TRUE,
+	TAG_FALSE,
+	TAG_INT,
+	TAG_STRING,
+	// A symbol's name the first time it appears in a value, giving it the
+	// next index, and its index after that
+	TAG_SYMBOL_DEF,
+	TAG_SYMBOL_REF,
+	// Starts a list, which is its elements followed by TAG_END if it is
+	// proper, or by TAG_DOT and its tail
+	TAG_LIST,
+	TAG_END,
+	TAG_DOT,
+	// Gives the pair or string that follows the next label, and refers to
+	// it again by label
+	TAG_DEF,
+	TAG_REF,
+};
+
+// ============================== POINTER TABLE ==============================
+// Open addressing hash table from pointers to numbers, without the
+// allocation per entry of uthash
+// ===========================================================================
+
+struct ptr_slot {
+	const void *key;
+	uint64_t val;
+};
+
+struct ptr_table {
+	struct ptr_slot *slots;
+	// Always a power of two
+	size_t capacity;
+	size_t len;
+};
+
+static size_t hash_ptr(const void *ptr) {
+	uint64_t h = (uintptr_t)ptr;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static void grow_table(struct ptr_table *t) {
+	struct ptr_table old = *t;
+	t->capacity = old.capacity == 0 ? 1024 : old.capacity*2;
+	t->slots = calloc(t->capacity, sizeof(struct ptr_slot));
+	ensure_mem(t->slots);
+
+	size_t mask = t->capacity - 1;
+	for(size_t i=0; i<old.capacity; i++) {
+		if(old.slots[i].key == NULL)
+			continue;
+		size_t j = hash_ptr(old.slots[i].key) & mask;
+		while(t->slots[j].key != NULL)
+			j = (j + 1) & mask;
+		t->slots[j] = old.slots[i];
+	}
+
+	free(old.slots);
+}
+
+// The value of key, which is added with value 0 if it isn't there yet. The
+// pointer is only valid until the next key is added.
+static uint64_t *table_slot(struct ptr_table *t, const void *key,
+	bool *found) {
+
+	if(2*(t->len + 1) > t->capacity)
+		grow_table(t);
+
+	size_t mask = t->capacity - 1;
+	size_t i = hash_ptr(key) & mask;
+	for(; t->slots[i].key != NULL; i = (i + 1) & mask) {
+		if(t->slots[i].key == key) {
+			*found = true;
+			return &t->slots[i].val;
+		}
+	}
+
+	t->slots[i].key = key;
+	t->slots[i].val = 0;
+	t->len++;
+	*found = false;
+	return &t->slots[i].val;
+}
+
+// ============================== OBJECT BITMAPS =============================
+// Which objects have been reached once and which more than once, as bits
+// indexed by address in chunks found through a pointer table. Objects made
+// together lie close together, so nearly every test hits the chunk of the
+// one before, and the bits of millions of pairs stay in cache where a hash
+// table with an entry for each would miss on every lookup.
+// ===========================================================================
+
+// Objects are at least 8 byte aligned, so each has its own bit
+#define ALIGN_SHIFT 3
+#define CHUNK_SHIFT 16
+#define CHUNK_BITS (1 << CHUNK_SHIFT)
+#define CHUNK_WORDS (CHUNK_BITS / 64)
+
+struct obj_bits {
+	// Chunks by address >> (ALIGN_SHIFT + CHUNK_SHIFT), plus one so that
+	// none is NULL. Each is CHUNK_WORDS words of bits for objects reached,
+	// then as many for objects reached again.
+	struct ptr_table chunks;
+	uintptr_t last_key;
+	uint64_t *last_chunk;
+};
+
+static uint64_t *get_chunk(struct obj_bits *b, uintptr_t bit) {
+	uintptr_t key = (bit >> CHUNK_SHIFT) + 1;
+	if(key == b->last_key)
+		return b->last_chunk;
+
+	bool found;
+	uint64_t *slot = table_slot(&b->chunks, (const void *)key, &found);
+	if(!found) {
+		uint64_t *chunk = calloc(2*CHUNK_WORDS, sizeof(uint64_t));
+		ensure_mem(chunk);
+		*slot = (uintptr_t)chunk;
+	}
+
+	b->last_key = key;
+	b->last_chunk = (uint64_t *)(uintptr_t)*slot;
+	return b->last_chunk;
+}
+
+// Marks obj as reached, or as reached again if it already was. Returns
+// whether it already was.
+static bool mark_reached(struct obj_bits *b, const void *obj) {
+	uintptr_t bit = (uintptr_t)obj >> ALIGN_SHIFT;
+	uint64_t *chunk = get_chunk(b, bit);
+	size_t word = (bit & (CHUNK_BITS - 1)) / 64;
+	uint64_t mask = 1ULL << (bit % 64);
+
+	if(chunk[word] & mask) {
+		chunk[CHUNK_WORDS + word] |= mask;
+		return true;
+	}
+	chunk[word] |= mask;
+	return false;
+}
+
+static bool is_shared(struct obj_bits *b, const void *obj) {
+	uintptr_t bit = (uintptr_t)obj >> ALIGN_SHIFT;
+	uint64_t *chunk = get_chunk(b, bit);
+	size_t word = (bit & (CHUNK_BITS - 1)) / 64;
+	return chunk[CHUNK_WORDS + word] & (1ULL << (bit % 64));
+}
+
+static void free_bits(struct obj_bits *b) {
+	for(size_t i=0; i<b->chunks.capacity; i++)
+		free((uint64_t *)(uintptr_t)b->chunks.slots[i].val);
+	free(b->chunks.slots);
+}
+
+// =============================== ENCODING ==================================
+// Values are written in two passes: the first marks which pairs and strings
+// are reached more than once, and the second writes the value, labelling
+// those the first time they are written. A pair is labelled before its
+// element is written, so that the element can refer to it.
+// ===========================================================================
+
+struct writer {
+	FILE *fp;
+	struct interp *interp;
+	unsigned char buf[BUF_SIZE];
+	size_t len;
+	struct obj_bits reached;
+	// Pairs and strings reached more than once to their label
+	struct ptr_table labels;
+	uint64_t num_labels;
+	// Symbols to their index plus one
+	struct ptr_table symbols;
+	uint64_t num_symbols;
+	// Set if writing the file fails
+	bool failed;
+};
+
+static void flush_writer(struct writer *w) {
+	if(w->len > 0 && fwrite(w->buf, 1, w->len, w->fp) != w->len)
+		w->failed = true;
+	w->len = 0;
+}
+
+static void put_bytes(struct writer *w, const void *data, size_t len) {
+	if(w->len + len > BUF_SIZE)
+		flush_writer(w);
+
+	if(len > BUF_SIZE) {
+		if(fwrite(data, 1, len, w->fp) != len)
+			w->failed = true;
+		return;
+	}
+
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+}
+
+static void put_byte(struct writer *w, unsigned char byte) {
+	if(w->len == BUF_SIZE)
+		flush_writer(w);
+	w->buf[w->len++] = byte;
+}
+
+static void put_varint(struct writer *w, uint64_t v) {
+	unsigned char bytes[10];
+	int n = 0;
+	for(; v >= 0x80; v >>= 7)
+		bytes[n++] = (v & 0x7f) | 0x80;
+	bytes[n++] = v;
+	put_bytes(w, bytes, n);
+}
+
+// Futures are written as their value
+static sobj *resolve(struct writer *w, sobj *obj) {
+	while(obj != NULL && obj->type == OBJ_FUTURE)
+		obj = touch_future(interp_scheduler(w->interp), obj->val.future);
+	return obj;
+}
+
+// The first pass. Recurses on the elements of lists and iterates along
+// their spines.
+static bool mark_value(struct writer *w, sobj *obj, int depth) {
+	for(;;) {
+		if((obj = resolve(w, obj)) == NULL)
+			return false;
+
+		switch(obj->type) {
+		case OBJ_CONS:
+		case OBJ_STRING:
+			break;
+		case OBJ_NUMBER:
+			// Floats can't be made yet, see new_numeric
+			if(obj->val.number.type != SCHEME_INT) {
+				SET_ERR("Cannot write a float with write-binary");
+				return false;
+			}
+			return true;
+		case OBJ_LAMBDA:
+		case OBJ_BUILTIN_FUNC:
+			SET_ERR("Cannot write a procedure with write-binary");
+			return false;
+		default:
+			return true;
+		}
+
+		if(mark_reached(&w->reached, obj) || obj->type == OBJ_STRING)
+			return true;
+
+		if(depth >= MAX_DEPTH) {
+			SET_ERR("Cannot write data nested more than %d deep", MAX_DEPTH);
+			return false;
+		}
+		if(!mark_value(w, obj->val.cc.left, depth + 1))
+			return false;
+		obj = obj->val.cc.right;
+	}
+}
+
+// Puts a reference instead of obj if it has already been written, or
+// labels it if it will be reached again. Returns whether obj itself still
+// needs to be written.
+static bool put_label(struct writer *w, sobj *obj) {
+	if(!is_shared(&w->reached, obj))
+		return true;
+
+	bool found;
+	uint64_t *label = table_slot(&w->labels, obj, &found);
+	if(found) {
+		put_byte(w, TAG_REF);
+		put_varint(w, *label);
+		return false;
+	}
+
+	*label = w->num_labels++;
+	put_byte(w, TAG_DEF);
+	return true;
+}
+
+static void put_symbol(struct writer *w, sobj *sym) {
+	bool found;
+	uint64_t *index = table_slot(&w->symbols, sym, &found);
+	if(found) {
+		put_byte(w, TAG_SYMBOL_REF);
+		put_varint(w, *index - 1);
+		return;
+	}
+
+	*index = ++w->num_symbols;
+	put_byte(w, TAG_SYMBOL_DEF);
+	put_varint(w, sym->val.sym.len);
+	put_bytes(w, sym->val.sym.str, sym->val.sym.len);
+}
+
+// The second pass, over a value mark_value accepted
+static void put_value(struct writer *w, sobj *obj) {
+	for(;;) {
+		obj = resolve(w, obj);
+		switch(obj->type) {
+		case OBJ_EMPTY_LIST:
+			put_byte(w, TAG_EMPTY_LIST);
+			return;
+		case OBJ_BOOLEAN:
+			put_byte(w, obj->val.boolean ? TAG_TRUE : TAG_FALSE);
+			return;
+		case OBJ_NUMBER: {
+			int64_t i = obj->val.number.value.integer;
+			put_byte(w, TAG_INT);
+			put_varint(w, ((uint64_t)i << 1) ^ (uint64_t)(i >> 63));
+			return;
+		}
+		case OBJ_SYMBOL:
+			put_symbol(w, obj);
+			return;
+		case OBJ_STRING:
+			if(put_label(w, obj)) {
+				put_byte(w, TAG_STRING);
+				put_varint(w, obj->val.str.len);
+				put_bytes(w, obj->val.str.str, obj->val.str.len);
+			}
+			return;
+		case OBJ_CONS:
+			break;
+		default:
+			return;
+		}
+
+		if(!put_label(w, obj))
+			return;
+
+		// The elements up to a tail that isn't a pair, or is one that has to
+		// be labelled or referred to
+		put_byte(w, TAG_LIST);
+		do {
+			put_value(w, obj->val.cc.left);
+			obj = resolve(w, obj->val.cc.right);
+		} while(obj->type == OBJ_CONS && !is_shared(&w->reached, obj));
+
+		if(obj->type == OBJ_EMPTY_LIST) {
+			put_byte(w, TAG_END);
+			return;
+		}
+		// The tail is written by the next iteration
+		put_byte(w, TAG_DOT);
+	}
+}
+
+bool write_binary(struct interp *interp, FILE *fp, sobj *obj, bool append) {
+	struct writer *w = calloc(1, sizeof(struct writer));
+	ensure_mem(w);
+	w->fp = fp;
+	w->interp = interp;
+
+	// The file is only touched once obj is known to be writable
+	bool ok = mark_value(w, obj, 0);
+	if(ok) {
+		int fd = fileno(fp);
+		if(!append && ftruncate(fd, 0) != 0)
+			w->failed = true;
+
+		fseek(fp, 0, SEEK_END);
+		long start = ftell(fp);
+		if(start == 0) {
+			put_bytes(w, binary_magic, sizeof(binary_magic));
+			put_byte(w, BINARY_VERSION);
+		}
+
+		put_value(w, obj);
+		flush_writer(w);
+		if(fflush(fp) != 0)
+			w->failed = true;
+
+		// Don't leave part of a value at the end of the stream
+		if(w->failed) {
+			SET_ERR("Failed to write binary data");
+			if(start >= 0 && ftruncate(fd, start) != 0)
+				SET_ERR("Failed to write binary data, and the file is damaged");
+		}
+		ok = !w->failed;
+	}
+
+	free_bits(&w->reached);
+	free(w->labels.slots);
+	free(w->symbols.slots);
+	free(w);
+	return ok;
+}
+
+// =============================== DECODING ==================================
+// Decoding fails on anything that isn't a valid encoding, and read_binary
+// then reports the stream as damaged.
+// ===========================================================================
+
+struct obj_array {
+	sobj **arr;
+	size_t len;
+	size_t capacity;
+};
+
+static void push_obj(struct obj_array *a, sobj *obj) {
+	if(a->len == a->capacity) {
+		a->capacity = a->capacity == 0 ? 256 : a->capacity*2;
+		a->arr = realloc(a->arr, a->capacity * sizeof(sobj *));
+		ensure_mem(a->arr);
+	}
+	a->arr[a->len++] = obj;
+}
+
+#define NO_LABEL SIZE_MAX
+
+struct binary_reader {
+	FILE *fp;
+	struct interp *interp;
+	unsigned char buf[BUF_SIZE];
+	size_t pos;
+	size_t len;
+	// Symbols by index, and pairs and strings by label, in the value being
+	// read. Labels are NULL until their object has been made.
+	struct obj_array symbols;
+	struct obj_array labels;
+};
+
+static bool get_byte(struct binary_reader *r, unsigned char *byte) {
+	if(r->pos == r->len) {
+		r->pos = 0;
+		r->len = fread(r->buf, 1, BUF_SIZE, r->fp);
+		if(r->len == 0)
+			return false;
+	}
+	*byte = r->buf[r->pos++];
+	return true;
+}
+
+static bool get_varint(struct binary_reader *r, uint64_t *v) {
+	*v = 0;
+	for(int shift = 0; shift < 64; shift += 7) {
+		unsigned char byte;
+		if(!get_byte(r, &byte))
+			return false;
+		*v |= (uint64_t)(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static bool get_bytes(struct binary_reader *r, void *out, size_t len) {
+	unsigned char *dst = out;
+	while(len > 0) {
+		if(r->pos == r->len) {
+			r->pos = 0;
+			r->len = fread(r->buf, 1, BUF_SIZE, r->fp);
+			if(r->len == 0)
+				return false;
+		}
+
+		size_t n = r->len - r->pos < len ? r->len - r->pos : len;
+		memcpy(dst, r->buf + r->pos, n);
+		r->pos += n;
+		dst += n;
+		len -= n;
+	}
+	return true;
+}
+
+// A string or symbol name of len bytes, in the buffer unless they straddle
+// a refill, in which case they are copied to *copy for the caller to free
+static const char *get_name(struct binary_reader *r, uint64_t len,
+	char **copy) {
+
+	*copy = NULL;
+	if(len > INT_MAX)
+		return NULL;
+	if(len <= r->len - r->pos) {
+		const char *str = (const char *)r->buf + r->pos;
+		r->pos += len;
+		return str;
+	}
+
+	*copy = malloc(len);
+	ensure_mem(*copy);
+	return get_bytes(r, *copy, len) ? *copy : NULL;
+}
+
+static size_t new_label(struct binary_reader *r) {
+	push_obj(&r->labels, NULL);
+	return r->labels.len - 1;
+}
+
+static sobj *get_tagged(struct binary_reader *r, unsigned char tag,
+	size_t label, int depth);
+
+// The pair made for the first element is given label, if there is one,
+// before the element is read, so that it can refer to it
+static sobj *get_list(struct binary_reader *r, size_t label, int depth) {
+	if(depth >= MAX_DEPTH)
+		return NULL;
+
+	sobj *emptylist = fetch_singleton_object(SG_EMPTY_LIST);
+	sobj *head = NULL;
+	sobj **tail = &head;
+	for(;;) {
+		unsigned char tag;
+		if(!get_byte(r, &tag) || tag == TAG_END || tag == TAG_DOT)
+			return NULL;
+
+		do {
+			sobj *cell = new_cons(emptylist, emptylist);
+			if(label != NO_LABEL) {
+				r->labels.arr[label] = cell;
+				label = NO_LABEL;
+			}
+			*tail = cell;
+			tail = &cell->val.cc.right;
+
+			cell->val.cc.left = get_tagged(r, tag, NO_LABEL, depth + 1);
+			if(cell->val.cc.left == NULL || !get_byte(r, &tag))
+				return NULL;
+		} while(tag != TAG_END && tag != TAG_DOT);
+
+		if(tag == TAG_END)
+			return head;
+
+		// A tail that continues the spine is read by the next iteration
+		// rather than recursively
+		if(!get_byte(r, &tag))
+			return NULL;
+		if(tag == TAG_DEF) {
+			label = new_label(r);
+			if(!get_byte(r, &tag))
+				return NULL;
+		}
+		if(tag == TAG_LIST)
+			continue;
+
+		if((*tail = get_tagged(r, tag, label, depth)) == NULL)
+			return NULL;
+		return head;
+	}
+}
+
+static sobj *get_tagged(struct binary_reader *r, unsigned char tag,
+	size_t label, int depth) {
+
+	// Only pairs and strings are labelled
+	if(label != NO_LABEL && tag != TAG_LIST && tag != TAG_STRING)
+		return NULL;
+
+	uint64_t v;
+	switch(tag) {
+	case TAG_EMPTY_LIST:
+		return fetch_singleton_object(SG_EMPTY_LIST);
+	case TAG_TRUE:
+		return fetch_singleton_object(SG_TRUE);
+	case TAG_FALSE:
+		return fetch_singleton_object(SG_FALSE);
+	case TAG_INT:
+		if(!get_varint(r, &v))
+			return NULL;
+		// Undoes the zigzag encoding of put_value
+		return new_numeric(SCHEME_INT, (v >> 1) ^ -(v & 1), 0);
+	case TAG_STRING:
+	case TAG_SYMBOL_DEF: {
+		char *copy;
+		const char *str;
+		if(!get_varint(r, &v) || (str = get_name(r, v, &copy)) == NULL) {
+			free(copy);
+			return NULL;
+		}
+
+		sobj *obj;
+		if(tag == TAG_STRING) {
+			obj = new_string(v, (char *)str);
+			if(label != NO_LABEL)
+				r->labels.arr[label] = obj;
+		} else {
+			obj = fetch_or_create_symbol(r->interp, v, str);
+			push_obj(&r->symbols, obj);
+		}
+		free(copy);
+		return obj;
+	}
+	case TAG_SYMBOL_REF:
+		if(!get_varint(r, &v) || v >= r->symbols.len)
+			return NULL;
+		return r->symbols.arr[v];
+	case TAG_LIST:
+		return get_list(r, label, depth);
+	case TAG_DEF:
+		label = new_label(r);
+		if(!get_byte(r, &tag))
+			return NULL;
+		return get_tagged(r, tag, label, depth);
+	case TAG_REF:
+		if(!get_varint(r, &v) || v >= r->labels.len)
+			return NULL;
+		return r->labels.arr[v];
+	default:
+		return NULL;
+	}
+}
+
+struct binary_reader *open_binary_reader(struct interp *interp, FILE *fp) {
+	struct binary_reader *r = calloc(1, sizeof(struct binary_reader));
+	ensure_mem(r);
+	r->fp = fp;
+	r->interp = interp;
+
+	unsigned char header[sizeof(binary_magic) + 1];
+	if(!get_bytes(r, header, sizeof(header))
+		|| memcmp(header, binary_magic, sizeof(binary_magic)) != 0
+		|| header[sizeof(binary_magic)] != BINARY_VERSION) {
+
+		SET_ERR("Not a binary data file, or from another version");
+		free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+sobj *read_binary(struct binary_reader *r, bool *end) {
+	*end = false;
+	r->symbols.len = 0;
+	r->labels.len = 0;
+
+	unsigned char tag;
+	if(!get_byte(r, &tag)) {
+		if(ferror(r->fp)) {
+			SET_ERR("Failed to read binary data");
+			return NULL;
+		}
+		*end = true;
+		return NULL;
+	}
+
+	sobj *obj = get_tagged(r, tag, NO_LABEL, 0);
+	if(obj == NULL)
+		SET_ERR("Binary data is damaged or truncated");
+	return obj;
+}
+
+void close_binary_reader(struct binary_reader *r) {
+	free(r->symbols.arr);
+	free(r->labels.arr);
+	free(r);
+}
@@ -0,0 +1,44 @@
+#ifndef __BINARY_H__
+#define __BINARY_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "internal_rep.h"
+#include "interp.h"
+
+// Binary serialisation of data, for write-binary and read-binary. A stream
+// is a header followed by any number of values, each self-contained, so
+// values can be appended to a file and read back one at a time.
+//
+// A value is a one byte tag followed by varints: integers zigzag encoded,
+// strings by their length and bytes, and lists by their elements and their
+// tail. A symbol is written by name the first time it appears in a value
+// and by index after that. A pair or string reached again is written as a
+// reference to the first time, so shared structure stays shared and cycles
+// can be written.
+//
+// Procedures can't be written. Futures are touched and their value written.
+
+struct binary_reader;
+
+// Writes obj to fp, which must be open for appending, as a value of a binary
+// stream: after the values already in fp if append, or else in place of its
+// contents. The stream header comes first if the file is empty. Returns false
+// with the error set if obj can't be written, leaving the file untouched, or
+// if writing the file fails, after truncating it to where obj began.
+bool write_binary(struct interp *interp, FILE *fp, struct s_obj *obj,
+    bool append);
+
+// Reads and checks the stream header of fp. Returns NULL with the error set
+// if it isn't a binary stream.
+struct binary_reader *open_binary_reader(struct interp *interp, FILE *fp);
+
+// The next value of the stream, or NULL either with *end set at the end of
+// the stream or with the error set if the stream is damaged
+struct s_obj *read_binary(struct binary_reader *r, bool *end);
+
+// Frees r. The file is left to the caller to close.
+void close_binary_reader(struct binary_reader *r);
+
+#endif
@@ -1,9 +1,22 @@
+#include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
+#include "binary.h"
 #include "builtins.h"
+#include "common.h"
+#include "desugar.h"
 #include "eval.h"
+#include "future.h"
+#include "interp.h"
+#include "pool.h"
+#include "printer.h"
+#include "profiler.h"
+#include "stats.h"
+#include "strops.h"
 
 typedef struct s_obj sobj;
 typedef struct s_env senv;
@@ -40,6 +53,10 @@ struct s_obj *builtin_define(struct s_obj *obj, struct s_env *env) {
 	// We're lucky and dealing with normal (define <symbol> <expr>)
 	if(symobj->type == OBJ_SYMBOL) {
 		struct s_obj *evaluated_val = eval(val, env, true);
+		if(evaluated_val != NULL && evaluated_val->type == OBJ_LAMBDA
+			&& evaluated_val->val.lambda->name == NULL) {
+			evaluated_val->val.lambda->name = symobj->val.sym.str;
+		}
 		associate_symbol(env, symobj->val.sym.str, evaluated_val);
 		return fetch_singleton_object(SG_EMPTY_LIST);
 	}
@@ -75,6 +92,7 @@ struct s_obj *builtin_define(struct s_obj *obj, struct s_env *env) {
 	}
 
 	if(lambda == NULL) return NULL;
+	lambda->val.lambda->name = fname->val.sym.str;
 	associate_symbol(env, fname->val.sym.str, lambda);
 	return fetch_singleton_object(SG_EMPTY_LIST);
 
@@ -85,6 +103,13 @@ struct s_obj *builtin_set_bang(struct s_obj *obj, struct s_env *env) {
 	return builtin_define(obj, env);
 }
 
+// Normally expanded away by the desugaring pass; this handles templates that
+// reach the evaluator without going through it
+struct s_obj *builtin_quasiquote(struct s_obj *obj, struct s_env *env) {
+	struct s_obj *expansion = expand_quasiquote(get_list_head(obj), env);
+	return eval(expansion, env, true);
+}
+
 struct s_obj *builtin_lambda(struct s_obj *obj, struct s_env *env) {
 	struct s_obj *arglistobj = get_list_nth(obj, 1);
 	struct s_obj *body = get_list_nth(obj, 2);
@@ -97,24 +122,53 @@ struct s_obj *builtin_lambda(struct s_obj *obj, struct s_env *env) {
 	return new_lambda(arglistobj, body, env);
 }
 
-struct s_obj *builtin_begin(struct s_obj *obj, struct s_env *env) {
-	struct s_obj *head = get_list_head(obj);
-	struct s_obj *rest = get_list_rest(obj);
+sobj *eval_sequence(sobj *body, senv *env);
 
-	if(rest->type != OBJ_EMPTY_LIST)
-		return builtin_begin(rest, env);
+// Begin is a special form so that its body is evaluated in order without
+// first building a list of the intermediate results
+struct s_obj *builtin_begin(struct s_obj *obj, struct s_env *env) {
+	if(obj->type == OBJ_EMPTY_LIST)
+		return fetch_singleton_object(SG_EMPTY_LIST);
 
-	return head;
+	return eval_sequence(obj, env);
 }
 
+// Unlike R5RS, write ends its output with a newline
 sobj *builtin_write(sobj *obj, senv *env) {
 	sobj *arg = get_list_head(obj);
 	print_obj_user(arg);
 	return fetch_singleton_object(SG_EMPTY_LIST);
 }
 
+sobj *builtin_display(sobj *obj, senv *env) {
+	struct strbuf *buf = get_output_buffer();
+	serialise_obj(buf, get_list_head(obj), false);
+	flush_strbuf(buf, STDOUT_FILENO);
+	return fetch_singleton_object(SG_EMPTY_LIST);
+}
+
+sobj *builtin_write_string(sobj *obj, senv *env) {
+	sobj *str = get_list_head(obj);
+	if(str->type != OBJ_STRING) {
+		SET_ERR("Argument to write-string not a string");
+		return NULL;
+	}
+
+	struct strbuf *buf = get_output_buffer();
+	strbuf_append(buf, str->val.str.str, str->val.str.len);
+	flush_strbuf(buf, STDOUT_FILENO);
+	return fetch_singleton_object(SG_EMPTY_LIST);
+}
+
+sobj *builtin_newline(sobj *obj, senv *env) {
+	struct strbuf *buf = get_output_buffer();
+	strbuf_putc(buf, '\n');
+	flush_strbuf(buf, STDOUT_FILENO);
+	return fetch_singleton_object(SG_EMPTY_LIST);
+}
+
 sobj *builtin_eval(sobj *obj, senv *env) {
-	sobj *arg = get_list_head(obj);
+	sobj *arg = desugar(get_list_head(obj), env);
 	return eval(arg, env, true);
 }
 
@@ -139,14 +193,59 @@ struct s_obj *builtin_cons(struct s_obj *obj, struct s_env *env) {
 
 struct s_obj *builtin_car(struct s_obj *obj, struct s_env *env) {
 	struct s_obj *arg = get_list_head(obj);
+	if(arg->type != OBJ_CONS) {
+		SET_ERR("car expects a pair");
+		return NULL;
+	}
+
 	return arg->val.cc.left;
 }
 
 struct s_obj *builtin_cdr(struct s_obj *obj, struct s_env *env) {
 	struct s_obj *arg = get_list_head(obj);
+	if(arg->type != OBJ_CONS) {
+		SET_ERR("cdr expects a pair");
+		return NULL;
+	}
+
 	return arg->val.cc.right;
 }
 
+// set-car! and set-cdr! mutate the pair in place. Quoted constants are
+// shared when hash consing is on, so mutating one would change every
+// occurrence; it is an error in Scheme, and refused here.
+struct s_obj *builtin_set_car(struct s_obj *obj, struct s_env *env) {
+	struct s_obj *pair = get_list_nth(obj, 1);
+	if(pair->type != OBJ_CONS) {
+		SET_ERR("set-car! expects a pair");
+		return NULL;
+	}
+
+	if(pair->immutable) {
+		SET_ERR("set-car! on a constant shared by hash consing");
+		return NULL;
+	}
+
+	pair->val.cc.left = get_list_nth(obj, 2);
+	return fetch_singleton_object(SG_EMPTY_LIST);
+}
+
+struct s_obj *builtin_set_cdr(struct s_obj *obj, struct s_env *env) {
+	struct s_obj *pair = get_list_nth(obj, 1);
+	if(pair->type != OBJ_CONS) {
+		SET_ERR("set-cdr! expects a pair");
+		return NULL;
+	}
+
+	if(pair->immutable) {
+		SET_ERR("set-cdr! on a constant shared by hash consing");
+		return NULL;
+	}
+
+	pair->val.cc.right = get_list_nth(obj, 2);
+	return fetch_singleton_object(SG_EMPTY_LIST);
+}
+
 struct s_obj *builtin_length(struct s_obj *obj, struct s_env *env) {
 	sobj *arg = get_list_head(obj);
 	int len = get_list_len(arg);
@@ -157,47 +256,38 @@ sobj *builtin_list(sobj *obj, senv *env) {
 	return obj;
 }
 
-struct s_obj *builtin_is_null(struct s_obj *obj, struct s_env *env) {
-	struct s_obj *arg = get_list_head(obj);
-	if(arg->type == OBJ_EMPTY_LIST)
-		return fetch_singleton_object(SG_TRUE);
-
-	return fetch_singleton_object(SG_FALSE);
-}
-
-bool elt_eq(sobj *obj1, sobj *obj2) {
-	if(obj1->type != obj2->type)
-		return false;
-
-	switch(obj1->type) {
-	case OBJ_CONS:
-		return elt_eq(obj1->val.cc.left, obj2->val.cc.left) &&
-			elt_eq(obj1->val.cc.right, obj2->val.cc.right);
-
-	case OBJ_NUMBER:
-		return obj1->val.number.value.integer == obj2->val.number.value.integer;
+// Copies every list but the last, which is shared with the result
+sobj *builtin_append(sobj *obj, senv *env) {
+	sobj *emptylist = fetch_singleton_object(SG_EMPTY_LIST);
+	if(obj->type == OBJ_EMPTY_LIST)
+		return emptylist;
 
-	case OBJ_STRING:
-		return strncmp(obj1->val.str.str, obj2->val.str.str, 
-			obj1->val.str.len) == 0;
+	sobj *res = emptylist;
+	sobj **tail = &res;
 
-	case OBJ_SYMBOL:
-		return strncmp(obj1->val.sym.str, obj2->val.sym.str, 
-			obj1->val.sym.len) == 0;
+	for(; get_list_rest(obj)->type == OBJ_CONS; obj = get_list_rest(obj)) {
+		sobj *lst = get_list_head(obj);
+		if(get_list_len(lst) == -1) {
+			SET_ERR("Arguments to append must be lists");
+			return NULL;
+		}
 
-	case OBJ_BOOLEAN:
-		return obj1->val.boolean == obj2->val.boolean;
+		for(; lst->type == OBJ_CONS; lst = get_list_rest(lst)) {
+			*tail = new_cons(get_list_head(lst), emptylist);
+			tail = &(*tail)->val.cc.right;
+		}
+	}
 
-	case OBJ_LAMBDA:
-		// Just check if they're the exact same function pointer
-		return obj1->val.lambda == obj2->val.lambda;	
+	*tail = get_list_head(obj);
+	return res;
+}
 
-	case OBJ_BUILTIN_FUNC:
-		return obj1->val.builtin.func == obj2->val.builtin.func;
+struct s_obj *builtin_is_null(struct s_obj *obj, struct s_env *env) {
+	struct s_obj *arg = get_list_head(obj);
+	if(arg->type == OBJ_EMPTY_LIST)
+		return fetch_singleton_object(SG_TRUE);
 
-	case OBJ_EMPTY_LIST:
-		return true;
-	}
+	return fetch_singleton_object(SG_FALSE);
 }
 
 sobj *builtin_is_list(sobj *obj, senv *env) {
@@ -218,6 +308,13 @@ struct s_obj *builtin_is_equal(sobj *obj, senv *env) {
 	return fetch_bool(res);
 }
 
+// Hash consistent with equal?, for equal?-keyed tables and memoisation
+sobj *builtin_equal_hash(sobj *obj, senv *env) {
+	sobj *x = get_list_nth(obj, 1);
+	// Keep the result a non-negative fixnum
+	return new_numeric(SCHEME_INT, elt_hash(x) >> 2, 0);
+}
+
 sobj *builtin_is_func(sobj *obj, senv *env) {
 	sobj *x = get_list_nth(obj, 1);
 	return fetch_bool(x->type == OBJ_LAMBDA || x->type == OBJ_BUILTIN_FUNC);
@@ -230,30 +327,28 @@ sobj *builtin_not(sobj *obj, senv *env) {
 	return fetch_bool(false);
 }
 
+// Like R5RS, and returns the value of its last operand if none before it is
+// #f, and or returns the first value that isn't #f
 sobj *builtin_and(sobj *obj, senv *env) {
-	if(obj->type == OBJ_EMPTY_LIST)
-		return fetch_bool(false);
-
-	sobj *head = get_list_head(obj);
-	sobj *res = eval(head, env, true);
-
-	if(is_false(res))
-		return fetch_bool(false);
+	sobj *res = fetch_bool(true);
+	for(; obj->type == OBJ_CONS; obj = get_list_rest(obj)) {
+		res = eval(get_list_head(obj), env, true);
+		if(res == NULL || is_false(res))
+			return res;
+	}
 
-	return builtin_and(get_list_rest(obj), env);
+	return res;
 }
 
 sobj *builtin_or(sobj *obj, senv *env) {
-	if(obj->type == OBJ_EMPTY_LIST)
-		return fetch_bool(false);
-
-	sobj *head = get_list_head(obj);
-	sobj *res = eval(head, env, true);
-
-	if(!is_false(res))
-		return fetch_bool(true);
+	sobj *res = fetch_bool(false);
+	for(; obj->type == OBJ_CONS; obj = get_list_rest(obj)) {
+		res = eval(get_list_head(obj), env, true);
+		if(res == NULL || !is_false(res))
+			return res;
+	}
 
-	return builtin_and(get_list_rest(obj), env);
+	return res;
 }
 
 struct s_obj *builtin_add(struct s_obj *obj, struct s_env *env) {
@@ -268,6 +363,7 @@ struct s_obj *builtin_add(struct s_obj *obj, struct s_env *env) {
 	}
 
 	sobj *rest_sum = builtin_add(get_list_rest(obj), env);
+	if(rest_sum == NULL) return NULL;
 
 	int64_t xn = x->val.number.value.integer;
 	int64_t yn = rest_sum->val.number.value.integer;
@@ -297,6 +393,7 @@ sobj *builtin_sub(sobj *obj, senv *env) {
 	}
 
 	sobj *rest_sum = builtin_add(get_list_rest(obj), env);
+	if(rest_sum == NULL) return NULL;
 	int64_t yn = rest_sum->val.number.value.integer;
 	int64_t diff = xn - yn;
 
@@ -316,6 +413,7 @@ sobj *builtin_mul(sobj *obj, senv *env) {
 	}
 
 	sobj *rest_prod = builtin_mul(get_list_rest(obj), env);
+	if(rest_prod == NULL) return NULL;
 
 	int64_t xn = x->val.number.value.integer;
 	int64_t yn = rest_prod->val.number.value.integer;
@@ -325,13 +423,57 @@ sobj *builtin_mul(sobj *obj, senv *env) {
 	return sum_obj;
 }
 
+enum num_cmp { CMP_LT, CMP_GT, CMP_LE, CMP_GE };
+
+// Checks that every adjacent pair of arguments is ordered by op
+static sobj *compare_chain(sobj *obj, enum num_cmp op) {
+	if(!all_list_of_type(obj, OBJ_NUMBER)) {
+		SET_ERR("Arguments to comparison not numbers");
+		return NULL;
+	}
+
+	for(; get_list_rest(obj)->type == OBJ_CONS; obj = get_list_rest(obj)) {
+		int64_t xn = get_list_head(obj)->val.number.value.integer;
+		int64_t yn = get_list_nth(obj, 2)->val.number.value.integer;
+
+		bool ordered = false;
+		switch(op) {
+		case CMP_LT: ordered = xn < yn; break;
+		case CMP_GT: ordered = xn > yn; break;
+		case CMP_LE: ordered = xn <= yn; break;
+		case CMP_GE: ordered = xn >= yn; break;
+		}
+
+		if(!ordered)
+			return fetch_bool(false);
+	}
+
+	return fetch_bool(true);
+}
+
+sobj *builtin_lt(sobj *obj, senv *env) {
+	return compare_chain(obj, CMP_LT);
+}
+
+sobj *builtin_gt(sobj *obj, senv *env) {
+	return compare_chain(obj, CMP_GT);
+}
+
+sobj *builtin_le(sobj *obj, senv *env) {
+	return compare_chain(obj, CMP_LE);
+}
+
+sobj *builtin_ge(sobj *obj, senv *env) {
+	return compare_chain(obj, CMP_GE);
+}
+
 sobj *builtin_cond(sobj *obj, senv *env) {
 	sobj *clause = get_list_head(obj);
 
 	sobj *test_cond = get_list_head(clause);
 	sobj *bodies = get_list_rest(clause);
 
-	if(test_cond->type == OBJ_SYMBOL && strncmp(test_cond->val.sym.str, "else", 4) == 0)
+	if(test_cond->type == OBJ_SYMBOL && strcmp(test_cond->val.sym.str, "else") == 0)
 		goto cond_true;
 
 	sobj *ev_cond = eval(test_cond, env, true);
@@ -346,32 +488,991 @@ sobj *builtin_cond(sobj *obj, senv *env) {
 	}
 
 cond_true:;
-	// Evaluate clause body and return. Because we may have multiple expressions
-	// in the body, first wrap in begin
-	sobj *beg = fetch_or_create_symbol(strlen("begin"), "begin");
-	sobj *wrapped = new_cons(beg, bodies);
-	return eval(wrapped, env, true);
+	// Evaluate clause body and return. We may have multiple expressions in the
+	// body, so evaluate it as a sequence
+	return builtin_begin(bodies, env);
+}
+
+// ================================ STRINGS ==================================
+// Strings are immutable byte strings that carry their length. There is no
+// character type, so string-ref returns a string of length one. Comparison
+// and search go through the SIMD kernels in strops.c.
+// ===========================================================================
+
+sobj *builtin_is_string(sobj *obj, senv *env) {
+	sobj *x = get_list_nth(obj, 1);
+	return fetch_bool(x->type == OBJ_STRING);
+}
+
+sobj *builtin_string_length(sobj *obj, senv *env) {
+	sobj *str = get_list_nth(obj, 1);
+	if(str->type != OBJ_STRING) {
+		SET_ERR("Argument to string-length not a string");
+		return NULL;
+	}
+
+	return new_numeric(SCHEME_INT, str->val.str.len, 0);
+}
+
+sobj *builtin_string_ref(sobj *obj, senv *env) {
+	sobj *str = get_list_nth(obj, 1);
+	sobj *k = get_list_nth(obj, 2);
+	if(str->type != OBJ_STRING || k->type != OBJ_NUMBER) {
+		SET_ERR("string-ref expects a string and a number");
+		return NULL;
+	}
+
+	int64_t i = k->val.number.value.integer;
+	if(i < 0 || i >= str->val.str.len) {
+		SET_ERR("string-ref index %ld out of range", (long)i);
+		return NULL;
+	}
+
+	return new_string(1, (char *)str->val.str.str + i);
+}
+
+sobj *builtin_substring(sobj *obj, senv *env) {
+	sobj *str = get_list_nth(obj, 1);
+	sobj *start = get_list_nth(obj, 2);
+	sobj *end = get_list_nth(obj, 3);
+	if(str->type != OBJ_STRING || start->type != OBJ_NUMBER 
+		|| end->type != OBJ_NUMBER) {
+		SET_ERR("substring expects a string and two numbers");
+		return NULL;
+	}
+
+	int64_t s = start->val.number.value.integer;
+	int64_t e = end->val.number.value.integer;
+	if(s < 0 || e < s || e > str->val.str.len) {
+		SET_ERR("substring range [%ld, %ld) out of range", (long)s, (long)e);
+		return NULL;
+	}
+
+	return new_string(e - s, (char *)str->val.str.str + s);
+}
+
+sobj *builtin_string_append(sobj *obj, senv *env) {
+	if(!all_list_of_type(obj, OBJ_STRING)) {
+		SET_ERR("Arguments to string-append not strings");
+		return NULL;
+	}
+
+	int len = 0;
+	for(sobj *cur = obj; cur->type == OBJ_CONS; cur = get_list_rest(cur))
+		len += get_list_head(cur)->val.str.len;
+
+	// Concatenate straight into the new string's storage
+	sobj *res = new_string(len, "");
+	char *dst = (char *)res->val.str.str;
+	for(sobj *cur = obj; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+		struct s_string *s = &get_list_head(cur)->val.str;
+		memcpy(dst, s->str, s->len);
+		dst += s->len;
+	}
+
+	return res;
+}
+
+static bool check_two_strings(sobj *obj, const char *name) {
+	if(!all_list_of_type(obj, OBJ_STRING)) {
+		SET_ERR("Arguments to %s not strings", name);
+		return false;
+	}
+
+	return true;
+}
+
+sobj *builtin_string_eq(sobj *obj, senv *env) {
+	if(!check_two_strings(obj, "string=?")) return NULL;
+	struct s_string *a = &get_list_nth(obj, 1)->val.str;
+	struct s_string *b = &get_list_nth(obj, 2)->val.str;
+
+	return fetch_bool(a->len == b->len 
+		&& str_mismatch(a->str, b->str, a->len) == (size_t)a->len);
+}
+
+sobj *builtin_string_lt(sobj *obj, senv *env) {
+	if(!check_two_strings(obj, "string<?")) return NULL;
+	struct s_string *a = &get_list_nth(obj, 1)->val.str;
+	struct s_string *b = &get_list_nth(obj, 2)->val.str;
+
+	return fetch_bool(str_compare(a->str, a->len, b->str, b->len) < 0);
+}
+
+// (string-search pattern string) returns the index of the first occurrence of
+// pattern in string, or #f
+sobj *builtin_string_search(sobj *obj, senv *env) {
+	if(!check_two_strings(obj, "string-search")) return NULL;
+	struct s_string *pat = &get_list_nth(obj, 1)->val.str;
+	struct s_string *str = &get_list_nth(obj, 2)->val.str;
+
+	long pos = str_search(str->str, str->len, pat->str, pat->len);
+	if(pos == -1)
+		return fetch_bool(false);
+
+	return new_numeric(SCHEME_INT, pos, 0);
+}
+
+// Returns #f if the string isn't a valid integer or doesn't fit in one
+sobj *builtin_string_to_number(sobj *obj, senv *env) {
+	sobj *str = get_list_nth(obj, 1);
+	if(str->type != OBJ_STRING) {
+		SET_ERR("Argument to string->number not a string");
+		return NULL;
+	}
+
+	const char *s = str->val.str.str;
+	int len = str->val.str.len;
+	int i = 0;
+	bool negative = false;
+
+	if(len > 0 && (s[0] == '-' || s[0] == '+')) {
+		negative = s[0] == '-';
+		i++;
+	}
+
+	if(i == len)
+		return fetch_bool(false);
+
+	// The magnitude of INT64_MIN is one more than INT64_MAX, so it is
+	// accumulated unsigned and negated at the end
+	uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : INT64_MAX;
+	uint64_t n = 0;
+	for(; i<len; i++) {
+		if(s[i] < '0' || s[i] > '9')
+			return fetch_bool(false);
+
+		// Numbers that don't fit in an integer aren't numbers we can make
+		unsigned digit = s[i] - '0';
+		if(n > (limit - digit) / 10)
+			return fetch_bool(false);
+		n = n*10 + digit;
+	}
+
+	return new_numeric(SCHEME_INT, negative ? (int64_t)(0 - n) : (int64_t)n, 0);
+}
+
+sobj *builtin_number_to_string(sobj *obj, senv *env) {
+	sobj *num = get_list_nth(obj, 1);
+	if(num->type != OBJ_NUMBER) {
+		SET_ERR("Argument to number->string not a number");
+		return NULL;
+	}
+
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "%" PRId64, num->val.number.value.integer);
+	return new_string(len, buf);
+}
+
+// ============================ BINDING FORMS ================================
+// let, let*, letrec, named let and do. All of these are macros, so they get
+// their arguments unevaluated. Each form allocates exactly one new frame for
+// its bindings; named let and do reuse that frame across iterations by
+// rebinding in place, and run as C loops so that iterating does not grow
+// the C stack.
+// ===========================================================================
+
+// Evaluates a body of one or more expressions in sequence, returning the
+// value of the last one
+sobj *eval_sequence(sobj *body, senv *env) {
+	if(body->type != OBJ_CONS) {
+		SET_ERR("Expected a body of at least one expression");
+		return NULL;
+	}
+
+	sobj *res = NULL;
+	for(sobj *cur = body; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+		res = eval(get_list_head(cur), env, true);
+		if(res == NULL) return NULL;
+	}
+
+	return res;
+}
+
+// Checks that every element of a binding list looks like (name expr ...)
+static bool check_bindings(sobj *bindings, int min_len, int max_len) {
+	if(get_list_len(bindings) == -1) {
+		SET_ERR("Bindings must be a list");
+		return false;
+	}
+
+	for(sobj *cur = bindings; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+		sobj *binding = get_list_head(cur);
+		int len = get_list_len(binding);
+
+		if(len < min_len || len > max_len
+			|| get_list_head(binding)->type != OBJ_SYMBOL) {
+			SET_ERR("Malformed binding");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Evaluates the init of each (name init) in bindings in eval_env and binds
+// the result to name in target
+static bool bind_inits(sobj *bindings, senv *eval_env, senv *target) {
+	for(sobj *cur = bindings; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+		sobj *binding = get_list_head(cur);
+		sobj *name = get_list_head(binding);
+		sobj *val = eval(get_list_nth(binding, 2), eval_env, true);
+		if(val == NULL) return false;
+
+		associate_symbol(target, name->val.sym.str, val);
+	}
+
+	return true;
+}
+
+// The frames of let, let* and letrec with their bindings made, or NULL if
+// the bindings are malformed or an init fails
+static senv *let_frame(sobj *bindings, senv *env) {
+	if(!check_bindings(bindings, 2, 2)) return NULL;
+
+	// Inits are evaluated in the enclosing environment
+	senv *frame = create_new_env(env);
+	if(!bind_inits(bindings, env, frame)) return NULL;
+	return frame;
+}
+
+static senv *let_star_frame(sobj *bindings, senv *env) {
+	if(!check_bindings(bindings, 2, 2)) return NULL;
+
+	// Each init sees the bindings before it, so evaluate in the new frame
+	senv *frame = create_new_env(env);
+	if(!bind_inits(bindings, frame, frame)) return NULL;
+	return frame;
+}
+
+static senv *letrec_frame(sobj *bindings, senv *env) {
+	if(!check_bindings(bindings, 2, 2)) return NULL;
+
+	// Bind every name first so that the inits can refer to each other
+	senv *frame = create_new_env(env);
+	for(sobj *cur = bindings; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+		sobj *name = get_list_head(get_list_head(cur));
+		associate_symbol(frame, name->val.sym.str,
+			fetch_singleton_object(SG_EMPTY_LIST));
+	}
+
+	if(!bind_inits(bindings, frame, frame)) return NULL;
+	return frame;
+}
+
+sobj *builtin_let_star(sobj *obj, senv *env) {
+	senv *frame = let_star_frame(get_list_head(obj), env);
+	if(frame == NULL) return NULL;
+	return eval_sequence(get_list_rest(obj), frame);
+}
+
+sobj *builtin_letrec(sobj *obj, senv *env) {
+	senv *frame = letrec_frame(get_list_head(obj), env);
+	if(frame == NULL) return NULL;
+	return eval_sequence(get_list_rest(obj), frame);
+}
+
+// Checks if head is the builtin func, or a symbol bound to it in env. The
+// desugaring pass replaces special form names with the builtin itself.
+static bool is_builtin_form(sobj *head, senv *env, 
+	sobj *(*func)(sobj *, senv *)) {
+
+	sobj *bound = head;
+	if(head->type == OBJ_SYMBOL)
+		bound = resolve_symbol(env, head->val.sym.str, true);
+
+	return bound != NULL && bound->type == OBJ_BUILTIN_FUNC
+		&& bound->val.builtin.func == func;
+}
+
+static sobj *eval_loop_tail(sobj *expr, senv *env,
+	sobj *loop_name, sobj *loop_fn, sobj **next_args);
+
+// Evaluates every expression of body but the last, which is in tail position
+static sobj *eval_body_tail(sobj *body, senv *env,
+	sobj *loop_name, sobj *loop_fn, sobj **next_args) {
+
+	*next_args = NULL;
+	if(body->type != OBJ_CONS) {
+		SET_ERR("Expected a body of at least one expression");
+		return NULL;
+	}
+
+	for(; get_list_rest(body)->type == OBJ_CONS; body = get_list_rest(body)) {
+		if(eval(get_list_head(body), env, true) == NULL)
+			return NULL;
+	}
+
+	return eval_loop_tail(get_list_head(body), env,
+		loop_name, loop_fn, next_args);
+}
+
+// Evaluates the body of a named let. Calls to the loop in tail position
+// (through if, cond, begin, the bodies of let, let* and letrec, and the last
+// operand of and and or) are not applied; instead their evaluated arguments
+// are returned through next_args and the caller loops. If the body produces
+// a value, *next_args is NULL.
+static sobj *eval_loop_tail(sobj *expr, senv *env,
+	sobj *loop_name, sobj *loop_fn, sobj **next_args) {
+
+	*next_args = NULL;
+	if(expr->type != OBJ_CONS)
+		return eval(expr, env, true);
+
+	sobj *head = get_list_head(expr);
+	sobj *rest = get_list_rest(expr);
+
+	// Tail call to the loop itself, as long as the name isn't shadowed
+	if(head->type == OBJ_SYMBOL 
+		&& strcmp(head->val.sym.str, loop_name->val.sym.str) == 0
+		&& resolve_symbol(env, head->val.sym.str, true) == loop_fn) {
+
+		sobj *args = eval(rest, env, false);
+		if(args == NULL) return NULL;
+
+		if(get_list_len(args) != loop_fn->val.lambda->num_args) {
+			SET_ERR("Arity mismatch: expected %d, got %d",
+				loop_fn->val.lambda->num_args, get_list_len(args));
+			return NULL;
+		}
+
+		*next_args = args;
+		return loop_fn;
+	}
+
+	if(is_builtin_form(head, env, &builtin_if)) {
+		if(get_list_len(rest) != 3) {
+			SET_ERR("Arity mismatch: expected 3, got %d", get_list_len(rest));
+			return NULL;
+		}
+
+		sobj *cond = eval(get_list_nth(rest, 1), env, true);
+		if(cond == NULL) return NULL;
+
+		sobj *branch = get_list_nth(rest, is_false(cond) ? 3 : 2);
+		return eval_loop_tail(branch, env, loop_name, loop_fn, next_args);
+	}
+
+	if(is_builtin_form(head, env, &builtin_begin) && rest->type == OBJ_CONS)
+		return eval_body_tail(rest, env, loop_name, loop_fn, next_args);
+
+	// The body of a let is in tail position once its frame is made. A named
+	// let is a loop of its own and is left to eval.
+	senv *(*make_frame)(sobj *, senv *) = NULL;
+	if(is_builtin_form(head, env, &builtin_let))
+		make_frame = &let_frame;
+	else if(is_builtin_form(head, env, &builtin_let_star))
+		make_frame = &let_star_frame;
+	else if(is_builtin_form(head, env, &builtin_letrec))
+		make_frame = &letrec_frame;
+
+	if(make_frame != NULL && get_list_len(rest) >= 2
+		&& get_list_head(rest)->type != OBJ_SYMBOL) {
+
+		senv *frame = make_frame(get_list_head(rest), env);
+		if(frame == NULL) return NULL;
+		return eval_body_tail(get_list_rest(rest), frame,
+			loop_name, loop_fn, next_args);
+	}
+
+	bool is_and = is_builtin_form(head, env, &builtin_and);
+	if((is_and || is_builtin_form(head, env, &builtin_or))
+		&& rest->type == OBJ_CONS) {
+
+		for(; get_list_rest(rest)->type == OBJ_CONS; rest = get_list_rest(rest)) {
+			sobj *res = eval(get_list_head(rest), env, true);
+			if(res == NULL || is_false(res) == is_and)
+				return res;
+		}
+
+		return eval_loop_tail(get_list_head(rest), env,
+			loop_name, loop_fn, next_args);
+	}
+
+	if(is_builtin_form(head, env, &builtin_cond)) {
+		for(; rest->type == OBJ_CONS; rest = get_list_rest(rest)) {
+			sobj *clause = get_list_head(rest);
+			sobj *test = get_list_head(clause);
+			sobj *bodies = get_list_rest(clause);
+
+			sobj *res = NULL;
+			if(test->type == OBJ_SYMBOL && strcmp(test->val.sym.str, "else") == 0) {
+				res = fetch_bool(true);
+			} else {
+				res = eval(test, env, true);
+				if(res == NULL) return NULL;
+				if(is_false(res)) continue;
+			}
+
+			if(bodies->type != OBJ_CONS)
+				return res;
+
+			return eval_body_tail(bodies, env, loop_name, loop_fn, next_args);
+		}
+
+		return fetch_singleton_object(SG_EMPTY_LIST);
+	}
+
+	return eval(expr, env, true);
+}
+
+// (let name ((var init) ...) body ...)
+static sobj *named_let(sobj *obj, senv *env) {
+	sobj *name = get_list_nth(obj, 1);
+	sobj *bindings = get_list_nth(obj, 2);
+	sobj *body = get_list_rest(get_list_rest(obj));
+	if(!check_bindings(bindings, 2, 2)) return NULL;
+
+	if(body->type != OBJ_CONS) {
+		SET_ERR("Named let requires a body");
+		return NULL;
+	}
+
+	// Build the list of variable names for the loop procedure
+	sobj *emptylist = fetch_singleton_object(SG_EMPTY_LIST);
+	sobj *vars = emptylist;
+	sobj **tail = &vars;
+	for(sobj *cur = bindings; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+		*tail = new_cons(get_list_head(get_list_head(cur)), emptylist);
+		tail = &(*tail)->val.cc.right;
+	}
+
+	// Wrap multiple body expressions in a begin
+	sobj *lambda_body = get_list_head(body);
+	if(get_list_rest(body)->type == OBJ_CONS) {
+		sobj *beg = fetch_or_create_symbol(env_interp(env), 
+			strlen("begin"), "begin");
+		lambda_body = new_cons(beg, body);
+	}
+
+	// The loop procedure is visible inside its own body, and is a real
+	// procedure so that non-tail calls and escaping references still work
+	senv *loop_scope = create_new_env(env);
+	sobj *loop_fn = new_lambda(vars, lambda_body, loop_scope);
+	if(loop_fn == NULL) return NULL;
+	associate_symbol(loop_scope, name->val.sym.str, loop_fn);
+	loop_fn->val.lambda->name = name->val.sym.str;
+
+	senv *frame = create_new_env(loop_scope);
+	if(!bind_inits(bindings, env, frame)) return NULL;
+
+	// The loop runs here rather than through apply_function, so it is
+	// entered on the profiler's stack here too
+	struct s_lambda *lambda = loop_fn->val.lambda;
+	bool profiled = profiling;
+	if(profiled)
+		shadow_push(lambda);
+
+	while(true) {
+		sobj *next_args = NULL;
+		sobj *res = eval_loop_tail(lambda_body, frame, name, loop_fn, &next_args);
+		if(res == NULL || next_args == NULL) {
+			if(profiled)
+				shadow_pop();
+			return res;
+		}
+
+		for(int i=0; i<lambda->num_args; i++) {
+			rebind_symbol(frame, lambda->arglist[i], get_list_head(next_args));
+			next_args = get_list_rest(next_args);
+		}
+	}
+}
+
+sobj *builtin_let(sobj *obj, senv *env) {
+	if(get_list_len(obj) < 2) {
+		SET_ERR("let requires bindings and a body");
+		return NULL;
+	}
+
+	if(get_list_head(obj)->type == OBJ_SYMBOL)
+		return named_let(obj, env);
+
+	senv *frame = let_frame(get_list_head(obj), env);
+	if(frame == NULL) return NULL;
+	return eval_sequence(get_list_rest(obj), frame);
+}
+
+// (do ((var init step) ...) (test expr ...) command ...)
+sobj *builtin_do(sobj *obj, senv *env) {
+	if(get_list_len(obj) < 2) {
+		SET_ERR("do requires bindings and a termination clause");
+		return NULL;
+	}
+
+	sobj *bindings = get_list_nth(obj, 1);
+	sobj *exit_clause = get_list_nth(obj, 2);
+	sobj *commands = get_list_rest(get_list_rest(obj));
+	if(!check_bindings(bindings, 2, 3)) return NULL;
+
+	if(get_list_len(exit_clause) < 1) {
+		SET_ERR("do termination clause must be a non-empty list");
+		return NULL;
+	}
+
+	int num_vars = get_list_len(bindings);
+	senv *frame = create_new_env(env);
+	if(!bind_inits(bindings, env, frame)) return NULL;
+
+	// Steps are all evaluated before any variable is updated
+	sobj *steps[num_vars > 0 ? num_vars : 1];
+
+	while(true) {
+		sobj *test = eval(get_list_head(exit_clause), frame, true);
+		if(test == NULL) return NULL;
+
+		if(!is_false(test)) {
+			sobj *results = get_list_rest(exit_clause);
+			if(results->type == OBJ_EMPTY_LIST)
+				return fetch_singleton_object(SG_EMPTY_LIST);
+			return eval_sequence(results, frame);
+		}
+
+		for(sobj *cur = commands; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+			if(eval(get_list_head(cur), frame, true) == NULL)
+				return NULL;
+		}
+
+		int i = 0;
+		for(sobj *cur = bindings; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+			sobj *binding = get_list_head(cur);
+			steps[i] = NULL;
+
+			// Variables without a step keep their value
+			if(get_list_len(binding) == 3) {
+				steps[i] = eval(get_list_nth(binding, 3), frame, true);
+				if(steps[i] == NULL) return NULL;
+			}
+			i++;
+		}
+
+		i = 0;
+		for(sobj *cur = bindings; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+			sobj *name = get_list_head(get_list_head(cur));
+			if(steps[i] != NULL)
+				rebind_symbol(frame, name->val.sym.str, steps[i]);
+			i++;
+		}
+	}
+}
+
+// =============================== PARALLEL ==================================
+// pmap, pfor-each and preduce split a list into chunks and run them on the
+// interpreter's thread pool. The procedure must be pure: evaluation only
+// allocates and reads environments, so concurrent calls are safe as long as
+// they don't define or set! variables that other calls can see.
+// ===========================================================================
+
+struct par_job {
+	sobj *func;
+	senv *env;
+	sobj **items;
+	int num_items;
+	int chunk_size;
+
+	// One per item for pmap, one per chunk for preduce
+	sobj **results;
+	sobj *identity;
+
+	// Reason for the first failure in any chunk
+	int failed;
+	char reason[512];
+};
+
+// Copies the elements of a proper list into a new array
+static sobj **list_to_array(sobj *list, int *len) {
+	*len = get_list_len(list);
+	if(*len == -1) {
+		SET_ERR("Expected a proper list");
+		return NULL;
+	}
+
+	sobj **items = malloc((*len + 1) * sizeof(sobj *));
+	ensure_mem(items);
+
+	int i = 0;
+	for(sobj *cur = list; cur->type == OBJ_CONS; cur = get_list_rest(cur))
+		items[i++] = get_list_head(cur);
+
+	return items;
+}
+
+static sobj *apply_par(struct par_job *job, sobj *arg1, sobj *arg2) {
+	sobj *args = fetch_singleton_object(SG_EMPTY_LIST);
+	if(arg2 != NULL)
+		args = new_cons(arg2, args);
+	args = new_cons(arg1, args);
+
+	sobj *res = apply_function(job->func, args, job->env);
+	if(res == NULL && __atomic_exchange_n(&job->failed, 1, __ATOMIC_RELAXED) == 0)
+		snprintf(job->reason, sizeof(job->reason), "%s", get_err_reason());
+	return res;
+}
+
+static void map_chunk(void *ctx, int chunk) {
+	struct par_job *job = ctx;
+	int start = chunk * job->chunk_size;
+	int end = start + job->chunk_size;
+	if(end > job->num_items)
+		end = job->num_items;
+
+	// Errors are reported once, on the calling thread
+	clear_err_reason(false);
+	for(int i=start; i<end; i++) {
+		// Stop early once any chunk has failed
+		if(__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+			break;
+
+		sobj *res = apply_par(job, job->items[i], NULL);
+		if(job->results != NULL)
+			job->results[i] = res;
+	}
+}
+
+static void reduce_chunk(void *ctx, int chunk) {
+	struct par_job *job = ctx;
+	int start = chunk * job->chunk_size;
+	int end = start + job->chunk_size;
+	if(end > job->num_items)
+		end = job->num_items;
+
+	clear_err_reason(false);
+	sobj *acc = job->identity;
+	for(int i=start; i<end && acc != NULL; i++)
+		acc = apply_par(job, acc, job->items[i]);
+	job->results[chunk] = acc;
+}
+
+// Splits the items of list into chunks and runs fn on them in parallel.
+// Returns the number of chunks, or -1 on error.
+static int run_par_job(struct par_job *job, sobj *func, sobj *list,
+	sobj *identity, senv *env, chunk_fn fn, bool keep_results) {
+
+	if(func->type != OBJ_LAMBDA && func->type != OBJ_BUILTIN_FUNC) {
+		SET_ERR("Expected a procedure");
+		return -1;
+	}
+
+	memset(job, 0, sizeof(*job));
+	job->func = func;
+	job->identity = identity;
+	job->env = env;
+	job->items = list_to_array(list, &job->num_items);
+	if(job->items == NULL)
+		return -1;
+
+	// A few chunks per thread, so that uneven work still balances out
+	struct interp *interp = env_interp(env);
+	struct thread_pool *pool = interp_pool(interp);
+	int num_chunks = pool_size(pool) * 4;
+	if(num_chunks > job->num_items)
+		num_chunks = job->num_items;
+	if(num_chunks == 0)
+		return 0;
+	job->chunk_size = (job->num_items + num_chunks - 1) / num_chunks;
+	num_chunks = (job->num_items + job->chunk_size - 1) / job->chunk_size;
+
+	if(keep_results) {
+		int num_results = fn == &reduce_chunk ? num_chunks : job->num_items;
+		job->results = malloc(num_results * sizeof(sobj *));
+		ensure_mem(job->results);
+	}
+
+	pool_run(pool, num_chunks, fn, job);
+
+	clear_err_reason(interp->print_errors);
+	if(job->failed) {
+		set_err_reason("%s", job->reason);
+		return -1;
+	}
+
+	return num_chunks;
+}
+
+sobj *builtin_pmap(sobj *obj, senv *env) {
+	struct par_job job;
+	if(run_par_job(&job, get_list_nth(obj, 1), get_list_nth(obj, 2), NULL,
+		env, &map_chunk, true) == -1) {
+		return NULL;
+	}
+
+	// Assemble the results in order
+	sobj *res = fetch_singleton_object(SG_EMPTY_LIST);
+	for(int i=job.num_items-1; i>=0; i--)
+		res = new_cons(job.results[i], res);
+
+	free(job.items);
+	free(job.results);
+	return res;
+}
+
+sobj *builtin_pfor_each(sobj *obj, senv *env) {
+	struct par_job job;
+	if(run_par_job(&job, get_list_nth(obj, 1), get_list_nth(obj, 2), NULL,
+		env, &map_chunk, false) == -1) {
+		return NULL;
+	}
+
+	free(job.items);
+	return fetch_singleton_object(SG_EMPTY_LIST);
+}
+
+// (preduce f identity list) folds each chunk from identity, then folds the
+// chunk results in order. f must be associative with identity as its
+// identity element for the result to match a sequential fold.
+sobj *builtin_preduce(sobj *obj, senv *env) {
+	struct par_job job;
+	sobj *identity = get_list_nth(obj, 2);
+	int num_chunks = run_par_job(&job, get_list_nth(obj, 1),
+		get_list_nth(obj, 3), identity, env, &reduce_chunk, true);
+	if(num_chunks == -1)
+		return NULL;
+
+	sobj *acc = identity;
+	if(num_chunks > 0) {
+		acc = job.results[0];
+		for(int i=1; i<num_chunks && acc != NULL; i++)
+			acc = apply_par(&job, acc, job.results[i]);
+	}
+
+	free(job.items);
+	free(job.results);
+	return acc;
+}
+
+// ================================ FUTURES ==================================
+// (future expr) returns at once and queues expr to be evaluated, possibly on
+// another thread; (touch f) waits for its value. The environments the future
+// can see are locked, so definitions made meanwhile, by the future or by the
+// code that spawned it, are safe, though which value the future reads is a
+// race.
+// ===========================================================================
+
+sobj *builtin_future(sobj *obj, senv *env) {
+	struct scheduler *sched = interp_scheduler(env_interp(env));
+	return spawn_future(sched, get_list_head(obj), env);
+}
+
+// Touching anything that isn't a future returns it unchanged
+sobj *builtin_touch(sobj *obj, senv *env) {
+	sobj *arg = get_list_head(obj);
+	if(arg->type != OBJ_FUTURE)
+		return arg;
+
+	return touch_future(interp_scheduler(env_interp(env)), arg->val.future);
+}
+
+sobj *builtin_is_future(sobj *obj, senv *env) {
+	return fetch_bool(get_list_head(obj)->type == OBJ_FUTURE);
+}
+
+// =============================== BINARY I/O ================================
+// (write-binary obj path) writes obj to the file at path in the format of
+// binary.h, replacing the file, and (write-binary obj path #t) appends obj
+// to it as one more value. (read-binary path) returns the first value in
+// the file, and (read-binary path proc) calls proc on each value in turn
+// and returns how many there were, so that a file of many values never has
+// to be held in memory at once.
+// ===========================================================================
+
+static FILE *open_data_file(sobj *path, const char *mode, const char *who) {
+	if(path->type != OBJ_STRING) {
+		SET_ERR("Path given to %s not a string", who);
+		return NULL;
+	}
+
+	FILE *fp = fopen(path->val.str.str, mode);
+	if(fp == NULL)
+		SET_ERR("%s: cannot open %s: %s", who, path->val.str.str,
+			strerror(errno));
+	return fp;
+}
+
+sobj *builtin_write_binary(sobj *obj, senv *env) {
+	int len = get_list_len(obj);
+	if(len != 2 && len != 3) {
+		SET_ERR("Arity mismatch: expected 2 or 3, got %d", len);
+		return NULL;
+	}
+
+	// Opened for appending either way, since the file mustn't be truncated
+	// until write_binary has checked that the value can be written
+	bool append = len == 3 && !is_false(get_list_nth(obj, 3));
+	FILE *fp = open_data_file(get_list_nth(obj, 2), "ab", "write-binary");
+	if(fp == NULL)
+		return NULL;
+
+	bool ok = write_binary(env_interp(env), fp, get_list_nth(obj, 1), append);
+	if(fclose(fp) != 0 && ok) {
+		SET_ERR("Failed to write binary data");
+		ok = false;
+	}
+
+	return ok ? fetch_singleton_object(SG_EMPTY_LIST) : NULL;
+}
+
+static sobj *read_each_binary(struct binary_reader *r, sobj *proc,
+	senv *env) {
+
+	sobj *emptylist = fetch_singleton_object(SG_EMPTY_LIST);
+	long count = 0;
+	for(;;) {
+		bool end;
+		sobj *val = read_binary(r, &end);
+		if(val == NULL)
+			return end ? new_numeric(SCHEME_INT, count, 0) : NULL;
+
+		if(apply_function(proc, new_cons(val, emptylist), env) == NULL)
+			return NULL;
+		count++;
+	}
+}
+
+sobj *builtin_read_binary(sobj *obj, senv *env) {
+	int len = get_list_len(obj);
+	if(len != 1 && len != 2) {
+		SET_ERR("Arity mismatch: expected 1 or 2, got %d", len);
+		return NULL;
+	}
+
+	FILE *fp = open_data_file(get_list_nth(obj, 1), "rb", "read-binary");
+	if(fp == NULL)
+		return NULL;
+
+	sobj *res = NULL;
+	struct binary_reader *r = open_binary_reader(env_interp(env), fp);
+	if(r != NULL && len == 2) {
+		res = read_each_binary(r, get_list_nth(obj, 2), env);
+	} else if(r != NULL) {
+		bool end;
+		res = read_binary(r, &end);
+		if(end)
+			SET_ERR("read-binary: no data in file");
+	}
+
+	if(r != NULL)
+		close_binary_reader(r);
+	fclose(fp);
+	return res;
+}
+
+// ================================ RUNTIME ==================================
+
+// (runtime-stats) returns the runtime counters, summed over all threads, as
+// an association list of (name . value)
+sobj *builtin_runtime_stats(sobj *obj, senv *env) {
+	uint64_t totals[NUM_STATS];
+	read_stats(totals);
+
+	struct interp *interp = env_interp(env);
+	sobj *alist = fetch_singleton_object(SG_EMPTY_LIST);
+	for(int i=NUM_STATS-1; i>=0; i--) {
+		const char *name = stat_name(i);
+		sobj *sym = fetch_or_create_symbol(interp, strlen(name), name);
+		sobj *pair = new_cons(sym, new_numeric(SCHEME_INT, (long)totals[i], 0));
+		alist = new_cons(pair, alist);
+	}
+
+	return alist;
+}
+
+// ============================== PROPERTIES =================================
+// What analysis may assume about each builtin, by name. Builtins that aren't
+// listed may have side effects and return anything. Procedures and futures
+// never appear in constants, so the predicates on them are pure too.
+// ===========================================================================
+
+struct builtin_props {
+	const char *name;
+	unsigned flags;
+	int result_type;
+};
+
+#define PURE_ALLOC (BUILTIN_PURE | BUILTIN_ALLOCATES)
+
+static const struct builtin_props builtin_props[] = {
+	{ "car",            BUILTIN_PURE, -1 },
+	{ "cdr",            BUILTIN_PURE, -1 },
+	{ "cons",           PURE_ALLOC,   OBJ_CONS },
+	{ "list",           PURE_ALLOC,   -1 },
+	{ "append",         PURE_ALLOC,   -1 },
+	{ "length",         PURE_ALLOC,   OBJ_NUMBER },
+	{ "null?",          BUILTIN_PURE, OBJ_BOOLEAN },
+	{ "list?",          BUILTIN_PURE, OBJ_BOOLEAN },
+	{ "number?",        BUILTIN_PURE, OBJ_BOOLEAN },
+	{ "equal?",         BUILTIN_PURE, OBJ_BOOLEAN },
+	{ "equal-hash",     PURE_ALLOC,   OBJ_NUMBER },
+	{ "procedure?",     BUILTIN_PURE, OBJ_BOOLEAN },
+	{ "not",            BUILTIN_PURE, OBJ_BOOLEAN },
+	{ "+",              PURE_ALLOC,   OBJ_NUMBER },
+	{ "-",              PURE_ALLOC,   OBJ_NUMBER },
+	{ "*",              PURE_ALLOC,   OBJ_NUMBER },
+	{ "<",              BUILTIN_PURE, OBJ_BOOLEAN },
+	{ ">",              BUILTIN_PURE, OBJ_BOOLEAN },
+	{ "<=",             BUILTIN_PURE, OBJ_BOOLEAN },
+	{ ">=",             BUILTIN_PURE, OBJ_BOOLEAN },
+	{ "string?",        BUILTIN_PURE, OBJ_BOOLEAN },
+	{ "string-length",  PURE_ALLOC,   OBJ_NUMBER },
+	{ "string-ref",     PURE_ALLOC,   OBJ_STRING },
+	{ "substring",      PURE_ALLOC,   OBJ_STRING },
+	{ "string-append",  PURE_ALLOC,   OBJ_STRING },
+	{ "string=?",       BUILTIN_PURE, OBJ_BOOLEAN },
+	{ "string<?",       BUILTIN_PURE, OBJ_BOOLEAN },
+	{ "string-search",  PURE_ALLOC,   -1 },
+	{ "string->number", PURE_ALLOC,   -1 },
+	{ "number->string", PURE_ALLOC,   OBJ_STRING },
+	{ "future?",        BUILTIN_PURE, OBJ_BOOLEAN },
+};
+
+#undef PURE_ALLOC
+
+static void set_builtin_props(struct s_env *env) {
+	int len = sizeof(builtin_props) / sizeof(builtin_props[0]);
+	for(int i=0; i<len; i++) {
+		sobj *fn = resolve_symbol(env, builtin_props[i].name, false);
+		fn->val.builtin.flags = builtin_props[i].flags;
+		fn->val.builtin.result_type = builtin_props[i].result_type;
+	}
+}
+
+// Numbers, strings, booleans and symbols can't be mutated, so only new
+// pairs, or results that might be pairs, stop a pure builtin from folding.
+// fold_call checks the arguments, which may be mutable pairs.
+bool is_foldable(struct s_builtin *builtin) {
+	if((builtin->flags & BUILTIN_PURE) == 0)
+		return false;
+	if((builtin->flags & BUILTIN_ALLOCATES) == 0)
+		return true;
+	return builtin->result_type != -1 && builtin->result_type != OBJ_CONS;
 }
 
 void add_builtins(struct s_env *env) {
 
 	// Fundamental special forms
 	struct s_obj *quote_fn =    new_builtin(true, 1, &builtin_quote);
+	struct s_obj *qquote_fn =   new_builtin(true, 1, &builtin_quasiquote);
 	struct s_obj *if_fn =       new_builtin(true, 3, &builtin_if);
 	struct s_obj *define_fn =   new_builtin(true, 2, &builtin_define);
 	struct s_obj *setbang_fn =  new_builtin(true, 2, &builtin_set_bang);
 	struct s_obj *lambda_fn =   new_builtin(true, 2, &builtin_lambda);
-	struct s_obj *begin_fn =    new_builtin(false, -1, &builtin_begin);
+	struct s_obj *begin_fn =    new_builtin(true, -1, &builtin_begin);
 	struct s_obj *write_fn =    new_builtin(false, 1, &builtin_write);
+	struct s_obj *display_fn =  new_builtin(false, 1, &builtin_display);
+	struct s_obj *write_str_fn = new_builtin(false, 1, &builtin_write_string);
+	struct s_obj *newline_fn =  new_builtin(false, 0, &builtin_newline);
 	struct s_obj *eval_fn =     new_builtin(false, 1, &builtin_eval);
 	struct s_obj *apply_fn =    new_builtin(false, 2, &builtin_apply);
 	associate_symbol(env, "quote", quote_fn);
+	associate_symbol(env, "quasiquote", qquote_fn);
 	associate_symbol(env, "if", if_fn);
 	associate_symbol(env, "define", define_fn);
 	associate_symbol(env, "set!", setbang_fn);
 	associate_symbol(env, "lambda", lambda_fn);
 	associate_symbol(env, "begin", begin_fn);
 	associate_symbol(env, "write", write_fn);
+	associate_symbol(env, "display", display_fn);
+	associate_symbol(env, "write-string", write_str_fn);
+	associate_symbol(env, "newline", newline_fn);
 	associate_symbol(env, "eval", eval_fn);
 	associate_symbol(env, "apply", apply_fn);
 
@@ -379,24 +1480,32 @@ void add_builtins(struct s_env *env) {
 	struct s_obj *cons_fn =     new_builtin(false, 2, &builtin_cons);
 	struct s_obj *car_fn =      new_builtin(false, 1, &builtin_car);
 	struct s_obj *cdr_fn =      new_builtin(false, 1, &builtin_cdr);
+	struct s_obj *set_car_fn =  new_builtin(false, 2, &builtin_set_car);
+	struct s_obj *set_cdr_fn =  new_builtin(false, 2, &builtin_set_cdr);
 	struct s_obj *length_fn =   new_builtin(false, 1, &builtin_length);
 	struct s_obj *list_fn =     new_builtin(false, -1, &builtin_list);
+	struct s_obj *append_fn =   new_builtin(false, -1, &builtin_append);
 	associate_symbol(env, "cons", cons_fn);
 	associate_symbol(env, "car", car_fn);
 	associate_symbol(env, "cdr", cdr_fn);
+	associate_symbol(env, "set-car!", set_car_fn);
+	associate_symbol(env, "set-cdr!", set_cdr_fn);
 	associate_symbol(env, "length", length_fn);
 	associate_symbol(env, "list", list_fn);
+	associate_symbol(env, "append", append_fn);
 
 	// Predicates
 	struct s_obj *is_null_fn =  new_builtin(false, 1, &builtin_is_null);
 	struct s_obj *is_list_fn =  new_builtin(false, 1, &builtin_is_list);
 	struct s_obj *is_number_fn = new_builtin(false, 1, &builtin_is_number);
 	struct s_obj *is_eq_fn =    new_builtin(false, 2, &builtin_is_equal);
+	struct s_obj *equal_hash_fn = new_builtin(false, 1, &builtin_equal_hash);
 	struct s_obj *is_func_fn =  new_builtin(false, 1, &builtin_is_func);
 	associate_symbol(env, "null?", is_null_fn);	
 	associate_symbol(env, "list?", is_list_fn);	
 	associate_symbol(env, "number?", is_number_fn);	
 	associate_symbol(env, "equal?", is_eq_fn);	
+	associate_symbol(env, "equal-hash", equal_hash_fn);
 	associate_symbol(env, "procedure?", is_func_fn);	
 	// Green wants function? instead of the R5RS procedure?, so we do both
 	associate_symbol(env, "function?", is_func_fn);	
@@ -417,8 +1526,77 @@ void add_builtins(struct s_env *env) {
 	associate_symbol(env, "-", sub_fn);
 	associate_symbol(env, "*", mul_fn);
 
+	struct s_obj *lt_fn = new_builtin(false, -1, &builtin_lt);
+	struct s_obj *gt_fn = new_builtin(false, -1, &builtin_gt);
+	struct s_obj *le_fn = new_builtin(false, -1, &builtin_le);
+	struct s_obj *ge_fn = new_builtin(false, -1, &builtin_ge);
+	associate_symbol(env, "<", lt_fn);
+	associate_symbol(env, ">", gt_fn);
+	associate_symbol(env, "<=", le_fn);
+	associate_symbol(env, ">=", ge_fn);
+
 	// Cond is here because my macro system sucks
 	// TODO: rewrite cond as a macro
 	struct s_obj *cond_fn = new_builtin(true, -1, &builtin_cond);
 	associate_symbol(env, "cond", cond_fn);
+
+	// Strings
+	struct s_obj *is_string_fn =  new_builtin(false, 1, &builtin_is_string);
+	struct s_obj *str_len_fn =    new_builtin(false, 1, &builtin_string_length);
+	struct s_obj *str_ref_fn =    new_builtin(false, 2, &builtin_string_ref);
+	struct s_obj *substring_fn =  new_builtin(false, 3, &builtin_substring);
+	struct s_obj *str_append_fn = new_builtin(false, -1, &builtin_string_append);
+	struct s_obj *str_eq_fn =     new_builtin(false, 2, &builtin_string_eq);
+	struct s_obj *str_lt_fn =     new_builtin(false, 2, &builtin_string_lt);
+	struct s_obj *str_search_fn = new_builtin(false, 2, &builtin_string_search);
+	struct s_obj *str_to_num_fn = new_builtin(false, 1, &builtin_string_to_number);
+	struct s_obj *num_to_str_fn = new_builtin(false, 1, &builtin_number_to_string);
+	associate_symbol(env, "string?", is_string_fn);
+	associate_symbol(env, "string-length", str_len_fn);
+	associate_symbol(env, "string-ref", str_ref_fn);
+	associate_symbol(env, "substring", substring_fn);
+	associate_symbol(env, "string-append", str_append_fn);
+	associate_symbol(env, "string=?", str_eq_fn);
+	associate_symbol(env, "string<?", str_lt_fn);
+	associate_symbol(env, "string-search", str_search_fn);
+	associate_symbol(env, "string->number", str_to_num_fn);
+	associate_symbol(env, "number->string", num_to_str_fn);
+
+	// Binding and iteration forms
+	struct s_obj *let_fn =      new_builtin(true, -1, &builtin_let);
+	struct s_obj *let_star_fn = new_builtin(true, -1, &builtin_let_star);
+	struct s_obj *letrec_fn =   new_builtin(true, -1, &builtin_letrec);
+	struct s_obj *do_fn =       new_builtin(true, -1, &builtin_do);
+	associate_symbol(env, "let", let_fn);
+	associate_symbol(env, "let*", let_star_fn);
+	associate_symbol(env, "letrec", letrec_fn);
+	associate_symbol(env, "do", do_fn);
+
+	// Data parallelism
+	struct s_obj *pmap_fn =     new_builtin(false, 2, &builtin_pmap);
+	struct s_obj *pfor_each_fn = new_builtin(false, 2, &builtin_pfor_each);
+	struct s_obj *preduce_fn =  new_builtin(false, 3, &builtin_preduce);
+	associate_symbol(env, "pmap", pmap_fn);
+	associate_symbol(env, "pfor-each", pfor_each_fn);
+	associate_symbol(env, "preduce", preduce_fn);
+
+	// Futures
+	struct s_obj *future_fn =    new_builtin(true, 1, &builtin_future);
+	struct s_obj *touch_fn =     new_builtin(false, 1, &builtin_touch);
+	struct s_obj *is_future_fn = new_builtin(false, 1, &builtin_is_future);
+	associate_symbol(env, "future", future_fn);
+	associate_symbol(env, "touch", touch_fn);
+	associate_symbol(env, "future?", is_future_fn);
+
+	// Binary serialisation
+	struct s_obj *write_bin_fn = new_builtin(false, -1, &builtin_write_binary);
+	struct s_obj *read_bin_fn =  new_builtin(false, -1, &builtin_read_binary);
+	associate_symbol(env, "write-binary", write_bin_fn);
+	associate_symbol(env, "read-binary", read_bin_fn);
+
+	// Runtime introspection
+	struct s_obj *runtime_stats_fn = new_builtin(false, 0, &builtin_runtime_stats);
+	associate_symbol(env, "runtime-stats", runtime_stats_fn);
+
+	set_builtin_props(env);
 }
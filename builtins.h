@@ -6,4 +6,42 @@
 
 void add_builtins(struct s_env *env);
 
-#endif
\ No newline at end of file
+// Only #f is false, every other object is true
+bool is_false(struct s_obj *obj);
+
+// Whether a call to builtin with constant arguments can be evaluated once,
+// ahead of time, and its result used for every evaluation: it must be pure
+// and not return new objects that could be mutated
+bool is_foldable(struct s_builtin *builtin);
+
+// Special forms, exposed so that syntactic passes can recognise them
+struct s_obj *builtin_quote(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_quasiquote(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_if(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_define(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_set_bang(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_lambda(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_begin(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_cond(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_let(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_let_star(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_letrec(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_do(struct s_obj *obj, struct s_env *env);
+
+// List construction, used by the quasiquote expansion
+struct s_obj *builtin_cons(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_append(struct s_obj *obj, struct s_env *env);
+
+// Primitives that the JIT inlines while they are still bound to these
+struct s_obj *builtin_car(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_cdr(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_is_null(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_is_equal(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_add(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_sub(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_lt(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_gt(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_le(struct s_obj *obj, struct s_env *env);
+struct s_obj *builtin_ge(struct s_obj *obj, struct s_env *env);
+
+#endif
@@ -0,0 +1,549 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "common.h"
+#include "internal_rep.h"
+#include "interp.h"
+#include "preparse.h"
+#include "stats.h"
+#include "uthash.h"
+
+typedef struct s_obj sobj;
+
+// Changed whenever the encoding, or what the parser makes of some source,
+// changes, so that older entries are ignored
+#define CACHE_VERSION 1
+
+// Lists nested deeper than this are not cached, since encoding and decoding
+// recurse on nesting
+#define MAX_DEPTH 10000
+
+static const char cache_magic[8] = { 'S', 'C', 'M', 'C', 'A', 'C', 'H', 'E' };
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t unused;
+	// Length of the source, checked besides its hash in the file name
+	uint64_t source_len;
+	// Hash of everything after the header
+	uint64_t payload_hash;
+};
+
+enum tag {
+	TAG_EMPTY_LIST,
+	TAG_TRUE,
+	TAG_FALSE,
+	TAG_INT,
+	TAG_STRING,
+	TAG_SYMBOL,
+	TAG_LIST,
+};
+
+enum item_kind { ITEM_RUN, ITEM_DEFINE };
+
+struct cache_entry {
+	sobj **symbols;
+	uint64_t num_symbols;
+};
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+// FNV-1a, continuing from hash
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+	const unsigned char *bytes = data;
+	for(size_t i=0; i<len; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// =============================== ENCODING ==================================
+
+struct sym_index {
+	sobj *sym;
+	uint64_t index;
+	UT_hash_handle hh;
+};
+
+struct writer {
+	unsigned char *buf;
+	size_t len;
+	size_t capacity;
+	// Symbols by their index, in the order they were added
+	struct sym_index *symbols;
+	uint64_t num_symbols;
+	int depth;
+	// Set if something can't be encoded
+	bool failed;
+};
+
+static void reserve(struct writer *w, size_t n) {
+	if(w->len + n <= w->capacity)
+		return;
+
+	while(w->len + n > w->capacity)
+		w->capacity = w->capacity == 0 ? 4096 : w->capacity*2;
+	w->buf = realloc(w->buf, w->capacity);
+	ensure_mem(w->buf);
+}
+
+static void put_bytes(struct writer *w, const void *data, size_t len) {
+	reserve(w, len);
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+}
+
+static void put_byte(struct writer *w, unsigned char byte) {
+	put_bytes(w, &byte, 1);
+}
+
+static int encode_varint(unsigned char *out, uint64_t v) {
+	int n = 0;
+	for(; v >= 0x80; v >>= 7)
+		out[n++] = (v & 0x7f) | 0x80;
+	out[n++] = v;
+	return n;
+}
+
+static void put_varint(struct writer *w, uint64_t v) {
+	unsigned char bytes[10];
+	put_bytes(w, bytes, encode_varint(bytes, v));
+}
+
+static void put_symbol(struct writer *w, sobj *sym) {
+	struct sym_index *entry = NULL;
+	HASH_FIND_PTR(w->symbols, &sym, entry);
+	if(entry == NULL) {
+		entry = malloc(sizeof(struct sym_index));
+		ensure_mem(entry);
+		entry->sym = sym;
+		entry->index = w->num_symbols++;
+		HASH_ADD_PTR(w->symbols, sym, entry);
+	}
+
+	put_varint(w, entry->index);
+}
+
+static void put_datum(struct writer *w, sobj *obj) {
+	switch(obj->type) {
+	case OBJ_EMPTY_LIST:
+		put_byte(w, TAG_EMPTY_LIST);
+		return;
+	case OBJ_BOOLEAN:
+		put_byte(w, obj->val.boolean ? TAG_TRUE : TAG_FALSE);
+		return;
+	case OBJ_NUMBER: {
+		// The parser only makes integers
+		if(obj->val.number.type != SCHEME_INT)
+			break;
+		int64_t i = obj->val.number.value.integer;
+		put_byte(w, TAG_INT);
+		put_varint(w, ((uint64_t)i << 1) ^ (uint64_t)(i >> 63));
+		return;
+	}
+	case OBJ_STRING:
+		put_byte(w, TAG_STRING);
+		put_varint(w, obj->val.str.len);
+		put_bytes(w, obj->val.str.str, obj->val.str.len);
+		return;
+	case OBJ_SYMBOL:
+		put_byte(w, TAG_SYMBOL);
+		put_symbol(w, obj);
+		return;
+	case OBJ_CONS: {
+		if(++w->depth > MAX_DEPTH)
+			break;
+
+		uint64_t len = 0;
+		sobj *cur = obj;
+		for(; cur->type == OBJ_CONS; cur = cur->val.cc.right)
+			len++;
+
+		put_byte(w, TAG_LIST);
+		put_varint(w, len);
+		for(cur = obj; cur->type == OBJ_CONS; cur = cur->val.cc.right)
+			put_datum(w, cur->val.cc.left);
+		put_datum(w, cur);
+		w->depth--;
+		return;
+	}
+	default:
+		break;
+	}
+
+	w->failed = true;
+}
+
+// Puts the encoding of obj preceded by its length, so that readers can
+// skip it
+static void put_sized_datum(struct writer *w, sobj *obj) {
+	size_t start = w->len;
+	put_datum(w, obj);
+
+	unsigned char bytes[10];
+	int n = encode_varint(bytes, w->len - start);
+	reserve(w, n);
+	memmove(w->buf + start + n, w->buf + start, w->len - start);
+	memcpy(w->buf + start, bytes, n);
+	w->len += n;
+}
+
+static void put_items(struct writer *w, struct interp *interp,
+	struct load_items *items) {
+
+	put_varint(w, items->len);
+	for(int i=0; i<items->len && !w->failed; i++) {
+		struct load_item *item = &items->arr[i];
+		if(item->program != NULL) {
+			put_byte(w, ITEM_RUN);
+			put_datum(w, item->program);
+			continue;
+		}
+
+		sobj *exprs = lazy_body_exprs(interp, item->body);
+		if(exprs == NULL) {
+			w->failed = true;
+			return;
+		}
+
+		put_byte(w, ITEM_DEFINE);
+		put_symbol(w, item->name);
+		put_datum(w, item->params);
+		put_sized_datum(w, exprs);
+	}
+}
+
+static void put_symbol_table(struct writer *table, struct writer *w) {
+	put_varint(table, w->num_symbols);
+
+	struct sym_index *entry, *tmp;
+	HASH_ITER(hh, w->symbols, entry, tmp) {
+		put_varint(table, entry->sym->val.sym.len);
+		put_bytes(table, entry->sym->val.sym.str, entry->sym->val.sym.len);
+		HASH_DEL(w->symbols, entry);
+		free(entry);
+	}
+}
+
+// Writes to a temporary file renamed into place, so that readers only ever
+// see whole entries
+static void write_file(const char *dir, const char *path,
+	struct cache_header *header, struct writer *table, struct writer *w) {
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s/.tmp-XXXXXX", dir);
+	int fd = mkstemp(tmp);
+	if(fd < 0)
+		return;
+
+	FILE *fp = fdopen(fd, "wb");
+	if(fp == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	bool ok = fwrite(header, sizeof(*header), 1, fp) == 1
+		&& fwrite(table->buf, 1, table->len, fp) == table->len
+		&& fwrite(w->buf, 1, w->len, fp) == w->len;
+	ok = fclose(fp) == 0 && ok;
+
+	if(!ok || rename(tmp, path) != 0)
+		unlink(tmp);
+}
+
+// Writing the entry is best effort: if anything fails, the file is simply
+// parsed again next time
+static void write_entry(struct interp *interp, const char *path,
+	size_t source_len, struct load_items *items) {
+
+	// Deferred bodies are parsed to be encoded. Their errors are left to
+	// their first call.
+	bool print = set_err_print(false);
+	struct writer w = { 0 };
+	put_items(&w, interp, items);
+	clear_err_reason(print);
+
+	struct writer table = { 0 };
+	put_symbol_table(&table, &w);
+
+	if(!w.failed) {
+		struct cache_header header = {
+			.version = CACHE_VERSION,
+			.source_len = source_len,
+		};
+		memcpy(header.magic, cache_magic, sizeof(cache_magic));
+
+		uint64_t hash = hash_bytes(HASH_INIT, table.buf, table.len);
+		header.payload_hash = hash_bytes(hash, w.buf, w.len);
+
+		mkdir(interp->cache_dir, 0755);
+		write_file(interp->cache_dir, path, &header, &table, &w);
+	}
+
+	free(table.buf);
+	free(w.buf);
+}
+
+// =============================== DECODING ==================================
+// Everything read is bounds checked, so a damaged entry is rejected rather
+// than read past its end.
+// ===========================================================================
+
+struct reader {
+	const unsigned char *pos;
+	const unsigned char *end;
+	struct cache_entry *entry;
+	int depth;
+};
+
+static bool get_byte(struct reader *r, unsigned char *byte) {
+	if(r->pos == r->end)
+		return false;
+	*byte = *r->pos++;
+	return true;
+}
+
+static bool get_varint(struct reader *r, uint64_t *v) {
+	*v = 0;
+	for(int shift = 0; shift < 64; shift += 7) {
+		unsigned char byte;
+		if(!get_byte(r, &byte))
+			return false;
+		*v |= (uint64_t)(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+// Pointer to the next len bytes, skipping them
+static const unsigned char *get_bytes(struct reader *r, uint64_t len) {
+	if(len > (uint64_t)(r->end - r->pos))
+		return NULL;
+	const unsigned char *bytes = r->pos;
+	r->pos += len;
+	return bytes;
+}
+
+static sobj *get_symbol(struct reader *r) {
+	uint64_t index;
+	if(!get_varint(r, &index) || index >= r->entry->num_symbols)
+		return NULL;
+	return r->entry->symbols[index];
+}
+
+static sobj *get_datum(struct reader *r) {
+	unsigned char tag;
+	uint64_t v;
+	if(!get_byte(r, &tag))
+		return NULL;
+
+	switch(tag) {
+	case TAG_EMPTY_LIST:
+		return fetch_singleton_object(SG_EMPTY_LIST);
+	case TAG_TRUE:
+		return fetch_singleton_object(SG_TRUE);
+	case TAG_FALSE:
+		return fetch_singleton_object(SG_FALSE);
+	case TAG_INT:
+		if(!get_varint(r, &v))
+			return NULL;
+		// Undoes the zigzag encoding of put_datum
+		return new_numeric(SCHEME_INT, (v >> 1) ^ -(v & 1), 0);
+	case TAG_STRING: {
+		const unsigned char *str;
+		if(!get_varint(r, &v) || v > INT_MAX || (str = get_bytes(r, v)) == NULL)
+			return NULL;
+		return new_string(v, (char *)str);
+	}
+	case TAG_SYMBOL:
+		return get_symbol(r);
+	case TAG_LIST: {
+		if(!get_varint(r, &v) || v == 0 || ++r->depth > MAX_DEPTH)
+			return NULL;
+
+		sobj *head = NULL;
+		sobj **tail = &head;
+		for(uint64_t i=0; i<v; i++) {
+			sobj *elt = get_datum(r);
+			if(elt == NULL)
+				return NULL;
+			*tail = new_cons(elt, NULL);
+			tail = &(*tail)->val.cc.right;
+		}
+
+		if((*tail = get_datum(r)) == NULL)
+			return NULL;
+		r->depth--;
+		return head;
+	}
+	default:
+		return NULL;
+	}
+}
+
+static bool get_items(struct reader *r, struct load_items *items,
+	bool *deferred) {
+
+	uint64_t num_items;
+	if(!get_varint(r, &num_items))
+		return false;
+
+	for(uint64_t i=0; i<num_items; i++) {
+		unsigned char kind;
+		if(!get_byte(r, &kind))
+			return false;
+
+		if(kind == ITEM_RUN) {
+			sobj *program = get_datum(r);
+			if(program == NULL || program->type != OBJ_CONS)
+				return false;
+			add_load_item(items, (struct load_item){ .program = program });
+			continue;
+		}
+
+		uint64_t len;
+		const unsigned char *body;
+		struct load_item item = { .name = get_symbol(r) };
+		if(kind != ITEM_DEFINE || item.name == NULL
+			|| (item.params = get_datum(r)) == NULL
+			|| !get_varint(r, &len) || len > INT_MAX
+			|| (body = get_bytes(r, len)) == NULL)
+			return false;
+
+		item.body = new_lazy_body((const char *)body, len, r->entry);
+		add_load_item(items, item);
+		*deferred = true;
+	}
+
+	return r->pos == r->end;
+}
+
+static bool get_symbol_table(struct interp *interp, struct reader *r) {
+	struct cache_entry *entry = r->entry;
+	uint64_t num_symbols;
+	// Every symbol takes at least a byte
+	if(!get_varint(r, &num_symbols)
+		|| num_symbols > (uint64_t)(r->end - r->pos))
+		return false;
+
+	// One more so that an empty table isn't a NULL allocation
+	entry->symbols = malloc((num_symbols + 1) * sizeof(sobj *));
+	ensure_mem(entry->symbols);
+	entry->num_symbols = num_symbols;
+
+	for(uint64_t i=0; i<num_symbols; i++) {
+		uint64_t len;
+		const unsigned char *name;
+		if(!get_varint(r, &len) || len > INT_MAX
+			|| (name = get_bytes(r, len)) == NULL)
+			return false;
+		entry->symbols[i] = fetch_or_create_symbol(interp, len,
+			(const char *)name);
+	}
+
+	return true;
+}
+
+// Maps and decodes the entry at path into items. The mapping is kept for as
+// long as the deferred bodies in it may be loaded, that is for good.
+static bool read_entry(struct interp *interp, const char *path,
+	size_t source_len, struct load_items *items) {
+
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct cache_header)) {
+		close(fd);
+		return false;
+	}
+
+	size_t size = st.st_size;
+	const unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return false;
+
+	struct cache_header header;
+	memcpy(&header, map, sizeof(header));
+	const unsigned char *payload = map + sizeof(header);
+	size_t payload_len = size - sizeof(header);
+
+	bool ok = memcmp(header.magic, cache_magic, sizeof(cache_magic)) == 0
+		&& header.version == CACHE_VERSION
+		&& header.source_len == source_len
+		&& header.payload_hash == hash_bytes(HASH_INIT, payload, payload_len);
+
+	struct cache_entry *entry = malloc(sizeof(struct cache_entry));
+	ensure_mem(entry);
+	entry->symbols = NULL;
+
+	struct reader r = { payload, payload + payload_len, entry, 0 };
+	bool deferred = false;
+	ok = ok && get_symbol_table(interp, &r) && get_items(&r, items, &deferred);
+
+	if(!ok)
+		items->len = 0;
+	if(!ok || !deferred) {
+		munmap((void *)map, size);
+		free(entry->symbols);
+		free(entry);
+	}
+
+	return ok;
+}
+
+sobj *decode_cached_body(struct cache_entry *entry, const char *data, int len) {
+	struct reader r = {
+		(const unsigned char *)data, (const unsigned char *)data + len, entry, 0
+	};
+
+	sobj *exprs = get_datum(&r);
+	if(exprs == NULL || r.pos != r.end) {
+		SET_ERR("Corrupt cache entry");
+		return NULL;
+	}
+
+	return exprs;
+}
+
+// ================================ LOADING ==================================
+
+sobj *eval_cached(struct interp *interp, const char *buf, size_t len) {
+	clear_err_reason(interp->print_errors);
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%016" PRIx64 ".cache", interp->cache_dir,
+		hash_bytes(HASH_INIT, buf, len));
+
+	struct load_items items = { 0 };
+	if(read_entry(interp, path, len, &items)) {
+		STAT_ADD(STAT_CACHE_HITS, 1);
+	} else {
+		STAT_ADD(STAT_CACHE_MISSES, 1);
+		if(!load_buffer(interp, buf, len, &items)) {
+			free(items.arr);
+			return NULL;
+		}
+		write_entry(interp, path, len, &items);
+	}
+
+	sobj *res = eval_items(interp, &items);
+	free(items.arr);
+	return res;
+}
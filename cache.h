@@ -0,0 +1,37 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+
+#include "internal_rep.h"
+#include "interp.h"
+
+// On-disk cache of parsed files. interp_eval_file stores the items that
+// load_buffer makes of a file (see preparse.h) in interp->cache_dir, in a
+// file named after a hash of the source, so that later runs map the entry
+// and decode it instead of tokenising and parsing the source. A changed
+// source hashes to another entry, so entries never go stale; old ones are
+// just no longer read.
+//
+// An entry is a header, the table of the symbols it uses, then the items.
+// Data is encoded with a one byte tag followed by varints, strings by their
+// length and bytes, symbols by their index in the table, and lists by their
+// length, their elements and their tail. The bodies of deferred definitions
+// are decoded from the mapping on their first call, like the source text of
+// a lazy body is parsed. Entries are checked against a hash of their
+// contents, and any entry that doesn't check out is rewritten.
+//
+// Only parsed forms are cached. Analysis happens when a body is first
+// applied and the results hold pointers, so it is redone on every run.
+
+struct cache_entry;
+
+// interp_eval_buffer for the contents of a file, from its cache entry if
+// there is a valid one, or else writing the entry
+struct s_obj *eval_cached(struct interp *interp, const char *buf, size_t len);
+
+// Decodes the list of body expressions at data in the mapping of entry
+struct s_obj *decode_cached_body(struct cache_entry *entry,
+    const char *data, int len);
+
+#endif
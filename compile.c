@@ -0,0 +1,1199 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "common.h"
+#include "compile.h"
+#include "environment.h"
+#include "internal_rep.h"
+#include "interp.h"
+#include "lexer.h"
+#include "parser.h"
+#include "printer.h"
+#include "uthash.h"
+
+typedef struct s_obj sobj;
+typedef struct s_env senv;
+typedef sobj *(*builtin_fn)(sobj *, senv *);
+
+enum name_kind { NAME_VARIABLE, NAME_FUNCTION, NAME_BUILTIN };
+
+// What the whole program does with one name
+struct name_info {
+	const char *name;
+	// The name as a C string literal
+	char *quoted;
+
+	int toplevel_defs;
+	// Bound by anything other than a top-level define: a parameter, a let,
+	// an internal define or set!
+	bool rebound;
+	// Parameters if the top-level define is of a lambda, else NULL
+	sobj *params;
+
+	bool classified;
+	enum name_kind kind;
+	// Suffix of the C names of the function or builtin
+	int id;
+	int arity;
+	builtin_fn func;
+	// Called directly somewhere, so it needs an entry point
+	bool called;
+
+	UT_hash_handle hh;
+};
+
+// Primitives with a fast path in aot.h
+struct prim {
+	builtin_fn func;
+	int num_args;
+	const char *helper;
+};
+
+static const struct prim prims[] = {
+	{ &builtin_add,      2, "aot_add" },
+	{ &builtin_sub,      2, "aot_sub" },
+	{ &builtin_lt,       2, "aot_lt" },
+	{ &builtin_gt,       2, "aot_gt" },
+	{ &builtin_le,       2, "aot_le" },
+	{ &builtin_ge,       2, "aot_ge" },
+	{ &builtin_is_equal, 2, "aot_num_eq" },
+	{ &builtin_car,      1, "aot_car" },
+	{ &builtin_cdr,      1, "aot_cdr" },
+	{ &builtin_is_null,  1, "aot_is_null" },
+};
+
+#define NUM_PRIMS (sizeof(prims) / sizeof(prims[0]))
+
+struct compiler {
+	struct interp *interp;
+	struct name_info *names;
+	// Declarations of every function and static, the body of init_program,
+	// and the finished functions
+	struct strbuf decls;
+	struct strbuf init;
+	struct strbuf funcs;
+	int next_id;
+};
+
+// C function being generated
+struct func {
+	struct strbuf code;
+	int indent;
+};
+
+// Innermost named let, whose calls in tail position rebind the frame and
+// jump back to the top of its C loop
+struct loop {
+	const char *name;
+	// Temporary holding the loop procedure
+	int fn;
+	const char *frame;
+	sobj *vars;
+	int num_vars;
+};
+
+// ============================== OUTPUT =====================================
+
+static void vappendf(struct strbuf *buf, const char *fmt, va_list ap) {
+	va_list copy;
+	va_copy(copy, ap);
+	int len = vsnprintf(NULL, 0, fmt, copy);
+	va_end(copy);
+
+	char *str = malloc(len + 1);
+	ensure_mem(str);
+	vsnprintf(str, len + 1, fmt, ap);
+	strbuf_append(buf, str, len);
+	free(str);
+}
+
+static void appendf(struct strbuf *buf, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vappendf(buf, fmt, ap);
+	va_end(ap);
+}
+
+// Appends one indented line of code to f
+static void line(struct func *f, const char *fmt, ...) {
+	for(int i=0; i<f->indent; i++)
+		strbuf_putc(&f->code, '\t');
+
+	va_list ap;
+	va_start(ap, fmt);
+	vappendf(&f->code, fmt, ap);
+	va_end(ap);
+	strbuf_putc(&f->code, '\n');
+}
+
+// str as a C string literal. Anything but printable ASCII is escaped in
+// octal, so the literal is the same bytes whatever str contains.
+static void append_c_string(struct strbuf *buf, const char *str, size_t len) {
+	strbuf_putc(buf, '"');
+	for(size_t i=0; i<len; i++) {
+		unsigned char ch = str[i];
+		if(ch == '"' || ch == '\\' || ch == '?') {
+			strbuf_putc(buf, '\\');
+			strbuf_putc(buf, ch);
+		} else if(ch < 0x20 || ch >= 0x7f) {
+			appendf(buf, "\\%03o", ch);
+		} else {
+			strbuf_putc(buf, ch);
+		}
+	}
+	strbuf_putc(buf, '"');
+}
+
+static char *c_string(const char *str, size_t len) {
+	struct strbuf buf = { NULL, 0, 0 };
+	append_c_string(&buf, str, len);
+	strbuf_putc(&buf, '\0');
+	return buf.data;
+}
+
+static int new_id(struct compiler *c) {
+	return c->next_id++;
+}
+
+// ============================== ANALYSIS ===================================
+// One pass over the whole program, before any code is generated, records
+// every name that is bound anywhere and how. Quoted data is skipped; any
+// other form that isn't understood is scanned as if it were code, which can
+// only make the result more conservative.
+// ===========================================================================
+
+static struct name_info *name_info(struct compiler *c, const char *name) {
+	struct name_info *ni = NULL;
+	HASH_FIND_STR(c->names, name, ni);
+	if(ni != NULL)
+		return ni;
+
+	ni = calloc(1, sizeof(struct name_info));
+	ensure_mem(ni);
+	ni->name = name;
+	ni->quoted = c_string(name, strlen(name));
+	HASH_ADD_KEYPTR(hh, c->names, ni->name, strlen(ni->name), ni);
+	return ni;
+}
+
+// The special form head refers to, resolved the way desugar does it
+static builtin_fn keyword(struct compiler *c, sobj *head) {
+	if(head->type != OBJ_SYMBOL)
+		return NULL;
+
+	sobj *bound = resolve_symbol(c->interp->root_env, head->val.sym.str, false);
+	if(bound == NULL || bound->type != OBJ_BUILTIN_FUNC
+		|| !bound->val.builtin.is_macro)
+		return NULL;
+
+	return bound->val.builtin.func;
+}
+
+// A proper list of symbols, the only arguments a lambda accepts
+static bool is_params(sobj *params) {
+	if(get_list_len(params) == -1)
+		return false;
+
+	for(; params->type == OBJ_CONS; params = get_list_rest(params)) {
+		if(get_list_head(params)->type != OBJ_SYMBOL)
+			return false;
+	}
+	return true;
+}
+
+// (lambda params body ...)
+static bool is_lambda_form(struct compiler *c, sobj *form) {
+	return form->type == OBJ_CONS
+		&& keyword(c, get_list_head(form)) == &builtin_lambda
+		&& get_list_len(form) >= 3
+		&& is_params(get_list_nth(form, 2));
+}
+
+static void scan(struct compiler *c, sobj *form, bool toplevel);
+
+static void scan_list(struct compiler *c, sobj *lst) {
+	for(; lst->type == OBJ_CONS; lst = get_list_rest(lst))
+		scan(c, get_list_head(lst), false);
+}
+
+static void mark_rebound(struct compiler *c, sobj *obj) {
+	if(obj->type == OBJ_SYMBOL)
+		name_info(c, obj->val.sym.str)->rebound = true;
+}
+
+static void mark_params(struct compiler *c, sobj *params) {
+	for(; params->type == OBJ_CONS; params = get_list_rest(params))
+		mark_rebound(c, get_list_head(params));
+
+	// Rest argument
+	mark_rebound(c, params);
+}
+
+// (name init [step]) ...
+static void scan_bindings(struct compiler *c, sobj *bindings) {
+	for(; bindings->type == OBJ_CONS; bindings = get_list_rest(bindings)) {
+		sobj *binding = get_list_head(bindings);
+		if(binding->type != OBJ_CONS)
+			continue;
+
+		mark_rebound(c, get_list_head(binding));
+		scan_list(c, get_list_rest(binding));
+	}
+}
+
+static void scan_define(struct compiler *c, builtin_fn form, sobj *args,
+	bool toplevel) {
+
+	if(args->type != OBJ_CONS)
+		return;
+
+	sobj *target = get_list_head(args);
+	sobj *rest = get_list_rest(args);
+	int len = get_list_len(args);
+	sobj *name = target;
+	// Only set for the defines of a lambda that compile_define compiles
+	sobj *params = NULL;
+
+	if(target->type == OBJ_CONS) {
+		name = get_list_head(target);
+		mark_params(c, get_list_rest(target));
+		if(len >= 2 && is_params(get_list_rest(target)))
+			params = get_list_rest(target);
+	} else if(len == 2 && is_lambda_form(c, get_list_head(rest))) {
+		params = get_list_nth(get_list_head(rest), 2);
+	}
+
+	scan_list(c, rest);
+	if(name->type != OBJ_SYMBOL)
+		return;
+
+	struct name_info *ni = name_info(c, name->val.sym.str);
+	if(toplevel && form == &builtin_define) {
+		ni->toplevel_defs++;
+		ni->params = params;
+	} else {
+		ni->rebound = true;
+	}
+}
+
+static void scan(struct compiler *c, sobj *form, bool toplevel) {
+	if(form->type != OBJ_CONS)
+		return;
+
+	sobj *args = get_list_rest(form);
+	builtin_fn kw = keyword(c, get_list_head(form));
+
+	if(kw == &builtin_quote)
+		return;
+
+	if(kw == &builtin_define || kw == &builtin_set_bang) {
+		scan_define(c, kw, args, toplevel);
+		return;
+	}
+
+	if(kw == &builtin_lambda && args->type == OBJ_CONS) {
+		mark_params(c, get_list_head(args));
+		scan_list(c, get_list_rest(args));
+		return;
+	}
+
+	if((kw == &builtin_let || kw == &builtin_let_star || kw == &builtin_letrec
+		|| kw == &builtin_do) && args->type == OBJ_CONS) {
+
+		sobj *bindings = get_list_head(args);
+		sobj *body = get_list_rest(args);
+
+		// Named let binds its name too
+		if(kw == &builtin_let && bindings->type == OBJ_SYMBOL
+			&& body->type == OBJ_CONS) {
+			mark_rebound(c, bindings);
+			bindings = get_list_head(body);
+			body = get_list_rest(body);
+		}
+
+		scan_bindings(c, bindings);
+		scan_list(c, body);
+		return;
+	}
+
+	scan_list(c, form);
+}
+
+// What a global name can be compiled to. Decided on first use, once the
+// whole program has been scanned.
+static struct name_info *lookup_name(struct compiler *c, const char *name) {
+	struct name_info *ni = name_info(c, name);
+	if(ni->classified)
+		return ni;
+
+	ni->classified = true;
+	ni->kind = NAME_VARIABLE;
+	if(ni->rebound)
+		return ni;
+
+	if(ni->toplevel_defs == 1 && ni->params != NULL) {
+		ni->kind = NAME_FUNCTION;
+		ni->id = new_id(c);
+		ni->arity = get_list_len(ni->params);
+
+		// The lambda, once its define has run
+		appendf(&c->decls, "static sobj *g_%d;\n", ni->id);
+		appendf(&c->decls, "static sobj *lambda_%d(senv *env);\n", ni->id);
+		return ni;
+	}
+
+	if(ni->toplevel_defs > 0)
+		return ni;
+
+	sobj *bound = resolve_symbol(c->interp->root_env, name, false);
+	if(bound != NULL && bound->type == OBJ_BUILTIN_FUNC
+		&& !bound->val.builtin.is_macro) {
+
+		ni->kind = NAME_BUILTIN;
+		ni->id = new_id(c);
+		ni->func = bound->val.builtin.func;
+		appendf(&c->decls, "static sobj *b_%d;\n", ni->id);
+		appendf(&c->init, "\tb_%d = resolve_symbol(interp->root_env, %s, false);\n",
+			ni->id, ni->quoted);
+	}
+
+	return ni;
+}
+
+// ============================== CONSTANTS ==================================
+// Quoted data and self-evaluating literals are built once by init_program
+// and kept in statics. Lists are built along their spine by a loop of
+// statements, so only nesting in the elements recurses.
+// ===========================================================================
+
+static void append_atom(struct strbuf *buf, sobj *obj) {
+	switch(obj->type) {
+	case OBJ_NUMBER:
+		if(obj->val.number.type == SCHEME_INT)
+			appendf(buf, "new_numeric(SCHEME_INT, %lldLL, 0)",
+				(long long)obj->val.number.value.integer);
+		else
+			appendf(buf, "new_numeric(SCHEME_FLOAT, 0, %a)",
+				obj->val.number.value.floating);
+		break;
+
+	case OBJ_STRING:
+		appendf(buf, "new_string(%d, ", obj->val.str.len);
+		append_c_string(buf, obj->val.str.str, obj->val.str.len);
+		strbuf_putc(buf, ')');
+		break;
+
+	case OBJ_SYMBOL:
+		appendf(buf, "fetch_or_create_symbol(interp, %d, ", obj->val.sym.len);
+		append_c_string(buf, obj->val.sym.str, obj->val.sym.len);
+		strbuf_putc(buf, ')');
+		break;
+
+	case OBJ_BOOLEAN:
+		appendf(buf, "fetch_bool(%s)", obj->val.boolean ? "true" : "false");
+		break;
+
+	default:
+		// The parser produces nothing else
+		appendf(buf, "fetch_singleton_object(SG_EMPTY_LIST)");
+		break;
+	}
+}
+
+// Returns the id of the static k_<id> that holds obj once init_program ran
+static int constant(struct compiler *c, sobj *obj) {
+	int k = new_id(c);
+	appendf(&c->decls, "static sobj *k_%d;\n", k);
+
+	if(obj->type != OBJ_CONS) {
+		appendf(&c->init, "\tk_%d = ", k);
+		append_atom(&c->init, obj);
+		appendf(&c->init, ";\n");
+		return k;
+	}
+
+	int len = 0;
+	sobj *tail = obj;
+	for(; tail->type == OBJ_CONS; tail = get_list_rest(tail))
+		len++;
+
+	sobj **elts = malloc(len * sizeof(sobj *));
+	int *ids = malloc(len * sizeof(int));
+	ensure_mem(elts);
+	ensure_mem(ids);
+
+	sobj *cur = obj;
+	for(int i=0; i<len; i++, cur = get_list_rest(cur)) {
+		elts[i] = get_list_head(cur);
+		ids[i] = elts[i]->type == OBJ_CONS ? constant(c, elts[i]) : -1;
+	}
+
+	appendf(&c->init, "\tk_%d = ", k);
+	append_atom(&c->init, tail);
+	appendf(&c->init, ";\n");
+
+	for(int i=len-1; i>=0; i--) {
+		appendf(&c->init, "\tk_%d = new_cons(", k);
+		if(ids[i] >= 0)
+			appendf(&c->init, "k_%d", ids[i]);
+		else
+			append_atom(&c->init, elts[i]);
+		appendf(&c->init, ", k_%d);\n", k);
+	}
+
+	free(elts);
+	free(ids);
+	return k;
+}
+
+// A form left to the interpreter, see struct aot_site
+static int new_site(struct compiler *c, sobj *form) {
+	int id = new_id(c);
+	struct strbuf src = { NULL, 0, 0 };
+	serialise_obj(&src, form, true);
+
+	appendf(&c->decls, "static struct aot_site site_%d = { ", id);
+	append_c_string(&c->decls, src.data, src.len);
+	appendf(&c->decls, ", NULL };\n");
+
+	strbuf_free(&src);
+	return id;
+}
+
+// ============================== EXPRESSIONS ================================
+// Every expression is compiled into statements that leave its value in a
+// fresh temporary t<id>, declared where it is assigned, and return NULL
+// from the function as soon as a value is NULL, like eval. Environments
+// created by let, named let and do are e<id>. Forms that can't be compiled
+// exactly are checked before any code is emitted for them and fall back to
+// the interpreter as a whole.
+// ===========================================================================
+
+static int compile_expr(struct compiler *c, struct func *f, sobj *expr,
+	const char *env, struct loop *loop);
+
+static void check(struct func *f, int t) {
+	line(f, "if(t%d == NULL) return NULL;", t);
+}
+
+static int compile_constant(struct compiler *c, struct func *f, sobj *obj) {
+	int k = constant(c, obj);
+	int t = new_id(c);
+	line(f, "sobj *t%d = k_%d;", t, k);
+	return t;
+}
+
+// Constants and builtins can't fail and have no effect, so they are left out
+// wherever their value is ignored
+static bool is_pure(struct compiler *c, sobj *expr) {
+	if(expr->type == OBJ_SYMBOL)
+		return lookup_name(c, expr->val.sym.str)->kind == NAME_BUILTIN;
+	if(expr->type != OBJ_CONS)
+		return true;
+
+	return keyword(c, get_list_head(expr)) == &builtin_quote
+		&& get_list_len(get_list_rest(expr)) == 1;
+}
+
+static int compile_fallback(struct compiler *c, struct func *f, sobj *expr,
+	const char *env) {
+
+	int site = new_site(c, expr);
+	int t = new_id(c);
+	line(f, "sobj *t%d = aot_eval(%s, &site_%d);", t, env, site);
+	check(f, t);
+	return t;
+}
+
+static int compile_ref(struct compiler *c, struct func *f, sobj *sym,
+	const char *env) {
+
+	struct name_info *ni = lookup_name(c, sym->val.sym.str);
+	int t = new_id(c);
+
+	if(ni->kind == NAME_BUILTIN) {
+		line(f, "sobj *t%d = b_%d;", t, ni->id);
+		return t;
+	}
+
+	if(ni->kind == NAME_FUNCTION)
+		line(f, "sobj *t%d = g_%d != NULL ? g_%d : aot_lookup(%s, %s);",
+			t, ni->id, ni->id, env, ni->quoted);
+	else
+		line(f, "sobj *t%d = aot_lookup(%s, %s);", t, env, ni->quoted);
+
+	check(f, t);
+	return t;
+}
+
+// Evaluates each expression of body in order, returning the last value.
+// Only the last one is in tail position.
+static int compile_body(struct compiler *c, struct func *f, sobj *body,
+	const char *env, struct loop *loop) {
+
+	if(body->type != OBJ_CONS)
+		return compile_constant(c, f, fetch_singleton_object(SG_EMPTY_LIST));
+
+	for(; get_list_rest(body)->type == OBJ_CONS; body = get_list_rest(body)) {
+		if(!is_pure(c, get_list_head(body)))
+			compile_expr(c, f, get_list_head(body), env, NULL);
+	}
+
+	return compile_expr(c, f, get_list_head(body), env, loop);
+}
+
+static int compile_if(struct compiler *c, struct func *f, sobj *args,
+	const char *env, struct loop *loop) {
+
+	int test = compile_expr(c, f, get_list_nth(args, 1), env, NULL);
+	int res = new_id(c);
+	line(f, "sobj *t%d = NULL;", res);
+	line(f, "if(!aot_is_false(t%d)) {", test);
+	f->indent++;
+	int then = compile_expr(c, f, get_list_nth(args, 2), env, loop);
+	line(f, "t%d = t%d;", res, then);
+	f->indent--;
+	line(f, "} else {");
+	f->indent++;
+	int otherwise = compile_expr(c, f, get_list_nth(args, 3), env, loop);
+	line(f, "t%d = t%d;", res, otherwise);
+	f->indent--;
+	line(f, "}");
+	check(f, res);
+	return res;
+}
+
+static bool is_else(sobj *test) {
+	return test->type == OBJ_SYMBOL && strcmp(test->val.sym.str, "else") == 0;
+}
+
+// Clauses that desugar can rewrite into ifs
+static bool check_clauses(sobj *clauses) {
+	for(; clauses->type == OBJ_CONS; clauses = get_list_rest(clauses)) {
+		sobj *clause = get_list_head(clauses);
+		if(get_list_len(clause) < 2)
+			return false;
+		if(is_else(get_list_head(clause)))
+			return true;
+	}
+	return clauses->type == OBJ_EMPTY_LIST;
+}
+
+static int compile_clauses(struct compiler *c, struct func *f, sobj *clauses,
+	const char *env, struct loop *loop) {
+
+	if(clauses->type != OBJ_CONS)
+		return compile_constant(c, f, fetch_singleton_object(SG_EMPTY_LIST));
+
+	sobj *clause = get_list_head(clauses);
+	if(is_else(get_list_head(clause)))
+		return compile_body(c, f, get_list_rest(clause), env, loop);
+
+	int test = compile_expr(c, f, get_list_head(clause), env, NULL);
+	int res = new_id(c);
+	line(f, "sobj *t%d = NULL;", res);
+	line(f, "if(!aot_is_false(t%d)) {", test);
+	f->indent++;
+	int then = compile_body(c, f, get_list_rest(clause), env, loop);
+	line(f, "t%d = t%d;", res, then);
+	f->indent--;
+	line(f, "} else {");
+	f->indent++;
+	int otherwise = compile_clauses(c, f, get_list_rest(clauses), env, loop);
+	line(f, "t%d = t%d;", res, otherwise);
+	f->indent--;
+	line(f, "}");
+	check(f, res);
+	return res;
+}
+
+// Compiles the body into its own C function and creates the lambda in env.
+// A known global's function has the id the name was given.
+static int compile_lambda(struct compiler *c, struct func *f, sobj *params,
+	sobj *body, const char *env, struct name_info *known) {
+
+	int id = known != NULL ? known->id : new_id(c);
+	if(known == NULL)
+		appendf(&c->decls, "static sobj *lambda_%d(senv *env);\n", id);
+
+	struct func fn = { { NULL, 0, 0 }, 0 };
+	line(&fn, "static sobj *lambda_%d(senv *env) {", id);
+	fn.indent++;
+	int res = compile_body(c, &fn, body, "env", NULL);
+	line(&fn, "return t%d;", res);
+	fn.indent--;
+	line(&fn, "}\n");
+
+	strbuf_append(&c->funcs, fn.code.data, fn.code.len);
+	strbuf_free(&fn.code);
+
+	int k = constant(c, params);
+	int t = new_id(c);
+	line(f, "sobj *t%d = aot_lambda(%s, k_%d, &lambda_%d);", t, env, k, id);
+	check(f, t);
+	return t;
+}
+
+// (define name expr) or (define (name . params) body ...), and set!. Returns
+// -1 for anything desugar and builtin_define would not accept.
+static int compile_define(struct compiler *c, struct func *f, sobj *args,
+	const char *env) {
+
+	int len = get_list_len(args);
+	if(len < 2)
+		return -1;
+
+	sobj *target = get_list_head(args);
+	struct name_info *ni = NULL;
+	int val = -1;
+
+	if(target->type == OBJ_SYMBOL) {
+		if(len != 2)
+			return -1;
+
+		sobj *expr = get_list_nth(args, 2);
+		ni = lookup_name(c, target->val.sym.str);
+		if(ni->kind == NAME_FUNCTION && is_lambda_form(c, expr)) {
+			val = compile_lambda(c, f, get_list_nth(expr, 2),
+				get_list_rest(get_list_rest(expr)), env, ni);
+		} else {
+			val = compile_expr(c, f, expr, env, NULL);
+		}
+	} else if(target->type == OBJ_CONS
+		&& get_list_head(target)->type == OBJ_SYMBOL
+		&& is_params(get_list_rest(target))) {
+
+		ni = lookup_name(c, get_list_head(target)->val.sym.str);
+		val = compile_lambda(c, f, get_list_rest(target), get_list_rest(args),
+			env, ni->kind == NAME_FUNCTION ? ni : NULL);
+	} else {
+		return -1;
+	}
+
+	int t = new_id(c);
+	line(f, "sobj *t%d = aot_define(%s, %s, t%d);", t, env, ni->quoted, val);
+	if(ni->kind == NAME_FUNCTION)
+		line(f, "g_%d = t%d;", ni->id, val);
+	check(f, t);
+	return t;
+}
+
+// Binding lists that builtin_let and friends accept
+static bool check_bindings(sobj *bindings, int min_len, int max_len) {
+	if(get_list_len(bindings) == -1)
+		return false;
+
+	for(; bindings->type == OBJ_CONS; bindings = get_list_rest(bindings)) {
+		sobj *binding = get_list_head(bindings);
+		int len = get_list_len(binding);
+		if(len < min_len || len > max_len
+			|| get_list_head(binding)->type != OBJ_SYMBOL)
+			return false;
+	}
+	return true;
+}
+
+// Evaluates each init in eval_env and binds it in frame
+static void compile_inits(struct compiler *c, struct func *f, sobj *bindings,
+	const char *eval_env, const char *frame) {
+
+	for(; bindings->type == OBJ_CONS; bindings = get_list_rest(bindings)) {
+		sobj *binding = get_list_head(bindings);
+		int val = compile_expr(c, f, get_list_nth(binding, 2), eval_env, NULL);
+		line(f, "associate_symbol(%s, %s, t%d);", frame,
+			name_info(c, get_list_head(binding)->val.sym.str)->quoted, val);
+	}
+}
+
+// (let name ((var init) ...) body ...), see named_let in builtins.c
+static int compile_named_let(struct compiler *c, struct func *f, sobj *args,
+	const char *env) {
+
+	sobj *name = get_list_nth(args, 1);
+	sobj *bindings = get_list_nth(args, 2);
+	sobj *body = get_list_rest(get_list_rest(args));
+	if(!check_bindings(bindings, 2, 2) || body->type != OBJ_CONS)
+		return -1;
+
+	sobj *emptylist = fetch_singleton_object(SG_EMPTY_LIST);
+	sobj *vars = emptylist;
+	sobj **tail = &vars;
+	for(sobj *cur = bindings; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+		*tail = new_cons(get_list_head(get_list_head(cur)), emptylist);
+		tail = &(*tail)->val.cc.right;
+	}
+
+	const char *quoted = name_info(c, name->val.sym.str)->quoted;
+	char scope[16], frame[16];
+	snprintf(scope, sizeof(scope), "e%d", new_id(c));
+	snprintf(frame, sizeof(frame), "e%d", new_id(c));
+
+	// The loop procedure, for calls that aren't in tail position
+	line(f, "senv *%s = create_new_env(%s);", scope, env);
+	int fn = compile_lambda(c, f, vars, body, scope, NULL);
+	line(f, "t%d->val.lambda->name = %s;", fn, quoted);
+	line(f, "associate_symbol(%s, %s, t%d);", scope, quoted, fn);
+
+	line(f, "senv *%s = create_new_env(%s);", frame, scope);
+	compile_inits(c, f, bindings, env, frame);
+
+	struct loop loop = {
+		.name = name->val.sym.str,
+		.fn = fn,
+		.frame = frame,
+		.vars = vars,
+		.num_vars = get_list_len(vars),
+	};
+
+	int res = new_id(c);
+	line(f, "sobj *t%d = NULL;", res);
+	line(f, "for(;;) {");
+	f->indent++;
+	int val = compile_body(c, f, body, frame, &loop);
+	line(f, "t%d = t%d;", res, val);
+	line(f, "break;");
+	f->indent--;
+	line(f, "}");
+	check(f, res);
+	return res;
+}
+
+// let and let*. Named let is compiled into a loop.
+static int compile_let(struct compiler *c, struct func *f, sobj *args,
+	const char *env, bool is_star) {
+
+	if(!is_star && get_list_len(args) < 2)
+		return -1;
+	if(args->type != OBJ_CONS)
+		return -1;
+
+	if(!is_star && get_list_head(args)->type == OBJ_SYMBOL)
+		return compile_named_let(c, f, args, env);
+
+	sobj *bindings = get_list_head(args);
+	sobj *body = get_list_rest(args);
+	if(!check_bindings(bindings, 2, 2) || body->type != OBJ_CONS)
+		return -1;
+
+	char frame[16];
+	snprintf(frame, sizeof(frame), "e%d", new_id(c));
+	line(f, "senv *%s = create_new_env(%s);", frame, env);
+
+	// let* inits see the bindings before them
+	compile_inits(c, f, bindings, is_star ? frame : env, frame);
+	return compile_body(c, f, body, frame, NULL);
+}
+
+// (do ((var init step) ...) (test expr ...) command ...), see builtin_do
+static int compile_do(struct compiler *c, struct func *f, sobj *args,
+	const char *env) {
+
+	if(get_list_len(args) < 2)
+		return -1;
+
+	sobj *bindings = get_list_nth(args, 1);
+	sobj *exit_clause = get_list_nth(args, 2);
+	sobj *commands = get_list_rest(get_list_rest(args));
+	if(!check_bindings(bindings, 2, 3) || get_list_len(exit_clause) < 1)
+		return -1;
+
+	char frame[16];
+	snprintf(frame, sizeof(frame), "e%d", new_id(c));
+	line(f, "senv *%s = create_new_env(%s);", frame, env);
+	compile_inits(c, f, bindings, env, frame);
+
+	int res = new_id(c);
+	line(f, "sobj *t%d = NULL;", res);
+	line(f, "for(;;) {");
+	f->indent++;
+
+	int test = compile_expr(c, f, get_list_head(exit_clause), frame, NULL);
+	line(f, "if(!aot_is_false(t%d)) {", test);
+	f->indent++;
+	int val = compile_body(c, f, get_list_rest(exit_clause), frame, NULL);
+	line(f, "t%d = t%d;", res, val);
+	line(f, "break;");
+	f->indent--;
+	line(f, "}");
+
+	for(sobj *cur = commands; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+		if(!is_pure(c, get_list_head(cur)))
+			compile_expr(c, f, get_list_head(cur), frame, NULL);
+	}
+
+	// Steps are all evaluated before any variable is updated
+	int num_vars = get_list_len(bindings);
+	int steps[num_vars > 0 ? num_vars : 1];
+	int i = 0;
+	for(sobj *cur = bindings; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+		sobj *binding = get_list_head(cur);
+		steps[i++] = get_list_len(binding) == 3
+			? compile_expr(c, f, get_list_nth(binding, 3), frame, NULL) : -1;
+	}
+
+	i = 0;
+	for(sobj *cur = bindings; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+		sobj *name = get_list_head(get_list_head(cur));
+		if(steps[i] >= 0)
+			line(f, "rebind_symbol(%s, %s, t%d);", frame,
+				name_info(c, name->val.sym.str)->quoted, steps[i]);
+		i++;
+	}
+
+	f->indent--;
+	line(f, "}");
+	check(f, res);
+	return res;
+}
+
+// Compiles every argument, in order, into temps
+static void compile_args(struct compiler *c, struct func *f, sobj *args,
+	const char *env, int *temps) {
+
+	int i = 0;
+	for(; args->type == OBJ_CONS; args = get_list_rest(args))
+		temps[i++] = compile_expr(c, f, get_list_head(args), env, NULL);
+}
+
+// ", t1, t2" for the given temps
+static void append_temps(struct strbuf *buf, int *temps, int n) {
+	for(int i=0; i<n; i++)
+		appendf(buf, ", t%d", temps[i]);
+}
+
+static const char *arg_array(struct strbuf *buf, int *temps, int n) {
+	strbuf_reset(buf);
+	if(n == 0) {
+		appendf(buf, "NULL");
+	} else {
+		appendf(buf, "(sobj *[]){ t%d", temps[0]);
+		for(int i=1; i<n; i++)
+			appendf(buf, ", t%d", temps[i]);
+		appendf(buf, " }");
+	}
+	strbuf_putc(buf, '\0');
+	return buf->data;
+}
+
+// Entry point of a known global for direct calls. It binds the arguments
+// like apply_function, in a frame whose parent is the caller's environment.
+static void compile_entry(struct compiler *c, struct name_info *ni) {
+	struct strbuf sig = { NULL, 0, 0 };
+	appendf(&sig, "static sobj *enter_%d(senv *caller", ni->id);
+	for(int i=0; i<ni->arity; i++)
+		appendf(&sig, ", sobj *a%d", i);
+	appendf(&sig, ")");
+
+	appendf(&c->decls, "%.*s;\n", (int)sig.len, sig.data);
+	appendf(&c->funcs, "%.*s {\n\tsenv *env = create_new_env(caller);\n",
+		(int)sig.len, sig.data);
+	strbuf_free(&sig);
+
+	int i = 0;
+	for(sobj *cur = ni->params; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+		const char *name = get_list_head(cur)->val.sym.str;
+		appendf(&c->funcs, "\tassociate_symbol(env, %s, a%d);\n",
+			name_info(c, name)->quoted, i++);
+	}
+	appendf(&c->funcs, "\treturn lambda_%d(env);\n}\n\n", ni->id);
+}
+
+// Call of a global defined once as a lambda. Until its define has run, the
+// interpreter reports whatever the name is bound to.
+static int compile_direct_call(struct compiler *c, struct func *f, sobj *expr,
+	struct name_info *ni, const char *env) {
+
+	int site = new_site(c, expr);
+	int res = new_id(c);
+	int temps[ni->arity > 0 ? ni->arity : 1];
+	ni->called = true;
+
+	line(f, "sobj *t%d = NULL;", res);
+	line(f, "if(g_%d != NULL) {", ni->id);
+	f->indent++;
+	compile_args(c, f, get_list_rest(expr), env, temps);
+
+	struct strbuf call = { NULL, 0, 0 };
+	appendf(&call, "t%d = enter_%d(%s", res, ni->id, env);
+	append_temps(&call, temps, ni->arity);
+	appendf(&call, ");");
+	strbuf_putc(&call, '\0');
+	line(f, "%s", call.data);
+	strbuf_free(&call);
+
+	f->indent--;
+	line(f, "} else {");
+	line(f, "\tt%d = aot_eval(%s, &site_%d);", res, env, site);
+	line(f, "}");
+	check(f, res);
+	return res;
+}
+
+static const struct prim *find_prim(builtin_fn func, int num_args) {
+	for(size_t i=0; i<NUM_PRIMS; i++) {
+		if(prims[i].func == func && prims[i].num_args == num_args)
+			return &prims[i];
+	}
+	return NULL;
+}
+
+// Call of a builtin that the program never rebinds
+static int compile_builtin_call(struct compiler *c, struct func *f,
+	sobj *args, int num_args, struct name_info *ni, const char *env) {
+
+	int temps[num_args > 0 ? num_args : 1];
+	compile_args(c, f, args, env, temps);
+
+	int res = new_id(c);
+	struct strbuf buf = { NULL, 0, 0 };
+	const struct prim *prim = find_prim(ni->func, num_args);
+	if(prim != NULL) {
+		appendf(&buf, "sobj *t%d = %s(b_%d, %s", res, prim->helper, ni->id, env);
+		append_temps(&buf, temps, num_args);
+		appendf(&buf, ");");
+		strbuf_putc(&buf, '\0');
+		line(f, "%s", buf.data);
+	} else {
+		line(f, "sobj *t%d = aot_apply(b_%d, %s, %d, %s);", res, ni->id, env,
+			num_args, arg_array(&buf, temps, num_args));
+	}
+	strbuf_free(&buf);
+
+	check(f, res);
+	return res;
+}
+
+// Any other call: evaluate the operator, then the arguments unless it turns
+// out to be a macro
+static int compile_generic_call(struct compiler *c, struct func *f,
+	sobj *expr, int num_args, const char *env) {
+
+	int op = compile_expr(c, f, get_list_head(expr), env, NULL);
+	int site = new_site(c, expr);
+	int res = new_id(c);
+	int kind = new_id(c);
+
+	line(f, "sobj *t%d = NULL;", res);
+	line(f, "enum aot_callable m%d = aot_callable(t%d);", kind, op);
+	line(f, "if(m%d == AOT_NOT_CALLABLE) return NULL;", kind);
+	line(f, "if(m%d == AOT_MACRO) {", kind);
+	line(f, "\tt%d = aot_apply_macro(t%d, %s, &site_%d);", res, op, env, site);
+	line(f, "} else {");
+	f->indent++;
+
+	int temps[num_args > 0 ? num_args : 1];
+	compile_args(c, f, get_list_rest(expr), env, temps);
+
+	struct strbuf buf = { NULL, 0, 0 };
+	line(f, "t%d = aot_apply(t%d, %s, %d, %s);", res, op, env, num_args,
+		arg_array(&buf, temps, num_args));
+	strbuf_free(&buf);
+
+	f->indent--;
+	line(f, "}");
+	check(f, res);
+	return res;
+}
+
+static int compile_call(struct compiler *c, struct func *f, sobj *expr,
+	const char *env, struct loop *loop) {
+
+	sobj *head = get_list_head(expr);
+	sobj *args = get_list_rest(expr);
+	int num_args = get_list_len(args);
+	if(num_args == -1)
+		return compile_fallback(c, f, expr, env);
+
+	// Tail call of the named let, unless its name has been shadowed since.
+	// Otherwise it is an ordinary call, below.
+	if(loop != NULL && head->type == OBJ_SYMBOL
+		&& strcmp(head->val.sym.str, loop->name) == 0) {
+
+		line(f, "if(resolve_symbol(%s, %s, true) == t%d) {", env,
+			name_info(c, loop->name)->quoted, loop->fn);
+		f->indent++;
+
+		int temps[num_args > 0 ? num_args : 1];
+		if(num_args != loop->num_vars) {
+			// The arguments are still evaluated first, for their errors
+			for(sobj *cur = args; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+				if(!is_pure(c, get_list_head(cur)))
+					compile_expr(c, f, get_list_head(cur), env, NULL);
+			}
+			line(f, "return aot_arity_error(%d, %d);", loop->num_vars, num_args);
+		} else {
+			compile_args(c, f, args, env, temps);
+			int i = 0;
+			for(sobj *cur = loop->vars; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+				line(f, "rebind_symbol(%s, %s, t%d);", loop->frame,
+					name_info(c, get_list_head(cur)->val.sym.str)->quoted,
+					temps[i++]);
+			}
+			line(f, "continue;");
+		}
+
+		f->indent--;
+		line(f, "}");
+	}
+
+	if(head->type == OBJ_SYMBOL) {
+		struct name_info *ni = lookup_name(c, head->val.sym.str);
+		if(ni->kind == NAME_FUNCTION && ni->arity == num_args)
+			return compile_direct_call(c, f, expr, ni, env);
+		if(ni->kind == NAME_BUILTIN)
+			return compile_builtin_call(c, f, args, num_args, ni, env);
+	}
+
+	return compile_generic_call(c, f, expr, num_args, env);
+}
+
+static int compile_expr(struct compiler *c, struct func *f, sobj *expr,
+	const char *env, struct loop *loop) {
+
+	if(expr->type == OBJ_SYMBOL)
+		return compile_ref(c, f, expr, env);
+	if(expr->type != OBJ_CONS)
+		return compile_constant(c, f, expr);
+
+	sobj *args = get_list_rest(expr);
+	int len = get_list_len(args);
+	builtin_fn kw = keyword(c, get_list_head(expr));
+	int res = -1;
+
+	if(kw == NULL)
+		return compile_call(c, f, expr, env, loop);
+
+	if(kw == &builtin_quote && len == 1)
+		res = compile_constant(c, f, get_list_head(args));
+	else if(kw == &builtin_if && len == 3)
+		res = compile_if(c, f, args, env, loop);
+	else if(kw == &builtin_begin && len != -1)
+		res = compile_body(c, f, args, env, loop);
+	else if(kw == &builtin_define || kw == &builtin_set_bang)
+		res = compile_define(c, f, args, env);
+	else if(kw == &builtin_lambda && len >= 2 && is_params(get_list_head(args)))
+		res = compile_lambda(c, f, get_list_head(args), get_list_rest(args),
+			env, NULL);
+	else if(kw == &builtin_cond && check_clauses(args))
+		res = compile_clauses(c, f, args, env, loop);
+	else if(kw == &builtin_let || kw == &builtin_let_star)
+		res = compile_let(c, f, args, env, kw == &builtin_let_star);
+	else if(kw == &builtin_do)
+		res = compile_do(c, f, args, env);
+
+	// and, or, letrec, quasiquote and anything malformed
+	if(res == -1)
+		res = compile_fallback(c, f, expr, env);
+	return res;
+}
+
+// ============================== PROGRAM ====================================
+
+static sobj *read_program(struct interp *interp, const char *path) {
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL) {
+		SET_ERR("Cannot open file: %s", path);
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	char *buf = calloc(1, size + 1);
+	ensure_mem(buf);
+	size_t nread = fread(buf, 1, size, fp);
+	fclose(fp);
+
+	struct tok_lst *toks = tokenise_buffer(interp->lexer, buf, nread);
+	if(toks == NULL) {
+		free(buf);
+		SET_ERR("Failed to tokenise %s", path);
+		return NULL;
+	}
+
+	sobj *program = parse_tokens(interp, toks);
+	free_tok_lst(toks);
+	free(buf);
+	return program;
+}
+
+// Each file runs in its own function, which stops at the first form that
+// fails, like interp_eval_file
+static void compile_file(struct compiler *c, sobj *program, int index,
+	const char *path) {
+
+	struct func f = { { NULL, 0, 0 }, 0 };
+	line(&f, "// %s", path);
+	line(&f, "static sobj *file_%d(senv *env) {", index);
+	f.indent++;
+
+	int res = compile_body(c, &f, get_list_rest(program), "env", NULL);
+	line(&f, "return t%d;", res);
+	f.indent--;
+	line(&f, "}\n");
+
+	strbuf_append(&c->funcs, f.code.data, f.code.len);
+	strbuf_free(&f.code);
+}
+
+bool compile_to_c(struct interp *interp, const char **paths, int num_paths,
+	FILE *out) {
+
+	struct compiler c = { .interp = interp };
+	sobj *programs[num_paths > 0 ? num_paths : 1];
+
+	for(int i=0; i<num_paths; i++) {
+		programs[i] = read_program(interp, paths[i]);
+		if(programs[i] == NULL)
+			return false;
+	}
+
+	for(int i=0; i<num_paths; i++) {
+		for(sobj *cur = get_list_rest(programs[i]); cur->type == OBJ_CONS;
+			cur = get_list_rest(cur))
+			scan(&c, get_list_head(cur), true);
+	}
+
+	for(int i=0; i<num_paths; i++)
+		compile_file(&c, programs[i], i, paths[i]);
+
+	struct name_info *ni, *tmp;
+	HASH_ITER(hh, c.names, ni, tmp) {
+		if(ni->kind == NAME_FUNCTION && ni->called)
+			compile_entry(&c, ni);
+	}
+
+	fprintf(out, "// Generated by scheme --compile-to-c from");
+	for(int i=0; i<num_paths; i++)
+		fprintf(out, " %s", paths[i]);
+	fprintf(out, ". Do not edit.\n\n#include \"aot.h\"\n\n"
+		"typedef struct s_obj sobj;\ntypedef struct s_env senv;\n\n");
+
+	fwrite(c.decls.data, 1, c.decls.len, out);
+	fprintf(out, "\n");
+	fwrite(c.funcs.data, 1, c.funcs.len, out);
+
+	fprintf(out, "static void init_program(struct interp *interp) {\n");
+	fwrite(c.init.data, 1, c.init.len, out);
+	fprintf(out, "}\n\nstatic sobj *(*files[])(senv *) = {");
+	for(int i=0; i<num_paths; i++)
+		fprintf(out, "%s file_%d", i > 0 ? "," : "", i);
+	fprintf(out, " };\n\nint main() {\n"
+		"\treturn aot_main(&init_program, files, %d);\n}\n", num_paths);
+
+	strbuf_free(&c.decls);
+	strbuf_free(&c.init);
+	strbuf_free(&c.funcs);
+
+	HASH_ITER(hh, c.names, ni, tmp) {
+		HASH_DEL(c.names, ni);
+		free(ni->quoted);
+		free(ni);
+	}
+
+	return !ferror(out);
+}
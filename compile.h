@@ -0,0 +1,31 @@
+#ifndef __COMPILE_H__
+#define __COMPILE_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "interp.h"
+
+// Ahead-of-time compiler from Scheme to C, used by --compile-to-c. The files
+// are read with the interpreter's lexer and parser and translated into one C
+// file that links against libscheme.a (see aot.h) and runs them in order.
+//
+// Each lambda becomes a C function. Constants, variable references, quote,
+// if, begin, cond, define, set!, lambda, let, let*, named let, do and calls
+// are compiled; any other form is kept as text and handed to the interpreter
+// when it runs, so the compiled program behaves like the interpreted one.
+//
+// Scope is dynamic, so a global can only be bound to something known when
+// nothing in the whole program could shadow it. Names defined once at the
+// top level as a lambda, and never bound anywhere else, are called directly
+// through a C function. Builtins that the program never binds are looked up
+// once at startup, and car, cdr, null?, =, +, -, <, >, <= and >= get inline
+// fixnum fast paths. Code created at run time with eval is not analysed, so
+// it must not redefine any of those names.
+
+// Compiles the files in paths, in order, into a C program written to out.
+// Returns false and sets an error if a file can't be read or parsed.
+bool compile_to_c(struct interp *interp, const char **paths, int num_paths,
+    FILE *out);
+
+#endif
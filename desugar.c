@@ -0,0 +1,341 @@
+#include <string.h>
+
+#include "builtins.h"
+#include "common.h"
+#include "desugar.h"
+#include "environment.h"
+#include "hashcons.h"
+#include "internal_rep.h"
+#include "interp.h"
+
+typedef struct s_obj sobj;
+typedef struct s_env senv;
+typedef sobj *(*builtin_fn)(sobj *, senv *);
+
+// ============================= DESUGARING ==================================
+// Runs once over each top-level form after it is parsed, so that the
+// evaluator never has to re-analyze derived syntax:
+//   (cond (t e ...) ... (else e ...))  -> (if t (begin e ...) ...)
+//   (define (f . args) e ...)          -> (define f (lambda args (begin e ...)))
+//   (lambda args e1 e2 ...)            -> (lambda args (begin e1 e2 ...))
+// Special form names are looked up once here and replaced with their builtin
+// objects, which evaluate to themselves. Quasiquote templates are expanded
+// into list construction (see below). Keywords are resolved in the
+// environment the form is desugared in, so local shadowing of a special form
+// name is not seen. Quoted data is never rewritten, but with hash-consing
+// enabled it is replaced by its shared canonical copy.
+// ===========================================================================
+
+static sobj *emptylist() {
+	return fetch_singleton_object(SG_EMPTY_LIST);
+}
+
+static sobj *list3(sobj *a, sobj *b, sobj *c) {
+	return new_cons(a, new_cons(b, new_cons(c, emptylist())));
+}
+
+static sobj *list4(sobj *a, sobj *b, sobj *c, sobj *d) {
+	return new_cons(a, list3(b, c, d));
+}
+
+// Returns the special form that head refers to in env, or NULL if it isn't one
+static sobj *special_form(sobj *head, senv *env) {
+	sobj *bound = head;
+	if(head->type == OBJ_SYMBOL)
+		bound = resolve_symbol(env, head->val.sym.str, true);
+
+	if(bound == NULL || bound->type != OBJ_BUILTIN_FUNC
+		|| !bound->val.builtin.is_macro)
+		return NULL;
+
+	return bound;
+}
+
+// Returns the builtin bound to name in env if it is still func, else NULL
+static sobj *keyword(senv *env, const char *name, builtin_fn func) {
+	sobj *bound = resolve_symbol(env, name, true);
+	if(bound == NULL || bound->type != OBJ_BUILTIN_FUNC
+		|| bound->val.builtin.func != func)
+		return NULL;
+
+	return bound;
+}
+
+static bool is_form(sobj *form, builtin_fn func) {
+	return form != NULL && form->val.builtin.func == func;
+}
+
+// Desugars every element of a (possibly improper) list
+static sobj *desugar_list(sobj *lst, senv *env) {
+	if(lst->type != OBJ_CONS)
+		return desugar(lst, env);
+
+	sobj *head = desugar(get_list_head(lst), env);
+	return new_cons(head, desugar_list(get_list_rest(lst), env));
+}
+
+// Turns a body of one or more expressions into a single expression
+sobj *desugar_body(sobj *body, senv *env) {
+	sobj *exprs = desugar_list(body, env);
+	if(exprs->type == OBJ_CONS && get_list_rest(exprs)->type == OBJ_EMPTY_LIST)
+		return get_list_head(exprs);
+
+	sobj *begin_fn = keyword(env, "begin", &builtin_begin);
+	if(begin_fn == NULL)
+		begin_fn = fetch_or_create_symbol(env_interp(env), 
+			strlen("begin"), "begin");
+
+	return new_cons(begin_fn, exprs);
+}
+
+// Desugars the expressions in a list of (name expr ...) bindings, leaving the
+// names alone
+static sobj *desugar_bindings(sobj *bindings, senv *env) {
+	if(bindings->type != OBJ_CONS)
+		return bindings;
+
+	sobj *binding = get_list_head(bindings);
+	if(binding->type == OBJ_CONS) {
+		binding = new_cons(get_list_head(binding),
+			desugar_list(get_list_rest(binding), env));
+	}
+
+	return new_cons(binding, desugar_bindings(get_list_rest(bindings), env));
+}
+
+// Rewrites the clauses of a cond into nested ifs. Returns NULL if the clauses
+// can't be rewritten, in which case the cond is left to the runtime.
+static sobj *desugar_cond(sobj *clauses, senv *env, sobj *if_fn) {
+	if(clauses->type == OBJ_EMPTY_LIST)
+		return emptylist();
+
+	if(clauses->type != OBJ_CONS)
+		return NULL;
+
+	sobj *clause = get_list_head(clauses);
+	if(get_list_len(clause) < 2)
+		return NULL;
+
+	sobj *test = get_list_head(clause);
+	sobj *body = desugar_body(get_list_rest(clause), env);
+
+	if(test->type == OBJ_SYMBOL && strcmp(test->val.sym.str, "else") == 0)
+		return body;
+
+	sobj *rest = desugar_cond(get_list_rest(clauses), env, if_fn);
+	if(rest == NULL)
+		return NULL;
+
+	return list4(if_fn, desugar(test, env), body, rest);
+}
+
+// (define (f . args) body ...) or (define name expr)
+static sobj *desugar_define(sobj *form, sobj *args, senv *env) {
+	if(get_list_len(args) < 2)
+		return new_cons(form, args);
+
+	sobj *target = get_list_head(args);
+	sobj *body = get_list_rest(args);
+
+	if(target->type != OBJ_CONS) {
+		return new_cons(form, new_cons(target, desugar_list(body, env)));
+	}
+
+	sobj *lambda_fn = keyword(env, "lambda", &builtin_lambda);
+	if(lambda_fn == NULL || get_list_head(target)->type != OBJ_SYMBOL)
+		return new_cons(form, new_cons(target, desugar_list(body, env)));
+
+	sobj *lambda = list3(lambda_fn, get_list_rest(target),
+		desugar_body(body, env));
+	return list3(form, get_list_head(target), lambda);
+}
+
+// (let [name] bindings body ...), let*, letrec
+static sobj *desugar_let(sobj *form, sobj *args, senv *env) {
+	if(args->type != OBJ_CONS)
+		return new_cons(form, args);
+
+	sobj *first = get_list_head(args);
+	sobj *rest = get_list_rest(args);
+
+	// Named let
+	if(first->type == OBJ_SYMBOL && rest->type == OBJ_CONS) {
+		sobj *bindings = desugar_bindings(get_list_head(rest), env);
+		sobj *body = desugar_list(get_list_rest(rest), env);
+		return new_cons(form, new_cons(first, new_cons(bindings, body)));
+	}
+
+	sobj *bindings = desugar_bindings(first, env);
+	return new_cons(form, new_cons(bindings, desugar_list(rest, env)));
+}
+
+// (do ((var init step) ...) (test expr ...) command ...)
+static sobj *desugar_do(sobj *form, sobj *args, senv *env) {
+	if(args->type != OBJ_CONS)
+		return new_cons(form, args);
+
+	sobj *bindings = desugar_bindings(get_list_head(args), env);
+	sobj *rest = desugar_list(get_list_rest(args), env);
+	return new_cons(form, new_cons(bindings, rest));
+}
+
+// ============================ QUASIQUOTE ====================================
+// A template is expanded into calls to the cons and append builtins. Every
+// sub-template that contains no unquote at the current nesting depth is
+// emitted as a quoted constant, so it is built once by the parser and shared
+// by every evaluation instead of being reallocated.
+// ===========================================================================
+
+struct qq_forms {
+	struct interp *interp;
+	sobj *quote_fn;
+	sobj *cons_fn;
+	sobj *append_fn;
+};
+
+// Checks if obj is (name x)
+static bool is_tagged(sobj *obj, const char *name) {
+	if(obj->type != OBJ_CONS || get_list_len(obj) != 2)
+		return false;
+
+	sobj *head = get_list_head(obj);
+	return head->type == OBJ_SYMBOL && strcmp(head->val.sym.str, name) == 0;
+}
+
+static bool is_unquote_splice(sobj *obj) {
+	// The parser produces unquote-splice for ,@ but accept the R5RS name too
+	return is_tagged(obj, "unquote-splice") || is_tagged(obj, "unquote-splicing");
+}
+
+static sobj *qq_constant(sobj *obj, struct qq_forms *forms) {
+	if(forms->interp->hash_cons)
+		obj = share_constant(forms->interp, obj);
+
+	switch(obj->type) {
+	case OBJ_NUMBER:
+	case OBJ_STRING:
+	case OBJ_BOOLEAN:
+	case OBJ_EMPTY_LIST:
+		return obj;
+	default:
+		return new_cons(forms->quote_fn, new_cons(obj, emptylist()));
+	}
+}
+
+// Returns an expression that builds tmpl, or NULL if tmpl is constant
+static sobj *qq_expand(sobj *tmpl, int depth, senv *env, 
+	struct qq_forms *forms) {
+
+	if(tmpl->type != OBJ_CONS)
+		return NULL;
+
+	// An unquote-splice outside of a list is treated as a plain unquote
+	bool is_unquote = is_tagged(tmpl, "unquote") || is_unquote_splice(tmpl);
+	bool is_nested = is_tagged(tmpl, "quasiquote");
+
+	if(is_unquote && depth == 1)
+		return desugar(get_list_nth(tmpl, 2), env);
+
+	// Nested quasiquotes keep their structure, only the depth changes
+	if(is_unquote || is_nested) {
+		sobj *arg = get_list_nth(tmpl, 2);
+		sobj *inner = qq_expand(arg, is_nested ? depth+1 : depth-1, env, forms);
+		if(inner == NULL)
+			return NULL;
+
+		sobj *rest = list3(forms->cons_fn, inner, emptylist());
+		return list3(forms->cons_fn, 
+			qq_constant(get_list_head(tmpl), forms), rest);
+	}
+
+	sobj *head = get_list_head(tmpl);
+	sobj *tail = get_list_rest(tmpl);
+	sobj *tail_exp = qq_expand(tail, depth, env, forms);
+
+	if(is_unquote_splice(head) && depth == 1) {
+		sobj *spliced = desugar(get_list_nth(head, 2), env);
+		if(tail->type == OBJ_EMPTY_LIST)
+			return spliced;
+
+		if(tail_exp == NULL)
+			tail_exp = qq_constant(tail, forms);
+		return list3(forms->append_fn, spliced, tail_exp);
+	}
+
+	sobj *head_exp = qq_expand(head, depth, env, forms);
+	if(head_exp == NULL && tail_exp == NULL)
+		return NULL;
+
+	if(head_exp == NULL) head_exp = qq_constant(head, forms);
+	if(tail_exp == NULL) tail_exp = qq_constant(tail, forms);
+	return list3(forms->cons_fn, head_exp, tail_exp);
+}
+
+sobj *expand_quasiquote(sobj *tmpl, senv *env) {
+	// Use the builtins directly so the expansion doesn't depend on what the
+	// program has bound cons or append to
+	struct qq_forms forms = {
+		.interp = env_interp(env),
+		.quote_fn = new_builtin(true, 1, &builtin_quote),
+		.cons_fn = new_builtin(false, 2, &builtin_cons),
+		.append_fn = new_builtin(false, -1, &builtin_append),
+	};
+
+	sobj *res = qq_expand(tmpl, 1, env, &forms);
+	if(res == NULL)
+		return qq_constant(tmpl, &forms);
+
+	return res;
+}
+
+sobj *desugar(sobj *obj, senv *env) {
+	if(obj->type != OBJ_CONS)
+		return obj;
+
+	sobj *head = get_list_head(obj);
+	sobj *args = get_list_rest(obj);
+	sobj *form = special_form(head, env);
+
+	// Ordinary application
+	if(form == NULL)
+		return desugar_list(obj, env);
+
+	if(is_form(form, &builtin_quote)) {
+		struct interp *interp = env_interp(env);
+		if(interp->hash_cons && get_list_len(args) == 1) {
+			sobj *shared = share_constant(interp, get_list_head(args));
+			args = new_cons(shared, emptylist());
+		}
+		return new_cons(form, args);
+	}
+
+	if(is_form(form, &builtin_quasiquote) && get_list_len(args) == 1)
+		return expand_quasiquote(get_list_head(args), env);
+
+	if(is_form(form, &builtin_cond)) {
+		sobj *if_fn = keyword(env, "if", &builtin_if);
+		sobj *res = if_fn == NULL ? NULL : desugar_cond(args, env, if_fn);
+		if(res != NULL)
+			return res;
+
+		return new_cons(form, desugar_list(args, env));
+	}
+
+	if(is_form(form, &builtin_define) || is_form(form, &builtin_set_bang))
+		return desugar_define(form, args, env);
+
+	if(is_form(form, &builtin_lambda) && get_list_len(args) >= 2) {
+		return list3(form, get_list_head(args),
+			desugar_body(get_list_rest(args), env));
+	}
+
+	if(is_form(form, &builtin_let) || is_form(form, &builtin_let_star)
+		|| is_form(form, &builtin_letrec))
+		return desugar_let(form, args, env);
+
+	if(is_form(form, &builtin_do))
+		return desugar_do(form, args, env);
+
+	// Any other special form, e.g. if, and, or, begin
+	return new_cons(form, desugar_list(args, env));
+}
@@ -0,0 +1,22 @@
+#ifndef __DESUGAR_H__
+#define __DESUGAR_H__
+
+#include "internal_rep.h"
+#include "environment.h"
+
+// Rewrites derived syntax in obj into the core forms, once, before it is
+// evaluated. Special form names are resolved in env at this point and
+// replaced with the builtins themselves. Returns the rewritten object; the
+// original is not modified.
+struct s_obj *desugar(struct s_obj *obj, struct s_env *env);
+
+// Desugars the body of a lambda, a list of expressions, into one expression,
+// wrapping them in begin if there are several
+struct s_obj *desugar_body(struct s_obj *body, struct s_env *env);
+
+// Expands the template of a quasiquote into an expression that builds it with
+// cons and append. Parts of the template without unquotes are quoted, so
+// that constant sub-structure is shared by every evaluation.
+struct s_obj *expand_quasiquote(struct s_obj *tmpl, struct s_env *env);
+
+#endif
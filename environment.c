@@ -1,12 +1,24 @@
 #include <assert.h>
+#include <pthread.h>
 
+#include "analyse.h"
 #include "common.h"
 #include "environment.h"
+#include "interp.h"
+#include "preparse.h"
+#include "stats.h"
 #include "uthash.h"
 
 struct s_env {
 	struct s_env *parent;
 	struct s_env_kp *map;
+	// Every environment points to its interpreter so that the context is
+	// available wherever an env is
+	struct interp *interp;
+	// Set by share_env once another thread can see the environment, after
+	// which map is only read and changed under it. Environments that stay
+	// on one thread never take a lock.
+	pthread_rwlock_t *lock;
 };
 
 struct s_env_kp {
@@ -16,25 +28,23 @@ struct s_env_kp {
 	UT_hash_handle hh;
 };
 
-bool root_env_initialised = false;
-struct s_env *root_env = NULL;
-
-void init_root() {
-	root_env = malloc(sizeof(struct s_env));
+struct s_env *create_root_env(struct interp *interp) {
+	struct s_env *root_env = malloc(sizeof(struct s_env));
 	ensure_mem(root_env);
+	STAT_ADD(STAT_ENVS_CREATED, 1);
+	STAT_ADD(STAT_BYTES_ALLOCATED, sizeof(struct s_env));
 
 	root_env->parent = NULL;
 	// Must start off as null according to docs
 	root_env->map = NULL;
+	root_env->interp = interp;
+	root_env->lock = NULL;
 
-	root_env_initialised = true;
+	return root_env;
 }
 
-struct s_env *get_root_env() {
-	if(!root_env_initialised)
-		init_root();
-
-	return root_env;
+struct interp *env_interp(struct s_env *env) {
+	return env->interp;
 }
 
 struct s_env *get_parent_env(struct s_env *env) {
@@ -42,43 +52,76 @@ struct s_env *get_parent_env(struct s_env *env) {
 	return env->parent;
 }
 
-bool has_symbol(struct s_env *env, const char *sym, bool traverse) {
-	assert(sym != NULL);
+static pthread_rwlock_t *read_lock(struct s_env *env) {
+	pthread_rwlock_t *lock = __atomic_load_n(&env->lock, __ATOMIC_ACQUIRE);
+	if(lock != NULL)
+		pthread_rwlock_rdlock(lock);
+	return lock;
+}
 
-	// Not in root env
-	if(env == NULL) return false;
+static pthread_rwlock_t *write_lock(struct s_env *env) {
+	pthread_rwlock_t *lock = __atomic_load_n(&env->lock, __ATOMIC_ACQUIRE);
+	if(lock != NULL)
+		pthread_rwlock_wrlock(lock);
+	return lock;
+}
 
-	struct s_env_kp *kp;
-	HASH_FIND_STR(env->map, sym, kp);
+static void unlock(pthread_rwlock_t *lock) {
+	if(lock != NULL)
+		pthread_rwlock_unlock(lock);
+}
 
-	// If we find it, we're done
-	if(kp != NULL) return true;
+// Walks up from env to the first environment that binds sym, or stops at env
+// itself unless traverse is set. The value is read under the environment's
+// lock, since the binding may be replaced and freed as soon as it is dropped.
+static bool find_value(struct s_env *env, const char *sym, bool traverse,
+	struct s_obj **val) {
 
-	// We didn't find it here, if not looking in parent we're also done
-	if(!traverse) return false;
+	assert(sym != NULL);
 
-	return has_symbol(env->parent, sym, true);
+	int depth = 0;
+	struct s_env_kp *kp = NULL;
+	for(; env != NULL; env = env->parent) {
+		depth++;
+		pthread_rwlock_t *lock = read_lock(env);
+		HASH_FIND_STR(env->map, sym, kp);
+		if(kp != NULL)
+			*val = kp->value;
+		unlock(lock);
+
+		if(kp != NULL || !traverse)
+			break;
+	}
+
+	STAT_ADD(STAT_SYMBOL_LOOKUPS, 1);
+	STAT_ADD(STAT_LOOKUP_DEPTH, depth);
+	return kp != NULL;
 }
 
-struct s_obj *resolve_symbol(struct s_env *env, const char *sym, bool traverse) {
-	assert(sym != NULL);
+bool has_symbol(struct s_env *env, const char *sym, bool traverse) {
+	struct s_obj *val;
+	return find_value(env, sym, traverse, &val);
+}
 
-	// Not in root env
-	if(env == NULL) return NULL;
+struct s_obj *resolve_symbol(struct s_env *env, const char *sym, bool traverse) {
+	struct s_obj *val = NULL;
+	find_value(env, sym, traverse, &val);
+	return val;
+}
 
-	struct s_env_kp *kp = NULL;
-	HASH_FIND_STR(env->map, sym, kp);
+// Rebinding a macro in the root may load lazy bodies, which resolves
+// symbols, so it is noted before taking the lock
+static void note_rebinding(struct s_env *env, const char *sym,
+	struct s_obj *obj) {
 
-	if(kp != NULL) return kp->value;
-	if(!traverse) return NULL;
-	return resolve_symbol(env->parent, sym, true);
+	if(env->parent == NULL && env->interp->pending_bodies != NULL)
+		note_root_rebinding(env->interp, resolve_symbol(env, sym, false), obj);
 }
 
 void associate_symbol(struct s_env *env, const char *sym, struct s_obj *obj) {
 	assert(env != NULL && sym != NULL);
 
-	if(has_symbol(env, sym, false))
-		remove_symbol(env, sym);
+	note_rebinding(env, sym, obj);
 
 	struct s_env_kp *kp = malloc(sizeof(struct s_env_kp));
 	ensure_mem(kp);
@@ -86,19 +129,47 @@ void associate_symbol(struct s_env *env, const char *sym, struct s_obj *obj) {
 	kp->name = strdup(sym);
 	kp->value = obj;
 
+	pthread_rwlock_t *lock = write_lock(env);
+	struct s_env_kp *old = NULL;
+	HASH_FIND_STR(env->map, sym, old);
+	if(old != NULL)
+		HASH_DEL(env->map, old);
 	HASH_ADD_KEYPTR(hh, env->map, kp->name, strlen(sym), kp);
+	note_binding(env, sym, kp->hh.hashv, obj);
+	STAT_HASH_INSERT(kp->hh);
+	unlock(lock);
+
+	free(old);
+	STAT_ADD(STAT_BYTES_ALLOCATED, sizeof(struct s_env_kp) + strlen(sym) + 1);
 }
 
-void remove_symbol(struct s_env *env, const char *sym) {
+bool rebind_symbol(struct s_env *env, const char *sym, struct s_obj *obj) {
 	assert(env != NULL && sym != NULL);
 
+	note_rebinding(env, sym, obj);
+
+	pthread_rwlock_t *lock = write_lock(env);
 	struct s_env_kp *kp = NULL;
 	HASH_FIND_STR(env->map, sym, kp);
+	if(kp != NULL) {
+		note_binding(env, sym, kp->hh.hashv, obj);
+		kp->value = obj;
+	}
+	unlock(lock);
 
-	if(kp == NULL)
-		return;
+	return kp != NULL;
+}
+
+void remove_symbol(struct s_env *env, const char *sym) {
+	assert(env != NULL && sym != NULL);
+
+	pthread_rwlock_t *lock = write_lock(env);
+	struct s_env_kp *kp = NULL;
+	HASH_FIND_STR(env->map, sym, kp);
+	if(kp != NULL)
+		HASH_DEL(env->map, kp);
+	unlock(lock);
 
-	HASH_DEL(env->map, kp);
 	free(kp);
 }
 
@@ -106,7 +177,32 @@ struct s_env *create_new_env(struct s_env *parent) {
 	assert(parent != NULL);
 
 	struct s_env *env = malloc(sizeof(struct s_env));
+	ensure_mem(env);
+	STAT_ADD(STAT_ENVS_CREATED, 1);
+	STAT_ADD(STAT_BYTES_ALLOCATED, sizeof(struct s_env));
 	env->parent = parent;
 	env->map = NULL;
+	env->interp = parent->interp;
+	env->lock = NULL;
 	return env;
 }
+
+// Gives env a lock, after its ancestors so that an environment with a lock
+// always has locked ancestors
+void share_env(struct s_env *env) {
+	if(env == NULL || __atomic_load_n(&env->lock, __ATOMIC_ACQUIRE) != NULL)
+		return;
+	share_env(env->parent);
+
+	pthread_rwlock_t *lock = malloc(sizeof(pthread_rwlock_t));
+	ensure_mem(lock);
+	pthread_rwlock_init(lock, NULL);
+
+	pthread_rwlock_t *expected = NULL;
+	if(!__atomic_compare_exchange_n(&env->lock, &expected, lock, false,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		// Another thread shared it first
+		pthread_rwlock_destroy(lock);
+		free(lock);
+	}
+}
@@ -6,6 +6,7 @@
 #include "internal_rep.h"
 
 struct s_env;
+struct interp;
 
 // Get the parent envionment
 struct s_env *get_parent_env(struct s_env *env);
@@ -22,13 +23,25 @@ struct s_obj *resolve_symbol(struct s_env *env,
 void associate_symbol(struct s_env *env, 
     const char *sym, struct s_obj *obj);
 
+// Update an existing binding in env (no traversal) in place, without
+// reallocating the entry. Returns false if sym is not bound in env.
+bool rebind_symbol(struct s_env *env, const char *sym, struct s_obj *obj);
+
 // Remove symbol from environment. Returns previous association if any.
 void remove_symbol(struct s_env *env, const char *sym);
 
 // Creates a new environment
 struct s_env *create_new_env(struct s_env *parent);
 
-// Get the root environment with all default symbols
-struct s_env *get_root_env();
+// Makes env and its ancestors safe to use from several threads, for when a
+// future is to be evaluated in env. Lookups and changes in them take a lock
+// from then on.
+void share_env(struct s_env *env);
+
+// Creates the root environment of an interpreter
+struct s_env *create_root_env(struct interp *interp);
+
+// Get the interpreter an environment belongs to
+struct interp *env_interp(struct s_env *env);
 
 #endif
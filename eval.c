@@ -4,11 +4,40 @@
 #include <stdlib.h>
 #include <stdarg.h>
 
+#include "analyse.h"
 #include "common.h"
+#include "desugar.h"
 #include "environment.h"
 #include "eval.h"
 #include "internal_rep.h"
+#include "interp.h"
+#include "jit.h"
 #include "parser.h"
+#include "preparse.h"
+#include "profiler.h"
+#include "stats.h"
+
+// Native code for lambda, compiling it if this call makes it hot. Every
+// thread counts, but only the one that reaches the threshold compiles.
+static jit_fn native_code(struct s_lambda *lambda, struct s_env *env) {
+	jit_fn native = __atomic_load_n(&lambda->native, __ATOMIC_ACQUIRE);
+	if(native != NULL)
+		return native;
+
+	// The JIT compiles from the source body, so its code would lose the
+	// inlining and folding of the analysed body, which runs faster. Only
+	// bodies that aren't analysed are compiled.
+	struct interp *interp = env_interp(env);
+	if(interp->jit_threshold <= 0 || (interp->analyse && !interp->verbose))
+		return NULL;
+
+	unsigned calls = __atomic_add_fetch(&lambda->calls, 1, __ATOMIC_RELAXED);
+	if(calls != (unsigned)interp->jit_threshold)
+		return NULL;
+
+	jit_compile(interp, lambda);
+	return __atomic_load_n(&lambda->native, __ATOMIC_ACQUIRE);
+}
 
 struct s_obj *apply_function(struct s_obj *obj, 
 	struct s_obj *arglist, struct s_env *env) {
@@ -17,6 +46,12 @@ struct s_obj *apply_function(struct s_obj *obj,
 	// Pass up the error
 	if(args_passed_in == -1) return NULL;
 
+	return apply_function_n(obj, arglist, args_passed_in, env);
+}
+
+struct s_obj *apply_function_n(struct s_obj *obj, struct s_obj *arglist,
+	int args_passed_in, struct s_env *env) {
+
 	// Check for arity and type
 	int expected_args = 0;
 	if(obj->type == OBJ_BUILTIN_FUNC) {
@@ -41,6 +76,11 @@ struct s_obj *apply_function(struct s_obj *obj,
 
 	// Lambdas neet to bind vars to now lexical scope before eval
 	struct s_lambda *lambda = obj->val.lambda;
+	if(lambda->lazy != NULL && lambda_body(lambda) == NULL)
+		return NULL;
+
+	jit_fn native = native_code(lambda, env);
+	bool profiled = profiling;
 	struct s_env *local_scope = create_new_env(env);
 	struct s_obj *cur = arglist;
 
@@ -55,7 +95,22 @@ struct s_obj *apply_function(struct s_obj *obj,
 		}
 	}
 
-	return eval(lambda->body, local_scope, true);
+	if(profiled)
+		shadow_push(lambda);
+
+	struct s_obj *res = NULL;
+	struct node *analysed = NULL;
+	if(native != NULL)
+		res = native(local_scope);
+	else if((analysed = analysed_body(lambda, env)) != NULL)
+		res = run_node(analysed, local_scope);
+	else
+		res = eval(lambda->body, local_scope, true);
+
+	if(profiled)
+		shadow_pop();
+
+	return res;
 }
 
 // Evaluate the given obj in the specified environment. The parameter
@@ -63,10 +118,10 @@ struct s_obj *apply_function(struct s_obj *obj,
 // if the cons cell is the beginning of the list and thus the left element
 // should be evaluated and applied to the right element. A return value of
 // NULL means that evaluation failed for some reason, retrieve the reason
-// from get_fail_reason()
+// from get_err_reason()
 struct s_obj *eval(struct s_obj *obj, struct s_env *env, bool is_start) {
 
-	if(is_start && get_verbose()) {
+	if(is_start && env_interp(env)->verbose) {
 		printf("Evaluating: ");
 		print_obj_user(obj);
 	}
@@ -75,10 +130,13 @@ struct s_obj *eval(struct s_obj *obj, struct s_env *env, bool is_start) {
 	// Put empty list here because when we eval cons cells recursively
 	// this is how we know we're at the end
 	// Not sure to do with lambda, so gonna put it here for now
+	// Builtins appear in code after desugaring replaces special form names
 	if(obj->type == OBJ_NUMBER 
 		|| obj->type == OBJ_STRING 
 		|| obj->type == OBJ_BOOLEAN 
 		|| obj->type == OBJ_LAMBDA
+		|| obj->type == OBJ_BUILTIN_FUNC
+		|| obj->type == OBJ_FUTURE
 		|| obj->type == OBJ_EMPTY_LIST) {
 		return obj;
 	}
@@ -86,7 +144,7 @@ struct s_obj *eval(struct s_obj *obj, struct s_env *env, bool is_start) {
 	// Lookup symbol in the symbol table
 	if(obj->type == OBJ_SYMBOL) {
 		if(!has_symbol(env, obj->val.sym.str, true)) {
-			log_err("Unbound symbol: %s", obj->val.sym.str);
+			SET_ERR("Unbound symbol: %s", obj->val.sym.str);
 			return NULL;
 		}
 
@@ -117,8 +175,9 @@ struct s_obj *eval(struct s_obj *obj, struct s_env *env, bool is_start) {
 	// Is start of list, so apply LHS to RHS
 	// Make sure LHS is a function
 	if(newleft->type != OBJ_LAMBDA && newleft->type != OBJ_BUILTIN_FUNC) {
-		log_err("Trying to treat non-function object as function:");
-		print_obj_user(newleft);
+		char rep[128];
+		SET_ERR("Trying to treat non-function object as function: %s",
+			get_string_rep(newleft, rep, sizeof(rep)));
 		return NULL;
 	}
 
@@ -144,4 +203,23 @@ struct s_obj *eval(struct s_obj *obj, struct s_env *env, bool is_start) {
 
 	// Finally actually do the evaluation
 	return apply_function(newleft, newright, env);
-}
\ No newline at end of file
+}
+
+// Evaluates a parsed program, i.e. the (begin form ...) list built by
+// parse_tokens. Each top-level form is desugared right before it is evaluated,
+// so that it sees the definitions made by the forms before it. Returns the
+// value of the last form, or NULL as soon as one fails.
+struct s_obj *eval_toplevel(struct s_obj *program, struct s_env *env) {
+	uint64_t start = stat_now_ns();
+	struct s_obj *res = fetch_singleton_object(SG_EMPTY_LIST);
+	struct s_obj *cur = get_list_rest(program);
+
+	for(; cur->type == OBJ_CONS; cur = get_list_rest(cur)) {
+		struct s_obj *form = desugar(get_list_head(cur), env);
+		res = eval(form, env, true);
+		if(res == NULL) break;
+	}
+
+	STAT_ADD(STAT_EVAL_NS, stat_now_ns() - start);
+	return res;
+}
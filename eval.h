@@ -9,6 +9,13 @@
 struct s_obj *apply_function(struct s_obj *obj, 
     struct s_obj *arglist, struct s_env *env);
 
+// apply_function for an arglist already known to be a proper list of
+// num_args elements
+struct s_obj *apply_function_n(struct s_obj *obj, struct s_obj *arglist,
+    int num_args, struct s_env *env);
+
 struct s_obj *eval(struct s_obj *obj, struct s_env *env, bool is_start);
 
+struct s_obj *eval_toplevel(struct s_obj *program, struct s_env *env);
+
 #endif
\ No newline at end of file
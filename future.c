@@ -0,0 +1,341 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "eval.h"
+#include "interp.h"
+#include "future.h"
+#include "stats.h"
+
+// ============================ CHASE-LEV DEQUE ==============================
+// Work-stealing deque from "Correct and Efficient Work-Stealing for Weak
+// Memory Models" (Le et al., PPoPP 2013). The owner pushes and takes at the
+// bottom without locking; thieves take from the top with a CAS. The buffer
+// grows when full, and old buffers are never freed since a thief may still
+// be reading one.
+// ===========================================================================
+
+struct deque_buffer {
+	long capacity;
+	struct s_future *slots[];
+};
+
+struct deque {
+	long top;
+	long bottom;
+	struct deque_buffer *buffer;
+};
+
+static struct deque_buffer *new_deque_buffer(long capacity) {
+	struct deque_buffer *buf = malloc(sizeof(struct deque_buffer)
+		+ capacity * sizeof(struct s_future *));
+	ensure_mem(buf);
+	buf->capacity = capacity;
+	return buf;
+}
+
+static struct s_future *buffer_get(struct deque_buffer *buf, long i) {
+	return __atomic_load_n(&buf->slots[i % buf->capacity], __ATOMIC_RELAXED);
+}
+
+static void buffer_put(struct deque_buffer *buf, long i, struct s_future *f) {
+	__atomic_store_n(&buf->slots[i % buf->capacity], f, __ATOMIC_RELAXED);
+}
+
+static void deque_init(struct deque *dq) {
+	dq->top = 0;
+	dq->bottom = 0;
+	dq->buffer = new_deque_buffer(64);
+}
+
+static void deque_push(struct deque *dq, struct s_future *fut) {
+	long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+	struct deque_buffer *buf = __atomic_load_n(&dq->buffer, __ATOMIC_RELAXED);
+
+	if(b - t > buf->capacity - 1) {
+		struct deque_buffer *bigger = new_deque_buffer(buf->capacity * 2);
+		for(long i=t; i<b; i++)
+			buffer_put(bigger, i, buffer_get(buf, i));
+		__atomic_store_n(&dq->buffer, bigger, __ATOMIC_RELEASE);
+		buf = bigger;
+	}
+
+	// The paper uses a release fence and a relaxed store here; a release
+	// store is equivalent and is understood by ThreadSanitizer
+	buffer_put(buf, b, fut);
+	__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+// Owner only. Returns NULL if the deque is empty
+static struct s_future *deque_take(struct deque *dq) {
+	long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+	struct deque_buffer *buf = __atomic_load_n(&dq->buffer, __ATOMIC_RELAXED);
+	__atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+	if(t > b) {
+		__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	struct s_future *fut = buffer_get(buf, b);
+	if(t == b) {
+		// Last element, race the thieves for it
+		if(!__atomic_compare_exchange_n(&dq->top, &t, t + 1, false,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			fut = NULL;
+		}
+		__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+
+	return fut;
+}
+
+// Any thread. Returns NULL if the deque is empty or another thief won
+static struct s_future *deque_steal(struct deque *dq) {
+	long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+
+	if(t >= b)
+		return NULL;
+
+	struct deque_buffer *buf = __atomic_load_n(&dq->buffer, __ATOMIC_ACQUIRE);
+	struct s_future *fut = buffer_get(buf, t);
+	if(!__atomic_compare_exchange_n(&dq->top, &t, t + 1, false,
+		__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+
+	return fut;
+}
+
+// =============================== SCHEDULER =================================
+// Deque 0 belongs to the first thread besides the workers to use the
+// scheduler, normally the one using the interpreter, and the rest to the
+// workers. Other threads, such as the pool's or an embedder's, own no deque:
+// they run the futures they spawn straight away and only steal while they
+// wait on one. Idle workers sleep on a condition variable when no deque has
+// anything queued, so they don't take CPU time from the interpreter thread.
+// ===========================================================================
+
+struct worker {
+	struct scheduler *sched;
+	struct deque deque;
+	int index;
+};
+
+struct scheduler {
+	struct interp *interp;
+	int num_deques;
+	struct worker *workers;
+
+	// Futures pushed but not yet taken off a deque
+	long queued;
+
+	// Set once deque 0 has been claimed, see get_worker
+	int owned;
+
+	// Idle workers wait on work_ready
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	int sleepers;
+};
+
+// Worker the current thread runs as, or NULL on threads that aren't workers
+static __thread struct worker *current_worker = NULL;
+
+// Scheduler whose deque 0 the current thread owns
+static __thread struct scheduler *owned_sched = NULL;
+
+// The worker whose deque the calling thread may push to and take from, or
+// NULL if it owns none. The first other thread to get here claims deque 0.
+static struct worker *get_worker(struct scheduler *sched) {
+	if(current_worker != NULL && current_worker->sched == sched)
+		return current_worker;
+	if(owned_sched == sched)
+		return &sched->workers[0];
+
+	int expected = 0;
+	if(__atomic_compare_exchange_n(&sched->owned, &expected, 1, false,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		owned_sched = sched;
+		return &sched->workers[0];
+	}
+
+	return NULL;
+}
+
+static void run_future(struct s_future *fut) {
+	int expected = FUTURE_PENDING;
+	if(!__atomic_compare_exchange_n(&fut->state, &expected, FUTURE_RUNNING,
+		false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		// Already claimed, e.g. by touch_future
+		return;
+	}
+
+	clear_err_reason(false);
+	fut->result = eval(fut->expr, fut->env, true);
+	if(fut->result == NULL)
+		fut->reason = strdup(get_err_reason());
+
+	__atomic_store_n(&fut->state, FUTURE_DONE, __ATOMIC_RELEASE);
+}
+
+// Takes a future from self's deque, or steals one from another deque. With
+// no self, only steals.
+static struct s_future *find_work(struct scheduler *sched,
+	struct worker *self) {
+
+	struct s_future *fut = NULL;
+	int start = 0;
+	if(self != NULL) {
+		fut = deque_take(&self->deque);
+		start = self->index + 1;
+	}
+
+	for(int i=0; fut == NULL && i<sched->num_deques; i++) {
+		int victim = (start + i) % sched->num_deques;
+		if(self == NULL || victim != self->index)
+			fut = deque_steal(&sched->workers[victim].deque);
+	}
+
+	if(fut != NULL)
+		__atomic_fetch_sub(&sched->queued, 1, __ATOMIC_SEQ_CST);
+	return fut;
+}
+
+static void *worker_main(void *arg) {
+	struct worker *self = arg;
+	struct scheduler *sched = self->sched;
+	current_worker = self;
+
+	while(true) {
+		struct s_future *fut = find_work(sched, self);
+		if(fut != NULL) {
+			run_future(fut);
+			continue;
+		}
+
+		pthread_mutex_lock(&sched->lock);
+		__atomic_fetch_add(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+		while(__atomic_load_n(&sched->queued, __ATOMIC_SEQ_CST) == 0)
+			pthread_cond_wait(&sched->work_ready, &sched->lock);
+		__atomic_fetch_sub(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&sched->lock);
+	}
+
+	return NULL;
+}
+
+struct scheduler *create_scheduler(struct interp *interp, int num_workers) {
+	struct scheduler *sched = calloc(1, sizeof(struct scheduler));
+	ensure_mem(sched);
+
+	sched->interp = interp;
+	sched->num_deques = num_workers + 1;
+	sched->workers = calloc(sched->num_deques, sizeof(struct worker));
+	ensure_mem(sched->workers);
+	pthread_mutex_init(&sched->lock, NULL);
+	pthread_cond_init(&sched->work_ready, NULL);
+
+	for(int i=0; i<sched->num_deques; i++) {
+		sched->workers[i].sched = sched;
+		sched->workers[i].index = i;
+		deque_init(&sched->workers[i].deque);
+	}
+
+	// Futures nest as deep as the computation that creates them, and eval
+	// recurses, so give workers a larger stack than the default
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 * 1024 * 1024);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for(int i=1; i<sched->num_deques; i++) {
+		pthread_t thread;
+		int ret = pthread_create(&thread, &attr, &worker_main,
+			&sched->workers[i]);
+		ensure_exit(ret == 0, EX_OSERR, "Failed to start worker thread");
+	}
+
+	pthread_attr_destroy(&attr);
+	return sched;
+}
+
+struct s_obj *spawn_future(struct scheduler *sched,
+	struct s_obj *expr, struct s_env *env) {
+
+	// The future may run on another thread while this one carries on in env,
+	// so env gets locks, and anything the future defines goes in a frame of
+	// its own
+	share_env(env);
+
+	struct s_future *fut = calloc(1, sizeof(struct s_future));
+	ensure_mem(fut);
+	fut->expr = expr;
+	fut->env = create_new_env(env);
+	fut->state = FUTURE_PENDING;
+
+	struct s_obj *obj = malloc(sizeof(struct s_obj));
+	ensure_mem(obj);
+	STAT_ADD(STAT_ALLOC_FUTURE, 1);
+	STAT_ADD(STAT_BYTES_ALLOCATED, sizeof(struct s_obj) + sizeof(struct s_future));
+	obj->type = OBJ_FUTURE;
+	obj->val.future = fut;
+
+	// With no workers nobody would steal it, so leave it for touch_future
+	if(sched->num_deques == 1)
+		return obj;
+
+	// A thread without a deque has nowhere to queue it
+	struct worker *self = get_worker(sched);
+	if(self == NULL) {
+		run_future(fut);
+		return obj;
+	}
+
+	deque_push(&self->deque, fut);
+	__atomic_fetch_add(&sched->queued, 1, __ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&sched->sleepers, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&sched->lock);
+		pthread_cond_signal(&sched->work_ready);
+		pthread_mutex_unlock(&sched->lock);
+	}
+
+	return obj;
+}
+
+struct s_obj *touch_future(struct scheduler *sched, struct s_future *fut) {
+	struct worker *self = get_worker(sched);
+
+	// Nobody has started it yet, so run it here. Its deque entry is skipped
+	// when it is taken later
+	run_future(fut);
+
+	// Otherwise help with queued work until whoever runs it is done
+	while(__atomic_load_n(&fut->state, __ATOMIC_ACQUIRE) != FUTURE_DONE) {
+		struct s_future *other = find_work(sched, self);
+		if(other != NULL)
+			run_future(other);
+		else
+			sched_yield();
+	}
+
+	// Workers never print errors, the interpreter's thread reports them
+	bool print = current_worker == NULL && sched->interp->print_errors;
+	clear_err_reason(print);
+
+	if(fut->result == NULL) {
+		set_err_reason("%s", fut->reason);
+		return NULL;
+	}
+
+	return fut->result;
+}
@@ -0,0 +1,48 @@
+#ifndef __FUTURE_H__
+#define __FUTURE_H__
+
+#include "internal_rep.h"
+#include "environment.h"
+
+// Futures and the work-stealing scheduler that runs them. Every worker thread
+// owns a Chase-Lev deque: it pushes the futures it creates and pops them from
+// the bottom, while idle workers steal from the top of other deques. The
+// first other thread to use the scheduler, normally the one that owns the
+// interpreter, has a deque too, and runs futures while it waits on one.
+// Any further threads run the futures they spawn themselves.
+
+struct scheduler;
+struct interp;
+
+// Result of a future. Futures run at most once, by whichever thread claims
+// them first.
+struct s_future {
+    struct s_obj *expr;
+    struct s_env *env;
+
+    // One of the FUTURE_* states, accessed atomically
+    int state;
+
+    // Set before state becomes FUTURE_DONE. On failure result is NULL and
+    // reason is the error the evaluation raised.
+    struct s_obj *result;
+    char *reason;
+};
+
+enum { FUTURE_PENDING, FUTURE_RUNNING, FUTURE_DONE };
+
+// Starts num_workers threads besides the interpreter's own
+struct scheduler *create_scheduler(struct interp *interp, int num_workers);
+
+// Creates a future that evaluates expr in a new frame of env and queues it on
+// the deque of the calling thread, or evaluates it now if the thread has no
+// deque. env and its ancestors are shared with share_env first.
+struct s_obj *spawn_future(struct scheduler *sched,
+    struct s_obj *expr, struct s_env *env);
+
+// Returns the value of a future. If nobody has started it yet it is run on
+// the calling thread; otherwise the caller runs other queued futures until it
+// finishes. Returns NULL with the future's error set if it failed.
+struct s_obj *touch_future(struct scheduler *sched, struct s_future *fut);
+
+#endif
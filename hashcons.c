@@ -0,0 +1,137 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "hashcons.h"
+#include "internal_rep.h"
+#include "interp.h"
+#include "uthash.h"
+
+// Cons cells are canonicalised bottom-up, so by the time a cell is looked up
+// its car and cdr are already canonical and the cell is identified by those
+// two pointers alone. Numbers and strings are keyed by value. Symbols are
+// already interned, and booleans and the empty list are singletons.
+
+struct cons_key {
+	struct s_obj *left;
+	struct s_obj *right;
+};
+
+struct number_key {
+	int64_t type;
+	int64_t bits;
+};
+
+struct hc_entry {
+	union {
+		struct cons_key cons;
+		struct number_key number;
+	} key;
+	struct s_obj *obj;
+	UT_hash_handle hh;
+};
+
+static struct hc_entry *new_entry(struct s_obj *obj) {
+	struct hc_entry *entry = calloc(1, sizeof(struct hc_entry));
+	ensure_mem(entry);
+	entry->obj = obj;
+	return entry;
+}
+
+static struct s_obj *share_number(struct interp *interp, struct s_obj *obj) {
+	struct number_key key = { .type = obj->val.number.type, .bits = 0 };
+	if(obj->val.number.type == SCHEME_INT)
+		key.bits = obj->val.number.value.integer;
+	else
+		memcpy(&key.bits, &obj->val.number.value.floating, sizeof(key.bits));
+
+	struct hc_entry *entry = NULL;
+	HASH_FIND(hh, interp->hc_number_table, &key, sizeof(key), entry);
+	if(entry != NULL)
+		return entry->obj;
+
+	entry = new_entry(obj);
+	entry->key.number = key;
+	HASH_ADD(hh, interp->hc_number_table, key.number, sizeof(key), entry);
+	return obj;
+}
+
+static struct s_obj *share_string(struct interp *interp, struct s_obj *obj) {
+	struct hc_entry *entry = NULL;
+	HASH_FIND(hh, interp->hc_string_table, obj->val.str.str, 
+		(unsigned)obj->val.str.len, entry);
+	if(entry != NULL)
+		return entry->obj;
+
+	// Keyed by the string's own bytes
+	entry = new_entry(obj);
+	HASH_ADD_KEYPTR(hh, interp->hc_string_table, obj->val.str.str, 
+		(unsigned)obj->val.str.len, entry);
+	return obj;
+}
+
+// left and right must already be canonical. Reuses cell if it has them.
+static struct s_obj *share_cons(struct interp *interp, struct s_obj *cell,
+	struct s_obj *left, struct s_obj *right) {
+
+	struct cons_key key = { left, right };
+	struct hc_entry *entry = NULL;
+	HASH_FIND(hh, interp->hc_cons_table, &key, sizeof(key), entry);
+	if(entry != NULL)
+		return entry->obj;
+
+	if(cell->val.cc.left != left || cell->val.cc.right != right)
+		cell = new_cons(left, right);
+
+	cell->immutable = true;
+	entry = new_entry(cell);
+	entry->key.cons = key;
+	HASH_ADD(hh, interp->hc_cons_table, key.cons, sizeof(key), entry);
+	return cell;
+}
+
+static struct s_obj *share_obj(struct interp *interp, struct s_obj *obj) {
+	switch(obj->type) {
+	case OBJ_NUMBER:
+		return share_number(interp, obj);
+	case OBJ_STRING:
+		return share_string(interp, obj);
+	case OBJ_CONS:
+		break;
+	default:
+		return obj;
+	}
+
+	// Collect the spine so that it can be canonicalised from the end without
+	// recursing down the cdrs
+	int len = 0;
+	int capacity = 16;
+	struct s_obj **spine = malloc(capacity * sizeof(struct s_obj *));
+	ensure_mem(spine);
+
+	struct s_obj *cur = obj;
+	for(; cur->type == OBJ_CONS; cur = cur->val.cc.right) {
+		if(len == capacity) {
+			capacity *= 2;
+			spine = realloc(spine, capacity * sizeof(struct s_obj *));
+			ensure_mem(spine);
+		}
+		spine[len++] = cur;
+	}
+
+	struct s_obj *tail = share_obj(interp, cur);
+	for(int i=len-1; i>=0; i--) {
+		struct s_obj *left = share_obj(interp, spine[i]->val.cc.left);
+		tail = share_cons(interp, spine[i], left, tail);
+	}
+
+	free(spine);
+	return tail;
+}
+
+struct s_obj *share_constant(struct interp *interp, struct s_obj *obj) {
+	pthread_mutex_lock(&interp->lock);
+	struct s_obj *shared = share_obj(interp, obj);
+	pthread_mutex_unlock(&interp->lock);
+	return shared;
+}
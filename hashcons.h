@@ -0,0 +1,22 @@
+#ifndef __HASHCONS_H__
+#define __HASHCONS_H__
+
+#include <stdbool.h>
+
+#include "internal_rep.h"
+
+// Hash-consing of immutable constant data. When enabled, the desugaring pass
+// runs every quoted literal through share_constant, so structurally equal
+// constants anywhere in the program are the same object: they take the
+// memory of one copy, and equal? on them is a pointer comparison.
+
+// The tables belong to an interpreter, and sharing is enabled by its
+// hash_cons flag.
+
+// Returns the canonical copy of obj. The result is elt_eq to obj, and
+// share_constant returns the same pointer for any two elt_eq arguments.
+// Constants must never be mutated once shared, so the pairs are marked
+// immutable and set-car! and set-cdr! on them are errors.
+struct s_obj *share_constant(struct interp *interp, struct s_obj *obj);
+
+#endif
@@ -3,27 +3,45 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "internal_rep.h"
 #include "eval.h"
+#include "interp.h"
+#include "printer.h"
+#include "stats.h"
+#include "strops.h"
+#include "uthash.h"
+
+// Errors are reported on the thread that raised them, so the last one is
+// kept per thread for embedders to read back with get_err_reason
+static __thread char err_reason[512];
+static __thread bool err_print = true;
 
 void set_err_reason(char *reason, ...) {
-	// For now, just print the stupid thing
 	va_list args;
 	va_start(args, reason);
-	vprintf(reason, args);
+	vsnprintf(err_reason, sizeof(err_reason), reason, args);
 	va_end(args);
+
+	if(err_print)
+		fputs(err_reason, stdout);
 }
 
-bool g_verbose_flag = false;
+const char *get_err_reason() {
+	return err_reason;
+}
 
-void set_verbose(bool vb) {
-	g_verbose_flag = vb;
+void clear_err_reason(bool print) {
+	err_reason[0] = '\0';
+	err_print = print;
 }
 
-bool get_verbose() {
-	return g_verbose_flag;
+bool set_err_print(bool print) {
+	bool old = err_print;
+	err_print = print;
+	return old;
 }
 
 void print_obj_debug(struct s_obj *obj, int indent) {
@@ -66,92 +84,58 @@ void print_obj_debug(struct s_obj *obj, int indent) {
 	case OBJ_EMPTY_LIST:
 		printf("<empty list>\n");
 		break;
-	}
-}
-
-void print_obj_user_util(struct s_obj *obj, bool is_start) {
-	switch(obj->type) {
-	case OBJ_CONS:
-		if(is_start) printf("(");
-
-		print_obj_user_util(obj->val.cc.left, true);
-
-		if(obj->val.cc.right->type == OBJ_EMPTY_LIST) {
-			printf("\b) ");
-			return;
-		}
-
-		if(obj->val.cc.right->type != OBJ_CONS) {
-			printf(". ");
-			print_obj_user_util(obj->val.cc.right, false);
-			printf("\b) ");
-			return;
-		}
-
-		print_obj_user_util(obj->val.cc.right, false);
-		break;
-
-	case OBJ_NUMBER:
-		printf("%lld ", obj->val.number.value.integer);
-		break;
-
-	case OBJ_STRING:
-		printf("%s ", obj->val.str.str);
-		break;
-
-	case OBJ_SYMBOL:
-		printf("%s ", obj->val.sym.str);
-		break;
-
-	case OBJ_BOOLEAN:
-		if(obj->val.boolean)
-			printf("#t ");
-		else
-			printf("#f ");
-		break;
-
-	case OBJ_LAMBDA:
-		printf("#<procedure %p> ", obj->val.lambda);
-		break;
-
-	case OBJ_BUILTIN_FUNC:
-		printf("#<builtin function %p> ", obj->val.builtin.func);
-		break;
-
-	case OBJ_EMPTY_LIST:
-		printf("() ");
+	case OBJ_FUTURE:
+		printf("#<future %p>\n", obj->val.future);
 		break;
 	}
 }
 
+// Serialises into the per-thread output buffer and writes the result, plus a
+// newline, with a single write
 void print_obj_user(struct s_obj *obj) {
-	print_obj_user_util(obj, true);
-	printf("\n");
+	struct strbuf *buf = get_output_buffer();
+	serialise_obj(buf, obj, true);
+	strbuf_putc(buf, '\n');
+	flush_strbuf(buf, STDOUT_FILENO);
 }
 
+// Writes the representation of obj into buf, truncated to fit in buflen
+// bytes including the null terminator. Only that much is serialised, so
+// cyclic data is fine.
 char *get_string_rep(struct s_obj *obj, char *buf, int buflen) {
-	printf("unimplemented\n");
-	memset(buf, 0, buflen);
+	if(buflen <= 0)
+		return buf;
+
+	struct strbuf *scratch = get_output_buffer();
+	size_t start = scratch->len;
+	serialise_obj_prefix(scratch, obj, true, buflen);
+
+	size_t len = scratch->len - start;
+	if(len > (size_t)buflen - 1)
+		len = buflen - 1;
+
+	memcpy(buf, scratch->data + start, len);
+	buf[len] = '\0';
+	scratch->len = start;
 	return buf;
 }
 
 // Gets the length of a list. Returns -1 and sets error reason if the object
-// is not a list
+// is not a list. Walks the list in a loop so that long lists don't use stack.
 int get_list_len(struct s_obj *obj) {
-	if(obj->type == OBJ_EMPTY_LIST)
-		return 0;
+	int len = 0;
+	while(obj->type == OBJ_CONS) {
+		len++;
+		obj = obj->val.cc.right;
+	}
 
 	// Make sure we're taking the length of a list
-	if(obj->type != OBJ_CONS) {
+	if(obj->type != OBJ_EMPTY_LIST) {
 		// SET_ERR("Trying to get length of non-cons object");
 		return -1;
 	}
 
-	int rest_len = get_list_len(obj->val.cc.right);
-	if(rest_len == -1)
-		return -1;
-
-	return 1 + rest_len;
+	return len;
 }
 
 struct s_obj *get_list_head(struct s_obj *obj) {
@@ -163,28 +147,145 @@ struct s_obj *get_list_rest(struct s_obj *obj) {
 }
 
 struct s_obj *get_list_nth(struct s_obj *obj, int n) {
-	int len = get_list_len(obj);
+	// Only walk as far as needed rather than taking the length of the list
+	struct s_obj *cur = obj;
+	for(int i=1; i<n && cur->type == OBJ_CONS; i++)
+		cur = cur->val.cc.right;
 
-	if(n <= 0 || len < n) {
-		SET_ERR("list has length %d, but n is %d", len, n);
+	if(n <= 0 || cur->type != OBJ_CONS) {
+		SET_ERR("list has length %d, but n is %d", get_list_len(obj), n);
 		return NULL;
 	}
 
-	if(n == 1) return get_list_head(obj);
-	return get_list_nth(get_list_rest(obj), n-1);
+	return cur->val.cc.left;
 }
 
 bool all_list_of_type(struct s_obj *obj, enum scheme_obj_type type) {
-	int len = get_list_len(obj);
-	if(len == -1) 
-		return false;
-	if(len == 0)
+	for(; obj->type == OBJ_CONS; obj = obj->val.cc.right) {
+		if(obj->val.cc.left->type != type)
+			return false;
+	}
+
+	return obj->type == OBJ_EMPTY_LIST;
+}
+
+static bool atom_eq(struct s_obj *obj1, struct s_obj *obj2) {
+	switch(obj1->type) {
+	case OBJ_NUMBER:
+		if(obj1->val.number.type != obj2->val.number.type)
+			return false;
+		if(obj1->val.number.type == SCHEME_INT)
+			return obj1->val.number.value.integer == obj2->val.number.value.integer;
+		return obj1->val.number.value.floating == obj2->val.number.value.floating;
+
+	case OBJ_STRING:
+		return obj1->val.str.len == obj2->val.str.len
+			&& str_mismatch(obj1->val.str.str, obj2->val.str.str,
+				obj1->val.str.len) == (size_t)obj1->val.str.len;
+
+	case OBJ_BOOLEAN:
+		return obj1->val.boolean == obj2->val.boolean;
+
+	case OBJ_BUILTIN_FUNC:
+		return obj1->val.builtin.func == obj2->val.builtin.func;
+
+	case OBJ_EMPTY_LIST:
 		return true;
 
-	if(obj->val.cc.left->type != type)
+	// Symbols are interned and lambdas and futures compare by identity, so
+	// if they weren't the same pointer they're different
+	case OBJ_SYMBOL:
+	case OBJ_LAMBDA:
+	case OBJ_FUTURE:
+	case OBJ_CONS:
 		return false;
+	}
+
+	return false;
+}
+
+bool elt_eq(struct s_obj *obj1, struct s_obj *obj2) {
+	while(true) {
+		if(obj1 == obj2)
+			return true;
+
+		if(obj1->type != obj2->type)
+			return false;
+
+		if(obj1->type != OBJ_CONS)
+			return atom_eq(obj1, obj2);
+
+		if(!elt_eq(obj1->val.cc.left, obj2->val.cc.left))
+			return false;
+
+		obj1 = obj1->val.cc.right;
+		obj2 = obj2->val.cc.right;
+	}
+}
+
+// splitmix64 finaliser
+static uint64_t mix_hash(uint64_t h) {
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+// FNV-1a
+static uint64_t bytes_hash(const char *str, int len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(int i=0; i<len; i++) {
+		h ^= (unsigned char)str[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t atom_hash(struct s_obj *obj) {
+	uint64_t h = obj->type;
+
+	switch(obj->type) {
+	case OBJ_NUMBER:
+		if(obj->val.number.type == SCHEME_INT)
+			h ^= (uint64_t)obj->val.number.value.integer;
+		else
+			memcpy(&h, &obj->val.number.value.floating, sizeof(h));
+		break;
+	case OBJ_STRING:
+		h ^= bytes_hash(obj->val.str.str, obj->val.str.len);
+		break;
+	case OBJ_SYMBOL:
+		// By name rather than address, so hashes are the same across runs
+		h ^= bytes_hash(obj->val.sym.str, obj->val.sym.len) + 1;
+		break;
+	case OBJ_BOOLEAN:
+		h ^= obj->val.boolean;
+		break;
+	case OBJ_LAMBDA:
+		h ^= (uintptr_t)obj->val.lambda;
+		break;
+	case OBJ_BUILTIN_FUNC:
+		h ^= (uintptr_t)obj->val.builtin.func;
+		break;
+	case OBJ_FUTURE:
+		h ^= (uintptr_t)obj->val.future;
+		break;
+	case OBJ_CONS:
+	case OBJ_EMPTY_LIST:
+		break;
+	}
 
-	return all_list_of_type(obj->val.cc.right, type);
+	return mix_hash(h);
+}
+
+uint64_t elt_hash(struct s_obj *obj) {
+	uint64_t h = OBJ_CONS;
+	for(; obj->type == OBJ_CONS; obj = obj->val.cc.right)
+		h = mix_hash(h ^ elt_hash(obj->val.cc.left)) + 1;
+
+	return mix_hash(h ^ atom_hash(obj));
 }
 
 struct s_obj *new_lambda(
@@ -229,10 +330,18 @@ struct s_obj *new_lambda(
 	lambda->num_args = num_args;
 	lambda->arglist = argnames;
 	lambda->body = body;
+	lambda->lazy = NULL;
 	lambda->parent_env = parent_env;
+	lambda->name = NULL;
+	lambda->calls = 0;
+	lambda->native = NULL;
+	lambda->analysed = NULL;
 
 	struct s_obj *lamb_obj = malloc(sizeof(struct s_obj));
 	ensure_mem(lamb_obj);
+	STAT_ADD(STAT_ALLOC_LAMBDA, 1);
+	STAT_ADD(STAT_BYTES_ALLOCATED, sizeof(struct s_obj) + sizeof(struct s_lambda)
+		+ (num_args == -1 ? 1 : num_args) * sizeof(char *));
 
 	lamb_obj->type = OBJ_LAMBDA;
 	lamb_obj->val.lambda = lambda;
@@ -246,10 +355,14 @@ struct s_obj *new_builtin(
 
 	struct s_obj *obj = malloc(sizeof(struct s_obj));
 	ensure_mem(obj);
+	STAT_ADD(STAT_ALLOC_BUILTIN, 1);
+	STAT_ADD(STAT_BYTES_ALLOCATED, sizeof(struct s_obj));
 
 	obj->type = OBJ_BUILTIN_FUNC;
 	obj->val.builtin.is_macro = is_macro;
 	obj->val.builtin.num_args = num_args;
+	obj->val.builtin.flags = 0;
+	obj->val.builtin.result_type = -1;
 	obj->val.builtin.func = func;
 
 	return obj;
@@ -258,8 +371,11 @@ struct s_obj *new_builtin(
 struct s_obj *new_cons(struct s_obj *left, struct s_obj *right) {
 	struct s_obj *obj = malloc(sizeof(struct s_obj));
 	ensure_mem(obj);
+	STAT_ADD(STAT_ALLOC_CONS, 1);
+	STAT_ADD(STAT_BYTES_ALLOCATED, sizeof(struct s_obj));
 
 	obj->type = OBJ_CONS;
+	obj->immutable = false;
 	obj->val.cc.left = left;
 	obj->val.cc.right = right;
 	return obj;
@@ -270,6 +386,8 @@ struct s_obj *new_numeric(enum numeric_type type, long i, double f){
 	assert(type != SCHEME_FLOAT);
 	struct s_obj *obj = malloc(sizeof(struct s_obj));
 	ensure_mem(obj);
+	STAT_ADD(STAT_ALLOC_NUMBER, 1);
+	STAT_ADD(STAT_BYTES_ALLOCATED, sizeof(struct s_obj));
 
 	obj->type = OBJ_NUMBER;
 	obj->val.number.type = SCHEME_INT;
@@ -280,9 +398,14 @@ struct s_obj *new_numeric(enum numeric_type type, long i, double f){
 struct s_obj *new_string(int len, char *str) {
 	struct s_obj *obj = malloc(sizeof(struct s_obj));
 	ensure_mem(obj);
+	STAT_ADD(STAT_ALLOC_STRING, 1);
+	STAT_ADD(STAT_BYTES_ALLOCATED, sizeof(struct s_obj) + len + 1);
 
+	// Strings may contain null bytes, so copy by length. They are still null
+	// terminated for convenience.
 	char *newstr = calloc(len+1, sizeof(char));
-	strncpy(newstr, str, len);
+	ensure_mem(newstr);
+	memcpy(newstr, str, len);
 	newstr[len] = '\0';
 
 	obj->type = OBJ_STRING;
@@ -291,58 +414,68 @@ struct s_obj *new_string(int len, char *str) {
 	return obj;
 }
 
-struct s_obj *fetch_or_create_symbol(int len, const char *name) {
-	// Don't bother de-duplicating symbols for now
+struct symbol_entry {
+	// Key, points into the symbol's own name
+	const char *name;
+	struct s_obj *sym;
+	UT_hash_handle hh;
+};
+
+struct s_obj *fetch_or_create_symbol(struct interp *interp,
+	int len, const char *name) {
+
+	pthread_mutex_lock(&interp->lock);
+
+	struct symbol_entry *entry = NULL;
+	HASH_FIND(hh, interp->symbol_table, name, (unsigned)len, entry);
+	if(entry != NULL) {
+		pthread_mutex_unlock(&interp->lock);
+		return entry->sym;
+	}
+
 	struct s_obj *obj = malloc(sizeof(struct s_obj));
 	ensure_mem(obj);
 
 	char *newstr = calloc(len+1, sizeof(char));
+	ensure_mem(newstr);
 	strncpy(newstr, name, len);
 	newstr[len] = '\0';
 
 	obj->type = OBJ_SYMBOL;
 	obj->val.sym.len = len;
 	obj->val.sym.str = newstr;
+
+	entry = malloc(sizeof(struct symbol_entry));
+	ensure_mem(entry);
+	entry->name = newstr;
+	entry->sym = obj;
+	HASH_ADD_KEYPTR(hh, interp->symbol_table, entry->name, len, entry);
+	STAT_HASH_INSERT(entry->hh);
+	STAT_ADD(STAT_ALLOC_SYMBOL, 1);
+	STAT_ADD(STAT_BYTES_ALLOCATED, sizeof(struct s_obj)
+		+ sizeof(struct symbol_entry) + len + 1);
+
+	pthread_mutex_unlock(&interp->lock);
 	return obj;
 }
 
-static bool initialised_singletons = false;
-
-static struct s_obj *singleton_true = NULL;
-static struct s_obj *singleton_false = NULL;
-static struct s_obj *singleton_emptylist = NULL;
-
-void initialise_singleton_objects() {
-	if(initialised_singletons)
-		return;
-
-	singleton_true = malloc(sizeof(struct s_obj));
-	singleton_false = malloc(sizeof(struct s_obj));
-	singleton_emptylist = malloc(sizeof(struct s_obj));
-	ensure_mem(singleton_true);
-	ensure_mem(singleton_false);
-	ensure_mem(singleton_emptylist);
-
-	singleton_true->type = OBJ_BOOLEAN;
-	singleton_true->val.boolean = true;
-
-	singleton_false->type = OBJ_BOOLEAN;
-	singleton_false->val.boolean = false;
-
-	singleton_emptylist->type = OBJ_EMPTY_LIST;
-	// no need to add value here, since it doesn't matter
-
-	initialised_singletons = true;
-}
+// The singletons are immutable and statically initialised, so they need no
+// setup and are shared by every interpreter
+static struct s_obj singleton_true = {
+	.type = OBJ_BOOLEAN, .val.boolean = true };
+static struct s_obj singleton_false = {
+	.type = OBJ_BOOLEAN, .val.boolean = false };
+// no need to add value here, since it doesn't matter
+static struct s_obj singleton_emptylist = { .type = OBJ_EMPTY_LIST };
 
 struct s_obj *fetch_singleton_object(enum singleton_objects sg) {
-	assert(initialised_singletons == true);
-
 	switch(sg) {
-	case SG_TRUE: return singleton_true;
-	case SG_FALSE: return singleton_false;
-	case SG_EMPTY_LIST: return singleton_emptylist;
+	case SG_TRUE: return &singleton_true;
+	case SG_FALSE: return &singleton_false;
+	case SG_EMPTY_LIST: return &singleton_emptylist;
 	}
+
+	return NULL;
 }
 
 struct s_obj *fetch_bool(bool b) {
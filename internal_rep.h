@@ -12,6 +12,18 @@
 
 void set_err_reason(char *reason, ...);
 
+// Last error set with SET_ERR on this thread, or "" if there was none since
+// the last clear_err_reason
+const char *get_err_reason();
+
+// Forgets the last error. print controls whether later errors on this thread
+// are also printed to stdout as they happen
+void clear_err_reason(bool print);
+
+// Sets whether later errors on this thread are printed, like
+// clear_err_reason but keeping the last error, and returns the old setting
+bool set_err_print(bool print);
+
 enum scheme_obj_type {
     OBJ_CONS = 0,
     OBJ_NUMBER,
@@ -21,6 +33,7 @@ enum scheme_obj_type {
     OBJ_LAMBDA,
     OBJ_BUILTIN_FUNC,
     OBJ_EMPTY_LIST,
+    OBJ_FUTURE,
 };
 
 struct s_obj;
@@ -29,6 +42,10 @@ struct s_number;
 struct s_string;
 struct s_symbol;
 struct s_lambda;
+struct s_future;
+struct interp;
+struct node;
+struct lazy_body;
 
 // non-symbol singleton objects
 enum singleton_objects {
@@ -68,33 +85,60 @@ struct s_lambda {
     int num_args;
     char **arglist;
     struct s_obj *body;
+    // Source of the body of a top-level define while it is still unparsed,
+    // see preparse.h. body is NULL until the source is loaded.
+    struct lazy_body *lazy;
     // Lexical scoping, so we base the evaluation on the env when the lambda
     // was created
     struct s_env *parent_env;
+    // Name of the first define that bound it, NULL if it was never bound.
+    // Only used for reporting.
+    const char *name;
+    // Applications so far, counted only while the JIT is enabled
+    unsigned calls;
+    // Compiled body, see jit.h. NULL until the lambda gets hot
+    struct s_obj *(*native)(struct s_env *env);
+    // Analysed body, see analyse.h. NULL until the lambda is first applied,
+    // unless it was made by an analysed lambda expression
+    struct node *analysed;
+};
+
+// What analysis may assume about a builtin besides its arity. A builtin
+// without flags may have any effect.
+enum builtin_flags {
+    // No side effects, and the result depends only on the arguments
+    BUILTIN_PURE = 1 << 0,
+    // May allocate the objects it returns
+    BUILTIN_ALLOCATES = 1 << 1,
 };
 
 struct s_builtin {
     bool is_macro;
     int num_args;
+    // enum builtin_flags, and the type of every object returned, or -1 if
+    // it varies. Set by add_builtins.
+    unsigned flags;
+    int result_type;
     struct s_obj *(*func)(struct s_obj *arglist, struct s_env *env);
 };
 
 struct s_obj {
     enum scheme_obj_type type;
+    // Pairs only: set on pairs shared by hash consing, which set-car! and
+    // set-cdr! refuse to change. Fits in the padding after type.
+    bool immutable;
     union {
         struct s_cons_cell cc;
         struct s_number number;
         struct s_string str;
         struct s_symbol sym;
         struct s_lambda *lambda;
+        struct s_future *future;
         struct s_builtin builtin;
         bool boolean;
     } val;
 };
 
-void set_verbose(bool vb);
-bool get_verbose();
-
 // Printing
 void print_obj_debug(struct s_obj *obj, int indent);
 void print_obj_user(struct s_obj *obj);
@@ -108,6 +152,12 @@ struct s_obj *get_list_rest(struct s_obj *obj);
 
 bool all_list_of_type(struct s_obj *obj, enum scheme_obj_type type);
 
+// Structural equality (equal?) and a hash consistent with it: objects that
+// are elt_eq have the same elt_hash. Both loop down list spines and only
+// recurse into the elements.
+bool elt_eq(struct s_obj *obj1, struct s_obj *obj2);
+uint64_t elt_hash(struct s_obj *obj);
+
 // Object creation
 struct s_obj *new_lambda(
     struct s_obj *arglist, 
@@ -121,10 +171,12 @@ struct s_obj *new_builtin(
 struct s_obj *new_cons(struct s_obj *left, struct s_obj *right);
 struct s_obj *new_numeric(enum numeric_type type, long i, double f);
 struct s_obj *new_string(int len, char *str);
-struct s_obj *fetch_or_create_symbol(int len, const char *name);
+// Symbols are interned per interpreter, so two symbols with the same name
+// are the same object
+struct s_obj *fetch_or_create_symbol(struct interp *interp,
+    int len, const char *name);
 
 // Singletons
-void initialise_singleton_objects();
 struct s_obj *fetch_singleton_object(enum singleton_objects sg);
 struct s_obj *fetch_bool(bool b);
 
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "analyse.h"
+#include "builtins.h"
+#include "cache.h"
+#include "common.h"
+#include "environment.h"
+#include "eval.h"
+#include "future.h"
+#include "interp.h"
+#include "lexer.h"
+#include "parser.h"
+#include "pool.h"
+#include "preparse.h"
+
+struct interp *create_interp() {
+	struct interp *interp = calloc(1, sizeof(struct interp));
+	ensure_mem(interp);
+
+	interp->print_errors = true;
+	interp->analyse = true;
+	interp->lazy_bodies = true;
+	interp->num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_mutex_init(&interp->lock, NULL);
+	interp->lexer = compile_token_definitions();
+	interp->root_env = create_root_env(interp);
+	add_builtins(interp->root_env);
+	init_guards(interp);
+
+	return interp;
+}
+
+struct s_obj *interp_eval_string(struct interp *interp, const char *src) {
+	return interp_eval_buffer(interp, src, strlen(src));
+}
+
+struct s_obj *interp_eval_buffer(struct interp *interp,
+	const char *buf, size_t len) {
+
+	clear_err_reason(interp->print_errors);
+
+	struct load_items items = { 0 };
+	struct s_obj *res = NULL;
+	if(load_buffer(interp, buf, len, &items))
+		res = eval_items(interp, &items);
+
+	free(items.arr);
+	return res;
+}
+
+static long file_size(FILE *fp) {
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	return size;
+}
+
+struct s_obj *interp_eval_file(struct interp *interp, const char *path) {
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL) {
+		SET_ERR("Cannot open file: %s", path);
+		return NULL;
+	}
+
+	long size = file_size(fp);
+	// Extra byte so that the buffer is null terminated
+	char *buf = calloc(1, size + 1);
+	ensure_mem(buf);
+	size_t nread = fread(buf, 1, size, fp);
+	fclose(fp);
+	buf[nread] = '\0';
+
+	// Parsed objects copy everything they need out of the buffer
+	struct s_obj *res = NULL;
+	if(interp->cache_dir != NULL && !interp->verbose)
+		res = eval_cached(interp, buf, strlen(buf));
+	else
+		res = interp_eval_string(interp, buf);
+	free(buf);
+	return res;
+}
+
+void interp_define_primitive(struct interp *interp, const char *name,
+	int num_args, primitive_fn func) {
+
+	associate_symbol(interp->root_env, name, new_builtin(false, num_args, func));
+}
+
+struct s_obj *interp_lookup(struct interp *interp, const char *name) {
+	return resolve_symbol(interp->root_env, name, false);
+}
+
+struct s_obj *interp_apply(struct interp *interp, struct s_obj *proc,
+	struct s_obj *args) {
+
+	clear_err_reason(interp->print_errors);
+	return apply_function(proc, args, interp->root_env);
+}
+
+// Parallel builtins and futures can be first used from several threads at
+// once, so both are started under the lock. The pointers are published with
+// a release store so that the unlocked check sees them fully set up.
+struct thread_pool *interp_pool(struct interp *interp) {
+	struct thread_pool *pool = __atomic_load_n(&interp->pool, __ATOMIC_ACQUIRE);
+	if(pool != NULL)
+		return pool;
+
+	pthread_mutex_lock(&interp->lock);
+	pool = interp->pool;
+	if(pool == NULL) {
+		int workers = interp->num_threads > 1 ? interp->num_threads - 1 : 0;
+		pool = create_thread_pool(workers);
+		__atomic_store_n(&interp->pool, pool, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&interp->lock);
+	return pool;
+}
+
+struct scheduler *interp_scheduler(struct interp *interp) {
+	struct scheduler *sched = __atomic_load_n(&interp->sched, __ATOMIC_ACQUIRE);
+	if(sched != NULL)
+		return sched;
+
+	pthread_mutex_lock(&interp->lock);
+	sched = interp->sched;
+	if(sched == NULL) {
+		int workers = interp->num_threads > 1 ? interp->num_threads - 1 : 0;
+		sched = create_scheduler(interp, workers);
+		__atomic_store_n(&interp->sched, sched, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&interp->lock);
+	return sched;
+}
@@ -0,0 +1,134 @@
+#ifndef __INTERP_H__
+#define __INTERP_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "internal_rep.h"
+#include "environment.h"
+
+struct lexer;
+struct symbol_entry;
+struct hc_entry;
+struct thread_pool;
+struct scheduler;
+struct guard;
+struct lazy_body;
+
+// All of the state of one interpreter. Interpreters share nothing mutable,
+// so independent interpreters can run on different threads at the same time
+// as long as each one is only used by one thread at a time. The context is
+// reachable from every environment, so eval, apply_function and builtins
+// find it through the env they are given.
+struct interp {
+    // Global environment, with the builtins bound in it
+    struct s_env *root_env;
+
+    // Compiled token definitions
+    struct lexer *lexer;
+
+    // Guards symbol_table, the hash-cons tables and starting pool and
+    // sched, which parallel builtins can reach from several threads at once
+    pthread_mutex_t lock;
+
+    // Interned symbols, see fetch_or_create_symbol
+    struct symbol_entry *symbol_table;
+
+    // Shared constants, see hashcons.h
+    bool hash_cons;
+    struct hc_entry *hc_cons_table;
+    struct hc_entry *hc_number_table;
+    struct hc_entry *hc_string_table;
+
+    bool verbose;
+
+    // Applications of a lambda after which its body is compiled to native
+    // code, or 0 to always interpret. Only used when analyse is off, see
+    // jit.h
+    int jit_threshold;
+
+    // Evaluate lambda bodies through the analysed node trees of analyse.h
+    // rather than with eval. On by default
+    bool analyse;
+
+    // Parse the bodies of top-level function definitions on their first
+    // call rather than when they are loaded, see preparse.h. On by default.
+    // pending_bodies lists the bodies loaded lazily since the last
+    // force_lazy_bodies.
+    bool lazy_bodies;
+    struct lazy_body *pending_bodies;
+
+    // Directory of the parsed files cached by interp_eval_file, see cache.h,
+    // or NULL to always parse them
+    const char *cache_dir;
+
+    // Bindings that analysed code relies on, see analyse.h. Bit i of
+    // broken_guards is set once the name of guards[i] has been bound to
+    // anything else. num_guards only grows, under lock.
+    struct guard *guards;
+    int num_guards;
+    uint64_t broken_guards;
+
+    // A bit for the first character of each guarded name, so that most
+    // bindings skip the guards, and a Bloom filter of the names that have
+    // ever been bound outside the root environment, by symbol table hash
+    uint64_t guard_initials[4];
+    uint64_t shadowed[16];
+
+    // Print errors to stdout as they happen. They can always be read back
+    // with get_err_reason after a call returns NULL
+    bool print_errors;
+
+    // Threads used by pmap, pfor-each, preduce and futures, including the
+    // calling thread. Defaults to the number of online CPUs, and can be changed until
+    // the first parallel call starts the pool.
+    int num_threads;
+    struct thread_pool *pool;
+
+    // Runs futures, with num_threads - 1 workers besides the thread using
+    // the interpreter
+    struct scheduler *sched;
+};
+
+// Signature of builtins, including native primitives registered by embedders.
+// args is the list of evaluated arguments.
+typedef struct s_obj *(*primitive_fn)(struct s_obj *args, struct s_env *env);
+
+// Creates an interpreter whose root environment contains the builtins.
+// builtins.scheme is not loaded.
+struct interp *create_interp();
+
+// Tokenises, parses and evaluates every form in src in the root environment.
+// Returns the value of the last form, or NULL if any step failed.
+struct s_obj *interp_eval_string(struct interp *interp, const char *src);
+
+// Same as interp_eval_string for the first len bytes of buf, which does not
+// need to be null terminated. buf can be freed as soon as this returns.
+struct s_obj *interp_eval_buffer(struct interp *interp,
+    const char *buf, size_t len);
+
+// Reads a whole file and evaluates it with interp_eval_string, or from its
+// entry in cache_dir if there is one
+struct s_obj *interp_eval_file(struct interp *interp, const char *path);
+
+// Binds name in the root environment to a native function taking num_args
+// arguments, or any number if num_args is -1
+void interp_define_primitive(struct interp *interp, const char *name,
+    int num_args, primitive_fn func);
+
+// Value bound to name in the root environment, or NULL if it is unbound
+struct s_obj *interp_lookup(struct interp *interp, const char *name);
+
+// Pool for parallel builtins, started on first use
+struct thread_pool *interp_pool(struct interp *interp);
+
+// Scheduler for futures, started on first use
+struct scheduler *interp_scheduler(struct interp *interp);
+
+// Calls a procedure with a list of already evaluated arguments, e.g. one
+// found with interp_lookup. Returns NULL on error.
+struct s_obj *interp_apply(struct interp *interp, struct s_obj *proc,
+    struct s_obj *args);
+
+#endif
@@ -0,0 +1,644 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "builtins.h"
+#include "common.h"
+#include "environment.h"
+#include "eval.h"
+#include "interp.h"
+#include "jit.h"
+#include "preparse.h"
+#include "stats.h"
+
+typedef struct s_obj sobj;
+typedef struct s_env senv;
+typedef sobj *(*builtin_fn)(sobj *, senv *);
+
+#if defined(__x86_64__)
+
+// ============================== ASSEMBLER ==================================
+// Just enough of x86-64 for the templates below. Every memory operand is
+// [base + disp32] and every branch is rel32, so instruction sizes never
+// depend on label positions and fixups can be patched in one pass.
+// ===========================================================================
+
+enum reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15 };
+
+enum cond { CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD,
+	CC_LE = 0xE, CC_G = 0xF };
+
+enum alu { ALU_ADD = 0x01, ALU_SUB = 0x29, ALU_CMP = 0x39 };
+
+struct fixup {
+	size_t pos;
+	int label;
+};
+
+struct assembler {
+	uint8_t *code;
+	size_t len;
+	size_t capacity;
+
+	// Position of each label, or -1 while it is unbound
+	long *labels;
+	int num_labels;
+
+	struct fixup *fixups;
+	int num_fixups;
+};
+
+static void emit8(struct assembler *a, uint8_t b) {
+	if(a->len == a->capacity) {
+		a->capacity = a->capacity == 0 ? 256 : a->capacity * 2;
+		a->code = realloc(a->code, a->capacity);
+		ensure_mem(a->code);
+	}
+	a->code[a->len++] = b;
+}
+
+static void emit32(struct assembler *a, uint32_t v) {
+	for(int i=0; i<4; i++)
+		emit8(a, v >> (8*i));
+}
+
+static void emit64(struct assembler *a, uint64_t v) {
+	for(int i=0; i<8; i++)
+		emit8(a, v >> (8*i));
+}
+
+static void patch32(struct assembler *a, size_t pos, uint32_t v) {
+	for(int i=0; i<4; i++)
+		a->code[pos + i] = v >> (8*i);
+}
+
+static void emit_rex(struct assembler *a, bool wide, int reg, int rm) {
+	uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+	if(rex != 0x40)
+		emit8(a, rex);
+}
+
+static void emit_modrm_rr(struct assembler *a, int reg, int rm) {
+	emit8(a, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// ModRM for [base + disp32]
+static void emit_modrm_mem(struct assembler *a, int reg, int base, int32_t disp) {
+	emit8(a, 0x80 | (reg & 7) << 3 | (base & 7));
+	if((base & 7) == RSP)
+		emit8(a, 0x24);
+	emit32(a, disp);
+}
+
+static int new_label(struct assembler *a) {
+	a->labels = realloc(a->labels, (a->num_labels + 1) * sizeof(long));
+	ensure_mem(a->labels);
+	a->labels[a->num_labels] = -1;
+	return a->num_labels++;
+}
+
+static void bind_label(struct assembler *a, int label) {
+	a->labels[label] = a->len;
+}
+
+static void emit_label_ref(struct assembler *a, int label) {
+	a->fixups = realloc(a->fixups, (a->num_fixups + 1) * sizeof(struct fixup));
+	ensure_mem(a->fixups);
+	a->fixups[a->num_fixups].pos = a->len;
+	a->fixups[a->num_fixups].label = label;
+	a->num_fixups++;
+	emit32(a, 0);
+}
+
+static void resolve_fixups(struct assembler *a) {
+	for(int i=0; i<a->num_fixups; i++) {
+		struct fixup *f = &a->fixups[i];
+		long target = a->labels[f->label];
+		patch32(a, f->pos, (uint32_t)(target - (long)(f->pos + 4)));
+	}
+}
+
+static void mov_imm(struct assembler *a, int dst, uint64_t imm) {
+	emit_rex(a, true, 0, dst);
+	emit8(a, 0xB8 + (dst & 7));
+	emit64(a, imm);
+}
+
+static void mov_imm32(struct assembler *a, int dst, uint32_t imm) {
+	emit_rex(a, false, 0, dst);
+	emit8(a, 0xB8 + (dst & 7));
+	emit32(a, imm);
+}
+
+static void mov_rr(struct assembler *a, int dst, int src) {
+	emit_rex(a, true, src, dst);
+	emit8(a, 0x89);
+	emit_modrm_rr(a, src, dst);
+}
+
+static void load(struct assembler *a, int dst, int base, int32_t disp) {
+	emit_rex(a, true, dst, base);
+	emit8(a, 0x8B);
+	emit_modrm_mem(a, dst, base, disp);
+}
+
+static void store(struct assembler *a, int base, int32_t disp, int src) {
+	emit_rex(a, true, src, base);
+	emit8(a, 0x89);
+	emit_modrm_mem(a, src, base, disp);
+}
+
+static void alu_rr(struct assembler *a, enum alu op, int dst, int src) {
+	emit_rex(a, true, src, dst);
+	emit8(a, op);
+	emit_modrm_rr(a, src, dst);
+}
+
+// cmp dword [base + disp], imm8
+static void cmp_mem32_imm(struct assembler *a, int base, int32_t disp, int8_t imm) {
+	emit_rex(a, false, 0, base);
+	emit8(a, 0x83);
+	emit_modrm_mem(a, 7, base, disp);
+	emit8(a, imm);
+}
+
+// cmp byte [base + disp], imm8
+static void cmp_mem8_imm(struct assembler *a, int base, int32_t disp, int8_t imm) {
+	emit_rex(a, false, 0, base);
+	emit8(a, 0x80);
+	emit_modrm_mem(a, 7, base, disp);
+	emit8(a, imm);
+}
+
+// cmp eax, imm8
+static void cmp_eax_imm(struct assembler *a, int8_t imm) {
+	emit8(a, 0x83);
+	emit_modrm_rr(a, 7, RAX);
+	emit8(a, imm);
+}
+
+static void test_rr(struct assembler *a, int dst, int src) {
+	emit_rex(a, true, src, dst);
+	emit8(a, 0x85);
+	emit_modrm_rr(a, src, dst);
+}
+
+static void test32_rr(struct assembler *a, int dst, int src) {
+	emit_rex(a, false, src, dst);
+	emit8(a, 0x85);
+	emit_modrm_rr(a, src, dst);
+}
+
+static void push(struct assembler *a, int r) {
+	emit_rex(a, false, 0, r);
+	emit8(a, 0x50 + (r & 7));
+}
+
+static void pop(struct assembler *a, int r) {
+	emit_rex(a, false, 0, r);
+	emit8(a, 0x58 + (r & 7));
+}
+
+static void jcc(struct assembler *a, enum cond cc, int label) {
+	emit8(a, 0x0F);
+	emit8(a, 0x80 | cc);
+	emit_label_ref(a, label);
+}
+
+static void jmp(struct assembler *a, int label) {
+	emit8(a, 0xE9);
+	emit_label_ref(a, label);
+}
+
+// Calls an absolute address through r11, which no argument uses
+static void call(struct assembler *a, void *fn) {
+	mov_imm(a, R11, (uint64_t)(uintptr_t)fn);
+	emit_rex(a, false, 0, R11);
+	emit8(a, 0xFF);
+	emit_modrm_rr(a, 2, R11);
+}
+
+// ============================== TEMPLATES ==================================
+// Compiled code keeps the environment in rbx and every expression leaves
+// its value in rax. Values that must survive a call live in stack slots
+// below the saved registers. A NULL from any helper jumps to the shared
+// exit, which returns NULL so that the error propagates like in eval.
+// ===========================================================================
+
+#define OFF_TYPE    offsetof(struct s_obj, type)
+#define OFF_BOOL    offsetof(struct s_obj, val.boolean)
+#define OFF_CAR     offsetof(struct s_obj, val.cc.left)
+#define OFF_CDR     offsetof(struct s_obj, val.cc.right)
+#define OFF_NUMTYPE offsetof(struct s_obj, val.number.type)
+#define OFF_INT     offsetof(struct s_obj, val.number.value.integer)
+
+enum prim_op { PRIM_ADD, PRIM_SUB, PRIM_LT, PRIM_GT, PRIM_LE, PRIM_GE,
+	PRIM_NUM_EQ, PRIM_CAR, PRIM_CDR, PRIM_IS_NULL };
+
+struct prim {
+	builtin_fn func;
+	int num_args;
+	enum prim_op op;
+};
+
+static const struct prim prims[] = {
+	{ &builtin_add,      2, PRIM_ADD },
+	{ &builtin_sub,      2, PRIM_SUB },
+	{ &builtin_lt,       2, PRIM_LT },
+	{ &builtin_gt,       2, PRIM_GT },
+	{ &builtin_le,       2, PRIM_LE },
+	{ &builtin_ge,       2, PRIM_GE },
+	{ &builtin_is_equal, 2, PRIM_NUM_EQ },
+	{ &builtin_car,      1, PRIM_CAR },
+	{ &builtin_cdr,      1, PRIM_CDR },
+	{ &builtin_is_null,  1, PRIM_IS_NULL },
+};
+
+#define NUM_PRIMS (sizeof(prims) / sizeof(prims[0]))
+
+struct compiler {
+	struct assembler a;
+	struct interp *interp;
+	int fail;
+	// Stack slots in use and the most ever used at once
+	int depth;
+	int max_depth;
+};
+
+static int32_t slot_disp(int slot) {
+	// Below the saved rbx and r12
+	return -16 - 8 * (slot + 1);
+}
+
+static int alloc_slot(struct compiler *c) {
+	int slot = c->depth++;
+	if(c->depth > c->max_depth)
+		c->max_depth = c->depth;
+	return slot;
+}
+
+static void check_null(struct compiler *c) {
+	test_rr(&c->a, RAX, RAX);
+	jcc(&c->a, CC_E, c->fail);
+}
+
+// Runtime helpers called from compiled code
+
+static sobj *jit_lookup(senv *env, sobj *sym) {
+	sobj *val = resolve_symbol(env, sym->val.sym.str, true);
+	if(val == NULL && !has_symbol(env, sym->val.sym.str, true))
+		SET_ERR("Unbound symbol: %s", sym->val.sym.str);
+	return val;
+}
+
+// 0 and an error if op can't be applied, 2 if it is a macro, 1 otherwise
+static int jit_check_callable(sobj *op) {
+	if(op->type == OBJ_BUILTIN_FUNC)
+		return op->val.builtin.is_macro ? 2 : 1;
+	if(op->type == OBJ_LAMBDA)
+		return op->val.lambda->is_macro ? 2 : 1;
+
+	char rep[128];
+	SET_ERR("Trying to treat non-function object as function: %s",
+		get_string_rep(op, rep, sizeof(rep)));
+	return 0;
+}
+
+static void compile_expr(struct compiler *c, sobj *expr);
+
+// Hands expr to the interpreter
+static void compile_fallback(struct compiler *c, sobj *expr) {
+	mov_imm(&c->a, RDI, (uint64_t)(uintptr_t)expr);
+	mov_rr(&c->a, RSI, RBX);
+	mov_imm32(&c->a, RDX, true);
+	call(&c->a, &eval);
+	check_null(c);
+}
+
+static bool is_proper_list(sobj *lst) {
+	return get_list_len(lst) != -1;
+}
+
+// Jumps to target unless reg holds a fixnum
+static void guard_fixnum(struct compiler *c, int reg, int target) {
+	cmp_mem32_imm(&c->a, reg, OFF_TYPE, OBJ_NUMBER);
+	jcc(&c->a, CC_NE, target);
+	cmp_mem32_imm(&c->a, reg, OFF_NUMTYPE, SCHEME_INT);
+	jcc(&c->a, CC_NE, target);
+}
+
+// Sets rax to #t if cc holds after the last compare, #f otherwise
+static void materialise_bool(struct compiler *c, enum cond cc) {
+	struct assembler *a = &c->a;
+	int is_true = new_label(a), done = new_label(a);
+	jcc(a, cc, is_true);
+	mov_imm(a, RAX, (uint64_t)(uintptr_t)fetch_bool(false));
+	jmp(a, done);
+	bind_label(a, is_true);
+	mov_imm(a, RAX, (uint64_t)(uintptr_t)fetch_bool(true));
+	bind_label(a, done);
+}
+
+// Inline body of a primitive whose arguments are in slots. Jumps to generic
+// if the arguments have types the fast path doesn't handle.
+static void compile_prim(struct compiler *c, enum prim_op op, int *slots,
+	int generic) {
+
+	struct assembler *a = &c->a;
+	load(a, RAX, RBP, slot_disp(slots[0]));
+
+	switch(op) {
+	case PRIM_CAR:
+	case PRIM_CDR:
+		cmp_mem32_imm(a, RAX, OFF_TYPE, OBJ_CONS);
+		jcc(a, CC_NE, generic);
+		load(a, RAX, RAX, op == PRIM_CAR ? OFF_CAR : OFF_CDR);
+		return;
+
+	case PRIM_IS_NULL:
+		cmp_mem32_imm(a, RAX, OFF_TYPE, OBJ_EMPTY_LIST);
+		materialise_bool(c, CC_E);
+		return;
+
+	default:
+		break;
+	}
+
+	load(a, RCX, RBP, slot_disp(slots[1]));
+	guard_fixnum(c, RAX, generic);
+	guard_fixnum(c, RCX, generic);
+	load(a, RSI, RAX, OFF_INT);
+	load(a, RCX, RCX, OFF_INT);
+
+	switch(op) {
+	case PRIM_ADD:
+	case PRIM_SUB:
+		alu_rr(a, op == PRIM_ADD ? ALU_ADD : ALU_SUB, RSI, RCX);
+		mov_imm32(a, RDI, SCHEME_INT);
+		// pxor xmm0, xmm0 for the unused double argument
+		emit8(a, 0x66); emit8(a, 0x0F); emit8(a, 0xEF); emit8(a, 0xC0);
+		call(a, &new_numeric);
+		return;
+
+	case PRIM_LT: alu_rr(a, ALU_CMP, RSI, RCX); materialise_bool(c, CC_L); return;
+	case PRIM_GT: alu_rr(a, ALU_CMP, RSI, RCX); materialise_bool(c, CC_G); return;
+	case PRIM_LE: alu_rr(a, ALU_CMP, RSI, RCX); materialise_bool(c, CC_LE); return;
+	case PRIM_GE: alu_rr(a, ALU_CMP, RSI, RCX); materialise_bool(c, CC_GE); return;
+	case PRIM_NUM_EQ: alu_rr(a, ALU_CMP, RSI, RCX); materialise_bool(c, CC_E); return;
+
+	default:
+		return;
+	}
+}
+
+// The primitive that head refers to, if it has a fast path for num_args
+// arguments. Only the binding at compile time is looked at; the compiled
+// code checks that it still holds before taking the fast path.
+static const struct prim *find_prim(struct compiler *c, sobj *head,
+	int num_args, sobj **expected) {
+
+	sobj *bound = head;
+	if(head->type == OBJ_SYMBOL)
+		bound = resolve_symbol(c->interp->root_env, head->val.sym.str, false);
+
+	if(bound == NULL || bound->type != OBJ_BUILTIN_FUNC)
+		return NULL;
+
+	for(size_t i=0; i<NUM_PRIMS; i++) {
+		if(prims[i].func == bound->val.builtin.func
+			&& prims[i].num_args == num_args) {
+			*expected = bound;
+			return &prims[i];
+		}
+	}
+	return NULL;
+}
+
+// (op arg ...) where op is not a special form known at compile time
+static void compile_call(struct compiler *c, sobj *head, sobj *args) {
+	struct assembler *a = &c->a;
+	int num_args = get_list_len(args);
+	int saved_depth = c->depth;
+
+	sobj *expected = NULL;
+	const struct prim *prim = find_prim(c, head, num_args, &expected);
+
+	int op_slot = alloc_slot(c);
+	compile_expr(c, head);
+	store(a, RBP, slot_disp(op_slot), RAX);
+
+	int eval_args = new_label(a), done = new_label(a);
+	bool known_fn = head->type == OBJ_BUILTIN_FUNC && !head->val.builtin.is_macro;
+
+	if(prim != NULL) {
+		mov_imm(a, R11, (uint64_t)(uintptr_t)expected);
+		alu_rr(a, ALU_CMP, RAX, R11);
+		jcc(a, CC_E, eval_args);
+	}
+
+	if(!known_fn) {
+		mov_rr(a, RDI, RAX);
+		call(a, &jit_check_callable);
+		test32_rr(a, RAX, RAX);
+		jcc(a, CC_E, c->fail);
+		cmp_eax_imm(a, 2);
+		jcc(a, CC_NE, eval_args);
+
+		// Macros get their arguments unevaluated
+		load(a, RDI, RBP, slot_disp(op_slot));
+		mov_imm(a, RSI, (uint64_t)(uintptr_t)args);
+		mov_rr(a, RDX, RBX);
+		call(a, &apply_function);
+		check_null(c);
+		jmp(a, done);
+	}
+
+	bind_label(a, eval_args);
+
+	int slots[num_args > 0 ? num_args : 1];
+	sobj *cur = args;
+	for(int i=0; i<num_args; i++, cur = get_list_rest(cur)) {
+		slots[i] = alloc_slot(c);
+		compile_expr(c, get_list_head(cur));
+		store(a, RBP, slot_disp(slots[i]), RAX);
+	}
+
+	int generic = new_label(a);
+	if(prim != NULL) {
+		load(a, RAX, RBP, slot_disp(op_slot));
+		mov_imm(a, R11, (uint64_t)(uintptr_t)expected);
+		alu_rr(a, ALU_CMP, RAX, R11);
+		jcc(a, CC_NE, generic);
+		compile_prim(c, prim->op, slots, generic);
+		jmp(a, done);
+	}
+
+	// Build the argument list back to front, like eval does
+	bind_label(a, generic);
+	mov_imm(a, RAX, (uint64_t)(uintptr_t)fetch_singleton_object(SG_EMPTY_LIST));
+	for(int i=num_args-1; i>=0; i--) {
+		load(a, RDI, RBP, slot_disp(slots[i]));
+		mov_rr(a, RSI, RAX);
+		call(a, &new_cons);
+	}
+	mov_rr(a, RSI, RAX);
+	load(a, RDI, RBP, slot_disp(op_slot));
+	mov_rr(a, RDX, RBX);
+	call(a, &apply_function);
+	check_null(c);
+
+	bind_label(a, done);
+	c->depth = saved_depth;
+}
+
+static void compile_if(struct compiler *c, sobj *args) {
+	struct assembler *a = &c->a;
+	int then = new_label(a), otherwise = new_label(a), done = new_label(a);
+
+	compile_expr(c, get_list_nth(args, 1));
+	cmp_mem32_imm(a, RAX, OFF_TYPE, OBJ_BOOLEAN);
+	jcc(a, CC_NE, then);
+	cmp_mem8_imm(a, RAX, OFF_BOOL, false);
+	jcc(a, CC_E, otherwise);
+
+	bind_label(a, then);
+	compile_expr(c, get_list_nth(args, 2));
+	jmp(a, done);
+
+	bind_label(a, otherwise);
+	compile_expr(c, get_list_nth(args, 3));
+	bind_label(a, done);
+}
+
+static void compile_expr(struct compiler *c, sobj *expr) {
+	if(expr->type == OBJ_SYMBOL) {
+		mov_rr(&c->a, RDI, RBX);
+		mov_imm(&c->a, RSI, (uint64_t)(uintptr_t)expr);
+		call(&c->a, &jit_lookup);
+		check_null(c);
+		return;
+	}
+
+	if(expr->type != OBJ_CONS) {
+		mov_imm(&c->a, RAX, (uint64_t)(uintptr_t)expr);
+		return;
+	}
+
+	sobj *head = get_list_head(expr);
+	sobj *args = get_list_rest(expr);
+	if(!is_proper_list(args)) {
+		compile_fallback(c, expr);
+		return;
+	}
+
+	int num_args = get_list_len(args);
+
+	// Desugaring leaves the special forms in head position as builtins
+	if(head->type == OBJ_BUILTIN_FUNC && head->val.builtin.is_macro) {
+		builtin_fn func = head->val.builtin.func;
+
+		if(func == &builtin_quote && num_args == 1) {
+			mov_imm(&c->a, RAX, (uint64_t)(uintptr_t)get_list_head(args));
+		} else if(func == &builtin_if && num_args == 3) {
+			compile_if(c, args);
+		} else if(func == &builtin_begin && num_args > 0) {
+			for(sobj *cur = args; cur->type == OBJ_CONS; cur = get_list_rest(cur))
+				compile_expr(c, get_list_head(cur));
+		} else {
+			compile_fallback(c, expr);
+		}
+		return;
+	}
+
+	compile_call(c, head, args);
+}
+
+// Copies the code into its own executable mapping
+static jit_fn map_code(struct assembler *a) {
+	void *mem = mmap(NULL, a->len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED)
+		return NULL;
+
+	memcpy(mem, a->code, a->len);
+	if(mprotect(mem, a->len, PROT_READ | PROT_EXEC) != 0) {
+		munmap(mem, a->len);
+		return NULL;
+	}
+
+	return (jit_fn)mem;
+}
+
+bool jit_compile(struct interp *interp, struct s_lambda *lambda) {
+	// Compiled code doesn't trace evaluation
+	if(interp->verbose)
+		return false;
+
+	struct compiler c;
+	memset(&c, 0, sizeof(c));
+	c.interp = interp;
+	struct assembler *a = &c.a;
+
+	// Prologue. The frame size is patched in once the body is compiled
+	push(a, RBP);
+	mov_rr(a, RBP, RSP);
+	push(a, RBX);
+	push(a, R12);
+	emit_rex(a, true, 0, RSP);
+	emit8(a, 0x81);
+	emit_modrm_rr(a, 5, RSP);
+	size_t frame_pos = a->len;
+	emit32(a, 0);
+	mov_rr(a, RBX, RDI);
+
+	c.fail = new_label(a);
+	int epilogue = new_label(a);
+
+	compile_expr(&c, lambda_body(lambda));
+	jmp(a, epilogue);
+
+	bind_label(a, c.fail);
+	// xor eax, eax
+	emit8(a, 0x31);
+	emit8(a, 0xC0);
+
+	bind_label(a, epilogue);
+	// lea rsp, [rbp - 16]
+	emit_rex(a, true, RSP, RBP);
+	emit8(a, 0x8D);
+	emit_modrm_mem(a, RSP, RBP, -16);
+	pop(a, R12);
+	pop(a, RBX);
+	pop(a, RBP);
+	emit8(a, 0xC3);
+
+	// Keeps rsp 16 byte aligned at calls, since the pushes above leave it
+	// aligned
+	patch32(a, frame_pos, (c.max_depth * 8 + 15) & ~15);
+	resolve_fixups(a);
+
+	jit_fn fn = map_code(a);
+	if(fn != NULL) {
+		STAT_ADD(STAT_JIT_COMPILED, 1);
+		STAT_ADD(STAT_JIT_CODE_BYTES, a->len);
+		__atomic_store_n(&lambda->native, fn, __ATOMIC_RELEASE);
+	}
+
+	free(a->code);
+	free(a->labels);
+	free(a->fixups);
+	return fn != NULL;
+}
+
+#else
+
+bool jit_compile(struct interp *interp, struct s_lambda *lambda) {
+	(void)interp;
+	(void)lambda;
+	return false;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <stdbool.h>
+
+#include "environment.h"
+#include "internal_rep.h"
+
+// Baseline JIT for x86-64. Once a lambda has been applied jit_threshold
+// times, its body is translated into machine code by stitching together a
+// fixed template per kind of node: constants, variable loads, if, begin,
+// quote, calls, and inline fixnum arithmetic, comparisons, car, cdr and
+// null? guarded by a check that the operator is still the original builtin.
+// Any other form is compiled to a call back into eval, so the compiled code
+// behaves exactly like the interpreter. apply_function still creates and
+// binds the environment; the native code only replaces eval of the body.
+// Bodies that analysis runs are left to it, so the JIT only compiles with
+// --no-analyse.
+
+// Threshold used by --jit
+#define JIT_DEFAULT_THRESHOLD 50
+
+typedef struct s_obj *(*jit_fn)(struct s_env *env);
+
+// Compiles the body of lambda and publishes it in lambda->native. Returns
+// false, leaving the lambda interpreted, on other architectures or if the
+// code could not be mapped.
+bool jit_compile(struct interp *interp, struct s_lambda *lambda);
+
+#endif
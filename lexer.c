@@ -8,13 +8,13 @@
 
 #include "common.h"
 #include "lexer.h"
+#include "stats.h"
 
 struct tok_defn {
     char *pattern;
     enum tok_class cls;
     char *cls_name;
     int patflags;
-    regex_t regex;
 };
 
 struct tok_lst {
@@ -26,44 +26,47 @@ struct tok_lst {
 
 // Grammar from: https://www.scheme.com/tspl2d/grammar.html
 // HACK: List must be in same order as lexer.h class definitions enum
-struct tok_defn definitions[] = {
-    { "^[ \t\n\r\f\v]+", TOK_WHITESPACE, "whitespace", REG_EXTENDED, {} },
-    { "^;.*$", TOK_COMMENT, "line comment", REG_EXTENDED | REG_NEWLINE, {} },
-    { "^'()", TOK_EMPTY_LIST, "empty list", 0, {} },
-    { "^#t", TOK_BOOL_TRUE, "true", 0, {} },
-    { "^#f", TOK_BOOL_FALSE, "false", 0, {} },
-    { "^[0-9]+", TOK_NUMBER, "number", REG_EXTENDED, {} },
+// The definitions are constant; each interpreter compiles its own copy of
+// the regexes (see struct lexer), since regexec serialises callers that share
+// a compiled regex.
+static const struct tok_defn definitions[] = {
+    { "^[ \t\n\r\f\v]+", TOK_WHITESPACE, "whitespace", REG_EXTENDED },
+    // Not REG_NEWLINE, since then '^' also matches after every newline and
+    // a failed match scans the rest of the input
+    { "^;[^\n]*", TOK_COMMENT, "line comment", REG_EXTENDED },
+    { "^'()", TOK_EMPTY_LIST, "empty list", 0 },
+    { "^#t", TOK_BOOL_TRUE, "true", 0 },
+    { "^#f", TOK_BOOL_FALSE, "false", 0 },
+    { "^[0-9]+", TOK_NUMBER, "number", REG_EXTENDED },
     { 
-        // A string is anything that is not '"', excluding '\"' and '\\',
-        // surrounded by quotes. The longest match requirement will make it so
-        // that we get the correct string in the case that there are multiple
-        // escaped quotes
-        .pattern = "^\"(\\\"|\\\\|[^\"\\])*\"", 
+        // A string is any sequence of characters that are not '"' or '\',
+        // or of escape sequences of '\' followed by any character,
+        // surrounded by quotes. Escapes are interpreted by the parser
+        .pattern = "^\"([^\"\\]|\\\\.)*\"", 
         .cls = TOK_STRING, 
         .cls_name = "string", 
         .patflags = REG_EXTENDED, 
-        .regex = {} 
     },
-    { "^#(", TOK_VEC_OPEN, "vector open", 0, {} },
-    { "^(", TOK_PAREN_OPEN, "open paren", 0, {} },
-    { "^)", TOK_PAREN_CLOSE, "close paren", 0, {} },
-    { "^'", TOK_QUOTE, "quote", 0, {} },
-    { "^`", TOK_QUASIQUOTE, "quasiquote", 0, {} },
-    { "^,@", TOK_UNQUOTE_SPLICE, "unquote splice", 0, {} },
-    { "^,", TOK_UNQUOTE, "unquoce", 0, {} },
-    { "^\\. ", TOK_CONS_DOT, "cons dot", 0, {} },
+    { "^#(", TOK_VEC_OPEN, "vector open", 0 },
+    { "^(", TOK_PAREN_OPEN, "open paren", 0 },
+    { "^)", TOK_PAREN_CLOSE, "close paren", 0 },
+    { "^'", TOK_QUOTE, "quote", 0 },
+    { "^`", TOK_QUASIQUOTE, "quasiquote", 0 },
+    { "^,@", TOK_UNQUOTE_SPLICE, "unquote splice", 0 },
+    { "^,", TOK_UNQUOTE, "unquoce", 0 },
+    { "^\\. ", TOK_CONS_DOT, "cons dot", 0 },
     // The '-' doesn't need to be escaped since it is interpreted as literal
     // if first or last character of a character class in the POSIX
-    // non-extended regex
+    // non-extended regex. Subsequent characters follow R5RS, so that names
+    // like let* and set! are single identifiers
     { 
-        .pattern = "^[a-z!$%&*/:<=>?~_^+-][-+._a-z0-9?]*", 
+        .pattern = "^[a-z!$%&*/:<=>?~_^+-][-+._a-z0-9!$%&*/:<=>?~^]*", 
         .cls = TOK_IDENTIFIER, 
         .cls_name = "identifier", 
         .patflags = REG_ICASE, 
-        .regex = {} 
     },
     // HACK: pretend this doesnt exist in NUM_TOK_DEFNS
-    { NULL, TOK_END_OF_FILE, "EOF", 0, {} },
+    { NULL, TOK_END_OF_FILE, "EOF", 0 },
 };
 
 char *get_tokcls_name(enum tok_class cls) {
@@ -71,21 +74,38 @@ char *get_tokcls_name(enum tok_class cls) {
 }
 
 // DIRTY HACK: -1 to not include the EOF token so we never try to match it
-const int NUM_TOK_DEFNS = sizeof(definitions)/sizeof(struct tok_defn) - 1;
+#define NUM_TOK_DEFNS ((int)(sizeof(definitions)/sizeof(struct tok_defn) - 1))
+
+struct lexer {
+    regex_t regexes[NUM_TOK_DEFNS];
+};
+
+struct lexer *compile_token_definitions() {
+    uint64_t start = stat_now_ns();
+    struct lexer *lx = malloc(sizeof(struct lexer));
+    ensure_mem(lx);
 
-void compile_token_definitions() {
     for(int i=0; i< NUM_TOK_DEFNS; i++) {
-        struct tok_defn *tdn = &definitions[i];
-        int ret = regcomp(&tdn->regex, tdn->pattern, tdn->patflags);
+        const struct tok_defn *tdn = &definitions[i];
+        int ret = regcomp(&lx->regexes[i], tdn->pattern, tdn->patflags);
 
         if(ret != 0) {
             char buf[8192];
-            regerror(ret, &tdn->regex, buf, sizeof(buf));
+            regerror(ret, &lx->regexes[i], buf, sizeof(buf));
             log_err("Failed to compile regex %s\nReason: %s\n", 
                 tdn->pattern, buf);
             exit(1);
         }
     }
+
+    STAT_ADD(STAT_LEXER_COMPILE_NS, stat_now_ns() - start);
+    return lx;
+}
+
+void free_lexer(struct lexer *lx) {
+    for(int i=0; i<NUM_TOK_DEFNS; i++)
+        regfree(&lx->regexes[i]);
+    free(lx);
 }
 
 void add_token(struct tok_lst *ta, enum tok_class cls, 
@@ -127,18 +147,27 @@ void free_tok_lst(struct tok_lst *tokens) {
  * Given an input string, returns array of tokens. Assumes that the input string
  * is immutable, since the returned tokens will retain pointers into it.
  */
-struct tok_lst *tokenise_string(char const *input_str) {
-    int input_str_len = strlen(input_str);
+struct tok_lst *tokenise_string(struct lexer *lx, char const *input_str) {
+    return tokenise_buffer(lx, input_str, strlen(input_str));
+}
+
+static struct tok_lst *match_tokens(struct lexer *lx, char const *input_str,
+    int input_str_len) {
+
     struct tok_lst *ta = make_tok_lst(input_str_len/4);
     char const *offset_str = input_str;
 
     for(int i=0; i<NUM_TOK_DEFNS; i++) {
-        struct tok_defn tdn = definitions[i];
+        const struct tok_defn *tdn = &definitions[i];
 
         // You're supposed to pass in an array, but an array of length one
         // is equivalent to just getting the address to the variable
+        // REG_STARTEND passes the length of the input, otherwise regexec
+        // computes it with strlen on every call
         regmatch_t match;
-        int ret = regexec(&tdn.regex, offset_str, 1, &match, 0);
+        match.rm_so = 0;
+        match.rm_eo = input_str + input_str_len - offset_str;
+        int ret = regexec(&lx->regexes[i], offset_str, 1, &match, REG_STARTEND);
 
         ensure_exit(ret != REG_ESPACE, 1, "Ran out of memory at %s",
             offset_str);
@@ -153,14 +182,13 @@ struct tok_lst *tokenise_string(char const *input_str) {
         int toklen = match.rm_eo - match.rm_so;
 
         // Ignore whitespace and comments
-        if(tdn.cls != TOK_WHITESPACE && tdn.cls != TOK_COMMENT)
-            add_token(ta, tdn.cls, offset_str, toklen);
+        if(tdn->cls != TOK_WHITESPACE && tdn->cls != TOK_COMMENT)
+            add_token(ta, tdn->cls, offset_str, toklen);
 
         offset_str += toklen;
 
         // If offset goes past the end of the string, we're done with matching
-        // everything. Since input_str+len is the address of the null
-        // terminator, no further manipulation is needed
+        // everything
         if(offset_str >= input_str + input_str_len) {
             // Add EOF token
             add_token(ta, TOK_END_OF_FILE, offset_str, 0);
@@ -173,10 +201,121 @@ struct tok_lst *tokenise_string(char const *input_str) {
     }
 
     // No token matched
-    log_err("No token matched. String remaining: %s", offset_str);
+    log_err("No token matched. String remaining: %.*s",
+        (int)(input_str + input_str_len - offset_str), offset_str);
     return NULL;
 }
 
+/**
+ * Same as tokenise_string, but the input is the first input_str_len bytes of
+ * input_str and does not need to be null terminated.
+ */
+struct tok_lst *tokenise_buffer(struct lexer *lx, char const *input_str,
+    int input_str_len) {
+
+    uint64_t start = stat_now_ns();
+    struct tok_lst *ta = match_tokens(lx, input_str, input_str_len);
+    STAT_ADD(STAT_TOKENISE_NS, stat_now_ns() - start);
+    return ta;
+}
+
+static bool is_initial(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+        || (c != '\0' && strchr("!$%&*/:<=>?~_^+-", c) != NULL);
+}
+
+static bool is_subsequent(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9')
+        || (c != '\0' && strchr("-+._!$%&*/:<=>?~^", c) != NULL);
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f'
+        || c == '\v';
+}
+
+/**
+ * Each case is the definition of the same class above, tried in the same
+ * order, so that this matches exactly what match_tokens would.
+ */
+int scan_token(char const *s, int len, enum tok_class *cls) {
+    if(len <= 0)
+        return 0;
+
+    int n = 0;
+    if(is_space(s[0])) {
+        while(n < len && is_space(s[n])) n++;
+        *cls = TOK_WHITESPACE;
+        return n;
+    }
+
+    if(s[0] == ';') {
+        while(n < len && s[n] != '\n') n++;
+        *cls = TOK_COMMENT;
+        return n;
+    }
+
+    if(len >= 3 && s[0] == '\'' && s[1] == '(' && s[2] == ')') {
+        *cls = TOK_EMPTY_LIST;
+        return 3;
+    }
+
+    if(len >= 2 && s[0] == '#' && (s[1] == 't' || s[1] == 'f')) {
+        *cls = s[1] == 't' ? TOK_BOOL_TRUE : TOK_BOOL_FALSE;
+        return 2;
+    }
+
+    if(s[0] >= '0' && s[0] <= '9') {
+        while(n < len && s[n] >= '0' && s[n] <= '9') n++;
+        *cls = TOK_NUMBER;
+        return n;
+    }
+
+    if(s[0] == '"') {
+        for(n = 1; n < len && s[n] != '"'; n++) {
+            if(s[n] == '\\' && ++n == len)
+                return 0;
+        }
+        if(n == len)
+            return 0;
+        *cls = TOK_STRING;
+        return n + 1;
+    }
+
+    if(len >= 2 && s[0] == '#' && s[1] == '(') {
+        *cls = TOK_VEC_OPEN;
+        return 2;
+    }
+
+    switch(s[0]) {
+    case '(': *cls = TOK_PAREN_OPEN; return 1;
+    case ')': *cls = TOK_PAREN_CLOSE; return 1;
+    case '\'': *cls = TOK_QUOTE; return 1;
+    case '`': *cls = TOK_QUASIQUOTE; return 1;
+    case ',':
+        if(len >= 2 && s[1] == '@') {
+            *cls = TOK_UNQUOTE_SPLICE;
+            return 2;
+        }
+        *cls = TOK_UNQUOTE;
+        return 1;
+    }
+
+    if(len >= 2 && s[0] == '.' && s[1] == ' ') {
+        *cls = TOK_CONS_DOT;
+        return 2;
+    }
+
+    if(is_initial(s[0])) {
+        for(n = 1; n < len && is_subsequent(s[n]); n++);
+        *cls = TOK_IDENTIFIER;
+        return n;
+    }
+
+    return 0;
+}
+
 void print_token(struct token *tok) {
     assert(tok != NULL);
     printf("%s: %1.*s\n", 
@@ -212,3 +351,12 @@ void advance_token_stream(struct tok_lst *tokens) {
     assert(has_next_token(tokens));
     tokens->position++;
 }
+
+int get_stream_pos(struct tok_lst *tokens) {
+    return tokens->position;
+}
+
+void set_stream_pos(struct tok_lst *tokens, int n) {
+    assert(n >= 0 && n < tokens->len);
+    tokens->position = n;
+}
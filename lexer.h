@@ -31,13 +31,23 @@ struct token {
 };
 
 struct tok_lst;
+struct lexer;
 
 char *get_tokcls_name(enum tok_class cls);
 
-void compile_token_definitions();
+struct lexer *compile_token_definitions();
+void free_lexer(struct lexer *lx);
 void free_tok_lst(struct tok_lst *tokens);
 
-struct tok_lst *tokenise_string(char const *input_str);
+struct tok_lst *tokenise_string(struct lexer *lx, char const *input_str);
+struct tok_lst *tokenise_buffer(struct lexer *lx, char const *input_str,
+    int input_str_len);
+
+// Length of the token at the start of the first len bytes of s, setting cls
+// to its class, or 0 if no token matches there. Accepts exactly the tokens
+// tokenise_buffer does in text without null bytes, without the regexes, for
+// skimming source text.
+int scan_token(char const *s, int len, enum tok_class *cls);
 
 void print_token(struct token *tok);
 void print_tokens(struct tok_lst *tokens);
@@ -9,56 +9,63 @@
 
 #include "builtins.h"
 #include "common.h"
+#include "compile.h"
 #include "lexer.h"
 #include "parser.h"
 #include "eval.h"
 #include "environment.h"
+#include "interp.h"
+#include "jit.h"
+#include "profiler.h"
+#include "stats.h"
 
 const char *prompt = "scheme> ";
+const char *profile_folded_path = "profile.folded";
 
-long file_size(FILE *fp) {
-	fseek(fp, 0, SEEK_END);
-	long size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	return size;
-}
-
-void eval_file(char *path, struct s_env *env) {
+void eval_file(char *path, struct interp *interp) {
 	log("Evaluating file: %s", path);
-	FILE *fp = fopen(path, "r");
-	long size = file_size(fp);
-	char *buf = calloc(1, size);
-	fread(buf, 1, size, fp);
-	fclose(fp);
-
-	struct tok_lst *toks = tokenise_string(buf);
-	struct s_obj *objs = parse_tokens(toks);
-	free(buf);
-
-	eval(objs, env, true);
+	interp_eval_file(interp, path);
 }
 
 int main(int argc, char **argv) {
-    compile_token_definitions();
-
     int print_tokens_flag = false;
     int interactive_flag = false;
     int print_cst_flag = false;
     int verbose_flag = false;
+    int hash_cons_flag = false;
+    int profile_flag = false;
+    int stats_flag = false;
+    int jit_flag = false;
+    int no_analyse_flag = false;
+    int no_lazy_flag = false;
     int help_flag = false;
+    char *compile_out = NULL;
+    char *cache_dir = getenv("SCHEME_CACHE_DIR");
     // char *input_file;
 
     struct option long_options[] = {
         {"interactive", no_argument, &interactive_flag, true},
         {"verbose", no_argument, &verbose_flag, true},
+        {"hash-cons", no_argument, &hash_cons_flag, true},
+        {"profile", no_argument, &profile_flag, true},
+        {"stats", no_argument, &stats_flag, true},
+        {"jit", no_argument, &jit_flag, true},
+        {"no-analyse", no_argument, &no_analyse_flag, true},
+        {"no-lazy", no_argument, &no_lazy_flag, true},
         {"tokens", no_argument, &print_tokens_flag, true},
         {"cst", no_argument, &print_cst_flag, true},
         {"help", no_argument, &help_flag, true},
+        {"compile-to-c", required_argument, NULL, 'c'},
+        {"cache-dir", required_argument, NULL, 'd'},
+        {0, 0, 0, 0},
     };
 
     int ch;
     while((ch = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
-        continue;
+        if(ch == 'c')
+            compile_out = optarg;
+        else if(ch == 'd')
+            cache_dir = optarg;
     }
 
     // Advance past parsed options
@@ -71,6 +78,24 @@ int main(int argc, char **argv) {
     	printf("  --verbose: Verbose logging\n");
     	printf("  --tokens: Print lexer output\n");
     	printf("  --cst:    Print debug output of parser\n");
+    	printf("  --hash-cons: Share structurally equal quoted constants,"
+    		" which makes\n             them immutable\n");
+    	printf("  --profile: Sample Scheme procedures and print a profile on"
+    		" exit.\n             Folded stacks are written to %s\n",
+    		profile_folded_path);
+    	printf("  --stats: Print allocation, lookup and timing counters on"
+    		" exit\n");
+    	printf("  --jit: Compile procedures to native code after %d calls,"
+    		" with --no-analyse\n", JIT_DEFAULT_THRESHOLD);
+    	printf("  --no-analyse: Evaluate procedure bodies with eval instead of"
+    		" analysing them\n             first\n");
+    	printf("  --no-lazy: Parse the bodies of top-level functions when"
+    		" they are loaded\n             instead of on their first call\n");
+    	printf("  --cache-dir=<dir>: Cache parsed files in dir, which defaults"
+    		" to\n             $SCHEME_CACHE_DIR. Off if neither is set\n");
+    	printf("  --compile-to-c=<out.c>: Compile builtins.scheme and the input"
+    		" file into a C\n             program instead of running them."
+    		" Link it with libscheme.a\n");
     	printf("\nIf you don't want to pass in an input file, use noin,"
     		" as in `./scheme noin`");
     	return EX_USAGE;
@@ -85,19 +110,43 @@ int main(int argc, char **argv) {
     if(print_tokens_flag) log("Printing lexer output");
     if(print_cst_flag)    log("Printing parser output");
 
-    set_verbose(verbose_flag);
-
     // Initialise everything
-    initialise_singleton_objects();
-    struct s_env *root_env = get_root_env();
-	add_builtins(root_env);
+    struct interp *interp = create_interp();
+    interp->verbose = verbose_flag;
+    interp->hash_cons = hash_cons_flag;
+    if(jit_flag)
+        interp->jit_threshold = JIT_DEFAULT_THRESHOLD;
+    interp->analyse = !no_analyse_flag;
+    interp->lazy_bodies = !no_lazy_flag;
+    interp->cache_dir = cache_dir;
+
+    if(compile_out != NULL) {
+        const char *paths[] = { "builtins.scheme", argv[0] };
+        int num_paths = strncmp(argv[0], "noin", 4) != 0 ? 2 : 1;
+
+        // Reported once below instead of as it happens
+        clear_err_reason(false);
+        FILE *out = fopen(compile_out, "w");
+        ensure_exit(out != NULL, EX_CANTCREAT, "Cannot write %s", compile_out);
+        bool ok = compile_to_c(interp, paths, num_paths, out);
+        fclose(out);
+        if(!ok) {
+            remove(compile_out);
+            exit_msg(EX_DATAERR, "Compilation failed: %s", get_err_reason());
+        }
+        return 0;
+    }
+
+    if(profile_flag) {
+        start_profiler(1000);
+    }
 
 	// Add builtin functions written in scheme
-	eval_file("builtins.scheme", root_env);
+	eval_file("builtins.scheme", interp);
 
 	// Evaluate input file
 	if(strncmp(argv[0], "noin", 4) != 0) {
-		eval_file(argv[0], root_env);
+		eval_file(argv[0], interp);
 	}
 
 	printf("\n\nWelcome to scheme. Use <C-d> when input is empty to exit.\n");
@@ -120,17 +169,22 @@ int main(int argc, char **argv) {
         ensure_exit(linelen >= 0, 1, "Failed to read input");
 
         // Step 2: Parse an eval
-        struct tok_lst *tokens = tokenise_string(inbuf);
+        struct tok_lst *tokens = tokenise_string(interp->lexer, inbuf);
         if(tokens == NULL)
             continue;
         if(print_tokens_flag)
             print_tokens(tokens);
 
-        struct s_obj *root_obj = parse_tokens(tokens);
+        struct s_obj *root_obj = parse_tokens(interp, tokens);
+        if(root_obj == NULL) {
+            free_tok_lst(tokens);
+            continue;
+        }
+
         if(print_cst_flag)
             print_obj_debug(root_obj, 0);
 
-        struct s_obj *eval_res = eval(root_obj, root_env, true);
+        struct s_obj *eval_res = eval_toplevel(root_obj, interp->root_env);
 
         // Step 3: print output
         if(eval_res != NULL)
@@ -141,5 +195,22 @@ int main(int argc, char **argv) {
     }
 
     printf("\nExiting scheme interpreter.\n");
+
+    if(profile_flag) {
+        stop_profiler();
+        fflush(stdout);
+        FILE *folded = fopen(profile_folded_path, "w");
+        if(folded == NULL)
+            log_err("Cannot write %s", profile_folded_path);
+        write_profile(stderr, folded);
+        if(folded != NULL)
+            fclose(folded);
+    }
+
+    if(stats_flag) {
+        fflush(stdout);
+        print_stats(stderr);
+    }
+
     return 0;
 }
\ No newline at end of file
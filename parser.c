@@ -3,10 +3,48 @@
 
 #include "common.h"
 #include "internal_rep.h"
+#include "interp.h"
 #include "lexer.h"
 #include "parser.h"
+#include "stats.h"
 
-struct s_obj *tok_to_obj(struct token *tok) {
+// Converts a string literal token, including its quotes, into a string
+// object, interpreting backslash escapes. Returns NULL with the error set on
+// an unknown escape.
+struct s_obj *string_tok_to_obj(struct token *tok) {
+	const char *src = tok->start_pos + 1;
+	int srclen = tok->len - 2;
+	// Heap allocated since string literals can be arbitrarily long
+	char *buf = malloc(srclen+1);
+	ensure_mem(buf);
+	int len = 0;
+
+	for(int i=0; i<srclen; i++) {
+		if(src[i] != '\\' || i+1 == srclen) {
+			buf[len++] = src[i];
+			continue;
+		}
+
+		switch(src[++i]) {
+		case 'n':  buf[len++] = '\n'; break;
+		case 't':  buf[len++] = '\t'; break;
+		case 'r':  buf[len++] = '\r'; break;
+		case '0':  buf[len++] = '\0'; break;
+		case '\\': buf[len++] = '\\'; break;
+		case '"':  buf[len++] = '"'; break;
+		default:
+			SET_ERR("Unknown escape \\%c in string literal", src[i]);
+			free(buf);
+			return NULL;
+		}
+	}
+
+	struct s_obj *str = new_string(len, buf);
+	free(buf);
+	return str;
+}
+
+struct s_obj *tok_to_obj(struct interp *interp, struct token *tok) {
 	switch(tok->cls) {
 	case TOK_EMPTY_LIST:
 		return fetch_singleton_object(SG_EMPTY_LIST);
@@ -23,16 +61,18 @@ struct s_obj *tok_to_obj(struct token *tok) {
 		return new_numeric(SCHEME_INT, num, 0);
 	}
 	case TOK_STRING:
+		return string_tok_to_obj(tok);
 	case TOK_QUOTE:
-		return fetch_or_create_symbol(strlen("quote"), "quote");
+		return fetch_or_create_symbol(interp, strlen("quote"), "quote");
 	case TOK_QUASIQUOTE:
-		return fetch_or_create_symbol(strlen("quasiquote"), "quasiquote");
+		return fetch_or_create_symbol(interp, strlen("quasiquote"), "quasiquote");
 	case TOK_UNQUOTE_SPLICE:
-		return fetch_or_create_symbol(strlen("unquote-splice"), "unquote-splice");
+		return fetch_or_create_symbol(interp, 
+			strlen("unquote-splice"), "unquote-splice");
 	case TOK_UNQUOTE:
-		return fetch_or_create_symbol(strlen("unquote"), "unquote");
+		return fetch_or_create_symbol(interp, strlen("unquote"), "unquote");
 	case TOK_IDENTIFIER:
-		return fetch_or_create_symbol(tok->len, tok->start_pos);
+		return fetch_or_create_symbol(interp, tok->len, tok->start_pos);
 	default:
 		exit_msg(EX_SOFTWARE, "Cannot convert token class %d to scheme obj",
 			tok->cls);
@@ -40,12 +80,18 @@ struct s_obj *tok_to_obj(struct token *tok) {
 }
 
 // =========================== PUSHDOWN AUTOMATA =============================
-// These two functions constitute a two-state deterministic pushdown automata,
-// so there is no backtracking and parsing is done in linear time. Instead of 
-// returnig a parse tree, however, it directly converts the tokens into
+// The parser is a deterministic pushdown automaton with an explicit stack, so
+// there is no backtracking, parsing is done in linear time, and neither the
+// length of a list nor the nesting depth uses any C stack. Instead of
+// returning a parse tree, however, it directly converts the tokens into
 // the internal object representation of the runtime, which is possible
 // due to homoiconicity, where code *is* scheme data. By design, there
 // is no parse tree, only the scheme representation of the input code.
+//
+// Lists are built in a single forward pass by appending to the last cons
+// cell of the list. A quote prefix is a frame that wraps the next
+// complete s-expression. Syntax errors are reported with SET_ERR and NULL is
+// returned to the caller.
 // ===========================================================================
 
 /* Grammar:
@@ -58,150 +104,201 @@ SE -> QF SE
 QF -> quote | quasiquote | unquote | unquote-splice
 */
 
-struct s_obj *p_sexpr(struct tok_lst *toks);
-struct s_obj *p_cons(struct tok_lst *toks);
-
-struct s_obj *p_cons(struct tok_lst *toks) {
-    struct token *cur = read_cur_tok(toks);
-    switch(cur->cls) {
-
-    // Deriv 1: quoted sexpr
-    case TOK_QUOTE:
-    case TOK_QUASIQUOTE:
-    case TOK_UNQUOTE:
-    case TOK_UNQUOTE_SPLICE:
-    case TOK_EMPTY_LIST:
-    case TOK_BOOL_TRUE:
-    case TOK_BOOL_FALSE:
-    case TOK_NUMBER:
-    case TOK_STRING:
-    case TOK_PAREN_OPEN:
-    case TOK_IDENTIFIER: {
-        // Either case, begin with trying to get an sexpr
-        struct s_obj *se = p_sexpr(toks);
-        ensure_exit(se != NULL, EX_DATAERR, 
-            "Expected to get an s-expression, but did not get one.");
-
-        // If it's a cons dot, we're in the cons cell case(1), other wise we're
-        // in the list case(2)
-        struct token *after_se = read_cur_tok(toks);
-        struct s_obj *right;
-
-        if(after_se->cls == TOK_CONS_DOT) {
-            // Case 1: SE |. SE
-            advance_token_stream(toks);
-
-            right = p_sexpr(toks);
-            ensure_exit(se != NULL, EX_DATAERR, 
-                "Expected to get an s-expression, but did not get one.");
-        } else {
-            // Case 2: SE |Cons
-            right = p_cons(toks);
-        }
+enum frame_kind {
+    FRAME_TOPLEVEL,
+    FRAME_LIST,
+    FRAME_QUOTE,
+};
 
-        struct s_obj *cons = new_cons(se, right);
-        return cons;
-    }
+// Where a list frame is in the Cons production
+enum dot_state {
+    DOT_NONE,       // SE Cons
+    DOT_EXPECTING,  // SE . |SE
+    DOT_DONE,       // SE . SE|
+};
 
-    // End of list
-    case TOK_PAREN_CLOSE: {
-        // dont' advance token stream here, let s_expr deal with it
-        //advance_token_stream(toks);
-        return fetch_singleton_object(SG_EMPTY_LIST);
-    }
+struct parse_frame {
+    enum frame_kind kind;
+    enum dot_state dot;
+    // List frames: the list so far and its last cons cell, NULL while the
+    // list is empty. Quote frames: the quote symbol in head.
+    struct s_obj *head;
+    struct s_obj *last;
+};
 
-    // End of file
-    case TOK_END_OF_FILE: {
-    	// debug("Hit EOF");
-        return fetch_singleton_object(SG_EMPTY_LIST);
-    }
+struct parse_stack {
+    int capacity;
+    int len;
+    struct parse_frame *frames;
+};
 
-    case TOK_VEC_OPEN: {
-        log_err("Vectors are currently not supported.");
-        exit(1);
-    }
+static void push_frame(struct parse_stack *stack, enum frame_kind kind,
+    struct s_obj *head) {
 
-    case TOK_WHITESPACE:
-    case TOK_COMMENT:
-    case TOK_CONS_DOT: {
-        log_err("Unexpected token: ");
-        print_token(cur);
-        exit(1);    
-    }
+    if(stack->len == stack->capacity) {
+        stack->capacity = stack->capacity < 16 ? 16 : stack->capacity*2;
+        stack->frames = realloc(stack->frames, 
+            stack->capacity*sizeof(struct parse_frame));
+        ensure_mem(stack->frames);
     }
 
-    ensure_exit(true, EX_SOFTWARE, "Control should never reach here");
+    struct parse_frame *frame = &stack->frames[stack->len++];
+    frame->kind = kind;
+    frame->dot = DOT_NONE;
+    frame->head = head;
+    frame->last = NULL;
+}
+
+static struct parse_frame *top_frame(struct parse_stack *stack) {
+    return &stack->frames[stack->len-1];
 }
 
-struct s_obj *p_sexpr(struct tok_lst *toks) {
-    struct token *cur = read_cur_tok(toks);
-    switch(cur->cls) {
-
-    // Deriv 1: quoted sexpr
-    case TOK_QUOTE:
-    case TOK_QUASIQUOTE:
-    case TOK_UNQUOTE:
-    case TOK_UNQUOTE_SPLICE: {
-        struct s_obj *left = tok_to_obj(cur);
-        advance_token_stream(toks);
-
-        // We don't need to save state and potentially backtrack, since if
-        // it fails to parse an sexpr here it means that we quoted something
-        // invalid
-        struct s_obj *right = p_sexpr(toks);
-        ensure_exit(right != NULL, EX_DATAERR, "You can only quote an sexpr");
-
-        struct s_obj *quote_arglist = new_cons(right, 
-        	fetch_singleton_object(SG_EMPTY_LIST));
-        struct s_obj *cons = new_cons(left, quote_arglist);
-        return cons;
+// Hands a complete s-expression to the frame on top of the stack. Completes
+// any quote frames it finishes. Returns false on a syntax error.
+static bool deliver(struct parse_stack *stack, struct s_obj *se) {
+    struct s_obj *emptylist = fetch_singleton_object(SG_EMPTY_LIST);
 
+    // Unwind quotes: 'x becomes (quote x)
+    struct parse_frame *frame = top_frame(stack);
+    while(frame->kind == FRAME_QUOTE) {
+        se = new_cons(frame->head, new_cons(se, emptylist));
+        stack->len--;
+        frame = top_frame(stack);
     }
 
-    case TOK_PAREN_OPEN: {
-        advance_token_stream(toks);
-        struct s_obj *cons = p_cons(toks);
+    switch(frame->dot) {
+    case DOT_NONE: {
+        struct s_obj *cell = new_cons(se, emptylist);
+        if(frame->last == NULL)
+            frame->head = cell;
+        else
+            frame->last->val.cc.right = cell;
+        frame->last = cell;
+        return true;
+    }
 
-        // Ensure open is paired with a close paren
-        cur = read_cur_tok(toks);
-        ensure_exit(cur->cls == TOK_PAREN_CLOSE, EX_DATAERR,
-            "Unexpected token class when parsing s-expression: %s",
-            get_tokcls_name(cur->cls));
-        advance_token_stream(toks);
+    case DOT_EXPECTING:
+        frame->last->val.cc.right = se;
+        frame->dot = DOT_DONE;
+        return true;
 
-        return cons;
+    case DOT_DONE:
+        SET_ERR("Expected ) after the s-expression following a cons dot");
+        return false;
     }
 
-    case TOK_EMPTY_LIST:
-    case TOK_BOOL_TRUE:
-    case TOK_BOOL_FALSE:
-    case TOK_NUMBER:
-    case TOK_STRING:
-    case TOK_IDENTIFIER: {
-        struct s_obj *emptylist = tok_to_obj(cur);
-        advance_token_stream(toks);
-        return emptylist;
-    }
+    return false;
+}
 
-    case TOK_WHITESPACE:
-    case TOK_COMMENT:
-    case TOK_VEC_OPEN:
-    case TOK_PAREN_CLOSE:
-    case TOK_CONS_DOT:
-    case TOK_END_OF_FILE: {
-        log_err("Unexpected token: ");
-        print_token(cur);
-        exit(1);
-    }
-    }
+static struct s_obj *parse_error(struct parse_stack *stack) {
+    free(stack->frames);
+    return NULL;
 }
 
-struct s_obj *parse_tokens(struct tok_lst *tokens) {
-    struct s_obj *lst = p_cons(tokens);
+static struct s_obj *parse_stack_machine(struct interp *interp,
+    struct tok_lst *tokens) {
+
+    struct parse_stack stack = { 0, 0, NULL };
+    struct s_obj *emptylist = fetch_singleton_object(SG_EMPTY_LIST);
+
+    // The top-level frame collects every s-expression in the input
+    push_frame(&stack, FRAME_TOPLEVEL, emptylist);
 
-    // Add implicit begin
-    struct s_obj *beg = fetch_or_create_symbol(strlen("begin"), "begin");
-    struct s_obj *root = new_cons(beg, lst);
+    while(true) {
+        struct token *cur = read_cur_tok(tokens);
+        struct parse_frame *frame = top_frame(&stack);
+
+        switch(cur->cls) {
+        case TOK_QUOTE:
+        case TOK_QUASIQUOTE:
+        case TOK_UNQUOTE:
+        case TOK_UNQUOTE_SPLICE:
+            push_frame(&stack, FRAME_QUOTE, tok_to_obj(interp, cur));
+            break;
+
+        case TOK_PAREN_OPEN:
+            push_frame(&stack, FRAME_LIST, emptylist);
+            break;
+
+        case TOK_EMPTY_LIST:
+        case TOK_BOOL_TRUE:
+        case TOK_BOOL_FALSE:
+        case TOK_NUMBER:
+        case TOK_STRING:
+        case TOK_IDENTIFIER: {
+            struct s_obj *se = tok_to_obj(interp, cur);
+            if(se == NULL || !deliver(&stack, se))
+                return parse_error(&stack);
+            break;
+        }
+
+        case TOK_PAREN_CLOSE: {
+            if(frame->kind != FRAME_LIST) {
+                if(frame->kind == FRAME_QUOTE)
+                    SET_ERR("You can only quote an s-expression");
+                else
+                    SET_ERR("Unexpected )");
+                return parse_error(&stack);
+            }
+
+            if(frame->dot == DOT_EXPECTING) {
+                SET_ERR("Expected an s-expression after a cons dot");
+                return parse_error(&stack);
+            }
+
+            struct s_obj *lst = frame->head;
+            stack.len--;
+            if(!deliver(&stack, lst))
+                return parse_error(&stack);
+            break;
+        }
+
+        case TOK_CONS_DOT:
+            if(frame->kind != FRAME_LIST || frame->dot != DOT_NONE
+                || frame->last == NULL) {
+                SET_ERR("Unexpected cons dot");
+                return parse_error(&stack);
+            }
+
+            frame->dot = DOT_EXPECTING;
+            break;
+
+        case TOK_END_OF_FILE: {
+            if(frame->kind == FRAME_QUOTE) {
+                SET_ERR("You can only quote an s-expression");
+                return parse_error(&stack);
+            }
+
+            if(frame->kind != FRAME_TOPLEVEL) {
+                SET_ERR("Unexpected end of input, missing )");
+                return parse_error(&stack);
+            }
+
+            // Add implicit begin
+            struct s_obj *beg = fetch_or_create_symbol(interp, 
+                strlen("begin"), "begin");
+            struct s_obj *root = new_cons(beg, frame->head);
+            free(stack.frames);
+            return root;
+        }
+
+        case TOK_VEC_OPEN:
+            SET_ERR("Vectors are currently not supported.");
+            return parse_error(&stack);
+
+        case TOK_WHITESPACE:
+        case TOK_COMMENT:
+            SET_ERR("Unexpected token: %s", get_tokcls_name(cur->cls));
+            return parse_error(&stack);
+        }
+
+        advance_token_stream(tokens);
+    }
+}
 
+struct s_obj *parse_tokens(struct interp *interp, struct tok_lst *tokens) {
+    uint64_t start = stat_now_ns();
+    struct s_obj *root = parse_stack_machine(interp, tokens);
+    STAT_ADD(STAT_PARSE_NS, stat_now_ns() - start);
     return root;
 }
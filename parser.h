@@ -4,6 +4,7 @@
 #include "internal_rep.h"
 #include "lexer.h"
 
-struct s_obj *parse_tokens(struct tok_lst *tokens);
+// Symbols are interned in interp
+struct s_obj *parse_tokens(struct interp *interp, struct tok_lst *tokens);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "pool.h"
+
+struct thread_pool {
+	// Held for the whole of pool_run, so jobs don't overlap
+	pthread_mutex_t run_lock;
+
+	// Protects everything below
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+
+	int num_workers;
+
+	// Bumped for every job, so that workers can tell a new job from a
+	// spurious wakeup
+	unsigned long generation;
+	bool has_job;
+	chunk_fn fn;
+	void *ctx;
+	int num_chunks;
+
+	// Next chunk to hand out. Taken with an atomic increment, without the lock
+	int next_chunk;
+
+	// Threads currently taking chunks of the job, including the caller
+	int active;
+};
+
+// Set on threads that are running chunks, so that nested jobs run serially
+static __thread bool in_job = false;
+
+static void run_chunks(struct thread_pool *pool, chunk_fn fn, void *ctx,
+	int num_chunks) {
+
+	int i;
+	while((i = __atomic_fetch_add(&pool->next_chunk, 1, __ATOMIC_RELAXED))
+		< num_chunks) {
+		fn(ctx, i);
+	}
+}
+
+static void *worker_main(void *arg) {
+	struct thread_pool *pool = arg;
+	unsigned long seen = 0;
+	in_job = true;
+
+	pthread_mutex_lock(&pool->lock);
+	while(true) {
+		while(pool->generation == seen)
+			pthread_cond_wait(&pool->work_ready, &pool->lock);
+		seen = pool->generation;
+
+		// Woke up after the job already finished
+		if(!pool->has_job)
+			continue;
+
+		chunk_fn fn = pool->fn;
+		void *ctx = pool->ctx;
+		int num_chunks = pool->num_chunks;
+		pool->active++;
+		pthread_mutex_unlock(&pool->lock);
+
+		run_chunks(pool, fn, ctx, num_chunks);
+
+		pthread_mutex_lock(&pool->lock);
+		if(--pool->active == 0)
+			pthread_cond_signal(&pool->work_done);
+	}
+
+	return NULL;
+}
+
+struct thread_pool *create_thread_pool(int num_workers) {
+	struct thread_pool *pool = calloc(1, sizeof(struct thread_pool));
+	ensure_mem(pool);
+
+	pthread_mutex_init(&pool->run_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_ready, NULL);
+	pthread_cond_init(&pool->work_done, NULL);
+	pool->num_workers = num_workers;
+
+	for(int i=0; i<num_workers; i++) {
+		pthread_t thread;
+		int ret = pthread_create(&thread, NULL, &worker_main, pool);
+		ensure_exit(ret == 0, EX_OSERR, "Failed to start worker thread");
+		pthread_detach(thread);
+	}
+
+	return pool;
+}
+
+int pool_size(struct thread_pool *pool) {
+	return pool->num_workers + 1;
+}
+
+void pool_run(struct thread_pool *pool, int num_chunks, chunk_fn fn, void *ctx) {
+	if(in_job || pool->num_workers == 0 || num_chunks <= 1) {
+		for(int i=0; i<num_chunks; i++)
+			fn(ctx, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->run_lock);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->ctx = ctx;
+	pool->num_chunks = num_chunks;
+	pool->next_chunk = 0;
+	pool->has_job = true;
+	pool->active = 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	in_job = true;
+	run_chunks(pool, fn, ctx, num_chunks);
+	in_job = false;
+
+	// Once every chunk has been handed out, stop more workers from joining
+	// and wait for the ones still running theirs
+	pthread_mutex_lock(&pool->lock);
+	pool->has_job = false;
+	pool->active--;
+	while(pool->active > 0)
+		pthread_cond_wait(&pool->work_done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_mutex_unlock(&pool->run_lock);
+}
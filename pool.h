@@ -0,0 +1,24 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+// Fixed set of worker threads for data-parallel builtins. A job is split into
+// numbered chunks, and the workers and the calling thread take chunks until
+// there are none left.
+
+struct thread_pool;
+
+typedef void (*chunk_fn)(void *ctx, int chunk);
+
+// Starts num_workers threads. They live as long as the process.
+struct thread_pool *create_thread_pool(int num_workers);
+
+// Number of threads that run chunks, including the caller
+int pool_size(struct thread_pool *pool);
+
+// Calls fn(ctx, i) for every i in [0, num_chunks) and returns once all of them
+// have finished. Chunks may run in any order and on any thread. Calls made
+// from inside a chunk run every chunk on the calling thread, so nested
+// parallel operations can't deadlock the pool.
+void pool_run(struct thread_pool *pool, int num_chunks, chunk_fn fn, void *ctx);
+
+#endif
@@ -0,0 +1,403 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "cache.h"
+#include "common.h"
+#include "desugar.h"
+#include "environment.h"
+#include "eval.h"
+#include "interp.h"
+#include "lexer.h"
+#include "parser.h"
+#include "preparse.h"
+#include "stats.h"
+
+typedef struct s_obj sobj;
+typedef struct s_env senv;
+typedef sobj *(*builtin_fn)(sobj *, senv *);
+
+// =============================== SKIMMING ==================================
+// Splits a buffer into top-level spans without building any objects. A
+// buffer the tokeniser or the parser would reject as a whole, because of an
+// unknown token, a vector or unbalanced parentheses, fails the skim and is
+// then evaluated as usual so that the error is the same.
+// ===========================================================================
+
+// A run of top-level forms that are parsed as usual, or the text of a
+// function definition whose body is deferred
+struct span {
+	bool deferred;
+	const char *start;
+	int len;
+	// Deferred definitions. params is the text of the parameter names.
+	struct token name;
+	const char *params;
+	int params_len;
+	const char *body;
+	int body_len;
+};
+
+struct spans {
+	int len;
+	int capacity;
+	struct span *arr;
+};
+
+struct skimmer {
+	const char *pos;
+	const char *end;
+	// Set if the text has something that isn't a token
+	bool failed;
+};
+
+static void add_span(struct spans *spans, struct span span) {
+	if(spans->len == spans->capacity) {
+		spans->capacity = spans->capacity == 0 ? 16 : spans->capacity*2;
+		spans->arr = realloc(spans->arr, spans->capacity*sizeof(struct span));
+		ensure_mem(spans->arr);
+	}
+
+	spans->arr[spans->len++] = span;
+}
+
+// Next token other than whitespace and comments, or TOK_END_OF_FILE at the
+// end of the text or where no token matches
+static struct token next_token(struct skimmer *sk) {
+	enum tok_class cls;
+	int n;
+	while((n = scan_token(sk->pos, sk->end - sk->pos, &cls)) > 0) {
+		struct token tok = { sk->pos, n, cls };
+		sk->pos += n;
+		if(cls != TOK_WHITESPACE && cls != TOK_COMMENT)
+			return tok;
+	}
+
+	if(sk->pos != sk->end)
+		sk->failed = true;
+	return (struct token){ sk->pos, 0, TOK_END_OF_FILE };
+}
+
+static bool is_prefix(enum tok_class cls) {
+	return cls == TOK_QUOTE || cls == TOK_QUASIQUOTE
+		|| cls == TOK_UNQUOTE_SPLICE || cls == TOK_UNQUOTE;
+}
+
+static bool is_identifier(struct token tok, const char *name) {
+	return tok.cls == TOK_IDENTIFIER && tok.len == (int)strlen(name)
+		&& memcmp(tok.start_pos, name, tok.len) == 0;
+}
+
+// Skips the datum that starts with tok. False if it is a vector, or if the
+// parentheses don't balance before the end of the text.
+static bool skip_datum(struct skimmer *sk, struct token tok) {
+	while(is_prefix(tok.cls))
+		tok = next_token(sk);
+
+	if(tok.cls == TOK_PAREN_CLOSE || tok.cls == TOK_VEC_OPEN
+		|| tok.cls == TOK_END_OF_FILE)
+		return false;
+
+	for(int depth = tok.cls == TOK_PAREN_OPEN; depth > 0; ) {
+		tok = next_token(sk);
+		if(tok.cls == TOK_PAREN_OPEN)
+			depth++;
+		else if(tok.cls == TOK_PAREN_CLOSE)
+			depth--;
+		else if(tok.cls == TOK_VEC_OPEN || tok.cls == TOK_END_OF_FILE)
+			return false;
+	}
+
+	return true;
+}
+
+// Matches (define (name param ...) body ...) after its open paren. Varargs
+// are left to the usual path, which reports them as an error.
+static bool skim_define(struct skimmer *sk, struct span *span) {
+	if(!is_identifier(next_token(sk), "define")
+		|| next_token(sk).cls != TOK_PAREN_OPEN)
+		return false;
+
+	span->name = next_token(sk);
+	if(span->name.cls != TOK_IDENTIFIER)
+		return false;
+
+	struct token tok;
+	span->params = sk->pos;
+	while((tok = next_token(sk)).cls == TOK_IDENTIFIER);
+	if(tok.cls != TOK_PAREN_CLOSE)
+		return false;
+	span->params_len = tok.start_pos - span->params;
+
+	int num_exprs = 0;
+	span->body = sk->pos;
+	while((tok = next_token(sk)).cls != TOK_PAREN_CLOSE) {
+		if(tok.cls == TOK_CONS_DOT || !skip_datum(sk, tok))
+			return false;
+		num_exprs++;
+	}
+	span->body_len = tok.start_pos - span->body;
+
+	return num_exprs > 0;
+}
+
+static void end_run(struct spans *spans, const char *start, const char *end) {
+	if(start != NULL)
+		add_span(spans, (struct span){ .start = start, .len = end - start });
+}
+
+static bool skim(const char *buf, size_t len, struct spans *spans) {
+	// Null bytes end strings, which the regexes of the tokeniser see
+	// differently
+	if(memchr(buf, '\0', len) != NULL)
+		return false;
+
+	struct skimmer sk = { buf, buf + len, false };
+	const char *run = NULL;
+	const char *run_end = NULL;
+
+	for(;;) {
+		struct token tok = next_token(&sk);
+		if(tok.cls == TOK_END_OF_FILE)
+			break;
+
+		if(tok.cls == TOK_PAREN_OPEN) {
+			struct skimmer start = sk;
+			struct span span = { .deferred = true, .start = tok.start_pos };
+			if(skim_define(&sk, &span)) {
+				end_run(spans, run, run_end);
+				run = NULL;
+				span.len = sk.pos - span.start;
+				add_span(spans, span);
+				continue;
+			}
+			sk = start;
+		}
+
+		if(!skip_datum(&sk, tok))
+			return false;
+		if(run == NULL)
+			run = tok.start_pos;
+		run_end = sk.pos;
+	}
+
+	end_run(spans, run, run_end);
+	return !sk.failed;
+}
+
+// =============================== LOADING ===================================
+
+static sobj *parse_text(struct interp *interp, const char *start, int len) {
+	struct tok_lst *toks = tokenise_buffer(interp->lexer, start, len);
+	if(toks == NULL) {
+		SET_ERR("Failed to tokenise input");
+		return NULL;
+	}
+
+	sobj *program = parse_tokens(interp, toks);
+	free_tok_lst(toks);
+	return program;
+}
+
+void add_load_item(struct load_items *items, struct load_item item) {
+	if(items->len == items->capacity) {
+		items->capacity = items->capacity == 0 ? 16 : items->capacity*2;
+		items->arr = realloc(items->arr,
+			items->capacity*sizeof(struct load_item));
+		ensure_mem(items->arr);
+	}
+
+	items->arr[items->len++] = item;
+}
+
+struct lazy_body *new_lazy_body(const char *src, int len,
+	struct cache_entry *cached) {
+
+	struct lazy_body *lazy = malloc(sizeof(struct lazy_body));
+	ensure_mem(lazy);
+	lazy->src = src;
+	lazy->len = len;
+	lazy->cached = cached;
+	lazy->lambda = NULL;
+	lazy->next = NULL;
+	STAT_ADD(STAT_BYTES_ALLOCATED, sizeof(struct lazy_body));
+	return lazy;
+}
+
+static sobj *symbol_of(struct interp *interp, struct token tok) {
+	return fetch_or_create_symbol(interp, tok.len, tok.start_pos);
+}
+
+// Turns a deferred span into an item, copying the text of its body
+static struct load_item define_item(struct interp *interp, struct span *span) {
+	sobj *params = fetch_singleton_object(SG_EMPTY_LIST);
+	sobj **tail = &params;
+	const char *end = span->params + span->params_len;
+	struct skimmer sk = { span->params, end, false };
+	for(struct token tok = next_token(&sk); tok.cls != TOK_END_OF_FILE;
+		tok = next_token(&sk)) {
+		*tail = new_cons(symbol_of(interp, tok), *tail);
+		tail = &(*tail)->val.cc.right;
+	}
+
+	char *src = malloc(span->body_len);
+	ensure_mem(src);
+	memcpy(src, span->body, span->body_len);
+	STAT_ADD(STAT_BYTES_ALLOCATED, span->body_len);
+
+	return (struct load_item){
+		.name = symbol_of(interp, span->name),
+		.params = params,
+		.body = new_lazy_body(src, span->body_len, NULL),
+	};
+}
+
+bool load_buffer(struct interp *interp, const char *buf, size_t len,
+	struct load_items *items) {
+
+	struct spans spans = { 0 };
+	bool deferred = false;
+	if(interp->lazy_bodies && !interp->verbose && skim(buf, len, &spans)) {
+		for(int i=0; i<spans.len && !deferred; i++)
+			deferred = spans.arr[i].deferred;
+	}
+
+	if(!deferred) {
+		free(spans.arr);
+		sobj *program = parse_text(interp, buf, len);
+		if(program == NULL)
+			return false;
+		add_load_item(items, (struct load_item){ .program = program });
+		return true;
+	}
+
+	// Everything is parsed first, so that a syntax error stops the whole
+	// buffer as it would without lazy bodies
+	bool ok = true;
+	for(int i=0; i<spans.len && ok; i++) {
+		struct span *span = &spans.arr[i];
+		if(span->deferred) {
+			add_load_item(items, define_item(interp, span));
+			continue;
+		}
+
+		sobj *program = parse_text(interp, span->start, span->len);
+		if(program == NULL)
+			ok = false;
+		else
+			add_load_item(items, (struct load_item){ .program = program });
+	}
+
+	free(spans.arr);
+	return ok;
+}
+
+sobj *lazy_body_exprs(struct interp *interp, struct lazy_body *lazy) {
+	if(lazy->cached != NULL)
+		return decode_cached_body(lazy->cached, lazy->src, lazy->len);
+
+	sobj *program = parse_text(interp, lazy->src, lazy->len);
+	return program == NULL ? NULL : get_list_rest(program);
+}
+
+// ============================== EVALUATION =================================
+
+static bool is_keyword(senv *env, const char *name, builtin_fn func) {
+	sobj *bound = resolve_symbol(env, name, false);
+	return bound != NULL && bound->type == OBJ_BUILTIN_FUNC
+		&& bound->val.builtin.func == func;
+}
+
+static sobj *symbol(struct interp *interp, const char *name) {
+	return fetch_or_create_symbol(interp, strlen(name), name);
+}
+
+// Binds the name of a deferred definition, as builtin_define would bind it
+// to the lambda of the desugared form. If define or lambda no longer are
+// the builtins, the definition is rebuilt and evaluated like any other form.
+static sobj *eval_define(struct interp *interp, struct load_item *item) {
+	senv *root = interp->root_env;
+	if(!is_keyword(root, "define", &builtin_define)
+		|| !is_keyword(root, "lambda", &builtin_lambda)) {
+		sobj *exprs = lazy_body_exprs(interp, item->body);
+		if(exprs == NULL)
+			return NULL;
+
+		sobj *target = new_cons(item->name, item->params);
+		sobj *form = new_cons(symbol(interp, "define"),
+			new_cons(target, exprs));
+		sobj *program = new_cons(symbol(interp, "begin"),
+			new_cons(form, fetch_singleton_object(SG_EMPTY_LIST)));
+		return eval_toplevel(program, root);
+	}
+
+	sobj *lambda = new_lambda(item->params, NULL, root);
+	if(lambda == NULL)
+		return NULL;
+
+	struct lazy_body *lazy = item->body;
+	lazy->lambda = lambda->val.lambda;
+	lazy->next = interp->pending_bodies;
+	interp->pending_bodies = lazy;
+
+	lambda->val.lambda->lazy = lazy;
+	lambda->val.lambda->name = item->name->val.sym.str;
+	associate_symbol(root, item->name->val.sym.str, lambda);
+	STAT_ADD(STAT_BODIES_DEFERRED, 1);
+
+	// Only cache entries defer bodies when lazy bodies are off
+	if(!interp->lazy_bodies && lambda_body(lambda->val.lambda) == NULL)
+		return NULL;
+
+	return fetch_singleton_object(SG_EMPTY_LIST);
+}
+
+sobj *eval_items(struct interp *interp, struct load_items *items) {
+	sobj *res = fetch_singleton_object(SG_EMPTY_LIST);
+	for(int i=0; i<items->len && res != NULL; i++) {
+		struct load_item *item = &items->arr[i];
+		if(item->program == NULL)
+			res = eval_define(interp, item);
+		else
+			res = eval_toplevel(item->program, interp->root_env);
+	}
+
+	return res;
+}
+
+// ================================ BODIES ===================================
+
+sobj *load_lambda_body(struct s_lambda *lambda) {
+	sobj *body = __atomic_load_n(&lambda->body, __ATOMIC_ACQUIRE);
+	if(body != NULL)
+		return body;
+
+	// Keywords are resolved in the root environment, the same one the
+	// definition would have been desugared in
+	struct interp *interp = env_interp(lambda->parent_env);
+	sobj *exprs = lazy_body_exprs(interp, lambda->lazy);
+	if(exprs == NULL)
+		return NULL;
+
+	body = desugar_body(exprs, interp->root_env);
+	STAT_ADD(STAT_BODIES_LOADED, 1);
+
+	// Threads racing here load the same body, so any copy will do
+	sobj *expected = NULL;
+	if(!__atomic_compare_exchange_n(&lambda->body, &expected, body, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return expected;
+	return body;
+}
+
+void force_lazy_bodies(struct interp *interp) {
+	struct lazy_body *lazy = interp->pending_bodies;
+	interp->pending_bodies = NULL;
+
+	// A body that doesn't parse reports its error when it is called
+	bool print = set_err_print(false);
+	for(; lazy != NULL; lazy = lazy->next)
+		load_lambda_body(lazy->lambda);
+	set_err_print(print);
+}
@@ -0,0 +1,102 @@
+#ifndef __PREPARSE_H__
+#define __PREPARSE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "internal_rep.h"
+#include "interp.h"
+
+// Lazy loading of top-level function definitions. Before tokenising a
+// buffer, load_buffer skims it with scan_token, which only checks
+// that the text is made of tokens and that parentheses balance. Every
+// top-level (define (name param ...) body ...) found on the way is bound to
+// a lambda whose body is kept as source text, and is tokenised, parsed and
+// desugared in the root environment the first time the lambda is called.
+// The rest of the buffer goes through the usual tokeniser and parser, all
+// of it before anything is evaluated, so programs that are loaded but
+// mostly not run only pay for skimming most of their text. Definitions
+// loaded from a cache entry keep their body encoded instead, see cache.h.
+//
+// Bodies are desugared with the keywords bound when they are loaded rather
+// than when they were defined, so rebinding a special form in the root
+// environment first loads every pending body. Syntax errors that only the
+// parser detects, like a misplaced cons dot, are reported by the first call
+// rather than when the file is loaded.
+
+struct cache_entry;
+
+struct lazy_body {
+    // Source of the body expressions, not null terminated, or their
+    // encoding if they were loaded from cached, see cache.h
+    const char *src;
+    int len;
+    struct cache_entry *cached;
+    // Lambda the body belongs to once it is defined
+    struct s_lambda *lambda;
+    // Next in interp->pending_bodies
+    struct lazy_body *next;
+};
+
+// A top-level item of a loaded buffer: a run of forms, or a function
+// definition whose body is loaded on its first call
+struct load_item {
+    // Parsed (begin form ...) of a run, NULL for a definition
+    struct s_obj *program;
+    // Definitions: the symbol defined and the list of parameter symbols
+    struct s_obj *name;
+    struct s_obj *params;
+    struct lazy_body *body;
+};
+
+struct load_items {
+    int len;
+    int capacity;
+    struct load_item *arr;
+};
+
+// Skims, tokenises and parses buf into items, splitting off function
+// definitions only if lazy bodies are on. Returns false if there is a syntax
+// error outside of the deferred bodies, before anything is evaluated, as
+// interp_eval_buffer would.
+bool load_buffer(struct interp *interp, const char *buf, size_t len,
+    struct load_items *items);
+
+// Evaluates items in order in the root environment. Returns the value of
+// the last one, or NULL as soon as one fails.
+struct s_obj *eval_items(struct interp *interp, struct load_items *items);
+
+void add_load_item(struct load_items *items, struct load_item item);
+
+struct lazy_body *new_lazy_body(const char *src, int len,
+    struct cache_entry *cached);
+
+// The list of expressions in a lazy body, parsed or decoded. NULL with an
+// error set if they don't parse.
+struct s_obj *lazy_body_exprs(struct interp *interp, struct lazy_body *lazy);
+
+// Parses and desugars the lazy body of lambda, or returns the body it
+// already has. NULL with an error set if the source does not parse.
+struct s_obj *load_lambda_body(struct s_lambda *lambda);
+
+// Loads every pending body of interp
+void force_lazy_bodies(struct interp *interp);
+
+// Called before a binding in the root environment replaces old with val
+static inline void note_root_rebinding(struct interp *interp,
+    struct s_obj *old, struct s_obj *val) {
+    if(interp->pending_bodies != NULL && old != NULL && old != val
+        && old->type == OBJ_BUILTIN_FUNC && old->val.builtin.is_macro)
+        force_lazy_bodies(interp);
+}
+
+// Body of lambda, loading it if needed. NULL for a lazy body means an error
+// was set.
+static inline struct s_obj *lambda_body(struct s_lambda *lambda) {
+    struct s_obj *body = __atomic_load_n(&lambda->body, __ATOMIC_ACQUIRE);
+    if(body != NULL || lambda->lazy == NULL)
+        return body;
+    return load_lambda_body(lambda);
+}
+
+#endif
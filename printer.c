@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "internal_rep.h"
+#include "printer.h"
+
+void strbuf_reset(struct strbuf *buf) {
+	buf->len = 0;
+}
+
+void strbuf_free(struct strbuf *buf) {
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = 0;
+	buf->capacity = 0;
+}
+
+static void strbuf_reserve(struct strbuf *buf, size_t extra) {
+	if(buf->len + extra <= buf->capacity)
+		return;
+
+	size_t new_capacity = buf->capacity < 256 ? 256 : buf->capacity;
+	while(new_capacity < buf->len + extra)
+		new_capacity *= 2;
+
+	buf->data = realloc(buf->data, new_capacity);
+	ensure_mem(buf->data);
+	buf->capacity = new_capacity;
+}
+
+void strbuf_append(struct strbuf *buf, const char *str, size_t len) {
+	strbuf_reserve(buf, len);
+	memcpy(buf->data + buf->len, str, len);
+	buf->len += len;
+}
+
+void strbuf_putc(struct strbuf *buf, char c) {
+	strbuf_reserve(buf, 1);
+	buf->data[buf->len++] = c;
+}
+
+#define strbuf_puts(BUF, LITERAL) strbuf_append(BUF, LITERAL, sizeof(LITERAL)-1)
+
+static void append_int(struct strbuf *buf, int64_t n) {
+	// Build the digits backwards. Negate as unsigned so INT64_MIN works
+	char digits[24];
+	char *end = digits + sizeof(digits);
+	char *cur = end;
+	uint64_t u = n < 0 ? -(uint64_t)n : (uint64_t)n;
+
+	do {
+		*--cur = '0' + (u % 10);
+		u /= 10;
+	} while(u != 0);
+
+	if(n < 0)
+		*--cur = '-';
+
+	strbuf_append(buf, cur, end - cur);
+}
+
+static void append_float(struct strbuf *buf, double f) {
+	// Shortest of %.15g and %.17g that reads back as the same double
+	char tmp[32];
+	int len = snprintf(tmp, sizeof(tmp), "%.15g", f);
+	if(strtod(tmp, NULL) != f)
+		len = snprintf(tmp, sizeof(tmp), "%.17g", f);
+
+	strbuf_append(buf, tmp, len);
+
+	// Make sure it still looks like a float
+	if(strspn(tmp, "-0123456789") == (size_t)len)
+		strbuf_puts(buf, ".0");
+}
+
+static void append_ptr(struct strbuf *buf, const char *prefix, void *ptr) {
+	char tmp[64];
+	int len = snprintf(tmp, sizeof(tmp), "%s%p>", prefix, ptr);
+	strbuf_append(buf, tmp, len);
+}
+
+static void append_string(struct strbuf *buf, struct s_string *str,
+	bool is_write) {
+
+	if(!is_write) {
+		strbuf_append(buf, str->str, str->len);
+		return;
+	}
+
+	strbuf_reserve(buf, str->len + 2);
+	strbuf_putc(buf, '"');
+
+	// Copy runs of characters that don't need escaping in one go
+	int run = 0;
+	for(int i=0; i<str->len; i++) {
+		char esc = 0;
+		switch(str->str[i]) {
+		case '"':  esc = '"'; break;
+		case '\\': esc = '\\'; break;
+		case '\n': esc = 'n'; break;
+		case '\t': esc = 't'; break;
+		case '\r': esc = 'r'; break;
+		case '\0': esc = '0'; break;
+		}
+
+		if(esc == 0)
+			continue;
+
+		strbuf_append(buf, str->str + run, i - run);
+		strbuf_putc(buf, '\\');
+		strbuf_putc(buf, esc);
+		run = i + 1;
+	}
+
+	strbuf_append(buf, str->str + run, str->len - run);
+	strbuf_putc(buf, '"');
+}
+
+// Stops once buf holds stop bytes. Every list appends at least its '('
+// before recursing, so this ends even on cyclic data.
+static void serialise(struct strbuf *buf, struct s_obj *obj, bool is_write,
+	size_t stop) {
+
+	if(buf->len >= stop)
+		return;
+
+	switch(obj->type) {
+	case OBJ_CONS:
+		// Loop down the spine and only recurse into the elements, so that
+		// long lists don't use any stack
+		strbuf_putc(buf, '(');
+		while(true) {
+			serialise(buf, obj->val.cc.left, is_write, stop);
+			obj = obj->val.cc.right;
+			if(buf->len >= stop)
+				return;
+
+			if(obj->type == OBJ_EMPTY_LIST)
+				break;
+
+			if(obj->type != OBJ_CONS) {
+				strbuf_puts(buf, " . ");
+				serialise(buf, obj, is_write, stop);
+				break;
+			}
+
+			strbuf_putc(buf, ' ');
+		}
+		strbuf_putc(buf, ')');
+		break;
+
+	case OBJ_NUMBER:
+		if(obj->val.number.type == SCHEME_INT)
+			append_int(buf, obj->val.number.value.integer);
+		else
+			append_float(buf, obj->val.number.value.floating);
+		break;
+
+	case OBJ_STRING:
+		append_string(buf, &obj->val.str, is_write);
+		break;
+
+	case OBJ_SYMBOL:
+		strbuf_append(buf, obj->val.sym.str, obj->val.sym.len);
+		break;
+
+	case OBJ_BOOLEAN:
+		if(obj->val.boolean)
+			strbuf_puts(buf, "#t");
+		else
+			strbuf_puts(buf, "#f");
+		break;
+
+	case OBJ_LAMBDA:
+		append_ptr(buf, "#<procedure ", obj->val.lambda);
+		break;
+
+	case OBJ_BUILTIN_FUNC:
+		append_ptr(buf, "#<builtin function ", obj->val.builtin.func);
+		break;
+
+	case OBJ_EMPTY_LIST:
+		strbuf_puts(buf, "()");
+		break;
+
+	case OBJ_FUTURE:
+		append_ptr(buf, "#<future ", obj->val.future);
+		break;
+	}
+}
+
+void serialise_obj(struct strbuf *buf, struct s_obj *obj, bool is_write) {
+	serialise(buf, obj, is_write, SIZE_MAX);
+}
+
+void serialise_obj_prefix(struct strbuf *buf, struct s_obj *obj,
+	bool is_write, size_t limit) {
+
+	serialise(buf, obj, is_write, buf->len + limit);
+}
+
+void flush_strbuf(struct strbuf *buf, int fd) {
+	fflush(stdout);
+
+	size_t written = 0;
+	while(written < buf->len) {
+		ssize_t ret = write(fd, buf->data + written, buf->len - written);
+		if(ret == -1 && errno == EINTR)
+			continue;
+		if(ret == -1) {
+			log_err("Failed to write output: %s", strerror(errno));
+			break;
+		}
+		written += ret;
+	}
+
+	strbuf_reset(buf);
+}
+
+static __thread struct strbuf output_buffer = { NULL, 0, 0 };
+
+struct strbuf *get_output_buffer() {
+	return &output_buffer;
+}
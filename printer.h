@@ -0,0 +1,42 @@
+#ifndef __PRINTER_H__
+#define __PRINTER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "internal_rep.h"
+
+// Growable byte buffer that objects are serialised into before being written
+// out in one go
+struct strbuf {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+void strbuf_reset(struct strbuf *buf);
+void strbuf_free(struct strbuf *buf);
+void strbuf_append(struct strbuf *buf, const char *str, size_t len);
+void strbuf_putc(struct strbuf *buf, char c);
+
+// Appends the external representation of obj to buf. With is_write, strings
+// are quoted and escaped so that they read back as the same string (write);
+// otherwise their contents are appended as is (display).
+void serialise_obj(struct strbuf *buf, struct s_obj *obj, bool is_write);
+
+// Like serialise_obj, but stops once at least limit bytes have been appended,
+// so that it also ends on cyclic data. The output may run past limit by the
+// length of one atom.
+void serialise_obj_prefix(struct strbuf *buf, struct s_obj *obj,
+    bool is_write, size_t limit);
+
+// Writes the whole buffer to fd with as few write calls as possible, then
+// empties it. Pending stdio output on stdout is flushed first so that output
+// stays in order.
+void flush_strbuf(struct strbuf *buf, int fd);
+
+// Per-thread scratch buffer, reused between calls so that printing does not
+// allocate once it has grown to the size of the output
+struct strbuf *get_output_buffer();
+
+#endif
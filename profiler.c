@@ -0,0 +1,337 @@
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "internal_rep.h"
+#include "printer.h"
+#include "profiler.h"
+#include "uthash.h"
+
+// Frames beyond this depth are still counted but not recorded
+#define MAX_SHADOW_DEPTH 1024
+
+// Innermost frames kept in each sample
+#define MAX_SAMPLE_DEPTH 64
+
+// About a minute of CPU time at the default interval. Later samples are
+// dropped
+#define MAX_SAMPLES (1 << 16)
+
+bool profiling = false;
+
+struct shadow_stack {
+	int depth;
+	struct s_lambda *frames[MAX_SHADOW_DEPTH];
+};
+
+struct sample {
+	int depth;
+	bool truncated;
+	// Outermost recorded frame first
+	struct s_lambda *frames[MAX_SAMPLE_DEPTH];
+};
+
+static __thread struct shadow_stack *shadow = NULL;
+
+static struct sample *samples = NULL;
+static long num_samples = 0;
+static int sample_interval_us = 0;
+
+// ============================== SAMPLING ===================================
+// The handler runs on the interrupted thread, so it only reads that thread's
+// own shadow stack. push stores the frame before bumping depth, so the
+// handler never sees a frame that hasn't been written yet.
+// ===========================================================================
+
+void shadow_push(struct s_lambda *lambda) {
+	if(shadow == NULL) {
+		shadow = calloc(1, sizeof(struct shadow_stack));
+		ensure_mem(shadow);
+	}
+
+	if(shadow->depth < MAX_SHADOW_DEPTH)
+		shadow->frames[shadow->depth] = lambda;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	shadow->depth++;
+}
+
+void shadow_pop() {
+	// Profiling may have started in the middle of a call
+	if(shadow != NULL && shadow->depth > 0)
+		shadow->depth--;
+}
+
+static void on_sigprof(int sig) {
+	(void)sig;
+
+	long i = __atomic_fetch_add(&num_samples, 1, __ATOMIC_RELAXED);
+	if(i >= MAX_SAMPLES)
+		return;
+
+	struct sample *s = &samples[i];
+	struct shadow_stack *st = shadow;
+	int depth = st == NULL ? 0 : st->depth;
+	if(depth > MAX_SHADOW_DEPTH)
+		depth = MAX_SHADOW_DEPTH;
+
+	int keep = depth < MAX_SAMPLE_DEPTH ? depth : MAX_SAMPLE_DEPTH;
+	s->truncated = st != NULL && st->depth > keep;
+	for(int j=0; j<keep; j++)
+		s->frames[j] = st->frames[depth - keep + j];
+	s->depth = keep;
+}
+
+void start_profiler(int interval_us) {
+	samples = calloc(MAX_SAMPLES, sizeof(struct sample));
+	ensure_mem(samples);
+	sample_interval_us = interval_us;
+
+	// Make sure this thread's stack exists before the first signal
+	if(shadow == NULL) {
+		shadow = calloc(1, sizeof(struct shadow_stack));
+		ensure_mem(shadow);
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &on_sigprof;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	ensure_exit(sigaction(SIGPROF, &sa, NULL) == 0, EX_OSERR,
+		"Failed to install SIGPROF handler");
+
+	profiling = true;
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = interval_us / 1000000;
+	timer.it_interval.tv_usec = interval_us % 1000000;
+	timer.it_value = timer.it_interval;
+	ensure_exit(setitimer(ITIMER_PROF, &timer, NULL) == 0, EX_OSERR,
+		"Failed to start profiling timer");
+}
+
+void stop_profiler() {
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	profiling = false;
+}
+
+// ============================== REPORTING ==================================
+
+struct proc_entry {
+	struct s_lambda *lambda;
+	char label[64];
+	long self;
+	long total;
+	// Last sample counted in total, so recursion only counts once
+	long last_sample;
+	UT_hash_handle hh;
+};
+
+struct edge_key {
+	struct s_lambda *caller;
+	struct s_lambda *callee;
+};
+
+struct edge_entry {
+	struct edge_key key;
+	long count;
+	long last_sample;
+	UT_hash_handle hh;
+};
+
+struct folded_entry {
+	char *stack;
+	long count;
+	UT_hash_handle hh;
+};
+
+static struct proc_entry *get_proc(struct proc_entry **procs,
+	struct s_lambda *lambda) {
+
+	struct proc_entry *entry = NULL;
+	HASH_FIND_PTR(*procs, &lambda, entry);
+	if(entry != NULL)
+		return entry;
+
+	entry = calloc(1, sizeof(struct proc_entry));
+	ensure_mem(entry);
+	entry->lambda = lambda;
+	entry->last_sample = -1;
+
+	if(lambda == NULL)
+		snprintf(entry->label, sizeof(entry->label), "[toplevel]");
+	else if(lambda->name != NULL)
+		snprintf(entry->label, sizeof(entry->label), "%s", lambda->name);
+	else
+		snprintf(entry->label, sizeof(entry->label), "lambda@%p", lambda);
+
+	HASH_ADD_PTR(*procs, lambda, entry);
+	return entry;
+}
+
+static void count_edge(struct edge_entry **edges, struct s_lambda *caller,
+	struct s_lambda *callee, long sample) {
+
+	struct edge_key key;
+	memset(&key, 0, sizeof(key));
+	key.caller = caller;
+	key.callee = callee;
+
+	struct edge_entry *entry = NULL;
+	HASH_FIND(hh, *edges, &key, sizeof(key), entry);
+	if(entry == NULL) {
+		entry = calloc(1, sizeof(struct edge_entry));
+		ensure_mem(entry);
+		entry->key = key;
+		entry->last_sample = -1;
+		HASH_ADD(hh, *edges, key, sizeof(key), entry);
+	}
+
+	if(entry->last_sample != sample) {
+		entry->count++;
+		entry->last_sample = sample;
+	}
+}
+
+static void count_folded(struct folded_entry **folded, struct strbuf *buf) {
+	strbuf_putc(buf, '\0');
+
+	struct folded_entry *entry = NULL;
+	HASH_FIND_STR(*folded, buf->data, entry);
+	if(entry == NULL) {
+		entry = calloc(1, sizeof(struct folded_entry));
+		ensure_mem(entry);
+		entry->stack = strdup(buf->data);
+		ensure_mem(entry->stack);
+		HASH_ADD_KEYPTR(hh, *folded, entry->stack, strlen(entry->stack), entry);
+	}
+
+	entry->count++;
+}
+
+static int by_self(const void *a, const void *b) {
+	const struct proc_entry *x = *(struct proc_entry * const *)a;
+	const struct proc_entry *y = *(struct proc_entry * const *)b;
+	if(x->self != y->self)
+		return x->self < y->self ? 1 : -1;
+	return x->total < y->total ? 1 : (x->total > y->total ? -1 : 0);
+}
+
+static int by_total(const void *a, const void *b) {
+	const struct proc_entry *x = *(struct proc_entry * const *)a;
+	const struct proc_entry *y = *(struct proc_entry * const *)b;
+	if(x->total != y->total)
+		return x->total < y->total ? 1 : -1;
+	return x->self < y->self ? 1 : (x->self > y->self ? -1 : 0);
+}
+
+static void write_call_graph(FILE *report, struct proc_entry **sorted,
+	int num_procs, struct proc_entry **procs, struct edge_entry *edges) {
+
+	fprintf(report, "\nCall graph (samples in which each call was on the stack):\n");
+
+	for(int i=0; i<num_procs; i++) {
+		struct proc_entry *proc = sorted[i];
+		fprintf(report, "\n%s  total %ld, self %ld\n",
+			proc->label, proc->total, proc->self);
+
+		for(struct edge_entry *e = edges; e != NULL; e = e->hh.next) {
+			if(e->key.callee == proc->lambda) {
+				fprintf(report, "    called from  %-32s %ld\n",
+					get_proc(procs, e->key.caller)->label, e->count);
+			}
+		}
+
+		for(struct edge_entry *e = edges; e != NULL; e = e->hh.next) {
+			if(e->key.caller == proc->lambda) {
+				fprintf(report, "    calls        %-32s %ld\n",
+					get_proc(procs, e->key.callee)->label, e->count);
+			}
+		}
+	}
+}
+
+void write_profile(FILE *report, FILE *folded_out) {
+	long total_samples = num_samples < MAX_SAMPLES ? num_samples : MAX_SAMPLES;
+	long dropped = num_samples - total_samples;
+
+	struct proc_entry *procs = NULL;
+	struct edge_entry *edges = NULL;
+	struct folded_entry *folded = NULL;
+	struct strbuf stack = { NULL, 0, 0 };
+
+	for(long i=0; i<total_samples; i++) {
+		struct sample *s = &samples[i];
+		strbuf_reset(&stack);
+
+		if(s->depth == 0) {
+			struct proc_entry *top = get_proc(&procs, NULL);
+			top->self++;
+			top->total++;
+			strbuf_append(&stack, top->label, strlen(top->label));
+			count_folded(&folded, &stack);
+			continue;
+		}
+
+		if(s->truncated)
+			strbuf_append(&stack, "[truncated];", strlen("[truncated];"));
+
+		for(int j=0; j<s->depth; j++) {
+			struct proc_entry *proc = get_proc(&procs, s->frames[j]);
+			if(proc->last_sample != i) {
+				proc->total++;
+				proc->last_sample = i;
+			}
+
+			if(j > 0)
+				count_edge(&edges, s->frames[j-1], s->frames[j], i);
+
+			if(j > 0)
+				strbuf_putc(&stack, ';');
+			strbuf_append(&stack, proc->label, strlen(proc->label));
+		}
+
+		get_proc(&procs, s->frames[s->depth-1])->self++;
+		count_folded(&folded, &stack);
+	}
+
+	int num_procs = HASH_COUNT(procs);
+	struct proc_entry **sorted = calloc(num_procs + 1, sizeof(struct proc_entry *));
+	ensure_mem(sorted);
+	int n = 0;
+	for(struct proc_entry *p = procs; p != NULL; p = p->hh.next)
+		sorted[n++] = p;
+
+	fprintf(report, "\nFlat profile (%ld samples, one every %d us of CPU time",
+		total_samples, sample_interval_us);
+	if(dropped > 0)
+		fprintf(report, ", %ld dropped", dropped);
+	fprintf(report, "):\n\n");
+	fprintf(report, "  self%%  total%%      self     total  procedure\n");
+
+	qsort(sorted, num_procs, sizeof(struct proc_entry *), &by_self);
+	for(int i=0; i<num_procs; i++) {
+		struct proc_entry *p = sorted[i];
+		double denom = total_samples > 0 ? total_samples : 1;
+		fprintf(report, "%7.2f %7.2f %9ld %9ld  %s\n",
+			100.0 * p->self / denom, 100.0 * p->total / denom,
+			p->self, p->total, p->label);
+	}
+
+	qsort(sorted, num_procs, sizeof(struct proc_entry *), &by_total);
+	write_call_graph(report, sorted, num_procs, &procs, edges);
+
+	if(folded_out != NULL) {
+		for(struct folded_entry *f = folded; f != NULL; f = f->hh.next)
+			fprintf(folded_out, "%s %ld\n", f->stack, f->count);
+	}
+
+	free(sorted);
+	strbuf_free(&stack);
+}
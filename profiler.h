@@ -0,0 +1,31 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "internal_rep.h"
+
+// Statistical profiler for Scheme procedures. While it runs, every thread
+// keeps a shadow stack of the lambdas it is applying, and a SIGPROF timer
+// copies the stack of whichever thread it interrupts into a preallocated
+// sample buffer. The samples are only aggregated by write_profile, so the
+// signal handler never allocates or takes locks.
+
+// The profiler is process-wide, since the timer is
+extern bool profiling;
+
+// Starts sampling every interval_us microseconds of CPU time
+void start_profiler(int interval_us);
+void stop_profiler();
+
+// Only called while profiling is set
+void shadow_push(struct s_lambda *lambda);
+void shadow_pop();
+
+// Writes the flat profile and call graph to report, and the samples as
+// folded stacks (one "outer;inner count" line per distinct stack, the input
+// format of flamegraph.pl) to folded if it isn't NULL
+void write_profile(FILE *report, FILE *folded);
+
+#endif
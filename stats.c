@@ -0,0 +1,90 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "stats.h"
+
+struct thread_stats {
+	uint64_t counters[NUM_STATS];
+	struct thread_stats *next;
+};
+
+__thread uint64_t *thread_counters = NULL;
+
+// Every thread's counters, newest first. Entries are never removed, so the
+// counts of threads that have exited are kept.
+static struct thread_stats *all_stats = NULL;
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *names[NUM_STATS] = {
+	[STAT_ALLOC_CONS] =       "cons-allocated",
+	[STAT_ALLOC_NUMBER] =     "numbers-allocated",
+	[STAT_ALLOC_STRING] =     "strings-allocated",
+	[STAT_ALLOC_SYMBOL] =     "symbols-allocated",
+	[STAT_ALLOC_LAMBDA] =     "lambdas-allocated",
+	[STAT_ALLOC_BUILTIN] =    "builtins-allocated",
+	[STAT_ALLOC_FUTURE] =     "futures-allocated",
+	[STAT_BYTES_ALLOCATED] =  "bytes-allocated",
+	[STAT_ENVS_CREATED] =     "environments-created",
+	[STAT_SYMBOL_LOOKUPS] =   "symbol-lookups",
+	[STAT_LOOKUP_DEPTH] =     "lookup-depth",
+	[STAT_HASH_COLLISIONS] =  "hash-collisions",
+	[STAT_JIT_COMPILED] =     "lambdas-compiled",
+	[STAT_JIT_CODE_BYTES] =   "jit-code-bytes",
+	[STAT_BODIES_ANALYSED] =  "bodies-analysed",
+	[STAT_NODES_ANALYSED] =   "nodes-analysed",
+	[STAT_CALLS_INLINED] =    "calls-inlined",
+	[STAT_CALLS_FOLDED] =     "calls-folded",
+	[STAT_BODIES_DEFERRED] =  "bodies-deferred",
+	[STAT_BODIES_LOADED] =    "bodies-loaded",
+	[STAT_CACHE_HITS] =       "cache-hits",
+	[STAT_CACHE_MISSES] =     "cache-misses",
+	[STAT_LEXER_COMPILE_NS] = "lexer-compile-ns",
+	[STAT_TOKENISE_NS] =      "tokenise-ns",
+	[STAT_PARSE_NS] =         "parse-ns",
+	[STAT_EVAL_NS] =          "eval-ns",
+};
+
+void register_thread_stats() {
+	struct thread_stats *stats = calloc(1, sizeof(struct thread_stats));
+	ensure_mem(stats);
+
+	pthread_mutex_lock(&all_stats_lock);
+	stats->next = all_stats;
+	all_stats = stats;
+	pthread_mutex_unlock(&all_stats_lock);
+
+	thread_counters = stats->counters;
+}
+
+uint64_t stat_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+const char *stat_name(enum stat_counter counter) {
+	return names[counter];
+}
+
+void read_stats(uint64_t totals[NUM_STATS]) {
+	for(int i=0; i<NUM_STATS; i++)
+		totals[i] = 0;
+
+	pthread_mutex_lock(&all_stats_lock);
+	for(struct thread_stats *s = all_stats; s != NULL; s = s->next) {
+		for(int i=0; i<NUM_STATS; i++)
+			totals[i] += __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&all_stats_lock);
+}
+
+void print_stats(FILE *out) {
+	uint64_t totals[NUM_STATS];
+	read_stats(totals);
+
+	fprintf(out, "\nRuntime statistics:\n");
+	for(int i=0; i<NUM_STATS; i++)
+		fprintf(out, "  %-24s %llu\n", names[i], (unsigned long long)totals[i]);
+}
@@ -0,0 +1,98 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Runtime counters. Each thread increments its own copy without atomics or
+// locks; read_stats sums the copies of every thread that ever counted
+// anything. Cheap enough to leave on all the time.
+
+enum stat_counter {
+    // Objects allocated, by type
+    STAT_ALLOC_CONS = 0,
+    STAT_ALLOC_NUMBER,
+    STAT_ALLOC_STRING,
+    STAT_ALLOC_SYMBOL,
+    STAT_ALLOC_LAMBDA,
+    STAT_ALLOC_BUILTIN,
+    STAT_ALLOC_FUTURE,
+
+    // Objects, their payloads, environments and bindings
+    STAT_BYTES_ALLOCATED,
+
+    STAT_ENVS_CREATED,
+
+    // Calls to has_symbol and resolve_symbol, and the environments they
+    // looked in
+    STAT_SYMBOL_LOOKUPS,
+    STAT_LOOKUP_DEPTH,
+
+    // Inserts into uthash tables that landed in an occupied bucket
+    STAT_HASH_COLLISIONS,
+
+    // Lambdas compiled by the JIT and the size of their code
+    STAT_JIT_COMPILED,
+    STAT_JIT_CODE_BYTES,
+
+    // Lambda bodies analysed into nodes, the nodes built for them, and the
+    // calls whose lambda was inlined into them or that were folded
+    STAT_BODIES_ANALYSED,
+    STAT_NODES_ANALYSED,
+    STAT_CALLS_INLINED,
+    STAT_CALLS_FOLDED,
+
+    // Top-level function bodies left unparsed when they were loaded, and
+    // those parsed since because they were called
+    STAT_BODIES_DEFERRED,
+    STAT_BODIES_LOADED,
+
+    // Files loaded from their cache entry, and files that had none
+    STAT_CACHE_HITS,
+    STAT_CACHE_MISSES,
+
+    // Wall time in nanoseconds
+    STAT_LEXER_COMPILE_NS,
+    STAT_TOKENISE_NS,
+    STAT_PARSE_NS,
+    STAT_EVAL_NS,
+
+    NUM_STATS
+};
+
+extern __thread uint64_t *thread_counters;
+
+// Allocates the calling thread's counters and adds them to the global list
+void register_thread_stats();
+
+// Only the owning thread writes its counters, so a plain read-modify-write
+// is enough. The store is atomic so that read_stats never sees a torn value.
+#define STAT_ADD(COUNTER, N)                                            \
+    do {                                                                \
+        if(thread_counters == NULL)                                     \
+            register_thread_stats();                                    \
+        __atomic_store_n(&thread_counters[COUNTER],                     \
+            thread_counters[COUNTER] + (N), __ATOMIC_RELAXED);          \
+    } while(0)
+
+// Counts an insert into a uthash table that landed in an occupied bucket.
+// HH is the handle of the entry that was just added.
+#define STAT_HASH_INSERT(HH)                                            \
+    do {                                                                \
+        const UT_hash_handle *_hh = &(HH);                              \
+        if(_hh->tbl->buckets[_hh->hashv                                 \
+            & (_hh->tbl->num_buckets - 1U)].count > 1)                  \
+            STAT_ADD(STAT_HASH_COLLISIONS, 1);                          \
+    } while(0)
+
+// Monotonic clock in nanoseconds, for the timing counters
+uint64_t stat_now_ns();
+
+const char *stat_name(enum stat_counter counter);
+
+// Sums the counters of all threads into totals
+void read_stats(uint64_t totals[NUM_STATS]);
+
+void print_stats(FILE *out);
+
+#endif
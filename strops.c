@@ -0,0 +1,177 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "strops.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+// ============================ SCALAR KERNELS ===============================
+
+static size_t mismatch_scalar(const char *a, const char *b, size_t n) {
+	size_t i = 0;
+	while(i < n && a[i] == b[i])
+		i++;
+	return i;
+}
+
+static long search_scalar(const char *hay, size_t hlen,
+	const char *needle, size_t nlen) {
+
+	const char *end = hay + hlen - nlen + 1;
+	const char *cur = hay;
+
+	while(cur < end) {
+		cur = memchr(cur, needle[0], end - cur);
+		if(cur == NULL)
+			return -1;
+		if(memcmp(cur, needle, nlen) == 0)
+			return cur - hay;
+		cur++;
+	}
+
+	return -1;
+}
+
+#if HAVE_X86_SIMD
+
+// ============================= SSE2 KERNELS ================================
+// SSE2 is part of the x86-64 baseline, so these need no runtime check.
+// Search compares the first and last byte of the needle against 16 candidate
+// positions at once and only runs memcmp on positions where both match.
+// ===========================================================================
+
+static size_t mismatch_sse2(const char *a, const char *b, size_t n) {
+	size_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+		if(mask != 0xFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + mismatch_scalar(a + i, b + i, n - i);
+}
+
+static long search_sse2(const char *hay, size_t hlen,
+	const char *needle, size_t nlen) {
+
+	__m128i first = _mm_set1_epi8(needle[0]);
+	__m128i last = _mm_set1_epi8(needle[nlen-1]);
+	size_t num_pos = hlen - nlen + 1;
+	size_t i = 0;
+
+	for(; i + 16 <= num_pos; i += 16) {
+		__m128i bf = _mm_loadu_si128((const __m128i *)(hay + i));
+		__m128i bl = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+
+		while(mask != 0) {
+			size_t pos = i + __builtin_ctz(mask);
+			if(memcmp(hay + pos + 1, needle + 1, nlen - 1) == 0)
+				return pos;
+			mask &= mask - 1;
+		}
+	}
+
+	long rest = search_scalar(hay + i, hlen - i, needle, nlen);
+	return rest == -1 ? -1 : (long)i + rest;
+}
+
+// ============================= AVX2 KERNELS ================================
+// Same as the SSE2 kernels with 32 byte blocks. Only called after checking
+// that the CPU supports AVX2.
+// ===========================================================================
+
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const char *a, const char *b, size_t n) {
+	size_t i = 0;
+	for(; i + 32 <= n; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if(mask != 0xFFFFFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + mismatch_sse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static long search_avx2(const char *hay, size_t hlen,
+	const char *needle, size_t nlen) {
+
+	__m256i first = _mm256_set1_epi8(needle[0]);
+	__m256i last = _mm256_set1_epi8(needle[nlen-1]);
+	size_t num_pos = hlen - nlen + 1;
+	size_t i = 0;
+
+	for(; i + 32 <= num_pos; i += 32) {
+		__m256i bf = _mm256_loadu_si256((const __m256i *)(hay + i));
+		__m256i bl = _mm256_loadu_si256((const __m256i *)(hay + i + nlen - 1));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(bf, first), _mm256_cmpeq_epi8(bl, last)));
+
+		while(mask != 0) {
+			size_t pos = i + __builtin_ctz(mask);
+			if(memcmp(hay + pos + 1, needle + 1, nlen - 1) == 0)
+				return pos;
+			mask &= mask - 1;
+		}
+	}
+
+	long rest = search_sse2(hay + i, hlen - i, needle, nlen);
+	return rest == -1 ? -1 : (long)i + rest;
+}
+
+static bool has_avx2() {
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+// ============================== DISPATCH ===================================
+
+size_t str_mismatch(const char *a, const char *b, size_t n) {
+#if HAVE_X86_SIMD
+	if(n >= 32 && has_avx2())
+		return mismatch_avx2(a, b, n);
+	return mismatch_sse2(a, b, n);
+#else
+	return mismatch_scalar(a, b, n);
+#endif
+}
+
+int str_compare(const char *a, size_t alen, const char *b, size_t blen) {
+	size_t n = alen < blen ? alen : blen;
+	size_t i = str_mismatch(a, b, n);
+
+	if(i < n)
+		return (int)(unsigned char)a[i] - (int)(unsigned char)b[i];
+
+	if(alen == blen)
+		return 0;
+	return alen < blen ? -1 : 1;
+}
+
+long str_search(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+	if(nlen == 0)
+		return 0;
+	if(nlen > hlen)
+		return -1;
+
+#if HAVE_X86_SIMD
+	if(hlen - nlen + 1 >= 32 && has_avx2())
+		return search_avx2(hay, hlen, needle, nlen);
+	return search_sse2(hay, hlen, needle, nlen);
+#else
+	return search_scalar(hay, hlen, needle, nlen);
+#endif
+}
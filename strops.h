@@ -0,0 +1,20 @@
+#ifndef __STROPS_H__
+#define __STROPS_H__
+
+#include <stddef.h>
+
+// Length-aware byte string kernels used by the string builtins. On x86-64
+// these use SSE2, or AVX2 when the CPU supports it, with a portable scalar
+// fallback everywhere else. None of them rely on null termination.
+
+// Index of the first byte where a and b differ, or n if the first n bytes
+// are equal
+size_t str_mismatch(const char *a, const char *b, size_t n);
+
+// Lexicographic comparison of unsigned bytes. Returns <0, 0 or >0
+int str_compare(const char *a, size_t alen, const char *b, size_t blen);
+
+// Offset of the first occurrence of needle in hay, or -1 if there is none
+long str_search(const char *hay, size_t hlen, const char *needle, size_t nlen);
+
+#endif